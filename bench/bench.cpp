@@ -0,0 +1,971 @@
+/*
+ * Microbenchmarks for the block store and bitmap
+ *
+ * usage: hw3_bench [name...]
+ *  Runs every benchmark when no names are given.
+ *  Numbers only mean something with optimizations on, so configure with
+ *  -DCMAKE_BUILD_TYPE=Release
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bitmap.h"
+#include "block_store.h"
+#include "block_store_sharded.h"
+
+// Keeps the optimizer from throwing away results we never look at
+static volatile size_t sink;
+
+// Average nanoseconds per call of f over iters calls
+template <typename F>
+static double time_ns(const size_t iters, F f) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iters; ++i) {
+        f(i);
+    }
+    auto stop = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(stop - start).count() / iters;
+}
+
+static const unsigned fills[] = {25, 50, 90, 99};
+
+//
+// bitmap_ffz / bitmap_ffs
+//
+
+// What bitmap_ffz/ffs used to be, one bitmap_test per bit
+static size_t legacy_ffz(const bitmap_t *const bitmap) {
+    size_t result = 0;
+    const size_t bits = bitmap_get_bits(bitmap);
+    for (; result < bits && bitmap_test(bitmap, result); ++result) {
+    }
+    return (result == bits ? SIZE_MAX : result);
+}
+
+static size_t legacy_ffs(const bitmap_t *const bitmap) {
+    size_t result = 0;
+    const size_t bits = bitmap_get_bits(bitmap);
+    for (; result < bits && !bitmap_test(bitmap, result); ++result) {
+    }
+    return (result == bits ? SIZE_MAX : result);
+}
+
+// A map filled first-fit to the given percentage, like a store that's been
+// allocating from the bottom, so the first zero sits right past the full prefix
+static bitmap_t *filled_bitmap(const size_t bits, const unsigned fill, const bool summary) {
+    bitmap_t *bitmap = bitmap_create(bits);
+    if (summary) {
+        bitmap_enable_summary(bitmap);
+    }
+    const size_t full = bits / 100 * fill;
+    for (size_t i = 0; i < full; ++i) {
+        bitmap_set(bitmap, i);
+    }
+    return bitmap;
+}
+
+static void bench_ffz() {
+    const size_t bits = 1 << 22;
+    printf("ffz/ffs on %zu bits, ns per call\n", bits);
+    printf("%6s %14s %14s %14s %14s %14s\n", "fill", "legacy ffz", "word ffz", "summary ffz", "legacy ffs", "word ffs");
+    for (unsigned fill : fills) {
+        bitmap_t *plain = filled_bitmap(bits, fill, false);
+        bitmap_t *summarized = filled_bitmap(bits, fill, true);
+        // ffs looks for the first set bit past a prefix of zeros of the same length
+        bitmap_t *inverted = filled_bitmap(bits, fill, false);
+        bitmap_invert(inverted);
+
+        const double legacy = time_ns(20, [&](size_t) { sink = legacy_ffz(plain); });
+        const double word = time_ns(2000, [&](size_t) { sink = bitmap_ffz(plain); });
+        const double summary = time_ns(200000, [&](size_t) { sink = bitmap_ffz(summarized); });
+        const double legacy_s = time_ns(20, [&](size_t) { sink = legacy_ffs(inverted); });
+        const double word_s = time_ns(2000, [&](size_t) { sink = bitmap_ffs(inverted); });
+        printf("%5u%% %14.1f %14.1f %14.1f %14.1f %14.1f\n", fill, legacy, word, summary, legacy_s, word_s);
+
+        bitmap_destroy(inverted);
+        bitmap_destroy(summarized);
+        bitmap_destroy(plain);
+    }
+}
+
+//
+// Allocation policy under churn
+//
+
+// Fills a device to 90% and then releases a random allocated block and allocates
+// a replacement over and over, which is what a busy device looks like at steady state
+static void bench_churn() {
+    const size_t num_blocks = 1 << 20, block_size = 64, rounds = 1 << 20;
+    printf("steady state churn on %zu blocks at 90%% full, ns per release+allocate\n", num_blocks);
+    const char *names[] = {"first-fit", "next-fit", "near"};
+    for (int mode = 0; mode < 3; ++mode) {
+        block_store_t *bs = block_store_create_ex(num_blocks, block_size);
+        block_store_set_policy(bs, mode == 1 ? BLOCK_STORE_NEXT_FIT : BLOCK_STORE_FIRST_FIT);
+        std::vector<size_t> ids(block_store_get_total_blocks(bs) / 10 * 9);
+        for (size_t &id : ids) {
+            id = block_store_allocate(bs);
+        }
+        std::mt19937_64 rng(42);
+        size_t last = 0;
+        const double ns = time_ns(rounds, [&](size_t) {
+            size_t &slot = ids[rng() % ids.size()];
+            block_store_release(bs, slot);
+            // the near variant keeps each allocation next to the previous one
+            slot = mode == 2 ? block_store_allocate_near(bs, last) : block_store_allocate(bs);
+            last = slot;
+        });
+        printf("%10s %10.1f\n", names[mode], ns);
+        block_store_destroy(bs);
+    }
+}
+
+//
+// Batch allocate/release
+//
+
+static void bench_batch() {
+    const size_t num_blocks = 1 << 20, block_size = 64;
+    printf("allocating then releasing n blocks on an empty %zu block device, ns per block\n", num_blocks);
+    printf("%8s %14s %14s %14s %14s\n", "n", "allocate", "allocate_many", "release", "release_many");
+    for (size_t n : {16, 1024, 65536, 524288}) {
+        std::vector<size_t> ids(n);
+        block_store_t *bs = block_store_create_ex(num_blocks, block_size);
+        const size_t reps = (1 << 22) / n;
+        double alloc = 0, alloc_many = 0, release = 0, release_many = 0;
+        for (size_t r = 0; r < reps; ++r) {
+            alloc += time_ns(n, [&](size_t i) { ids[i] = block_store_allocate(bs); });
+            release += time_ns(n, [&](size_t i) { block_store_release(bs, ids[i]); });
+            alloc_many += time_ns(1, [&](size_t) { sink = block_store_allocate_many(bs, n, ids.data()); }) / n;
+            release_many += time_ns(1, [&](size_t) { block_store_release_many(bs, ids.data(), n); }) / n;
+        }
+        printf("%8zu %14.1f %14.1f %14.1f %14.1f\n", n, alloc / reps, alloc_many / reps, release / reps, release_many / reps);
+        block_store_destroy(bs);
+    }
+}
+
+//
+// Partial and vectored I/O
+//
+
+static void bench_io() {
+    const size_t num_blocks = 1 << 16, block_size = 256, header = 16, batch = 64, rounds = 1 << 20;
+    block_store_t *bs = block_store_create_ex(num_blocks, block_size);
+    const size_t avail = block_store_get_total_blocks(bs);
+    std::vector<uint8_t> buffer(batch * block_size);
+    std::vector<block_store_iovec_t> iov(batch);
+    for (size_t i = 0; i < batch; ++i) {
+        iov[i].buffer = &buffer[i * block_size];
+    }
+
+    printf("updating a %zu byte header in a %zu byte block, ns per update\n", header, block_size);
+    const double rmw = time_ns(rounds, [&](size_t i) {
+        const size_t id = (i * 7919) % avail;
+        block_store_read(bs, id, buffer.data());
+        memset(buffer.data(), (int) i, header);
+        block_store_write(bs, id, buffer.data());
+    });
+    const double partial = time_ns(rounds, [&](size_t i) {
+        memset(buffer.data(), (int) i, header);
+        block_store_pwrite(bs, (i * 7919) % avail, 0, header, buffer.data());
+    });
+    printf("%24s %10.1f\n%24s %10.1f\n", "read+modify+write", rmw, "pwrite", partial);
+
+    printf("moving %zu scattered blocks per call, ns per block\n", batch);
+    const size_t calls = rounds / batch;
+    auto scatter = [&](size_t call) {
+        for (size_t i = 0; i < batch; ++i) {
+            iov[i].block_id = ((call * batch + i) * 7919) % avail;
+        }
+    };
+    const double reads = time_ns(calls, [&](size_t call) {
+        scatter(call);
+        for (size_t i = 0; i < batch; ++i) {
+            block_store_read(bs, iov[i].block_id, iov[i].buffer);
+        }
+    }) / batch;
+    const double readv = time_ns(calls, [&](size_t call) {
+        scatter(call);
+        sink = block_store_readv(bs, iov.data(), batch);
+    }) / batch;
+    const double writes = time_ns(calls, [&](size_t call) {
+        scatter(call);
+        for (size_t i = 0; i < batch; ++i) {
+            block_store_write(bs, iov[i].block_id, iov[i].buffer);
+        }
+    }) / batch;
+    const double writev = time_ns(calls, [&](size_t call) {
+        scatter(call);
+        sink = block_store_writev(bs, iov.data(), batch);
+    }) / batch;
+    printf("%24s %10.1f\n%24s %10.1f\n%24s %10.1f\n%24s %10.1f\n", "read loop", reads, "readv", readv,
+           "write loop", writes, "writev", writev);
+    block_store_destroy(bs);
+}
+
+//
+// Concurrent allocation scaling
+//
+
+// Runs body(thread index) on the given number of threads and returns the wall time in ns
+template <typename F>
+static double run_threads(const unsigned threads, F body) {
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back(body, t);
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    auto stop = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(stop - start).count();
+}
+
+static const unsigned thread_counts[] = {1, 2, 4, 8, 16, 32, 64};
+
+static void bench_threads() {
+    const size_t num_blocks = 1 << 20, block_size = 64, ops = 1 << 21;
+    printf("concurrent allocate+write+release on %zu blocks at 50%% full, %u hardware threads\n", num_blocks,
+           std::thread::hardware_concurrency());
+    printf("%8s %14s %14s\n", "threads", "Mops/s", "magazines");
+    for (unsigned threads : thread_counts) {
+        printf("%8u", threads);
+        for (bool magazines : {false, true}) {
+            block_store_t *bs = block_store_create_ex(num_blocks, block_size);
+            block_store_set_concurrent(bs, true);
+            block_store_set_policy(bs, BLOCK_STORE_NEXT_FIT);
+            std::vector<size_t> base(block_store_get_total_blocks(bs) / 2);
+            sink = block_store_allocate_many(bs, base.size(), base.data());
+            block_store_set_magazines(bs, magazines ? BLOCK_STORE_MAGAZINE_SIZE : 0);
+            const size_t per_thread = ops / threads;
+            const double ns = run_threads(threads, [&](unsigned t) {
+                uint8_t data[64];
+                memset(data, (int) t, sizeof(data));
+                // hold a few blocks at a time so releases aren't always undone by the next allocate
+                size_t held[8];
+                for (size_t i = 0; i < per_thread; i += 8) {
+                    for (size_t &id : held) {
+                        id = block_store_allocate(bs);
+                        block_store_write(bs, id, data);
+                    }
+                    for (size_t id : held) {
+                        block_store_release(bs, id);
+                    }
+                }
+            });
+            printf(" %14.2f", (double) per_thread * threads / ns * 1000.0);
+            block_store_destroy(bs);
+        }
+        printf("\n");
+    }
+}
+
+//
+// Sharded devices
+//
+
+// Mixed workload on a sharded device: every thread keeps a working set of blocks and,
+// per op, either swaps one out (release + allocate + write) or reads one back, 1 in 4 swaps
+static void bench_shards() {
+    const size_t total_blocks = 1 << 20, block_size = 64, ops = 1 << 21, working_set = 256;
+    const size_t shard_counts[] = {1, 4, 16};
+    printf("mixed read/swap on %zu blocks split over n shards, %u hardware threads, Mops/s\n", total_blocks,
+           std::thread::hardware_concurrency());
+    printf("%8s", "threads");
+    for (size_t shards : shard_counts) {
+        printf(" %9zu shard%s", shards, shards == 1 ? " " : "s");
+    }
+    printf(" %16s\n", "16 by thread");
+    for (unsigned threads : thread_counts) {
+        printf("%8u", threads);
+        for (size_t column = 0; column <= sizeof(shard_counts) / sizeof(shard_counts[0]); ++column) {
+            // the extra column is the largest shard count with thread affinity routing
+            const bool affinity = column == sizeof(shard_counts) / sizeof(shard_counts[0]);
+            const size_t shards = shard_counts[affinity ? column - 1 : column];
+            block_store_sharded_t *sbs = block_store_sharded_create(shards, total_blocks / shards, block_size);
+            block_store_sharded_set_routing(sbs, affinity ? BLOCK_STORE_ROUTE_THREAD : BLOCK_STORE_ROUTE_ROUND_ROBIN);
+            const size_t per_thread = ops / threads;
+            const double ns = run_threads(threads, [&](unsigned t) {
+                uint8_t data[64];
+                memset(data, (int) t, sizeof(data));
+                std::vector<size_t> mine(working_set);
+                for (size_t &id : mine) {
+                    id = block_store_sharded_allocate(sbs);
+                }
+                std::mt19937_64 rng(t);
+                for (size_t i = 0; i < per_thread; ++i) {
+                    const uint64_t r = rng();
+                    size_t &slot = mine[r % working_set];
+                    if ((r >> 32) % 4 == 0) {
+                        block_store_sharded_release(sbs, slot);
+                        slot = block_store_sharded_allocate(sbs);
+                        block_store_sharded_write(sbs, slot, data);
+                    } else {
+                        sink = block_store_sharded_read(sbs, slot, data);
+                    }
+                }
+            });
+            printf(" %15.2f", (double) per_thread * threads / ns * 1000.0);
+            block_store_sharded_destroy(sbs);
+        }
+        printf("\n");
+    }
+}
+
+//
+// Block cache of a file backed device
+//
+
+// Skewed random reads and writes (80% of them to 10% of the blocks), once on its own and
+// once with a sequential scan running through the device in between, which is what
+// 2Q is supposed to hold up against
+static void bench_cache() {
+    const size_t num_blocks = 1 << 14, block_size = 4096, ops = 1 << 18;
+    const char *path = "hw3_bench_cache.bs";
+    remove(path);
+    block_store_t *bs = block_store_open_file(path, BLOCK_STORE_MMAP_CREATE, num_blocks, block_size);
+    if (bs == NULL) {
+        printf("couldn't create %s\n", path);
+        return;
+    }
+    const size_t avail = block_store_get_total_blocks(bs), hot = avail / 10;
+    printf("skewed 70/30 read/write on a %zu MB file, ns per op and hit rate\n", (num_blocks * block_size) >> 20);
+    printf("%8s %6s %22s %22s\n", "cache", "policy", "skewed", "skewed + scan");
+    std::vector<uint8_t> buffer(block_size);
+    for (size_t percent : {1, 10, 25}) {
+        for (block_store_cache_policy_t policy : {BLOCK_STORE_CACHE_CLOCK, BLOCK_STORE_CACHE_2Q}) {
+            printf("%7zu%% %6s", percent, policy == BLOCK_STORE_CACHE_CLOCK ? "CLOCK" : "2Q");
+            for (bool scan : {false, true}) {
+                block_store_set_cache(bs, avail * percent / 100, policy);
+                std::mt19937_64 rng(7);
+                size_t cursor = 0;
+                const double ns = time_ns(ops, [&](size_t) {
+                    const uint64_t r = rng();
+                    const size_t id = (r % 10 < 8) ? (r >> 8) % hot : hot + (r >> 8) % (avail - hot);
+                    if ((r >> 4) % 10 < 3) {
+                        block_store_write(bs, id, buffer.data());
+                    } else {
+                        block_store_read(bs, id, buffer.data());
+                    }
+                    if (scan) {
+                        block_store_read(bs, cursor, buffer.data());
+                        cursor = (cursor + 1) % avail;
+                    }
+                });
+                block_store_cache_stats_t stats;
+                block_store_get_cache_stats(bs, &stats);
+                printf(" %12.0f %8.1f%%", ns, 100.0 * stats.hits / (stats.hits + stats.misses));
+            }
+            printf("\n");
+        }
+    }
+    block_store_destroy(bs);
+    remove(path);
+}
+
+//
+// block_store_read_async against block_store_read
+//
+
+static void bench_async() {
+    const size_t num_blocks = 1 << 15, block_size = 4096, ops = 1 << 15;
+    const char *path = "hw3_bench_async.bs";
+    remove(path);
+    block_store_t *bs = block_store_open_file(path, BLOCK_STORE_MMAP_CREATE, num_blocks, block_size);
+    if (bs == NULL) {
+        printf("couldn't create %s\n", path);
+        return;
+    }
+    // uncached, so every read goes to the file, and the file is written out so there's something to read
+    block_store_set_cache(bs, 0, BLOCK_STORE_CACHE_CLOCK);
+    const size_t avail = block_store_get_total_blocks(bs);
+    std::vector<uint8_t> buffers(64 * block_size, 0x5A);
+    for (size_t id = 0; id < avail; ++id) {
+        block_store_write(bs, id, buffers.data());
+    }
+    block_store_sync(bs);
+    printf("random %zu byte block reads from a %zu MB file, ns per block\n", block_size, (num_blocks * block_size) >> 20);
+    printf("%8s %10s", "", "sync");
+    for (size_t depth : {1, 8, 64}) {
+        printf(" %9s%-2zu", "depth ", depth);
+    }
+    printf("\n");
+    const block_store_async_backend_t backends[] = {BLOCK_STORE_ASYNC_URING, BLOCK_STORE_ASYNC_THREADS};
+    for (block_store_async_backend_t backend : backends) {
+        printf("%8s", backend == BLOCK_STORE_ASYNC_URING ? "io_uring" : "threads");
+        std::mt19937_64 rng(11);
+        const double sync_ns = time_ns(ops, [&](size_t) {
+            block_store_read(bs, rng() % avail, buffers.data());
+        });
+        printf(" %10.0f", sync_ns);
+        for (size_t depth : {1, 8, 64}) {
+            if (!block_store_set_async(bs, backend, depth)) {
+                printf(" %11s", "n/a");
+                continue;
+            }
+            // a batch of depth reads at a time, each into its own buffer
+            const double ns = time_ns(ops, [&](size_t i) {
+                block_store_read_async(bs, rng() % avail, &buffers[(i % depth) * block_size], NULL, NULL);
+                if ((i + 1) % depth == 0) {
+                    block_store_poll(bs, SIZE_MAX);
+                }
+            });
+            block_store_poll(bs, SIZE_MAX);
+            printf(" %11.0f", ns);
+        }
+        printf("\n");
+    }
+    block_store_destroy(bs);
+    remove(path);
+}
+
+//
+// Journaled commits against in-place writes
+//
+
+static void bench_journal() {
+    const size_t num_blocks = 1 << 14, block_size = 4096, ops = 1 << 12;
+    const char *image = "hw3_bench_journal.bs", *path = "hw3_bench_inplace.bs";
+    printf("durable random %zu byte block writes, ns per block\n", block_size);
+    printf("%14s %12s %12s\n", "writes/commit", "journal", "in place");
+    std::vector<uint8_t> buffer(block_size, 0x5A);
+    for (size_t batch : {1, 16, 256}) {
+        // the journal: a memory device whose commits are one append and one fsync
+        remove(image);
+        block_store_t *bs = block_store_create_ex(num_blocks, block_size);
+        block_store_set_journal(bs, image);
+        const size_t avail = block_store_get_total_blocks(bs);
+        std::mt19937_64 rng(3);
+        const double journal_ns = time_ns(ops, [&](size_t i) {
+            block_store_write(bs, rng() % avail, buffer.data());
+            if ((i + 1) % batch == 0) {
+                block_store_commit(bs);
+            }
+        });
+        block_store_destroy(bs);
+        remove((std::string(image) + ".journal").c_str());
+
+        // in place: an uncached file device synced after every batch
+        remove(path);
+        bs = block_store_open_file(path, BLOCK_STORE_MMAP_CREATE, num_blocks, block_size);
+        block_store_set_cache(bs, 0, BLOCK_STORE_CACHE_CLOCK);
+        const double inplace_ns = time_ns(ops, [&](size_t i) {
+            block_store_write(bs, rng() % avail, buffer.data());
+            if ((i + 1) % batch == 0) {
+                block_store_sync(bs);
+            }
+        });
+        block_store_destroy(bs);
+        remove(path);
+        printf("%14zu %12.0f %12.0f\n", batch, journal_ns, inplace_ns);
+    }
+}
+
+//
+// block_store_load at a few image sizes
+//
+
+static void bench_load() {
+    const size_t block_size = 4096;
+    const char *path = "hw3_bench_load.bs";
+    const size_t chunks[] = {64 << 10, 1 << 20, SIZE_MAX};
+    printf("block_store_load of a saved image (warm page cache), ms and MB/s by chunk size\n");
+    printf("%8s %18s %18s %18s\n", "image", "64K chunks", "1M chunks", "one read");
+    for (size_t megabytes : {1, 100, 1024}) {
+        const size_t num_blocks = (megabytes << 20) / block_size;
+        block_store_t *bs = block_store_create_ex(num_blocks, block_size);
+        if (bs == NULL) {
+            printf("%6zuMB couldn't create the device\n", megabytes);
+            continue;
+        }
+        std::vector<uint8_t> buffer(block_size);
+        const size_t used = block_store_get_total_blocks(bs) / 2;
+        for (size_t id = 0; id < used; ++id) {
+            memset(buffer.data(), (int) id, block_size);
+            block_store_allocate(bs);
+            block_store_write(bs, id, buffer.data());
+        }
+        const bool saved = block_store_save(bs, path) != 0;
+        block_store_destroy(bs);
+        if (!saved) {
+            printf("%6zuMB couldn't save the image\n", megabytes);
+            continue;
+        }
+        printf("%6zuMB", megabytes);
+        for (size_t chunk : chunks) {
+            block_store_t *loaded = NULL;
+            const double ns = time_ns(1, [&](size_t) {
+                loaded = block_store_load(path, chunk, NULL);
+            });
+            printf(" %8.1f %7.0fMB/s", ns / 1e6, loaded != NULL ? megabytes / (ns / 1e9) : 0.0);
+            block_store_destroy(loaded);
+        }
+        printf("\n");
+        remove(path);
+    }
+}
+
+//
+// block_store_save_compressed against block_store_save
+//
+
+static void bench_compressed() {
+    const size_t num_blocks = 1 << 16, block_size = 4096;
+    const char *path = "hw3_bench_compressed.bs";
+    printf("saving and loading a %zu MB device, MB on disk and ms (%u hardware threads)\n",
+           (num_blocks * block_size) >> 20, std::thread::hardware_concurrency());
+    printf("%6s %22s %22s %22s %22s\n", "used", "save", "compressed, 1 thread", "compressed, 4 threads", "load compressed");
+    std::mt19937_64 rng(5);
+    std::vector<uint8_t> block(block_size);
+    for (unsigned fill : {10, 50, 90}) {
+        block_store_t *bs = block_store_create_ex(num_blocks, block_size);
+        const size_t avail = block_store_get_total_blocks(bs);
+        // scattered allocations holding text-like data, a little of it noise
+        for (size_t id = 0; id < avail; ++id) {
+            if (rng() % 100 >= fill) {
+                continue;
+            }
+            for (size_t i = 0; i < block_size; ++i) {
+                block[i] = (i % 512 < 32) ? (uint8_t) rng() : (uint8_t) "the block store keeps "[(i + id) % 22];
+            }
+            block_store_request(bs, id);
+            block_store_write(bs, id, block.data());
+        }
+        printf("%5u%%", fill);
+        size_t bytes = 0;
+        double ns = time_ns(1, [&](size_t) { bytes = block_store_save(bs, path); });
+        printf(" %10.1fMB %8.1fms", bytes / 1048576.0, ns / 1e6);
+        for (size_t threads : {1, 4}) {
+            ns = time_ns(1, [&](size_t) { bytes = block_store_save_compressed(bs, path, threads); });
+            printf(" %10.1fMB %8.1fms", bytes / 1048576.0, ns / 1e6);
+        }
+        block_store_destroy(bs);
+        block_store_t *loaded = NULL;
+        ns = time_ns(1, [&](size_t) { loaded = block_store_load(path, 0, NULL); });
+        printf(" %21.1fms\n", loaded != NULL ? ns / 1e6 : -1.0);
+        block_store_destroy(loaded);
+        remove(path);
+    }
+}
+
+//
+// Bitmap kernels
+//
+
+// What bitmap_total_set, bitmap_invert and bitmap_for_each used to be: a 256 entry
+// table of byte counts, a byte at a time and a bitmap_test per bit
+#define B2(n) n, n + 1, n + 1, n + 2
+#define B4(n) B2(n), B2(n + 1), B2(n + 1), B2(n + 2)
+#define B6(n) B4(n), B4(n + 1), B4(n + 1), B4(n + 2)
+static const uint8_t bit_totals[256] = {B6(0), B6(1), B6(1), B6(2)};
+#undef B6
+#undef B4
+#undef B2
+
+static size_t legacy_total_set(const bitmap_t *const bitmap) {
+    const uint8_t *data = bitmap_export(bitmap);
+    const size_t bytes = bitmap_get_bytes(bitmap);
+    size_t count = 0;
+    for (size_t i = 0; i < bytes; ++i) {
+        count += bit_totals[data[i]];
+    }
+    return count;
+}
+
+static void legacy_invert(bitmap_t *const bitmap) {
+    uint8_t *data = const_cast<uint8_t *>(bitmap_export(bitmap));
+    const size_t bytes = bitmap_get_bytes(bitmap);
+    for (size_t i = 0; i < bytes; ++i) {
+        data[i] = ~data[i];
+    }
+}
+
+static void legacy_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg) {
+    const size_t bits = bitmap_get_bits(bitmap);
+    for (size_t i = 0; i < bits; ++i) {
+        if (bitmap_test(bitmap, i)) {
+            func(i, arg);
+        }
+    }
+}
+
+static void tally_bit(size_t bit, void *arg) {
+    *(size_t *) arg += bit;
+}
+
+static void bench_kernels() {
+    const size_t bits = 1 << 24;
+    const bitmap_kernel_t kernels[] = {BITMAP_KERNEL_SCALAR, BITMAP_KERNEL_SSE42, BITMAP_KERNEL_AVX2};
+    const char *names[] = {"scalar", "sse4.2", "avx2"};
+    printf("bulk bitmap loops on %zu bits at 1%% fill, us per call\n", bits);
+    printf("%10s %12s %12s %12s %12s %12s\n", "kernel", "total_set", "invert", "for_each", "ffs", "ffz");
+    bitmap_t *bitmap = bitmap_create(bits);
+    std::mt19937_64 rng(9);
+    for (size_t i = 0; i < bits / 100; ++i) {
+        bitmap_set(bitmap, rng() % bits);
+    }
+    // long empty (and after inverting, full) prefix for the searches to skip
+    bitmap_t *tail = bitmap_create(bits);
+    bitmap_set(tail, bits - 3);
+    bitmap_t *full = bitmap_create(bits);
+    bitmap_set(full, bits - 3);
+    bitmap_invert(full);
+
+    size_t tally = 0;
+    printf("%10s %12.1f %12.1f %12.1f %12s %12s\n", "table",
+           time_ns(20, [&](size_t) { sink = legacy_total_set(bitmap); }) / 1e3,
+           time_ns(20, [&](size_t) { legacy_invert(bitmap); }) / 1e3,
+           time_ns(4, [&](size_t) { legacy_for_each(bitmap, tally_bit, &tally); }) / 1e3, "-", "-");
+    for (size_t k = 0; k < 3; ++k) {
+        if (!bitmap_set_kernel(kernels[k])) {
+            printf("%10s %12s\n", names[k], "unsupported");
+            continue;
+        }
+        printf("%10s %12.1f %12.1f %12.1f %12.1f %12.1f\n", names[k],
+               time_ns(200, [&](size_t) { sink = bitmap_total_set(bitmap); }) / 1e3,
+               time_ns(200, [&](size_t) { bitmap_invert(bitmap); }) / 1e3,
+               time_ns(20, [&](size_t) { bitmap_for_each(bitmap, tally_bit, &tally); }) / 1e3,
+               time_ns(200, [&](size_t) { sink = bitmap_ffs(tail); }) / 1e3,
+               time_ns(200, [&](size_t) { sink = bitmap_ffz(full); }) / 1e3);
+    }
+    sink = tally;
+    bitmap_set_kernel(BITMAP_KERNEL_AUTO);
+    bitmap_destroy(full);
+    bitmap_destroy(tail);
+    bitmap_destroy(bitmap);
+}
+
+//
+// Walking set bits
+//
+
+static void bench_iterate() {
+    const size_t num_blocks = 1 << 22, block_size = 64;
+    printf("visiting every allocated block of a %zu block device, ns per allocated block\n", num_blocks);
+    printf("%6s %12s %12s %12s %12s %12s\n", "used", "test loop", "ffs_from", "for_each", "iterator", "allocated");
+    std::mt19937_64 rng(11);
+    for (unsigned fill : {1, 10, 50, 90, 99}) {
+        block_store_t *bs = block_store_create_ex(num_blocks, block_size);
+        const size_t avail = block_store_get_total_blocks(bs);
+        for (size_t id = 0; id < avail; ++id) {
+            if (rng() % 100 < fill) {
+                block_store_request(bs, id);
+            }
+        }
+        const size_t used = block_store_get_used_blocks(bs);
+        // the same map on its own, so the bitmap level loops can be timed directly
+        bitmap_t *bitmap = bitmap_create(avail);
+        block_store_for_each_allocated(bs, [](size_t id, void *arg) { bitmap_set((bitmap_t *) arg, id); }, bitmap);
+
+        size_t tally = 0;
+        const double test = time_ns(1, [&](size_t) {
+            for (size_t i = 0; i < avail; ++i) {
+                if (bitmap_test(bitmap, i)) {
+                    tally += i;
+                }
+            }
+        });
+        const double ffs = time_ns(1, [&](size_t) {
+            for (size_t i = bitmap_ffs(bitmap); i != SIZE_MAX; i = bitmap_ffs_from(bitmap, i + 1)) {
+                tally += i;
+            }
+        });
+        const double each = time_ns(1, [&](size_t) { bitmap_for_each(bitmap, tally_bit, &tally); });
+        const double iter = time_ns(1, [&](size_t) {
+            bitmap_iter_t it;
+            bitmap_iter_init(&it, bitmap, 0);
+            for (size_t i = bitmap_iter_next(&it); i != SIZE_MAX; i = bitmap_iter_next(&it)) {
+                tally += i;
+            }
+        });
+        const double allocated = time_ns(1, [&](size_t) { block_store_for_each_allocated(bs, tally_bit, &tally); });
+        sink = tally;
+        printf("%5u%% %12.2f %12.2f %12.2f %12.2f %12.2f\n", fill, test / used, ffs / used, each / used, iter / used, allocated / used);
+        bitmap_destroy(bitmap);
+        block_store_destroy(bs);
+    }
+}
+
+//
+// Buddy allocator
+//
+
+// Free runs of a device found from the gaps between allocated blocks
+struct free_runs {
+    size_t count, largest, last;
+};
+
+static void note_allocated(size_t id, void *arg) {
+    free_runs *runs = (free_runs *) arg;
+    if (id > runs->last) {
+        runs->count++;
+        runs->largest = std::max(runs->largest, id - runs->last);
+    }
+    runs->last = id + 1;
+}
+
+static void bench_buddy() {
+    const size_t num_blocks = 1 << 20, block_size = 64, rounds = 1 << 16;
+    printf("steady state churn of 1/2/4/8/16 block objects (weights 8/4/2/1/1) at ~75%% full on %zu blocks\n", num_blocks);
+    printf("%10s %14s %10s %12s %14s\n", "allocator", "ns per op", "failures", "free runs", "largest run");
+    std::discrete_distribution<unsigned> sizes({8, 4, 2, 1, 1});
+    for (int buddy = 0; buddy < 2; ++buddy) {
+        block_store_t *bs = block_store_create_ex(num_blocks, block_size);
+        if (buddy) {
+            block_store_set_buddy(bs, true);
+        }
+        const size_t target = block_store_get_total_blocks(bs) / 4 * 3;
+        std::mt19937_64 rng(17);
+        std::vector<std::pair<size_t, unsigned>> held;
+        size_t used = 0, failures = 0;
+        auto allocate = [&]() {
+            const unsigned order = sizes(rng);
+            size_t id = SIZE_MAX;
+            if (buddy) {
+                id = block_store_allocate_order(bs, order);
+            } else if (!block_store_allocate_extent(bs, (size_t) 1 << order, &id)) {
+                id = SIZE_MAX;
+            }
+            if (id == SIZE_MAX) {
+                failures++;
+                return;
+            }
+            held.push_back({id, order});
+            used += (size_t) 1 << order;
+        };
+        while (used < target) {
+            allocate();
+        }
+        failures = 0;
+        // free a random object, then allocate until we're back at the target
+        const double ns = time_ns(rounds, [&](size_t) {
+            const size_t pick = rng() % held.size();
+            block_store_release_order(bs, held[pick].first, held[pick].second);
+            used -= (size_t) 1 << held[pick].second;
+            held[pick] = held.back();
+            held.pop_back();
+            while (used < target && failures < rounds) {
+                allocate();
+            }
+        });
+        free_runs runs = {0, 0, 0};
+        block_store_for_each_allocated(bs, note_allocated, &runs);
+        note_allocated(block_store_get_total_blocks(bs), &runs);
+        printf("%10s %14.1f %10zu %12zu %14zu\n", buddy ? "buddy" : "first-fit", ns, failures, runs.count, runs.largest);
+        block_store_destroy(bs);
+    }
+}
+
+static void bench_extents() {
+    const size_t num_blocks = 1 << 20, block_size = 64, rounds = 1 << 12;
+    printf("free extent queries on %zu blocks, half of them allocated at random in runs of 1-16\n", num_blocks);
+    printf("%12s %16s %16s %20s\n", "lookup", "largest (ns)", "histogram (ns)", "extent of 32 (ns)");
+    block_store_t *bs = block_store_create_ex(num_blocks, block_size);
+    const size_t user_blocks = block_store_get_total_blocks(bs);
+    std::mt19937_64 rng(22);
+    while (block_store_get_used_blocks(bs) < user_blocks / 2) {
+        const size_t id = rng() % user_blocks, count = 1 + rng() % 16;
+        for (size_t req = id; req < std::min(id + count, user_blocks); ++req) {
+            block_store_request(bs, req);
+        }
+    }
+    // concurrent mode has no extent index, so it's the fbm walk
+    for (int scan = 0; scan < 2; ++scan) {
+        block_store_set_concurrent(bs, scan != 0);
+        block_store_fragmentation_t stats;
+        size_t first = 0;
+        const double largest = time_ns(rounds, [&](size_t) { block_store_largest_free_extent(bs, &first); });
+        const double histogram = time_ns(rounds, [&](size_t) { block_store_get_fragmentation(bs, &stats); });
+        // first fit, each one handed straight back so the device doesn't change
+        const double extent = time_ns(rounds, [&](size_t) {
+            if (block_store_allocate_extent(bs, 32, &first)) {
+                block_store_release_extent(bs, first, 32);
+            }
+        });
+        printf("%12s %16.1f %16.1f %20.1f\n", scan ? "fbm scan" : "index", largest, histogram, extent);
+    }
+    block_store_destroy(bs);
+}
+
+struct read_pass {
+    block_store_t *bs;
+    uint8_t *buffer;
+};
+
+static void read_allocated(size_t id, void *arg) {
+    read_pass *pass = (read_pass *) arg;
+    block_store_read(pass->bs, id, pass->buffer);
+}
+
+static void bench_compact() {
+    const size_t num_blocks = 1 << 16, block_size = 1024, slice = 1024;
+    printf("compacting %zu blocks of %zu bytes, a quarter allocated at random, %zu blocks per call\n", num_blocks, block_size, slice);
+    block_store_t *bs = block_store_create_ex(num_blocks, block_size);
+    const size_t user_blocks = block_store_get_total_blocks(bs);
+    std::vector<uint8_t> buffer(block_size, 0x5A);
+    std::mt19937_64 rng(23);
+    while (block_store_get_used_blocks(bs) < user_blocks / 4) {
+        const size_t id = rng() % user_blocks;
+        if (block_store_request(bs, id)) {
+            block_store_write(bs, id, buffer.data());
+        }
+    }
+    read_pass pass = {bs, buffer.data()};
+    auto report = [&](const char *when) {
+        const double ns = time_ns(4, [&](size_t) { block_store_for_each_allocated(bs, read_allocated, &pass); });
+        printf("%8s: read every allocated block %8.1f ns per block, largest free run %zu\n", when, ns / block_store_get_used_blocks(bs),
+               block_store_largest_free_extent(bs, NULL));
+    };
+    report("before");
+    const block_store_compact_budget_t budget = {slice, 0};
+    size_t moved = 0, calls = 0;
+    double worst = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (;;) {
+        auto call_start = std::chrono::steady_clock::now();
+        const size_t step = block_store_compact(bs, &budget, NULL, NULL);
+        worst = std::max(worst, std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - call_start).count());
+        if (step == 0 || step == SIZE_MAX) {
+            break;
+        }
+        moved += step;
+        calls++;
+    }
+    const double total = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    printf("moved %zu blocks in %zu calls, %.1f ns per block, longest call %.1f us\n", moved, calls, total / std::max<size_t>(moved, 1), worst);
+    report("after");
+    block_store_destroy(bs);
+}
+
+static void bench_snapshot() {
+    const size_t num_blocks = 1 << 16, block_size = 1024;
+    printf("point in time copies of %zu blocks of %zu bytes\n", num_blocks, block_size);
+    block_store_t *bs = block_store_create_ex(num_blocks, block_size);
+    const size_t user_blocks = block_store_get_total_blocks(bs);
+    std::vector<uint8_t> buffer(block_size, 0x5A);
+    for (size_t id = 0; id < user_blocks; ++id) {
+        block_store_request(bs, id);
+        block_store_write(bs, id, buffer.data());
+    }
+    const double serialize = time_ns(1, [&](size_t) { block_store_serialize(bs, "bench_snapshot.bs"); });
+    remove("bench_snapshot.bs");
+    const double plain = time_ns(user_blocks, [&](size_t id) { block_store_write(bs, id, buffer.data()); });
+    block_store_t *snap = NULL;
+    const double take = time_ns(1, [&](size_t) { snap = block_store_snapshot(bs); });
+    // the first write to each block copies it, the second finds it's the only owner
+    const double first = time_ns(user_blocks, [&](size_t id) { block_store_write(bs, id, buffer.data()); });
+    const double again = time_ns(user_blocks, [&](size_t id) { block_store_write(bs, id, buffer.data()); });
+    printf("serialize %.1f us, snapshot %.1f us\n", serialize / 1000, take / 1000);
+    printf("write ns per block: no snapshot %.1f, first after snapshot %.1f, after that %.1f\n", plain, first, again);
+    block_store_destroy(snap);
+    block_store_destroy(bs);
+}
+
+// where block id keeps the id of the next block in the chain, spread over the cache sets
+static size_t chain_offset(size_t id, size_t block_size) {
+    return (id * 64) & (block_size - 1);
+}
+
+static void bench_tlb() {
+    const size_t num_blocks = 1 << 16, block_size = 4096, hops = 1 << 20;
+    printf("dependent random reads of 8 bytes, one block after another, over %zu MiB\n", (num_blocks * block_size) >> 20);
+    printf("%24s %12s\n", "block memory", "ns per read");
+    const struct {
+        const char *name;
+        bool calloced;
+        block_store_memory_t memory;
+    } configs[] = {
+        {"calloc", true, {BLOCK_STORE_PAGES_DEFAULT, BLOCK_STORE_NUMA_DEFAULT, 0}},
+        {"mmap, 4 KiB pages", false, {BLOCK_STORE_PAGES_DEFAULT, BLOCK_STORE_NUMA_DEFAULT, 0}},
+        {"transparent huge pages", false, {BLOCK_STORE_PAGES_TRANSPARENT, BLOCK_STORE_NUMA_DEFAULT, 0}},
+        {"explicit huge pages", false, {BLOCK_STORE_PAGES_EXPLICIT, BLOCK_STORE_NUMA_DEFAULT, 0}},
+        {"thp, interleaved", false, {BLOCK_STORE_PAGES_TRANSPARENT, BLOCK_STORE_NUMA_INTERLEAVE, 0}},
+    };
+    for (const auto &config : configs) {
+        block_store_t *bs = config.calloced ? block_store_create_ex(num_blocks, block_size)
+                                            : block_store_create_memory(num_blocks, block_size, &config.memory);
+        if (bs == NULL) {
+            printf("%24s %12s\n", config.name, "unavailable");
+            continue;
+        }
+        // one random cycle through every user block (Sattolo's shuffle)
+        const size_t user_blocks = block_store_get_total_blocks(bs);
+        std::vector<size_t> order(user_blocks);
+        for (size_t i = 0; i < user_blocks; ++i) {
+            order[i] = i;
+        }
+        std::mt19937_64 rng(25);
+        for (size_t i = user_blocks - 1; i > 0; --i) {
+            std::swap(order[i], order[rng() % i]);
+        }
+        for (size_t i = 0; i < user_blocks; ++i) {
+            const size_t next = order[(i + 1) % user_blocks];
+            block_store_pwrite(bs, order[i], chain_offset(order[i], block_size), sizeof(next), &next);
+        }
+        size_t id = order[0];
+        const double ns = time_ns(hops, [&](size_t) { block_store_pread(bs, id, chain_offset(id, block_size), sizeof(id), &id); });
+        printf("%24s %12.1f\n", config.name, ns);
+        block_store_destroy(bs);
+    }
+}
+
+//
+// Driver
+//
+
+struct benchmark {
+    const char *name;
+    void (*run)();
+};
+
+static const benchmark benchmarks[] = {
+    {"ffz", bench_ffz},
+    {"churn", bench_churn},
+    {"batch", bench_batch},
+    {"io", bench_io},
+    {"threads", bench_threads},
+    {"shards", bench_shards},
+    {"cache", bench_cache},
+    {"async", bench_async},
+    {"journal", bench_journal},
+    {"load", bench_load},
+    {"compressed", bench_compressed},
+    {"kernels", bench_kernels},
+    {"iterate", bench_iterate},
+    {"buddy", bench_buddy},
+    {"extents", bench_extents},
+    {"compact", bench_compact},
+    {"snapshot", bench_snapshot},
+    {"tlb", bench_tlb},
+};
+
+int main(int argc, char **argv) {
+    bool ran = false;
+    for (const benchmark &b : benchmarks) {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; ++i) {
+            selected |= std::strcmp(argv[i], b.name) == 0;
+        }
+        if (selected) {
+            printf("== %s ==\n", b.name);
+            b.run();
+            printf("\n");
+            ran = true;
+        }
+    }
+    if (!ran) {
+        fprintf(stderr, "no benchmark matched, available:");
+        for (const benchmark &b : benchmarks) {
+            fprintf(stderr, " %s", b.name);
+        }
+        fprintf(stderr, "\n");
+        return 1;
+    }
+    return 0;
+}
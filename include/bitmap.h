@@ -13,6 +13,14 @@ extern "C"
 
 typedef struct bitmap bitmap_t;
 
+// Which implementation of the bulk loops (counting, inverting, searching whole words) to use
+typedef enum {
+    BITMAP_KERNEL_AUTO,    // AVX2 if the CPU supports it, scalar otherwise
+    BITMAP_KERNEL_SCALAR,  // 64 bit words, runs anywhere
+    BITMAP_KERNEL_SSE42,   // POPCNT and 128 bit compares, never picked automatically
+    BITMAP_KERNEL_AVX2,    // 256 bit loads, shuffle based counting
+} bitmap_kernel_t;
+
 // WARNING: Bit requests outside the bitmap and NULL pointers WILL result in a segfault
 // This was originally a high performance C++ library, so the C translation assumes you're using it right.
 
@@ -67,21 +75,166 @@ size_t bitmap_ffs(const bitmap_t *const bitmap);
 ///
 size_t bitmap_ffz(const bitmap_t *const bitmap);
 
+///
+/// Find first set at or after the given bit
+/// \param bitmap The bitmap
+/// \param start The bit to start searching from
+/// \return The first one bit address >= start, SIZE_MAX on error/not found
+///
+size_t bitmap_ffs_from(const bitmap_t *const bitmap, const size_t start);
+
+///
+/// Find first zero at or after the given bit
+/// \param bitmap The bitmap
+/// \param start The bit to start searching from
+/// \return The first zero bit address >= start, SIZE_MAX on error/not found
+///
+size_t bitmap_ffz_from(const bitmap_t *const bitmap, const size_t start);
+
+///
+/// Find last set below the given bit
+/// \param bitmap The bitmap
+/// \param end The bit to search down from, not included (past the end searches the whole bitmap)
+/// \return The last one bit address < end, SIZE_MAX on error/not found
+///
+size_t bitmap_fls_before(const bitmap_t *const bitmap, const size_t end);
+
+///
+/// Sets a range of bits
+///  (ranges that run past the end of the bitmap are ignored)
+/// \param bitmap The bitmap
+/// \param start The first bit to set
+/// \param count The number of bits to set
+///
+void bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Clears a range of bits
+///  (ranges that run past the end of the bitmap are ignored)
+/// \param bitmap The bitmap
+/// \param start The first bit to clear
+/// \param count The number of bits to clear
+///
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Find a run of zero bits
+/// \param bitmap The bitmap
+/// \param start The bit to start searching from
+/// \param count The length of the run
+/// \return The first bit address >= start of a run of at least count zeros, SIZE_MAX on error/not found
+///
+size_t bitmap_find_zero_run(const bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Atomically sets a bit, safe against other threads using the atomic calls at the same time
+///  The atomic calls work on 64 bit words in place, so the data has to be 8 byte aligned
+///  and padded out to a whole number of words. bitmap_create always is, overlays are up to
+///  the caller. The summary, if there is one, is kept up to date atomically too.
+/// \param bitmap The bitmap
+/// \param bit The bit to set
+/// \return State of the bit before it was set
+///
+bool bitmap_test_and_set_atomic(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Atomically clears a bit (see bitmap_test_and_set_atomic)
+/// \param bitmap The bitmap
+/// \param bit The bit to clear
+/// \return State of the bit before it was cleared
+///
+bool bitmap_test_and_reset_atomic(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Atomically sets a range of bits, but only if every one of them is clear (see bitmap_test_and_set_atomic)
+///  Each word is claimed with a compare and swap, if any bit turns out to be set the
+///  words already claimed are given back and nothing changes.
+/// \param bitmap The bitmap
+/// \param start The first bit to set
+/// \param count The number of bits to set
+/// \return true if the whole range was clear and is now set
+///
+bool bitmap_claim_range_atomic(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Atomically clears a range of bits (see bitmap_test_and_set_atomic)
+/// \param bitmap The bitmap
+/// \param start The first bit to clear
+/// \param count The number of bits to clear
+/// \return The number of bits in the range that were set
+///
+size_t bitmap_reset_range_atomic(bitmap_t *const bitmap, const size_t start, const size_t count);
+
 ///
 /// Count all bits set
 /// \param bitmap the bitmap
 /// \return the total number of bits that are set in the bitmap
 ///
 size_t bitmap_total_set(const bitmap_t *const bitmap);
+
+///
+/// Count the bits set in a range
+///  (ranges that run past the end of the bitmap count as empty)
+/// \param bitmap The bitmap
+/// \param start The first bit to count
+/// \param count The number of bits to look at
+/// \return The number of bits in the range that are set
+///
+size_t bitmap_count_range(const bitmap_t *const bitmap, const size_t start, const size_t count);
+
 ///
 /// For each loop for all set bits
 ///  (Arguments passed to func are saved across calls)
+///  Goes a word at a time, so bits func changes in the word it was called for aren't seen.
 /// \param bitmap The bitmap
 /// \param func The function to apply (first parameter will be size_t with the bit number)
 /// \param args A generic pointer to pass to the called function
 ///
 void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg);
 
+// Position of a walk over the set bits of a bitmap, see bitmap_iter_init
+//  Lives on the caller's stack, the fields are only here so bitmap_iter_next can be inlined
+typedef struct bitmap_iter {
+    const bitmap_t *bitmap;
+    size_t word;    // the word bits came from
+    uint64_t bits;  // set bits of that word not handed out yet, lowest first
+} bitmap_iter_t;
+
+///
+/// Starts a walk over the set bits at or after the given bit, in increasing order
+///  Bits changed during the walk may or may not be seen, the same as with bitmap_for_each.
+/// \param iter The walk
+/// \param bitmap The bitmap
+/// \param start The bit to start from
+///
+void bitmap_iter_init(bitmap_iter_t *const iter, const bitmap_t *const bitmap, const size_t start);
+
+///
+/// Moves a walk on to the next word with a set bit and hands out its first bit
+///  (the slow path of bitmap_iter_next, call that instead)
+/// \param iter The walk
+/// \return The next set bit, SIZE_MAX once there aren't any more
+///
+size_t bitmap_iter_advance(bitmap_iter_t *const iter);
+
+///
+/// Gets the next set bit of a walk
+///  Bits come out of a word with a count trailing zeros, runs of empty words get skipped
+///  by the bulk kernels, and only the move to a new word is a function call.
+/// \param iter The walk
+/// \return The next set bit, SIZE_MAX once there aren't any more
+///
+static inline size_t bitmap_iter_next(bitmap_iter_t *const iter)
+{
+    if (iter->bits)
+    {
+        const size_t bit = (iter->word << 6) + (size_t) __builtin_ctzll(iter->bits);
+        iter->bits &= iter->bits - 1;
+        return bit;
+    }
+    return bitmap_iter_advance(iter);
+}
+
 ///
 /// Resets bitmap contents to the desired pattern
 /// (pattern not guarenteed accurate for final bits
@@ -91,6 +244,37 @@ void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *),
 ///
 void bitmap_format(bitmap_t *const bitmap, const uint8_t pattern);
 
+///
+/// Allocates and builds the second level summary (one bit per 64 bit word, set when
+///  the word has a zero bit) that lets bitmap_ffz skip full words 64 at a time.
+///  Once enabled, set/reset/flip keep it up to date. Calling it again just rebuilds it.
+/// \param bitmap The bitmap
+/// \return true if the summary is enabled, false on allocation failure
+///
+bool bitmap_enable_summary(bitmap_t *const bitmap);
+
+///
+/// Rebuilds the summary after the bitmap data was changed behind the bitmap's back
+///  (like writing straight into the memory of an overlay). Does nothing without a summary.
+/// \param bitmap The bitmap
+///
+void bitmap_rebuild_summary(bitmap_t *const bitmap);
+
+///
+/// Picks the implementation of the bulk loops for every bitmap in the process
+///  The default is BITMAP_KERNEL_AUTO, checked against CPUID the first time it's needed.
+///  Meant for benchmarks and tests, don't switch while other threads are using bitmaps.
+/// \param kernel The implementation, BITMAP_KERNEL_AUTO goes back to the default
+/// \return true if it's in use now, false if this CPU or build can't run it
+///
+bool bitmap_set_kernel(const bitmap_kernel_t kernel);
+
+///
+/// Tells which implementation of the bulk loops is in use
+/// \return The implementation, never BITMAP_KERNEL_AUTO
+///
+bitmap_kernel_t bitmap_get_kernel(void);
+
 ///
 /// Gets total number of bits in bitmap
 /// \param bitmap The bitmap
@@ -8,14 +8,21 @@ extern "C"
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 	// Constants
 #define BITMAP_SIZE_BYTES 32         //  
 #define BLOCK_STORE_NUM_BLOCKS 256   // 2^ blocks. 
-#define BLOCK_STORE_AVAIL_BLOCKS (BLOCK_STORE_NUM_BLOCKS - 1) // First block consumed by the FBM
+#define BLOCK_STORE_AVAIL_BLOCKS (BLOCK_STORE_NUM_BLOCKS - 1) // Last block consumed by the FBM
 #define BLOCK_SIZE_BYTES 256         // 2^8 BYTES per block
 #define BLOCK_SIZE_BITS (BLOCK_SIZE_BYTES*8)
 #define BLOCK_STORE_NUM_BYTES (BLOCK_STORE_NUM_BLOCKS * BLOCK_SIZE_BYTES)
+#define BLOCK_STORE_MIN_BLOCK_SIZE 8 // Smallest block that keeps the FBM overlay word aligned
+#define BLOCK_STORE_POISON 0xDB      // Debug mode fills released blocks with this byte
+#define BLOCK_STORE_MAGAZINE_SIZE 64 // A reasonable block_store_set_magazines capacity
+#define BLOCK_STORE_CACHE_BLOCKS 1024 // Blocks block_store_open_file caches to begin with
+#define BLOCK_STORE_ASYNC_DEPTH 64   // Async requests a device keeps in flight unless told otherwise
+#define BLOCK_STORE_LOAD_CHUNK (1 << 20) // Bytes block_store_load reads at a time unless told otherwise
 
 
 	// Declaring the struct but not implementing in the header allows us to prevent users
@@ -24,12 +31,223 @@ extern "C"
 	// This enforces a black box device, but it can be restricting
 	typedef struct block_store block_store_t;
 
+	// Flags for block_store_open_mmap
+#define BLOCK_STORE_MMAP_CREATE 0x01   // Create the file (zero filled) if it doesn't exist or is empty
+#define BLOCK_STORE_MMAP_READONLY 0x02 // Map the file read only, anything that changes the device fails
+
+	// How block_store_allocate picks the block it hands out
+	typedef enum {
+		BLOCK_STORE_FIRST_FIT = 0, // lowest free id, the default
+		BLOCK_STORE_NEXT_FIT,      // first free id after the last allocation, wrapping around
+		BLOCK_STORE_BEST_FIT,      // lowest id of the smallest free run that fits (first fit in concurrent mode)
+	} block_store_policy_t;
+
+	// How the block cache of a file backed device picks blocks to evict
+	typedef enum {
+		BLOCK_STORE_CACHE_CLOCK = 0, // second chance, blocks used since the hand last passed stay
+		BLOCK_STORE_CACHE_2Q,        // blocks only earn a long stay by being used twice, resists scans
+	} block_store_cache_policy_t;
+
+	// What the block cache of a file backed device has done so far
+	typedef struct {
+		size_t hits;       // reads and writes of blocks already in the cache
+		size_t misses;     // reads and writes that had to bring the block in
+		size_t evictions;  // blocks thrown out to make room
+		size_t writebacks; // dirty blocks written to the file, on eviction or flush
+	} block_store_cache_stats_t;
+
+	// Buckets in the fragmentation histogram, bucket i counts free runs of [2^i, 2^(i+1)) blocks
+#define BLOCK_STORE_EXTENT_BUCKETS 64
+
+	// How the free blocks of a device are spread out, see block_store_get_fragmentation
+	typedef struct {
+		size_t free_blocks; // free blocks, blocks sitting in magazines count as used
+		size_t extents;     // runs of free blocks
+		size_t largest;     // blocks in the longest run
+		size_t histogram[BLOCK_STORE_EXTENT_BUCKETS]; // runs by length, bucket i holds [2^i, 2^(i+1)) blocks
+	} block_store_fragmentation_t;
+
+	// How much one block_store_compact call may do, whichever limit runs out first ends it
+	typedef struct {
+		size_t blocks;        // most blocks to move, 0 for no limit
+		uint64_t nanoseconds; // most time to spend, 0 for no limit
+	} block_store_compact_budget_t;
+
+	// Called by block_store_compact for every block it moves, once the data is in new_id
+	//  and before old_id is released
+	typedef void (*block_store_remap_callback_t)(void *context, size_t old_id, size_t new_id);
+
+	// Which engine runs the async reads and writes of a file backed device
+	typedef enum {
+		BLOCK_STORE_ASYNC_AUTO = 0, // io_uring when the kernel allows it, threads otherwise
+		BLOCK_STORE_ASYNC_URING,    // io_uring, set up with raw system calls
+		BLOCK_STORE_ASYNC_THREADS,  // a pool of worker threads doing pread/pwrite
+	} block_store_async_backend_t;
+
+	// Called from block_store_poll once an async read or write is done
+	//  bytes is the block size on success and 0 on error, like block_store_read/write return
+	typedef void (*block_store_io_callback_t)(void *context, size_t block_id, size_t bytes);
+
+	// Why block_store_load failed
+	typedef enum {
+		BLOCK_STORE_LOAD_OK = 0,
+		BLOCK_STORE_LOAD_BAD_ARGUMENT,
+		BLOCK_STORE_LOAD_IO_ERROR,      // the file couldn't be opened or read
+		BLOCK_STORE_LOAD_NOT_AN_IMAGE,  // no image header, and not the size of a raw dump either
+		BLOCK_STORE_LOAD_UNSUPPORTED,   // written by a newer version, or with features this one lacks
+		BLOCK_STORE_LOAD_BAD_GEOMETRY,  // the header describes a device that can't exist
+		BLOCK_STORE_LOAD_TRUNCATED,     // the file ends before the image does
+		BLOCK_STORE_LOAD_CORRUPT,       // a checksum doesn't match, or the FBM makes no sense
+		BLOCK_STORE_LOAD_NO_MEMORY,
+	} block_store_load_status_t;
+
+	// What pages back the blocks of a device from block_store_create_memory
+	typedef enum {
+		BLOCK_STORE_PAGES_DEFAULT = 0, // whatever the kernel hands out, usually 4 KiB pages
+		BLOCK_STORE_PAGES_TRANSPARENT, // aligned and advised for transparent huge pages, used when the kernel can
+		BLOCK_STORE_PAGES_EXPLICIT,    // 2 MiB pages from the reserved pool (vm.nr_hugepages), all or nothing
+	} block_store_pages_t;
+
+	// Which NUMA nodes the blocks of a device from block_store_create_memory come from
+	typedef enum {
+		BLOCK_STORE_NUMA_DEFAULT = 0,  // the node of whichever thread touches a page first
+		BLOCK_STORE_NUMA_INTERLEAVE,   // round robin over every node the process may use
+		BLOCK_STORE_NUMA_BIND,         // only the given node
+	} block_store_numa_t;
+
+	// Where the block memory of a device comes from, see block_store_create_memory
+	typedef struct {
+		block_store_pages_t pages;
+		block_store_numa_t numa;
+		int node;                      // the node for BLOCK_STORE_NUMA_BIND
+	} block_store_memory_t;
+
+	// One entry of a block_store_readv/writev list
+	typedef struct {
+		size_t block_id;
+		void *buffer;   // block_size bytes, only read from by block_store_writev
+	} block_store_iovec_t;
+
 	///
 	/// This creates a new BS device, ready to go
 	/// \return Pointer to a new block storage device, NULL on error
 	///
 	block_store_t *block_store_create();
 
+	///
+	/// This creates a new BS device with the requested geometry
+	///  The FBM is stored in the last blocks of the device, so the number of
+	///  user-addressable blocks is num_blocks minus the blocks the FBM needs
+	/// \param num_blocks Total number of blocks on the device, FBM included
+	/// \param block_size Bytes per block, must be a power of two and at least BLOCK_STORE_MIN_BLOCK_SIZE
+	/// \return Pointer to a new block storage device, NULL on error
+	///
+	block_store_t *block_store_create_ex(const size_t num_blocks, const size_t block_size);
+
+	///
+	/// This creates a new BS device with the requested geometry whose blocks live in memory
+	///  mapped to order, instead of calloc'd
+	///  Huge pages cut TLB misses when the blocks are read at random. The NUMA policy is set
+	///  before anything touches the memory, so it doesn't all end up on the creating thread's
+	///  node. A policy that can't be had fails the create, except transparent huge pages,
+	///  which the kernel only ever treats as a hint.
+	/// \param num_blocks Total number of blocks on the device, FBM included
+	/// \param block_size Bytes per block, must be a power of two and at least BLOCK_STORE_MIN_BLOCK_SIZE
+	/// \param memory How the block memory is backed and placed, NULL for the defaults
+	/// \return Pointer to a new block storage device, NULL on error
+	///
+	block_store_t *block_store_create_memory(const size_t num_blocks, const size_t block_size, const block_store_memory_t *const memory);
+
+	///
+	/// Opens a file as a BS device, mapping it straight into memory
+	///  The file holds the blocks in the same layout block_store_serialize writes,
+	///  so only the blocks that get touched are ever read in. Raw images written before the
+	///  FBM moved to the end of the device aren't converted here, load them with
+	///  block_store_load and serialize them again first. Changes land in the
+	///  page cache and reach the file on block_store_sync or whenever the OS writes them back.
+	/// \param path The backing file
+	/// \param flags Any of the BLOCK_STORE_MMAP_ flags
+	/// \return Pointer to the BS device, NULL on error
+	///
+	block_store_t *block_store_open_mmap(const char *const path, const int flags);
+
+	///
+	/// Opens a file as a BS device with the given geometry, mapping it straight into memory
+	/// \param path The backing file
+	/// \param flags Any of the BLOCK_STORE_MMAP_ flags
+	/// \param num_blocks Total number of blocks if the file gets created, otherwise ignored
+	/// \param block_size Bytes per block, the file size must be a multiple of it
+	/// \return Pointer to the BS device, NULL on error
+	///
+	block_store_t *block_store_open_mmap_ex(const char *const path, const int flags, const size_t num_blocks, const size_t block_size);
+
+	///
+	/// Opens a file as a BS device that's read and written through a block cache instead of mapped
+	///  For devices bigger than memory: only the FBM and the cached blocks are ever in memory.
+	///  Writes are absorbed by the cache and reach the file when a dirty block is evicted
+	///  or on block_store_sync (and destroy), which write dirty blocks back in block order.
+	///  The file layout is the same as block_store_open_mmap's. Blocks don't have a fixed
+	///  address, so block_store_block_ptr and block_store_pin aren't available.
+	///  Starts out with a CLOCK cache of BLOCK_STORE_CACHE_BLOCKS blocks, see block_store_set_cache.
+	/// \param path The backing file
+	/// \param flags Any of the BLOCK_STORE_MMAP_ flags, they mean the same thing here
+	/// \param num_blocks Total number of blocks if the file gets created, otherwise ignored
+	/// \param block_size Bytes per block, the file size must be a multiple of it
+	/// \return Pointer to the BS device, NULL on error
+	///
+	block_store_t *block_store_open_file(const char *const path, const int flags, const size_t num_blocks, const size_t block_size);
+
+	///
+	/// Takes a read only point in time copy of a BS device
+	///  The snapshot shares every block with the device: taking it copies the block table and
+	///  the FBM, and from then on whichever of them writes to a shared block copies just that
+	///  block first. Snapshots of snapshots and clones share the same way. Only devices from
+	///  block_store_create/_ex/_memory (or a snapshot or clone of one) can be snapshotted, and nothing may
+	///  write to the device while the snapshot is taken. Copying a shared block isn't thread safe,
+	///  so a device in concurrent mode can't be snapshotted, and once a device shares its blocks
+	///  it can't go into concurrent mode anymore. Pointers from block_store_block_ptr
+	///  or block_store_pin taken before it write into the shared block, so get them again.
+	///  Each device, the original included, still has to be destroyed on its own.
+	/// \param bs BS device
+	/// \return Pointer to the snapshot, NULL on error
+	///
+	block_store_t *block_store_snapshot(block_store_t *const bs);
+
+	///
+	/// Forks a BS device into a writable copy
+	///  Same as block_store_snapshot, except the copy can be allocated from and written to
+	///  like any other device. It starts out with the device's allocation policy and nothing
+	///  else: no journal, no debug mode, no magazines, not concurrent.
+	/// \param bs BS device
+	/// \return Pointer to the clone, NULL on error
+	///
+	block_store_t *block_store_clone(block_store_t *const bs);
+
+	///
+	/// Replaces the block cache of a file backed device, writing back the old one first
+	/// \param bs BS device
+	/// \param capacity Number of blocks to cache, 0 reads and writes the file directly
+	/// \param policy How blocks get picked for eviction
+	/// \return boolean indicating succes of operation
+	///
+	bool block_store_set_cache(block_store_t *const bs, const size_t capacity, const block_store_cache_policy_t policy);
+
+	///
+	/// Reports the hit/miss/eviction counters of a file backed device's block cache
+	///  The counters start over whenever block_store_set_cache is called
+	/// \param bs BS device
+	/// \param stats Receives the counters
+	/// \return boolean indicating succes of operation, false if the device has no cache
+	///
+	bool block_store_get_cache_stats(const block_store_t *const bs, block_store_cache_stats_t *const stats);
+
+	///
+	/// Flushes a file backed BS device to disk
+	/// \param bs BS device
+	/// \return boolean indicating succes of operation, devices that aren't backed by a file always succeed
+	///
+	bool block_store_sync(block_store_t *const bs);
+
 	///
 	/// Destroys the provided block storage device
 	/// This is an idempotent operation, so there is no return value
@@ -44,6 +262,143 @@ extern "C"
 	///
 	size_t block_store_allocate(block_store_t *const bs);
 
+	///
+	/// Searches for a free block at or after the hint (wrapping around to the start),
+	///  marks it as in use, and returns the block's id. Lets callers keep related blocks close.
+	///  A hint past the end of the device searches from the start.
+	///  This ignores the allocation policy and doesn't move the next-fit cursor.
+	/// \param bs BS device
+	/// \param hint_id Block id to start searching at
+	/// \return Allocated block's id, SIZE_MAX on error
+	///
+	size_t block_store_allocate_near(block_store_t *const bs, const size_t hint_id);
+
+	///
+	/// Searches for a run of contiguous free blocks, marks them as in use,
+	///  and returns the first block's id. Follows the allocation policy.
+	/// \param bs BS device
+	/// \param count Number of blocks in the run
+	/// \param first_id Receives the id of the first block in the run
+	/// \return boolean indicating succes of operation
+	///
+	bool block_store_allocate_extent(block_store_t *const bs, const size_t count, size_t *const first_id);
+
+	///
+	/// Frees a run of contiguous blocks
+	/// \param bs BS device
+	/// \param first_id The first block to free
+	/// \param count Number of blocks to free
+	///
+	void block_store_release_extent(block_store_t *const bs, const size_t first_id, const size_t count);
+
+	///
+	/// Allocates an aligned run of 2^order blocks from the buddy index (see block_store_set_buddy)
+	///  Takes the smallest free chunk that's big enough, splitting it if it's bigger.
+	///  Free with block_store_release_order, or any of the release calls.
+	/// \param bs BS device
+	/// \param order log2 of the number of blocks
+	/// \return The id of the first block, a multiple of 2^order, SIZE_MAX on error or if buddy mode is off
+	///
+	size_t block_store_allocate_order(block_store_t *const bs, const unsigned order);
+
+	///
+	/// Frees a run of 2^order blocks, merging it with free neighbours in buddy mode
+	/// \param bs BS device
+	/// \param first_id The first block to free
+	/// \param order log2 of the number of blocks
+	///
+	void block_store_release_order(block_store_t *const bs, const size_t first_id, const unsigned order);
+
+	///
+	/// Allocates up to n free blocks in one pass over the FBM, following the allocation policy
+	/// \param bs BS device
+	/// \param n Number of blocks wanted
+	/// \param ids_out Receives the allocated ids, must have room for n ids
+	/// \return Number of blocks allocated, less than n if the device ran out, 0 on error
+	///
+	size_t block_store_allocate_many(block_store_t *const bs, const size_t n, size_t *const ids_out);
+
+	///
+	/// Frees every block in the list, ids that aren't user blocks are skipped
+	/// \param bs BS device
+	/// \param ids The blocks to free
+	/// \param n Number of ids in the list
+	///
+	void block_store_release_many(block_store_t *const bs, const size_t *const ids, const size_t n);
+
+	///
+	/// Sets the policy block_store_allocate uses to pick free blocks
+	/// \param bs BS device
+	/// \param policy The allocation policy
+	/// \return boolean indicating succes of operation
+	///
+	bool block_store_set_policy(block_store_t *const bs, const block_store_policy_t policy);
+
+	///
+	/// Turns concurrent mode on or off. Has to be done before the device is shared between threads.
+	///  In concurrent mode the FBM is updated with atomic fetch-or/fetch-and and compare and swap
+	///  on 64 bit words, so the allocate, request and release calls (single, near, extent and
+	///  batch) are lock free and can be called from any number of threads at once. Two threads
+	///  can never be handed the same block. Reads and writes take no locks at all, so they're
+	///  safe as long as two threads don't write the same block at the same time. The used/free
+	///  counts are a snapshot while other threads are busy. Everything else (the setters,
+	///  serialization, mmap sync and destroy) still has to happen while nothing else is running.
+	///  Devices in buddy mode, and devices sharing blocks with a snapshot or clone, can't be put
+	///  in concurrent mode.
+	/// \param bs BS device
+	/// \param enable Whether concurrent mode should be on
+	/// \return boolean indicating succes of operation
+	///
+	bool block_store_set_concurrent(block_store_t *const bs, const bool enable);
+
+	///
+	/// Turns buddy mode on or off. Has to be done while nothing else is using the device.
+	///  Buddy mode keeps a binary buddy index of the free blocks next to the FBM: maximal
+	///  aligned power of two chunks, one bitmap per order. block_store_allocate_order takes
+	///  a chunk in a few word lookups per order, and releases merge chunks back with their
+	///  buddies, so power of two allocations don't break up the large free runs.
+	///  block_store_allocate takes single blocks from the smallest free chunk, the other calls
+	///  work as before and keep the index up to date. The FBM stays the record of what's
+	///  allocated, so images are the same with and without it. The index isn't thread safe,
+	///  so buddy mode can't be on together with concurrent mode or magazines.
+	/// \param bs BS device
+	/// \param enable Whether buddy mode should be on
+	/// \return boolean indicating succes of operation
+	///
+	bool block_store_set_buddy(block_store_t *const bs, const bool enable);
+
+	///
+	/// Turns per-thread magazines on or off. Has to be done while nothing else is using the device.
+	///  Each thread that allocates or releases gets its own magazine, a stack of block ids that
+	///  stay claimed in the FBM. block_store_allocate pops from it and block_store_release
+	///  pushes onto it, so the shared FBM is only touched to refill an empty magazine (half
+	///  full, in one block_store_allocate_many) or to drain the older half of a full one.
+	///  That keeps threads off each other's FBM words in concurrent mode, and hands out the
+	///  most recently released block, which is likely still in the cache.
+	///  A thread's magazine goes back to the FBM when the thread exits, when magazines are
+	///  turned off or flushed, and when the device is destroyed. When the FBM runs out,
+	///  block_store_allocate takes blocks from other threads' magazines, so it still only
+	///  fails when the whole device is allocated. Things to keep in mind while they're on:
+	///  - block_store_allocate no longer follows the allocation policy, the other calls still do
+	///  - blocks in magazines look allocated to block_store_request, extents and batches
+	///  - releasing a block that isn't allocated is ignored as usual, debug mode bypasses
+	///    magazines on release so those mistakes are still reported
+	///  - serialized images and synced files show blocks in magazines as allocated,
+	///    so call block_store_flush_magazines first
+	///  - each device with magazines on uses up a pthread key
+	///  - they can't be turned on while buddy mode is
+	/// \param bs BS device
+	/// \param capacity Most blocks a thread's magazine holds, 0 turns magazines off
+	/// \return boolean indicating succes of operation
+	///
+	bool block_store_set_magazines(block_store_t *const bs, const size_t capacity);
+
+	///
+	/// Gives every block sitting in a magazine back to the FBM. Safe to call while other threads are busy.
+	/// \param bs BS device
+	///
+	void block_store_flush_magazines(block_store_t *const bs);
+
 	///
 	/// Attempts to allocate the requested block id
 	/// \param bs the block store object
@@ -61,11 +416,73 @@ extern "C"
 
 	///
 	/// Counts the number of blocks marked as in use
+	///  Reads a counter the device keeps up to date, plus a visit to every thread's
+	///  magazine when magazines are on. In debug mode the counter is checked against
+	///  the FBM (not in concurrent mode), a mismatch counts as a violation.
 	/// \param bs BS device
 	/// \return Total blocks in use, SIZE_MAX on error
 	///
 	size_t block_store_get_used_blocks(const block_store_t *const bs);
 
+	///
+	/// Counts the number of blocks marked as in use, counting blocks that sit in
+	///  magazines as used. Skips visiting every thread's magazine, so it never comes in
+	///  under block_store_get_used_blocks and is over by at most capacity blocks per thread.
+	///  Always constant time.
+	/// \param bs BS device
+	/// \return Total blocks in use or in magazines, SIZE_MAX on error
+	///
+	size_t block_store_get_used_blocks_approx(const block_store_t *const bs);
+
+	///
+	/// Finds the largest run of free blocks
+	///  The device keeps an index of its free runs, by start and by length, while it isn't
+	///  in concurrent mode. That makes this a walk down a tree. In concurrent mode it walks the FBM.
+	/// \param bs BS device
+	/// \param first_id Receives the id of the first block in the run (the lowest one on a tie), may be NULL
+	/// \return Number of blocks in the run, 0 if nothing is free, SIZE_MAX on error
+	///
+	size_t block_store_largest_free_extent(const block_store_t *const bs, size_t *const first_id);
+
+	///
+	/// Reports how the free blocks are spread out: how many runs, the longest, and a histogram
+	///  of run lengths. Constant time from the free run index, a walk of the FBM in concurrent mode.
+	/// \param bs BS device
+	/// \param stats Receives the report
+	/// \return boolean indicating succes of operation
+	///
+	bool block_store_get_fragmentation(const block_store_t *const bs, block_store_fragmentation_t *const stats);
+
+	///
+	/// Moves allocated blocks toward the low end of the device, a little at a time
+	///  Each step takes the highest allocated block, copies it into the lowest free one the way
+	///  block_store_read/write would, reports the move and releases the old block. Calling it
+	///  with a small budget until it returns 0 compacts a device a little at a time, between
+	///  its other work. A move doesn't take the block from its owner, so nothing else may use
+	///  the device during a call: it can't be in concurrent mode, and callers with several
+	///  threads have to serialize the calls with their own lock. Owners pick up the new ids
+	///  from the callback. Blocks pinned in debug mode stay where they are. Magazines hold
+	///  blocks nobody owns yet, so a device with magazines on can't be compacted either.
+	/// \param bs BS device
+	/// \param budget Limits on the work done, NULL for none. At least one block moves if any can.
+	/// \param remap Told about every move, may be NULL
+	/// \param context Passed to remap
+	/// \return Number of blocks moved, 0 once there's nothing left to move, SIZE_MAX on error
+	///
+	size_t block_store_compact(block_store_t *const bs, const block_store_compact_budget_t *const budget, block_store_remap_callback_t remap, void *context);
+
+	///
+	/// Calls func for every allocated block id, in increasing order
+	///  Walks the FBM a word at a time, skipping runs of free blocks. Blocks sitting in
+	///  magazines count as allocated (see block_store_flush_magazines), and blocks
+	///  allocated or released by func or other threads during the walk may or may not be seen.
+	/// \param bs BS device
+	/// \param func The function to call (first parameter will be the block id)
+	/// \param arg A generic pointer to pass to func
+	/// \return Number of blocks func was called for, SIZE_MAX on error
+	///
+	size_t block_store_for_each_allocated(const block_store_t *const bs, void (*func)(size_t, void *), void *arg);
+
 	///
 	/// Counts the number of blocks marked free for use
 	/// \param bs BS device
@@ -75,10 +492,17 @@ extern "C"
 
 	///
 	/// Returns the total number of user-addressable blocks
-	///  (since this is constant, you don't even need the bs object)
-	/// \return Total blocks
+	/// \param bs BS device
+	/// \return Total blocks, SIZE_MAX on error
 	///
-	size_t block_store_get_total_blocks();
+	size_t block_store_get_total_blocks(const block_store_t *const bs);
+
+	///
+	/// Returns the size of each block on the device
+	/// \param bs BS device
+	/// \return Bytes per block, 0 on error
+	///
+	size_t block_store_get_block_size(const block_store_t *const bs);
 
 	///
 	/// Reads data from the specified block and writes it to the designated buffer
@@ -98,13 +522,235 @@ extern "C"
 	///
 	size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer);
 
+	///
+	/// Reads part of the specified block into the designated buffer
+	/// \param bs BS device
+	/// \param block_id Source block id
+	/// \param offset Byte offset within the block to start at
+	/// \param len Number of bytes to read, offset + len can't be past the end of the block
+	/// \param buffer Data buffer to write to
+	/// \return Number of bytes read, 0 on error
+	///
+	size_t block_store_pread(const block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, void *buffer);
+
+	///
+	/// Writes the designated buffer over part of the specified block
+	/// \param bs BS device
+	/// \param block_id Destination block id
+	/// \param offset Byte offset within the block to start at
+	/// \param len Number of bytes to write, offset + len can't be past the end of the block
+	/// \param buffer Data buffer to read from
+	/// \return Number of bytes written, 0 on error
+	///
+	size_t block_store_pwrite(block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, const void *buffer);
+
+	///
+	/// Reads a list of whole blocks, each into its own buffer
+	/// \param bs BS device
+	/// \param iov The blocks to read and where each one goes
+	/// \param count Number of entries in the list
+	/// \return Number of bytes read, stops short at the first bad entry, 0 on error
+	///
+	size_t block_store_readv(const block_store_t *const bs, const block_store_iovec_t *const iov, const size_t count);
+
+	///
+	/// Writes a list of whole blocks, each from its own buffer
+	/// \param bs BS device
+	/// \param iov The blocks to write and where each one comes from
+	/// \param count Number of entries in the list
+	/// \return Number of bytes written, stops short at the first bad entry, 0 on error
+	///
+	size_t block_store_writev(block_store_t *const bs, const block_store_iovec_t *const iov, const size_t count);
+
+	///
+	/// Queues a read of a whole block, it starts on the next block_store_submit (or block_store_poll)
+	///  On a file backed device the read goes to the file through io_uring or worker threads,
+	///  so many of them overlap, unless the block is already cached. Any other device
+	///  finishes it during submit. Either way the callback runs from block_store_poll.
+	///  The buffer has to stay put until then, and the block shouldn't be written by any
+	///  other call while the read is outstanding. The async calls (queueing, submit, poll)
+	///  can only be made by one thread at a time.
+	/// \param bs BS device
+	/// \param block_id Source block id
+	/// \param buffer Data buffer to write to
+	/// \param callback Called once the read is done, may be NULL
+	/// \param context Passed to the callback
+	/// \return boolean indicating succes of operation
+	///
+	bool block_store_read_async(block_store_t *const bs, const size_t block_id, void *buffer, block_store_io_callback_t callback, void *context);
+
+	///
+	/// Queues a write of a whole block, see block_store_read_async
+	///  The buffer isn't copied, it has to stay put until the callback runs. The write may not
+	///  show up to other calls on the block until then. On a file backed device with a cache
+	///  the write goes into the cache and finishes during submit, without a cache it goes
+	///  straight to the file.
+	/// \param bs BS device
+	/// \param block_id Destination block id
+	/// \param buffer Data buffer to read from
+	/// \param callback Called once the write is done, may be NULL
+	/// \param context Passed to the callback
+	/// \return boolean indicating succes of operation
+	///
+	bool block_store_write_async(block_store_t *const bs, const size_t block_id, const void *buffer, block_store_io_callback_t callback, void *context);
+
+	///
+	/// Starts every queued async request, as many as the queue depth allows
+	/// \param bs BS device
+	/// \return Number of requests started, the rest start as earlier ones are polled
+	///
+	size_t block_store_submit(block_store_t *const bs);
+
+	///
+	/// Submits whatever is queued, then runs the callbacks of finished async requests
+	/// \param bs BS device
+	/// \param min_complete Waits until at least this many have finished (or nothing is outstanding),
+	///  0 only collects what's already done, SIZE_MAX waits for everything
+	/// \return Number of callbacks run
+	///
+	size_t block_store_poll(block_store_t *const bs, const size_t min_complete);
+
+	///
+	/// Picks the engine for async requests and how many can be in flight at once
+	///  Devices start with BLOCK_STORE_ASYNC_AUTO and BLOCK_STORE_ASYNC_DEPTH, set up on first use.
+	///  Fails while requests are outstanding, or if the backend isn't available.
+	/// \param bs BS device
+	/// \param backend The engine
+	/// \param depth Most requests in flight at once, up to 4096
+	/// \return boolean indicating succes of operation
+	///
+	bool block_store_set_async(block_store_t *const bs, const block_store_async_backend_t backend, const size_t depth);
+
+	///
+	/// Tells which engine runs the device's async requests
+	/// \param bs BS device
+	/// \return BLOCK_STORE_ASYNC_URING or BLOCK_STORE_ASYNC_THREADS once one is running,
+	///  BLOCK_STORE_ASYNC_AUTO before that or for devices that don't need one
+	///
+	block_store_async_backend_t block_store_get_async_backend(const block_store_t *const bs);
+
+	///
+	/// Returns a pointer straight into the device's storage for the given block
+	///  Saves the copy block_store_read/write make. The pointer is good until the
+	///  device is destroyed, but the block may be handed to someone else once released.
+	/// \param bs BS device
+	/// \param block_id The block
+	/// \return Pointer to block_size bytes of block data, NULL on error
+	///
+	void *block_store_block_ptr(block_store_t *const bs, const size_t block_id);
+
+	///
+	/// Returns a read only pointer straight into the device's storage for the given block
+	/// \param bs BS device
+	/// \param block_id The block
+	/// \return Pointer to block_size bytes of block data, NULL on error
+	///
+	const void *block_store_block_ptr_const(const block_store_t *const bs, const size_t block_id);
+
+	///
+	/// Pins a block and returns a pointer straight into its storage
+	///  Same as block_store_block_ptr, but in debug mode the block can't be released
+	///  until every pin has been dropped with block_store_unpin
+	/// \param bs BS device
+	/// \param block_id The block
+	/// \return Pointer to block_size bytes of block data, NULL on error
+	///
+	void *block_store_pin(block_store_t *const bs, const size_t block_id);
+
+	///
+	/// Drops a pin taken with block_store_pin
+	/// \param bs BS device
+	/// \param block_id The block
+	///
+	void block_store_unpin(block_store_t *const bs, const size_t block_id);
+
+	///
+	/// Turns debug mode on or off. In debug mode the device catches and counts
+	///  (see block_store_get_debug_violations) these misuses, reporting each on stderr:
+	///  - pointers to, or writes to, blocks that aren't allocated (these fail)
+	///  - releasing a block that is pinned (the release doesn't happen) or already free
+	///  - unpinning a block that isn't pinned
+	///  - writing through a pointer after the block was released, since released blocks
+	///    are filled with BLOCK_STORE_POISON and checked when they're allocated again
+	/// \param bs BS device
+	/// \param enable Whether debug mode should be on
+	/// \return boolean indicating succes of operation
+	///
+	bool block_store_set_debug(block_store_t *const bs, const bool enable);
+
+	///
+	/// Counts the misuses debug mode has caught so far
+	/// \param bs BS device
+	/// \return Number of violations, SIZE_MAX on error or if debug mode is off
+	///
+	size_t block_store_get_debug_violations(const block_store_t *const bs);
+
+	///
+	/// Starts journaling the device's changes against an image, or stops
+	///  With a journal on, every block write and every allocation or release is also added
+	///  to a pending transaction. block_store_commit appends that transaction to
+	///  filename.journal as one checksummed record with a single sequential write and a
+	///  single fsync, so a batch of random block writes costs one log append. Threads
+	///  committing at the same time share the fsync. block_store_deserialize(filename)
+	///  loads the image and replays every committed record over it, a record that was cut
+	///  short by a crash is ignored, as is everything not committed yet.
+	///  Serializing into filename itself (either way) is a checkpoint: it commits first,
+	///  syncs the image and then empties the journal. block_store_serialize writes the new
+	///  image beside the old one and renames it over, block_store_serialize_incremental
+	///  writes in place and relies on the journal to redo any block it tears, so it's only
+	///  crash safe once an earlier checkpoint has written the whole image.
+	///  Writes through block_store_block_ptr are journaled when the block is unpinned, async
+	///  writes when they're queued. Replay goes in commit order, so in concurrent mode two
+	///  threads shouldn't write the same block without a commit in between.
+	///  An existing journal is kept and appended to, its records still belong to the image.
+	/// \param bs BS device
+	/// \param filename The image, NULL stops journaling and drops what wasn't committed
+	/// \return boolean indicating succes of operation
+	///
+	bool block_store_set_journal(block_store_t *const bs, const char *const filename);
+
+	///
+	/// Makes every change since the last commit durable as one transaction, see block_store_set_journal
+	/// \param bs BS device
+	/// \return boolean indicating succes of operation, false if there's no journal
+	///
+	bool block_store_commit(block_store_t *const bs);
+
 	///
 	/// Imports BS device from the given file - for grads/bonus
+	///  Same as block_store_load with the default chunk size, so it takes either kind of image
 	/// \param filename The file to load
 	/// \return Pointer to new BS device, NULL on error
 	///
 	block_store_t *block_store_deserialize(const char *const filename);
 
+	///
+	/// Loads a BS device from an image, reading it a chunk at a time and checking it as it goes
+	///  A versioned image (block_store_save or block_store_save_compressed) brings its own
+	///  geometry and checksums, a raw one (block_store_serialize) has to be exactly the size
+	///  of a default device. The blocks are read straight into the new device's memory,
+	///  chunk_size bytes per read (a compressed image goes through two segment sized
+	///  buffers), so nothing else the size of the image is ever allocated. A device is only returned if the whole
+	///  image loaded and checked out, and its FBM marks its own blocks in use. A journal
+	///  beside the image is replayed over it, see block_store_set_journal.
+	///  Raw images from before the FBM moved to the end of the device kept it in block 127.
+	///  Those are converted as they load: block 127 becomes a free user block and the FBM
+	///  moves to block 255, which is why an old image that allocated block 255 is
+	///  BLOCK_STORE_LOAD_UNSUPPORTED.
+	/// \param filename The image
+	/// \param chunk_size Bytes to read at a time, 0 for BLOCK_STORE_LOAD_CHUNK
+	/// \param status Receives why the load failed (or BLOCK_STORE_LOAD_OK), may be NULL
+	/// \return Pointer to new BS device, NULL on error
+	///
+	block_store_t *block_store_load(const char *const filename, const size_t chunk_size, block_store_load_status_t *const status);
+
+	///
+	/// Describes a block_store_load status
+	/// \param status The status
+	/// \return A short description, never NULL
+	///
+	const char *block_store_load_status_string(const block_store_load_status_t status);
+
 	///
 	/// Writes the entirety of the BS device to file, overwriting it if it exists - for grads/bonus
 	/// \param bs BS device
@@ -113,6 +759,50 @@ extern "C"
 	///
 	size_t block_store_serialize(const block_store_t *const bs, const char *const filename);
 
+	///
+	/// Writes the BS device to a versioned image, overwriting it if it exists
+	///  The image starts with a 64 byte header (magic, version, geometry, a CRC-32C of the
+	///  blocks and one of the header itself) followed by the blocks as block_store_serialize
+	///  writes them, so any geometry round trips through block_store_load. Nothing may write
+	///  to the device while it's being saved, or the checksum won't match what went out.
+	/// \param bs BS device
+	/// \param filename The file to write to
+	/// \return Number of bytes written, header included, 0 on error
+	///
+	size_t block_store_save(const block_store_t *const bs, const char *const filename);
+
+	///
+	/// Writes the BS device to a compressed image, overwriting it if it exists
+	///  Only allocated blocks go in: the FBM is written as it is, then the user blocks a 1 MB
+	///  segment at a time, each segment's allocated blocks compressed together with an LZ4
+	///  style codec (or stored as they are if that doesn't pay). Segments are compressed by
+	///  several threads at once and written in order. Blocks that aren't allocated come back
+	///  zero filled from block_store_load, whatever was in them. Same header and checksums as
+	///  block_store_save, and nothing may write to the device while it's being saved.
+	/// \param bs BS device, with blocks of at most 1 MB
+	/// \param filename The file to write to
+	/// \param threads Threads compressing at once, 0 for one per processor
+	/// \return Number of bytes written, header included, 0 on error
+	///
+	size_t block_store_save_compressed(const block_store_t *const bs, const char *const filename, size_t threads);
+
+	///
+	/// Brings an image of the BS device up to date, writing only the blocks changed since the last call
+	///  The device tracks which blocks were written, allocated or released (and hands out
+	///  through block_store_block_ptr or pins), and this writes just those plus the FBM
+	///  into the file in place, so a checkpoint costs what changed rather than the whole
+	///  device. The file should hold an image of this device, from block_store_serialize or
+	///  earlier calls to this one. A file that doesn't exist yet is created and zero filled.
+	///  Every block counts as changed on a new device, so the first call writes all of it,
+	///  and block_store_serialize doesn't reset what's changed. Writes through a pointer
+	///  after it was handed out are only tracked once the block is unpinned (or its pointer
+	///  is asked for again). Blocks that couldn't be written stay marked for the next call.
+	/// \param bs BS device
+	/// \param filename The image to update
+	/// \return Number of bytes written, FBM included, 0 on error
+	///
+	size_t block_store_serialize_incremental(const block_store_t *const bs, const char *const filename);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,139 @@
+#ifndef BLOCK_STORE_SHARDED_H__
+#define BLOCK_STORE_SHARDED_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "block_store.h"
+
+	// A sharded device stripes one block id space over several independent block stores,
+	//  each with its own FBM, so threads working on different shards never touch the same
+	//  bitmap words. Global id g lives on shard g % shard_count as local block g / shard_count,
+	//  so consecutive ids are spread over every shard.
+	typedef struct block_store_sharded block_store_sharded_t;
+
+	// How block_store_sharded_allocate picks the shard it allocates from
+	//  Both are tracked per thread, so picking a shard never touches shared memory.
+	//  Either way a full shard is skipped over until every shard is full.
+	typedef enum {
+		BLOCK_STORE_ROUTE_ROUND_ROBIN = 0, // each thread cycles through the shards, the default
+		BLOCK_STORE_ROUTE_THREAD,          // each thread sticks to its own home shard
+	} block_store_route_t;
+
+	///
+	/// Creates a sharded device, every shard is in concurrent mode and has the same geometry
+	/// \param shard_count Number of shards
+	/// \param num_blocks Total number of blocks on each shard, FBM included
+	/// \param block_size Bytes per block, same rules as block_store_create_ex
+	/// \return Pointer to the new sharded device, NULL on error
+	///
+	block_store_sharded_t *block_store_sharded_create(const size_t shard_count, const size_t num_blocks, const size_t block_size);
+
+	///
+	/// Destroys the sharded device and all of its shards
+	/// \param sbs Sharded device
+	///
+	void block_store_sharded_destroy(block_store_sharded_t *const sbs);
+
+	///
+	/// Sets how allocations are routed to shards
+	/// \param sbs Sharded device
+	/// \param route The routing policy
+	/// \return boolean indicating succes of operation
+	///
+	bool block_store_sharded_set_routing(block_store_sharded_t *const sbs, const block_store_route_t route);
+
+	///
+	/// Returns one of the shards, so per device settings (policy, magazines, debug) can be changed
+	///  Ids on the shard are local ids. The shard belongs to the sharded device, don't destroy it.
+	/// \param sbs Sharded device
+	/// \param index The shard
+	/// \return The shard, NULL on error
+	///
+	block_store_t *block_store_sharded_get_shard(block_store_sharded_t *const sbs, const size_t index);
+
+	///
+	/// Returns the number of shards
+	/// \param sbs Sharded device
+	/// \return Number of shards, 0 on error
+	///
+	size_t block_store_sharded_get_shard_count(const block_store_sharded_t *const sbs);
+
+	///
+	/// Allocates a free block from the shard the routing policy picks
+	/// \param sbs Sharded device
+	/// \return Allocated block's global id, SIZE_MAX on error
+	///
+	size_t block_store_sharded_allocate(block_store_sharded_t *const sbs);
+
+	///
+	/// Attempts to allocate the requested block id
+	/// \param sbs Sharded device
+	/// \param block_id Global block id
+	/// \return boolean indicating succes of operation
+	///
+	bool block_store_sharded_request(block_store_sharded_t *const sbs, const size_t block_id);
+
+	///
+	/// Frees the specified block
+	/// \param sbs Sharded device
+	/// \param block_id Global block id
+	///
+	void block_store_sharded_release(block_store_sharded_t *const sbs, const size_t block_id);
+
+	///
+	/// Counts the number of blocks marked as in use over all shards
+	/// \param sbs Sharded device
+	/// \return Total blocks in use, SIZE_MAX on error
+	///
+	size_t block_store_sharded_get_used_blocks(const block_store_sharded_t *const sbs);
+
+	///
+	/// Counts the number of blocks marked free for use over all shards
+	/// \param sbs Sharded device
+	/// \return Total blocks free, SIZE_MAX on error
+	///
+	size_t block_store_sharded_get_free_blocks(const block_store_sharded_t *const sbs);
+
+	///
+	/// Returns the total number of user-addressable blocks, global ids run from 0 up to it
+	/// \param sbs Sharded device
+	/// \return Total blocks, SIZE_MAX on error
+	///
+	size_t block_store_sharded_get_total_blocks(const block_store_sharded_t *const sbs);
+
+	///
+	/// Returns the size of each block
+	/// \param sbs Sharded device
+	/// \return Bytes per block, 0 on error
+	///
+	size_t block_store_sharded_get_block_size(const block_store_sharded_t *const sbs);
+
+	///
+	/// Reads data from the specified block and writes it to the designated buffer
+	/// \param sbs Sharded device
+	/// \param block_id Global source block id
+	/// \param buffer Data buffer to write to
+	/// \return Number of bytes read, 0 on error
+	///
+	size_t block_store_sharded_read(const block_store_sharded_t *const sbs, const size_t block_id, void *buffer);
+
+	///
+	/// Reads data from the specified buffer and writes it to the designated block
+	/// \param sbs Sharded device
+	/// \param block_id Global destination block id
+	/// \param buffer Data buffer to read from
+	/// \return Number of bytes written, 0 on error
+	///
+	size_t block_store_sharded_write(block_store_sharded_t *const sbs, const size_t block_id, const void *buffer);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
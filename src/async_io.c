@@ -0,0 +1,450 @@
+// syscall, the io_uring mmap offsets
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "async_io.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#else
+#define HAVE_IO_URING 0
+#endif
+
+// more threads than this just fight over the disk
+#define POOL_THREADS_MAX 16
+
+#if HAVE_IO_URING
+// the rings the kernel shares with us, there's no liburing so this is done by hand
+struct uring{
+    int fd;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned tail;          // our copy of the submission tail, published on submit
+    unsigned to_submit;     // filled in since the last submit
+};
+#endif
+
+// worker threads doing plain pread/pwrite
+struct pool{
+    pthread_t *threads;
+    size_t thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work;    // something was queued, or it's time to stop
+    pthread_cond_t done;    // something finished
+    async_op_t *staged_head, *staged_tail;  // pushed but not submitted, only the caller touches these
+    async_op_t *queue_head, *queue_tail;    // submitted, waiting for a worker
+    async_op_t *finished;   // waiting to be reaped
+    size_t finished_count;
+    bool stopping;
+};
+
+struct async_io{
+    block_store_async_backend_t backend;
+    size_t depth;
+    size_t in_flight;       // pushed and not reaped yet
+#if HAVE_IO_URING
+    struct uring ring;
+#endif
+    struct pool pool;
+};
+
+// appends op to the list with the given ends
+static void list_append(async_op_t **const head, async_op_t **const tail, async_op_t *const op){
+    op->next = NULL;
+    if(*tail != NULL){
+        (*tail)->next = op;
+    }
+    else{
+        *head = op;
+    }
+    *tail = op;
+}
+
+//
+// io_uring
+//
+
+#if HAVE_IO_URING
+static bool uring_setup(struct uring *const ring, const size_t depth){
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->sq_ring = ring->cq_ring = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+    ring->fd = (int)syscall(__NR_io_uring_setup, (unsigned)depth, &params);
+    if(ring->fd < 0){
+        return false;
+    }
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // newer kernels put both rings in one mapping
+    const bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if(single){
+        ring->sq_ring_size = ring->cq_ring_size = (ring->sq_ring_size > ring->cq_ring_size) ? ring->sq_ring_size : ring->cq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ring == MAP_FAILED){
+        return false;
+    }
+    ring->cq_ring = single ? ring->sq_ring :
+                    mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if(ring->cq_ring == MAP_FAILED){
+        return false;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED){
+        return false;
+    }
+    uint8_t *sq = (uint8_t *)ring->sq_ring, *cq = (uint8_t *)ring->cq_ring;
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->tail = *ring->sq_tail;
+    return true;
+}
+
+static void uring_teardown(struct uring *const ring){
+    if(ring->sqes != MAP_FAILED){
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if((ring->cq_ring != MAP_FAILED) && (ring->cq_ring != ring->sq_ring)){
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if(ring->sq_ring != MAP_FAILED){
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if(ring->fd >= 0){
+        close(ring->fd);
+    }
+}
+
+static int uring_enter(const struct uring *const ring, const unsigned to_submit, const unsigned min_complete){
+    int ret;
+    do{
+        ret = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    }while((ret < 0) && (errno == EINTR));
+    return ret;
+}
+
+static void uring_push(struct uring *const ring, async_op_t *const op){
+    const unsigned index = ring->tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    // the vectored ops go back to the first io_uring kernels, plain READ/WRITE came later
+    sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = op->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&op->iov;
+    sqe->len = 1;
+    sqe->off = (uint64_t)op->offset;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    ring->sq_array[index] = index;
+    ring->tail++;
+    ring->to_submit++;
+}
+
+static bool uring_submit(struct uring *const ring){
+    // the kernel mustn't see the new tail before the entries behind it
+    __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+    while(ring->to_submit > 0){
+        int ret = uring_enter(ring, ring->to_submit, 0);
+        if(ret <= 0){
+            // nothing taken (or -EAGAIN/-EBUSY) means completions have to be reaped first,
+            // what's left goes out on the next submit
+            if(ret == 0){
+                errno = EAGAIN;
+            }
+            return false;
+        }
+        ring->to_submit -= (unsigned)ret;
+    }
+    return true;
+}
+
+// collects whatever is on the completion ring, waiting for at least min_complete
+static size_t uring_reap(struct uring *const ring, const size_t min_complete, async_op_t **const head, async_op_t **const tail){
+    size_t count = 0;
+    for(;;){
+        unsigned cqHead = *ring->cq_head;
+        const unsigned cqTail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for(; cqHead != cqTail; cqHead++){
+            const struct io_uring_cqe *cqe = &ring->cqes[cqHead & *ring->cq_mask];
+            async_op_t *op = (async_op_t *)(uintptr_t)cqe->user_data;
+            op->result = cqe->res;
+            list_append(head, tail, op);
+            count++;
+        }
+        __atomic_store_n(ring->cq_head, cqHead, __ATOMIC_RELEASE);
+        if((count >= min_complete) || (uring_enter(ring, 0, (unsigned)(min_complete - count)) < 0)){
+            return count;
+        }
+    }
+}
+#endif
+
+//
+// thread pool
+//
+
+static void *pool_worker(void *arg){
+    struct pool *pool = (struct pool *)arg;
+    pthread_mutex_lock(&pool->lock);
+    for(;;){
+        while((pool->queue_head == NULL) && !pool->stopping){
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if(pool->queue_head == NULL){
+            break;
+        }
+        async_op_t *op = pool->queue_head;
+        pool->queue_head = op->next;
+        if(pool->queue_head == NULL){
+            pool->queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        const ssize_t moved = op->write ? pwrite(op->fd, op->iov.iov_base, op->iov.iov_len, op->offset)
+                                        : pread(op->fd, op->iov.iov_base, op->iov.iov_len, op->offset);
+        op->result = (moved < 0) ? -errno : moved;
+
+        pthread_mutex_lock(&pool->lock);
+        op->next = pool->finished;
+        pool->finished = op;
+        pool->finished_count++;
+        pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static bool pool_setup(struct pool *const pool, const size_t depth){
+    if(pthread_mutex_init(&pool->lock, NULL) != 0){
+        return false;
+    }
+    if(pthread_cond_init(&pool->work, NULL) != 0){
+        pthread_mutex_destroy(&pool->lock);
+        return false;
+    }
+    if(pthread_cond_init(&pool->done, NULL) != 0){
+        pthread_cond_destroy(&pool->work);
+        pthread_mutex_destroy(&pool->lock);
+        return false;
+    }
+    const size_t wanted = (depth < POOL_THREADS_MAX) ? depth : POOL_THREADS_MAX;
+    pool->threads = (pthread_t *)calloc(wanted, sizeof(pthread_t));
+    for(; (pool->threads != NULL) && (pool->thread_count < wanted); pool->thread_count++){
+        if(pthread_create(&pool->threads[pool->thread_count], NULL, pool_worker, pool) != 0){
+            break;
+        }
+    }
+    // fewer threads than we asked for still works, none doesn't
+    if(pool->thread_count == 0){
+        free(pool->threads);
+        pthread_cond_destroy(&pool->done);
+        pthread_cond_destroy(&pool->work);
+        pthread_mutex_destroy(&pool->lock);
+        return false;
+    }
+    return true;
+}
+
+static void pool_teardown(struct pool *const pool){
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for(size_t i = 0; i < pool->thread_count; i++){
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+static size_t pool_reap(struct pool *const pool, const size_t min_complete, async_op_t **const head, async_op_t **const tail){
+    pthread_mutex_lock(&pool->lock);
+    while(pool->finished_count < min_complete){
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    async_op_t *finished = pool->finished;
+    const size_t count = pool->finished_count;
+    pool->finished = NULL;
+    pool->finished_count = 0;
+    pthread_mutex_unlock(&pool->lock);
+    while(finished != NULL){
+        async_op_t *next = finished->next;
+        list_append(head, tail, finished);
+        finished = next;
+    }
+    return count;
+}
+
+///
+/// Starts up an engine
+/// \param backend Which backend to use, BLOCK_STORE_ASYNC_AUTO picks io_uring if the kernel allows it
+/// \param depth Most operations in flight at once
+/// \return Pointer to the engine, NULL on error (including an io_uring request the kernel refuses)
+///
+async_io_t *async_io_create(const block_store_async_backend_t backend, const size_t depth)
+{
+    if((depth == 0) || (depth > 4096)){
+        return NULL;
+    }
+    async_io_t *io = (async_io_t *)calloc(1, sizeof(async_io_t));
+    if(io == NULL){
+        return NULL;
+    }
+    io->depth = depth;
+#if HAVE_IO_URING
+    if((backend == BLOCK_STORE_ASYNC_AUTO) || (backend == BLOCK_STORE_ASYNC_URING)){
+        if(uring_setup(&io->ring, depth)){
+            io->backend = BLOCK_STORE_ASYNC_URING;
+            return io;
+        }
+        // io_uring can be compiled out, or turned off by seccomp or kernel.io_uring_disabled
+        uring_teardown(&io->ring);
+    }
+#endif
+    if((backend == BLOCK_STORE_ASYNC_AUTO) || (backend == BLOCK_STORE_ASYNC_THREADS)){
+        if(pool_setup(&io->pool, depth)){
+            io->backend = BLOCK_STORE_ASYNC_THREADS;
+            return io;
+        }
+    }
+    free(io);
+    return NULL;
+}
+
+///
+/// Waits for everything in flight and shuts the engine down, finished operations are dropped
+/// \param io The engine
+///
+void async_io_destroy(async_io_t *const io)
+{
+    if(io == NULL){
+        return;
+    }
+    // the kernel or a worker may still be writing into the callers' buffers
+    async_op_t *finished;
+    async_io_reap(io, io->in_flight, &finished);
+#if HAVE_IO_URING
+    if(io->backend == BLOCK_STORE_ASYNC_URING){
+        uring_teardown(&io->ring);
+    }
+#endif
+    if(io->backend == BLOCK_STORE_ASYNC_THREADS){
+        pool_teardown(&io->pool);
+    }
+    free(io);
+}
+
+///
+/// Tells which backend the engine ended up with
+/// \param io The engine
+/// \return BLOCK_STORE_ASYNC_URING or BLOCK_STORE_ASYNC_THREADS
+///
+block_store_async_backend_t async_io_backend(const async_io_t *const io)
+{
+    return io->backend;
+}
+
+///
+/// Queues an operation, it may not start until async_io_submit
+/// \param io The engine
+/// \param op The operation
+/// \return boolean indicating succes of operation, false when depth operations are already in flight
+///
+bool async_io_push(async_io_t *const io, async_op_t *const op)
+{
+    if(io->in_flight == io->depth){
+        return false;
+    }
+    io->in_flight++;
+#if HAVE_IO_URING
+    if(io->backend == BLOCK_STORE_ASYNC_URING){
+        uring_push(&io->ring, op);
+        return true;
+    }
+#endif
+    list_append(&io->pool.staged_head, &io->pool.staged_tail, op);
+    return true;
+}
+
+///
+/// Starts everything pushed since the last submit
+/// \param io The engine
+/// \return boolean indicating succes of operation
+///
+bool async_io_submit(async_io_t *const io)
+{
+#if HAVE_IO_URING
+    if(io->backend == BLOCK_STORE_ASYNC_URING){
+        return uring_submit(&io->ring);
+    }
+#endif
+    struct pool *pool = &io->pool;
+    if(pool->staged_head != NULL){
+        pthread_mutex_lock(&pool->lock);
+        if(pool->queue_tail != NULL){
+            pool->queue_tail->next = pool->staged_head;
+        }
+        else{
+            pool->queue_head = pool->staged_head;
+        }
+        pool->queue_tail = pool->staged_tail;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+        pool->staged_head = pool->staged_tail = NULL;
+    }
+    return true;
+}
+
+///
+/// Submits anything still pushed, then collects finished operations, waiting until at least
+/// min_complete have finished
+/// \param io The engine
+/// \param min_complete Operations to wait for, capped at the number the kernel or the workers have started
+/// \param finished Receives the list of finished operations linked through next, NULL if there aren't any
+/// \return boolean indicating succes of the submit, the finished operations come back either way
+///
+bool async_io_reap(async_io_t *const io, const size_t min_complete, async_op_t **const finished)
+{
+    async_op_t *head = NULL, *tail = NULL;
+    // anything still waiting on a submit would never finish, so only wait for what got started
+    const bool submitted = async_io_submit(io);
+    size_t started = io->in_flight;
+#if HAVE_IO_URING
+    if(io->backend == BLOCK_STORE_ASYNC_URING){
+        started -= io->ring.to_submit;
+    }
+#endif
+    const size_t wanted = (min_complete < started) ? min_complete : started;
+    size_t count;
+#if HAVE_IO_URING
+    if(io->backend == BLOCK_STORE_ASYNC_URING){
+        count = uring_reap(&io->ring, wanted, &head, &tail);
+    }
+    else
+#endif
+    {
+        count = pool_reap(&io->pool, wanted, &head, &tail);
+    }
+    io->in_flight -= count;
+    *finished = head;
+    return submitted;
+}
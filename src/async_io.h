@@ -0,0 +1,71 @@
+#ifndef ASYNC_IO_H__
+#define ASYNC_IO_H__
+
+// Overlapped pread/pwrite on file descriptors, through io_uring when the kernel has it
+// and a small pool of worker threads when it doesn't
+// Only one thread at a time may push, submit or reap
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "block_store.h"
+
+// One read or write, owned by the caller until it comes back out of async_io_reap
+typedef struct async_op {
+    int fd;
+    bool write;
+    struct iovec iov;       // the buffer and its length
+    off_t offset;
+    ssize_t result;         // bytes moved or -errno, filled in on completion
+    struct async_op *next;  // the engine's, also links what async_io_reap hands back
+} async_op_t;
+
+typedef struct async_io async_io_t;
+
+///
+/// Starts up an engine
+/// \param backend Which backend to use, BLOCK_STORE_ASYNC_AUTO picks io_uring if the kernel allows it
+/// \param depth Most operations in flight at once
+/// \return Pointer to the engine, NULL on error (including an io_uring request the kernel refuses)
+///
+async_io_t *async_io_create(const block_store_async_backend_t backend, const size_t depth);
+
+///
+/// Waits for everything in flight and shuts the engine down, finished operations are dropped
+/// \param io The engine
+///
+void async_io_destroy(async_io_t *const io);
+
+///
+/// Tells which backend the engine ended up with
+/// \param io The engine
+/// \return BLOCK_STORE_ASYNC_URING or BLOCK_STORE_ASYNC_THREADS
+///
+block_store_async_backend_t async_io_backend(const async_io_t *const io);
+
+///
+/// Queues an operation, it may not start until async_io_submit
+/// \param io The engine
+/// \param op The operation
+/// \return boolean indicating succes of operation, false when depth operations are already in flight
+///
+bool async_io_push(async_io_t *const io, async_op_t *const op);
+
+///
+/// Starts everything pushed since the last submit
+/// \param io The engine
+/// \return boolean indicating succes of operation
+///
+bool async_io_submit(async_io_t *const io);
+
+///
+/// Submits anything still pushed, then collects finished operations, waiting until at least
+/// min_complete have finished
+/// \param io The engine
+/// \param min_complete Operations to wait for, capped at the number the kernel or the workers have started
+/// \param finished Receives the list of finished operations linked through next, NULL if there aren't any
+/// \return boolean indicating succes of the submit, the finished operations come back either way
+///
+bool async_io_reap(async_io_t *const io, const size_t min_complete, async_op_t **const finished);
+
+#endif
@@ -1,9 +1,11 @@
 #include "bitmap.h"
 #include <string.h>
+#include "bitmap_kernels.h"
 
-// Just the one for now. Indicates we're an overlay and should not free
+// OVERLAY indicates we're an overlay and should not free
+// SUMMARY indicates the second level "word has a zero bit" map is allocated and kept up to date
 // (also, make sure that ALL is as wide as ll of the flags)
-typedef enum { NONE = 0x00, OVERLAY = 0x01, ALL = 0xFF } BITMAP_FLAGS;
+typedef enum { NONE = 0x00, OVERLAY = 0x01, SUMMARY = 0x02, ALL = 0xFF } BITMAP_FLAGS;
 
 struct bitmap 
 {
@@ -11,6 +13,8 @@ struct bitmap
     BITMAP_FLAGS flags;      // Generic place to store flags. Not enough flags to worry about width yet.
     uint8_t *data;
     size_t bit_count, byte_count;
+    size_t word_count;       // 64 bit words needed to cover bit_count, the last one may be partial
+    uint64_t *summary;       // bit w is set when data word w has a zero bit, NULL unless SUMMARY
 };
 
 #define FLAG_CHECK(bitmap, flag) ((bitmap)->flags & flag)
@@ -29,90 +33,463 @@ static const uint8_t mask_down_inclusive[8] = {0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3
 // Inverted mask
 static const uint8_t invert_mask[8] = {0xFE, 0xFD, 0xFB, 0xF7, 0xEF, 0xDF, 0xBF, 0x7F};
 
-// Way more testing than I should waste my time on suggested uint8_t was faster
-// but it may still be negligible/indeterminate.
-// Since the data store is uint8_t, we already get punished for our bad alignment
-// so this doesn't really matter until everything gets moved to generic int
-
-// Total bits set in the given byte in a handy lookup table
-// Macros, man...
-// http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetTable
-#define B2(n) n, n + 1, n + 1, n + 2
-#define B4(n) B2(n), B2(n + 1), B2(n + 1), B2(n + 2)
-#define B6(n) B4(n), B4(n + 1), B4(n + 1), B4(n + 2)
-static const uint8_t bit_totals[256] = {B6(0), B6(1), B6(1), B6(2)};
-#undef B6
-#undef B4
-#undef B2
-// There is an alternative for getting bit count that only loops as many times as there are bits set
-// but that's still a loop and this table is 256B.
-/*
-   unsigned int v; // count the number of bits set in v
-   unsigned int c; // c accumulates the total bits set in v
-
-   for (c = 0; v; v >>= 1)
-   {
-   c += v & 1;
-   }
- */
-
 // A place to generalize the creation process and setup
 bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags);
 
+// Word level access
+// The data is still a byte array (so overlays and exports don't change) but scanning
+// goes through 64 bit words. Bit i lives in word i >> 6 at position i & 63 as long as
+// the bytes are assembled little endian, which is what load_word does.
+// memcpy keeps us clear of alignment trouble and compiles to a single load.
+// Aligned words are read with a relaxed atomic load instead, which is the same single load
+// but keeps searches well defined while other threads use the _atomic calls on the same words.
+
+static inline uint64_t load_word(const bitmap_t *const bitmap, const size_t word) 
+{
+    const size_t offset = word << 3;
+    uint64_t value = 0;
+    if (offset + 8 <= bitmap->byte_count) 
+    {
+        if (((uintptr_t) bitmap->data & 7) == 0) 
+        {
+            value = __atomic_load_n((const uint64_t *) (bitmap->data + offset), __ATOMIC_RELAXED);
+        } 
+        else 
+        {
+            memcpy(&value, bitmap->data + offset, 8);
+        }
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        value = __builtin_bswap64(value);
+#endif
+    } 
+    else 
+    {
+        // partial word at the end, bytes past the bitmap read as zero
+        for (size_t byte = offset; byte < bitmap->byte_count; ++byte) 
+        {
+            value |= (uint64_t) bitmap->data[byte] << ((byte - offset) << 3);
+        }
+    }
+    return value;
+}
+
+// Mask of the bits in the given word that are actually part of the bitmap
+static inline uint64_t valid_mask(const bitmap_t *const bitmap, const size_t word) 
+{
+    const unsigned tail = bitmap->bit_count & 63;
+    return (word + 1 == bitmap->word_count && tail) ? ((UINT64_C(1) << tail) - 1) : ~UINT64_C(0);
+}
+
+// Zero bits of the given word, positions past the end of the bitmap never count
+static inline uint64_t zero_bits(const bitmap_t *const bitmap, const size_t word) 
+{
+    return ~load_word(bitmap, word) & valid_mask(bitmap, word);
+}
+
+// Summary words get read while other threads update them with atomics,
+// a relaxed load is a plain load on anything we care about but keeps the compiler honest
+static inline uint64_t load_summary(const bitmap_t *const bitmap, const size_t idx) 
+{
+    return __atomic_load_n(&bitmap->summary[idx], __ATOMIC_RELAXED);
+}
+
+// Brings the summary bit for the given word in line with the data
+static inline void summary_update(bitmap_t *const bitmap, const size_t word) 
+{
+    if (zero_bits(bitmap, word)) 
+    {
+        bitmap->summary[word >> 6] |= UINT64_C(1) << (word & 63);
+    } 
+    else 
+    {
+        bitmap->summary[word >> 6] &= ~(UINT64_C(1) << (word & 63));
+    }
+}
+
 void bitmap_set(bitmap_t *const bitmap, const size_t bit) 
 {
     bitmap->data[bit >> 3] |= mask[bit & 0x07];
+    if (FLAG_CHECK(bitmap, SUMMARY)) 
+    {
+        // setting can only fill a word, so there's only work to do if it's full now
+        summary_update(bitmap, bit >> 6);
+    }
 }
 
 void bitmap_reset(bitmap_t *const bitmap, const size_t bit) 
 {
     bitmap->data[bit >> 3] &= invert_mask[bit & 0x07];
+    if (FLAG_CHECK(bitmap, SUMMARY)) 
+    {
+        // the word definitely has a zero now, no need to look at it
+        bitmap->summary[bit >> 12] |= UINT64_C(1) << ((bit >> 6) & 63);
+    }
 }
 
 bool bitmap_test(const bitmap_t *const bitmap, const size_t bit) 
 {
-    return bitmap->data[bit >> 3] & mask[bit & 0x07];
+    // relaxed atomic for the same reason as load_word, it's still a plain byte load
+    return __atomic_load_n(&bitmap->data[bit >> 3], __ATOMIC_RELAXED) & mask[bit & 0x07];
 }
 
 void bitmap_flip(bitmap_t *const bitmap, const size_t bit) 
 {
     bitmap->data[bit >> 3] ^= mask[bit & 0x07];
+    if (FLAG_CHECK(bitmap, SUMMARY)) 
+    {
+        summary_update(bitmap, bit >> 6);
+    }
 }
 
 void bitmap_invert(bitmap_t *const bitmap) 
 {
-    for (size_t byte = 0; byte < bitmap->byte_count; ++byte) 
+    bitmap_kernels()->invert(bitmap->data, bitmap->byte_count);
+    bitmap_rebuild_summary(bitmap);
+}
+
+size_t bitmap_ffs(const bitmap_t *const bitmap) 
+{
+    return bitmap_ffs_from(bitmap, 0);
+}
+
+size_t bitmap_ffz(const bitmap_t *const bitmap) 
+{
+    return bitmap_ffz_from(bitmap, 0);
+}
+
+size_t bitmap_ffs_from(const bitmap_t *const bitmap, const size_t start) 
+{
+    if (bitmap && start < bitmap->bit_count) 
     {
-        bitmap->data[byte] = ~bitmap->data[byte];
+        // whole words of zeros get skipped in one compare
+        // the first word is masked so bits below start don't count
+        size_t word = start >> 6;
+        uint64_t bits = load_word(bitmap, word) & valid_mask(bitmap, word) & (~UINT64_C(0) << (start & 63));
+        while (!bits) 
+        {
+            // the kernel skips whole words of zeros, the partial word at the end is ours
+            word = bitmap_kernels()->scan(bitmap->data, word + 1, bitmap->byte_count >> 3, 0);
+            if (word >= bitmap->word_count) 
+            {
+                return SIZE_MAX;
+            }
+            bits = load_word(bitmap, word) & valid_mask(bitmap, word);
+        }
+        return (word << 6) + __builtin_ctzll(bits);
     }
+    return SIZE_MAX;
 }
 
-size_t bitmap_ffs(const bitmap_t *const bitmap) 
+size_t bitmap_fls_before(const bitmap_t *const bitmap, const size_t end) 
 {
-    if (bitmap) 
+    if (bitmap && bitmap->bit_count && end) 
     {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && !bitmap_test(bitmap, result); ++result) 
+        // the first word is masked so bits at or above end don't count
+        const size_t last = ((end < bitmap->bit_count) ? end : bitmap->bit_count) - 1;
+        size_t word = last >> 6;
+        uint64_t bits = load_word(bitmap, word) & valid_mask(bitmap, word) & (~UINT64_C(0) >> (63 - (last & 63)));
+        while (!bits) 
         {
+            if (word == 0) 
+            {
+                return SIZE_MAX;
+            }
+            --word;
+            bits = load_word(bitmap, word);
         }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
+        return (word << 6) + 63 - __builtin_clzll(bits);
     }
     return SIZE_MAX;
 }
 
-size_t bitmap_ffz(const bitmap_t *const bitmap) 
+size_t bitmap_ffz_from(const bitmap_t *const bitmap, const size_t start) 
 {
-    if (bitmap) 
+    if (bitmap && start < bitmap->bit_count) 
     {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && bitmap_test(bitmap, result); ++result) 
+        const size_t first = start >> 6;
+        const uint64_t bits = zero_bits(bitmap, first) & (~UINT64_C(0) << (start & 63));
+        if (bits) 
+        {
+            return (first << 6) + __builtin_ctzll(bits);
+        }
+        if (FLAG_CHECK(bitmap, SUMMARY)) 
+        {
+            // first summary bit past the starting word is the next word with a zero in it,
+            // so that's two lookups once we've found a non-empty summary word
+            const size_t summary_words = (bitmap->word_count + 63) >> 6;
+            const size_t next = first + 1;
+            size_t idx = next >> 6;
+            uint64_t summary = (next < bitmap->word_count) ? load_summary(bitmap, idx) & (~UINT64_C(0) << (next & 63)) : 0;
+            for (;;) 
+            {
+                while (!summary) 
+                {
+                    if (++idx >= summary_words) 
+                    {
+                        return SIZE_MAX;
+                    }
+                    summary = load_summary(bitmap, idx);
+                }
+                const size_t word = (idx << 6) + __builtin_ctzll(summary);
+                const uint64_t zeros = zero_bits(bitmap, word);
+                if (zeros) 
+                {
+                    return (word << 6) + __builtin_ctzll(zeros);
+                }
+                // another thread filled the word after we read the summary, keep looking
+                summary &= summary - 1;
+            }
+        }
+        const bitmap_kernels_t *const kernels = bitmap_kernels();
+        const size_t full_words = bitmap->byte_count >> 3;
+        for (size_t word = kernels->scan(bitmap->data, first + 1, full_words, ~UINT64_C(0)); word < bitmap->word_count;
+             word = kernels->scan(bitmap->data, word + 1, full_words, ~UINT64_C(0))) 
         {
+            // the word may have changed since the scan, or be the partial one at the end
+            const uint64_t zeros = zero_bits(bitmap, word);
+            if (zeros) 
+            {
+                return (word << 6) + __builtin_ctzll(zeros);
+            }
         }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
     }
     return SIZE_MAX;
 }
 
+// Sets or clears the summary bits of words [first, end), a summary word at a time
+static void summary_fill(bitmap_t *const bitmap, size_t first, const size_t end, const bool value) 
+{
+    while (first < end) 
+    {
+        const size_t idx = first >> 6;
+        const size_t stop = ((idx + 1) << 6) < end ? ((idx + 1) << 6) : end;
+        uint64_t bits = ~UINT64_C(0) << (first & 63);
+        if (stop & 63) 
+        {
+            bits &= (UINT64_C(1) << (stop & 63)) - 1;
+        }
+        bitmap->summary[idx] = value ? (bitmap->summary[idx] | bits) : (bitmap->summary[idx] & ~bits);
+        first = stop;
+    }
+}
+
+// Applies a byte mask to bytes [first, last] of the range, with the partial end bytes masked
+// set is true to set the bits, false to clear them
+static void range_apply(bitmap_t *const bitmap, const size_t start, const size_t count, const bool set) 
+{
+    const size_t end = start + count;  // one past the last bit
+    const size_t first = start >> 3, last = (end - 1) >> 3;
+    // bits of the first and last byte that fall inside the range
+    uint8_t head = (uint8_t)(0xFF << (start & 0x07));
+    const uint8_t tail = mask_down_inclusive[(end - 1) & 0x07];
+    if (first == last) 
+    {
+        head &= tail;
+    }
+    bitmap->data[first] = set ? (bitmap->data[first] | head) : (bitmap->data[first] & ~head);
+    if (first != last) 
+    {
+        // everything in between is whole bytes
+        memset(bitmap->data + first + 1, set ? 0xFF : 0x00, last - first - 1);
+        bitmap->data[last] = set ? (bitmap->data[last] | tail) : (bitmap->data[last] & ~tail);
+    }
+    if (FLAG_CHECK(bitmap, SUMMARY)) 
+    {
+        // words the range covers completely are all ones or all zeros now,
+        // so only the two ends need looking at
+        summary_update(bitmap, start >> 6);
+        summary_update(bitmap, (end - 1) >> 6);
+        const size_t covered = (start + 63) >> 6, covered_end = end >> 6;
+        if (covered < covered_end) 
+        {
+            summary_fill(bitmap, covered, covered_end, !set);
+        }
+    }
+}
+
+void bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+    if (bitmap && count && start < bitmap->bit_count && count <= bitmap->bit_count - start) 
+    {
+        range_apply(bitmap, start, count, true);
+    }
+}
+
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+    if (bitmap && count && start < bitmap->bit_count && count <= bitmap->bit_count - start) 
+    {
+        range_apply(bitmap, start, count, false);
+    }
+}
+
+size_t bitmap_find_zero_run(const bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+    if (bitmap && count) 
+    {
+        // hop from the start of each run of zeros to the start of the next run of ones,
+        // both searches are word scans so long runs of either cost one compare per 64 bits
+        size_t pos = start;
+        while (pos < bitmap->bit_count) 
+        {
+            const size_t run_start = bitmap_ffz_from(bitmap, pos);
+            if (run_start == SIZE_MAX) 
+            {
+                break;
+            }
+            size_t run_end = bitmap_ffs_from(bitmap, run_start);
+            if (run_end == SIZE_MAX) 
+            {
+                run_end = bitmap->bit_count;
+            }
+            if (run_end - run_start >= count) 
+            {
+                return run_start;
+            }
+            pos = run_end;
+        }
+    }
+    return SIZE_MAX;
+}
+
+//
+// Atomic operations
+// These work on whole 64 bit words in place, so the data has to be 8 byte aligned and
+// padded out to a whole word. bitmap_create always is, overlays are up to the caller.
+// The summary is kept in sync with atomics too: a word that looks full after a set gets
+// its summary bit cleared, then rechecked in case a reset snuck in between, and resets
+// always set the summary bit after the data. Either way the summary bit ends up set if
+// the word has a zero bit.
+//
+
+// In-place pointer to a data word
+static inline uint64_t *word_ptr(const bitmap_t *const bitmap, const size_t word) 
+{
+    return (uint64_t *) (bitmap->data + (word << 3));
+}
+
+// Converts a little endian bit mask to the way the word sits in memory
+static inline uint64_t native_mask(const uint64_t mask_bits) 
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap64(mask_bits);
+#else
+    return mask_bits;
+#endif
+}
+
+// Mask of the bits of [start, end) that fall in the given word
+static inline uint64_t range_mask(const size_t word, const size_t start, const size_t end) 
+{
+    const size_t low = word << 6;
+    uint64_t bits = ~UINT64_C(0);
+    if (start > low) 
+    {
+        bits &= ~UINT64_C(0) << (start - low);
+    }
+    if (end < low + 64) 
+    {
+        bits &= (UINT64_C(1) << (end - low)) - 1;
+    }
+    return bits;
+}
+
+static inline void summary_after_set_atomic(bitmap_t *const bitmap, const size_t word) 
+{
+    const uint64_t bit = UINT64_C(1) << (word & 63);
+    if (!(~__atomic_load_n(word_ptr(bitmap, word), __ATOMIC_SEQ_CST) & native_mask(valid_mask(bitmap, word)))) 
+    {
+        __atomic_fetch_and(&bitmap->summary[word >> 6], ~bit, __ATOMIC_SEQ_CST);
+        if (~__atomic_load_n(word_ptr(bitmap, word), __ATOMIC_SEQ_CST) & native_mask(valid_mask(bitmap, word))) 
+        {
+            __atomic_fetch_or(&bitmap->summary[word >> 6], bit, __ATOMIC_SEQ_CST);
+        }
+    }
+}
+
+static inline void summary_after_reset_atomic(bitmap_t *const bitmap, const size_t word) 
+{
+    __atomic_fetch_or(&bitmap->summary[word >> 6], UINT64_C(1) << (word & 63), __ATOMIC_SEQ_CST);
+}
+
+bool bitmap_test_and_set_atomic(bitmap_t *const bitmap, const size_t bit) 
+{
+    const uint64_t bit_mask = native_mask(UINT64_C(1) << (bit & 63));
+    const bool was_set = __atomic_fetch_or(word_ptr(bitmap, bit >> 6), bit_mask, __ATOMIC_SEQ_CST) & bit_mask;
+    if (!was_set && FLAG_CHECK(bitmap, SUMMARY)) 
+    {
+        summary_after_set_atomic(bitmap, bit >> 6);
+    }
+    return was_set;
+}
+
+bool bitmap_test_and_reset_atomic(bitmap_t *const bitmap, const size_t bit) 
+{
+    const uint64_t bit_mask = native_mask(UINT64_C(1) << (bit & 63));
+    const bool was_set = __atomic_fetch_and(word_ptr(bitmap, bit >> 6), ~bit_mask, __ATOMIC_SEQ_CST) & bit_mask;
+    if (was_set && FLAG_CHECK(bitmap, SUMMARY)) 
+    {
+        summary_after_reset_atomic(bitmap, bit >> 6);
+    }
+    return was_set;
+}
+
+bool bitmap_claim_range_atomic(bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+    if (!bitmap || !count || start >= bitmap->bit_count || count > bitmap->bit_count - start) 
+    {
+        return false;
+    }
+    const size_t end = start + count;
+    const size_t first = start >> 6, last = (end - 1) >> 6;
+    for (size_t word = first; word <= last; ++word) 
+    {
+        const uint64_t want = native_mask(range_mask(word, start, end));
+        uint64_t *const target = word_ptr(bitmap, word);
+        uint64_t old = __atomic_load_n(target, __ATOMIC_RELAXED);
+        do 
+        {
+            if (old & want) 
+            {
+                // somebody got to part of the range first, hand back the words we already took
+                for (size_t undo = first; undo < word; ++undo) 
+                {
+                    __atomic_fetch_and(word_ptr(bitmap, undo), ~native_mask(range_mask(undo, start, end)), __ATOMIC_SEQ_CST);
+                    if (FLAG_CHECK(bitmap, SUMMARY)) 
+                    {
+                        summary_after_reset_atomic(bitmap, undo);
+                    }
+                }
+                return false;
+            }
+        } while (!__atomic_compare_exchange_n(target, &old, old | want, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+        if (FLAG_CHECK(bitmap, SUMMARY)) 
+        {
+            summary_after_set_atomic(bitmap, word);
+        }
+    }
+    return true;
+}
+
+size_t bitmap_reset_range_atomic(bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+    size_t cleared = 0;
+    if (bitmap && count && start < bitmap->bit_count && count <= bitmap->bit_count - start) 
+    {
+        const size_t end = start + count;
+        for (size_t word = start >> 6; word <= (end - 1) >> 6; ++word) 
+        {
+            const uint64_t bits = native_mask(range_mask(word, start, end));
+            cleared += __builtin_popcountll(__atomic_fetch_and(word_ptr(bitmap, word), ~bits, __ATOMIC_SEQ_CST) & bits);
+            if (FLAG_CHECK(bitmap, SUMMARY)) 
+            {
+                summary_after_reset_atomic(bitmap, word);
+            }
+        }
+    }
+    return cleared;
+}
+
 size_t bitmap_total_set(const bitmap_t *const bitmap) 
 {
     size_t total = 0;
@@ -120,39 +497,124 @@ size_t bitmap_total_set(const bitmap_t *const bitmap)
     {
         // If we have leftover, stop a byte early because we have to handle it differently.
         size_t stop = bitmap->leftover_bits ? bitmap->byte_count - 1 : bitmap->byte_count;
-        for (size_t idx = 0; idx < stop; ++idx) 
-        {
-            total += bit_totals[bitmap->data[idx]];
-        }
+        total = bitmap_kernels()->popcount(bitmap->data, stop);
         if (bitmap->leftover_bits) 
         {
-            // haha, this is readable
-            // get the byte at the end of the bitmap, mask it so we're only looking at the bits in use
-            // then feed that to the bit_total lookup so we don't count the bits past our bit total
-            // (which whould be considered undetermined)
-            total += bit_totals[bitmap->data[bitmap->byte_count - 1] & mask_down_inclusive[bitmap->leftover_bits - 1]];
+            // mask the last byte so the bits past our bit total (which would be considered
+            // undetermined) don't count
+            total += __builtin_popcount(bitmap->data[bitmap->byte_count - 1] & mask_down_inclusive[bitmap->leftover_bits - 1]);
         }
     }
     return total;
 }
 
+size_t bitmap_count_range(const bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+    size_t set = 0;
+    if (bitmap && count && start < bitmap->bit_count && count <= bitmap->bit_count - start) 
+    {
+        const size_t end = start + count;
+        for (size_t word = start >> 6; word <= (end - 1) >> 6; ++word) 
+        {
+            set += __builtin_popcountll(load_word(bitmap, word) & range_mask(word, start, end));
+        }
+    }
+    return set;
+}
+
 void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg) 
 {
     if (bitmap && func) 
     {
-        for (size_t idx = 0; idx < bitmap->bit_count; ++idx) 
+        bitmap_iter_t iter;
+        bitmap_iter_init(&iter, bitmap, 0);
+        for (size_t bit = bitmap_iter_next(&iter); bit != SIZE_MAX; bit = bitmap_iter_next(&iter)) 
         {
-            if (bitmap_test(bitmap, idx)) 
-            {
-                func(idx, arg);
-            }
+            func(bit, arg);
         }
     }
 }
 
+void bitmap_iter_init(bitmap_iter_t *const iter, const bitmap_t *const bitmap, const size_t start) 
+{
+    iter->bitmap = bitmap;
+    if (start < bitmap->bit_count) 
+    {
+        iter->word = start >> 6;
+        iter->bits = load_word(bitmap, iter->word) & valid_mask(bitmap, iter->word) & (~UINT64_C(0) << (start & 63));
+    } 
+    else 
+    {
+        // parked on the last word with nothing pending, so advance finds nothing
+        iter->word = bitmap->word_count - 1;
+        iter->bits = 0;
+    }
+}
+
+size_t bitmap_iter_advance(bitmap_iter_t *const iter) 
+{
+    const bitmap_t *const bitmap = iter->bitmap;
+    // the kernel skips whole words of zeros, the partial word at the end is ours
+    const bitmap_kernels_t *const kernels = bitmap_kernels();
+    const size_t full_words = bitmap->byte_count >> 3;
+    for (size_t word = kernels->scan(bitmap->data, iter->word + 1, full_words, 0); word < bitmap->word_count;
+         word = kernels->scan(bitmap->data, word + 1, full_words, 0)) 
+    {
+        const uint64_t bits = load_word(bitmap, word) & valid_mask(bitmap, word);
+        if (bits) 
+        {
+            iter->word = word;
+            iter->bits = bits & (bits - 1);
+            return (word << 6) + __builtin_ctzll(bits);
+        }
+    }
+    iter->word = bitmap->word_count - 1;
+    iter->bits = 0;
+    return SIZE_MAX;
+}
+
 void bitmap_format(bitmap_t *const bitmap, const uint8_t pattern) 
 {
     memset(bitmap->data, pattern, bitmap->byte_count);
+    bitmap_rebuild_summary(bitmap);
+}
+
+bool bitmap_enable_summary(bitmap_t *const bitmap) 
+{
+    if (bitmap) 
+    {
+        if (!FLAG_CHECK(bitmap, SUMMARY)) 
+        {
+            bitmap->summary = (uint64_t *) calloc((bitmap->word_count + 63) >> 6, sizeof(uint64_t));
+            if (!bitmap->summary) 
+            {
+                return false;
+            }
+            bitmap->flags |= SUMMARY;
+        }
+        bitmap_rebuild_summary(bitmap);
+        return true;
+    }
+    return false;
+}
+
+void bitmap_rebuild_summary(bitmap_t *const bitmap) 
+{
+    if (bitmap && FLAG_CHECK(bitmap, SUMMARY)) 
+    {
+        // a summary word at a time instead of a read-modify-write per data word
+        const size_t summary_words = (bitmap->word_count + 63) >> 6;
+        for (size_t idx = 0; idx < summary_words; ++idx) 
+        {
+            const size_t end = ((idx + 1) << 6) < bitmap->word_count ? ((idx + 1) << 6) : bitmap->word_count;
+            uint64_t summary = 0;
+            for (size_t word = idx << 6; word < end; ++word) 
+            {
+                summary |= (uint64_t) (zero_bits(bitmap, word) != 0) << (word & 63);
+            }
+            bitmap->summary[idx] = summary;
+        }
+    }
 }
 
 size_t bitmap_get_bits(const bitmap_t *const bitmap) 
@@ -183,6 +645,7 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data)
         if (bitmap) 
         {
             memcpy(bitmap->data, bitmap_data, bitmap->byte_count);
+            bitmap_rebuild_summary(bitmap);
             return bitmap;
         }
     }
@@ -212,6 +675,8 @@ void bitmap_destroy(bitmap_t *bitmap)
             // don't free memory that isn't ours!
             free(bitmap->data);
         }
+        // the summary is always ours though
+        free(bitmap->summary);
         free(bitmap);
     }
 }
@@ -234,6 +699,8 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags)
             bitmap->byte_count    = n_bits >> 3;
             bitmap->leftover_bits = n_bits & 0x07;
             bitmap->byte_count += (bitmap->leftover_bits ? 1 : 0);
+            bitmap->word_count    = (n_bits >> 6) + ((n_bits & 63) ? 1 : 0);
+            bitmap->summary       = NULL;
 
             // FLAG HANDLING HERE
 
@@ -249,7 +716,8 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags)
             } 
             else 
             {
-                bitmap->data = (uint8_t *) calloc(bitmap->byte_count, 1);
+                // padded out to a whole word so the atomic calls can always work on words
+                bitmap->data = (uint8_t *) calloc(bitmap->word_count, sizeof(uint64_t));
                 if (bitmap->data) 
                 {
                     return bitmap;
@@ -0,0 +1,308 @@
+#include <pthread.h>
+#include <string.h>
+#include "bitmap_kernels.h"
+
+// The SIMD versions are x86-64 only and get compiled with per-function target attributes,
+// so the library still runs on CPUs without them and the build flags don't change.
+// ThreadSanitizer can't see through vector loads, and the concurrent block store scans
+// words that other threads are updating with atomics, so sanitized builds stick to the
+// scalar kernels, which read through relaxed atomics like the rest of the bitmap.
+#if defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define BITMAP_KERNELS_TSAN 1
+#endif
+#endif
+#if defined(__SANITIZE_THREAD__)
+#define BITMAP_KERNELS_TSAN 1
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define BITMAP_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+//
+// Scalar, a 64 bit word at a time
+//
+
+static inline uint64_t load64(const uint8_t *const p)
+{
+    uint64_t value;
+    memcpy(&value, p, 8);
+    return value;
+}
+
+static size_t popcount_scalar(const uint8_t *data, size_t bytes)
+{
+    size_t total = 0;
+    size_t idx = 0;
+    for (; idx + 8 <= bytes; idx += 8)
+    {
+        total += __builtin_popcountll(load64(data + idx));
+    }
+    for (; idx < bytes; ++idx)
+    {
+        total += __builtin_popcount(data[idx]);
+    }
+    return total;
+}
+
+static void invert_scalar(uint8_t *data, size_t bytes)
+{
+    size_t idx = 0;
+    for (; idx + 8 <= bytes; idx += 8)
+    {
+        const uint64_t value = ~load64(data + idx);
+        memcpy(data + idx, &value, 8);
+    }
+    for (; idx < bytes; ++idx)
+    {
+        data[idx] = ~data[idx];
+    }
+}
+
+// skip is all zeros or all ones so byte order doesn't matter here
+static size_t scan_scalar(const uint8_t *data, size_t word, size_t words, uint64_t skip)
+{
+    if (((uintptr_t) data & 7) == 0)
+    {
+        const uint64_t *const aligned = (const uint64_t *) data;
+        while (word < words && __atomic_load_n(&aligned[word], __ATOMIC_RELAXED) == skip)
+        {
+            ++word;
+        }
+        return word;
+    }
+    while (word < words && load64(data + (word << 3)) == skip)
+    {
+        ++word;
+    }
+    return word;
+}
+
+static const bitmap_kernels_t scalar_kernels = {BITMAP_KERNEL_SCALAR, popcount_scalar, invert_scalar, scan_scalar};
+
+#ifdef BITMAP_KERNELS_X86
+
+//
+// SSE4.2, hardware popcount and 128 bit compares
+//
+
+__attribute__((target("sse4.2,popcnt")))
+static size_t popcount_sse42(const uint8_t *data, size_t bytes)
+{
+    // four counters so the popcnt latency overlaps
+    uint64_t a = 0, b = 0, c = 0, d = 0;
+    size_t idx = 0;
+    for (; idx + 32 <= bytes; idx += 32)
+    {
+        a += _mm_popcnt_u64(load64(data + idx));
+        b += _mm_popcnt_u64(load64(data + idx + 8));
+        c += _mm_popcnt_u64(load64(data + idx + 16));
+        d += _mm_popcnt_u64(load64(data + idx + 24));
+    }
+    for (; idx + 8 <= bytes; idx += 8)
+    {
+        a += _mm_popcnt_u64(load64(data + idx));
+    }
+    for (; idx < bytes; ++idx)
+    {
+        b += _mm_popcnt_u32(data[idx]);
+    }
+    return a + b + c + d;
+}
+
+__attribute__((target("sse4.2")))
+static void invert_sse42(uint8_t *data, size_t bytes)
+{
+    const __m128i ones = _mm_set1_epi8(-1);
+    size_t idx = 0;
+    for (; idx + 16 <= bytes; idx += 16)
+    {
+        const __m128i value = _mm_loadu_si128((const __m128i *) (data + idx));
+        _mm_storeu_si128((__m128i *) (data + idx), _mm_xor_si128(value, ones));
+    }
+    invert_scalar(data + idx, bytes - idx);
+}
+
+__attribute__((target("sse4.2")))
+static size_t scan_sse42(const uint8_t *data, size_t word, size_t words, uint64_t skip)
+{
+    const __m128i pattern = _mm_set1_epi64x((long long) skip);
+    for (; word + 2 <= words; word += 2)
+    {
+        const __m128i value = _mm_loadu_si128((const __m128i *) (data + (word << 3)));
+        const int equal = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(value, pattern)));
+        if (equal != 0x3)
+        {
+            return word + __builtin_ctz(~(unsigned) equal);
+        }
+    }
+    return scan_scalar(data, word, words, skip);
+}
+
+static const bitmap_kernels_t sse42_kernels = {BITMAP_KERNEL_SSE42, popcount_sse42, invert_sse42, scan_sse42};
+
+//
+// AVX2, 256 bits at a time
+//
+
+// Counts bits with a 4 bit lookup table in a shuffle (Mula's method), the byte counts
+// add up in 8 bit lanes for a few vectors before sad folds them into 64 bit lanes
+__attribute__((target("avx2,popcnt")))
+static size_t popcount_avx2(const uint8_t *data, size_t bytes)
+{
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i totals = zero;
+    size_t idx = 0;
+    for (; idx + 128 <= bytes; idx += 128)
+    {
+        // at most 8 per byte per vector, 32 after four, well inside a byte
+        __m256i counts = zero;
+        for (size_t part = 0; part < 128; part += 32)
+        {
+            const __m256i value = _mm256_loadu_si256((const __m256i *) (data + idx + part));
+            const __m256i low = _mm256_and_si256(value, low_nibble);
+            const __m256i high = _mm256_and_si256(_mm256_srli_epi16(value, 4), low_nibble);
+            counts = _mm256_add_epi8(counts, _mm256_shuffle_epi8(lookup, low));
+            counts = _mm256_add_epi8(counts, _mm256_shuffle_epi8(lookup, high));
+        }
+        totals = _mm256_add_epi64(totals, _mm256_sad_epu8(counts, zero));
+    }
+    size_t total = (size_t) _mm256_extract_epi64(totals, 0) + (size_t) _mm256_extract_epi64(totals, 1) +
+                   (size_t) _mm256_extract_epi64(totals, 2) + (size_t) _mm256_extract_epi64(totals, 3);
+    for (; idx + 8 <= bytes; idx += 8)
+    {
+        total += _mm_popcnt_u64(load64(data + idx));
+    }
+    for (; idx < bytes; ++idx)
+    {
+        total += _mm_popcnt_u32(data[idx]);
+    }
+    return total;
+}
+
+__attribute__((target("avx2")))
+static void invert_avx2(uint8_t *data, size_t bytes)
+{
+    const __m256i ones = _mm256_set1_epi8(-1);
+    size_t idx = 0;
+    for (; idx + 32 <= bytes; idx += 32)
+    {
+        const __m256i value = _mm256_loadu_si256((const __m256i *) (data + idx));
+        _mm256_storeu_si256((__m256i *) (data + idx), _mm256_xor_si256(value, ones));
+    }
+    invert_scalar(data + idx, bytes - idx);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const uint8_t *data, size_t word, size_t words, uint64_t skip)
+{
+    const __m256i pattern = _mm256_set1_epi64x((long long) skip);
+    // eight words per test while nothing differs, then narrow down
+    for (; word + 8 <= words; word += 8)
+    {
+        const __m256i first = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (data + (word << 3))), pattern);
+        const __m256i second = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (data + (word << 3) + 32)), pattern);
+        const __m256i either = _mm256_or_si256(first, second);
+        if (!_mm256_testz_si256(either, either))
+        {
+            break;
+        }
+    }
+    for (; word + 4 <= words; word += 4)
+    {
+        const __m256i value = _mm256_loadu_si256((const __m256i *) (data + (word << 3)));
+        const int equal = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(value, pattern)));
+        if (equal != 0xF)
+        {
+            return word + __builtin_ctz(~(unsigned) equal);
+        }
+    }
+    return scan_scalar(data, word, words, skip);
+}
+
+static const bitmap_kernels_t avx2_kernels = {BITMAP_KERNEL_AVX2, popcount_avx2, invert_avx2, scan_avx2};
+
+#endif
+
+//
+// Dispatch
+//
+
+static const bitmap_kernels_t *active;
+static pthread_once_t active_once = PTHREAD_ONCE_INIT;
+
+// Kernels for the given kind, NULL if this CPU (or build) can't run them
+static const bitmap_kernels_t *kernels_for(const bitmap_kernel_t kernel)
+{
+    switch (kernel)
+    {
+        case BITMAP_KERNEL_SCALAR:
+            return &scalar_kernels;
+#ifdef BITMAP_KERNELS_X86
+        case BITMAP_KERNEL_SSE42:
+            __builtin_cpu_init();
+            return (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt")) ? &sse42_kernels : NULL;
+        case BITMAP_KERNEL_AVX2:
+            __builtin_cpu_init();
+            return (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) ? &avx2_kernels : NULL;
+#endif
+        default:
+            return NULL;
+    }
+}
+
+static const bitmap_kernels_t *best_kernels(void)
+{
+#ifndef BITMAP_KERNELS_TSAN
+    // SSE4.2 isn't reliably faster than the scalar words, so it's only used when asked for
+    static const bitmap_kernel_t preference[] = {BITMAP_KERNEL_AVX2};
+    for (size_t idx = 0; idx < sizeof(preference) / sizeof(preference[0]); ++idx)
+    {
+        const bitmap_kernels_t *const kernels = kernels_for(preference[idx]);
+        if (kernels)
+        {
+            return kernels;
+        }
+    }
+#endif
+    return &scalar_kernels;
+}
+
+static void active_init(void)
+{
+    __atomic_store_n(&active, best_kernels(), __ATOMIC_RELEASE);
+}
+
+const bitmap_kernels_t *bitmap_kernels(void)
+{
+    const bitmap_kernels_t *const kernels = __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+    if (kernels)
+    {
+        return kernels;
+    }
+    pthread_once(&active_once, active_init);
+    return __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+}
+
+bool bitmap_set_kernel(const bitmap_kernel_t kernel)
+{
+    const bitmap_kernels_t *const kernels = (kernel == BITMAP_KERNEL_AUTO) ? best_kernels() : kernels_for(kernel);
+    if (kernels)
+    {
+        // make sure a later first call doesn't put the default back
+        pthread_once(&active_once, active_init);
+        __atomic_store_n(&active, kernels, __ATOMIC_RELEASE);
+        return true;
+    }
+    return false;
+}
+
+bitmap_kernel_t bitmap_get_kernel(void)
+{
+    return bitmap_kernels()->kind;
+}
@@ -0,0 +1,27 @@
+#ifndef BITMAP_KERNELS_H__
+#define BITMAP_KERNELS_H__
+
+// The bulk loops behind the bitmap (counting, inverting, skipping over words),
+// in a plain 64 bit version and SSE4.2/AVX2 versions picked at runtime from what the CPU has
+// They all work on whole bytes or words, the bitmap takes care of the partial word at the end
+
+#include <stdint.h>
+#include "bitmap.h"
+
+typedef struct bitmap_kernels {
+    bitmap_kernel_t kind;
+    // number of set bits in bytes [0, bytes)
+    size_t (*popcount)(const uint8_t *data, size_t bytes);
+    // flips every bit in bytes [0, bytes)
+    void (*invert)(uint8_t *data, size_t bytes);
+    // first 64 bit word in [word, words) that isn't skip (all zeros or all ones), words if there isn't one
+    size_t (*scan)(const uint8_t *data, size_t word, size_t words, uint64_t skip);
+} bitmap_kernels_t;
+
+///
+/// Gets the kernels in use, the best the CPU supports unless bitmap_set_kernel said otherwise
+/// \return The kernels
+///
+const bitmap_kernels_t *bitmap_kernels(void);
+
+#endif
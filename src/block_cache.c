@@ -0,0 +1,448 @@
+// pwritev
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "block_cache.h"
+
+// which 2Q queue a slot sits on
+enum { QUEUE_NONE = 0, QUEUE_IN, QUEUE_MAIN };
+
+struct cache_slot{
+    size_t block_id;        // SIZE_MAX while the slot is empty
+    size_t prev, next;      // 2Q queue links, SIZE_MAX ends the list
+    uint8_t queue;
+    bool dirty;
+    bool referenced;        // CLOCK second chance bit
+};
+
+// doubly linked list of slots, newest at the head
+struct slot_queue{
+    size_t head, tail, length;
+};
+
+// open addressing map from block id to a value, both SIZE_MAX-free
+// (linear probing with backward shift deletion, so there are no tombstones to clean up)
+struct id_table{
+    size_t *keys;           // SIZE_MAX marks an empty bucket
+    size_t *values;
+    size_t mask;
+    unsigned shift;         // 64 - log2(buckets), for fibonacci hashing
+};
+
+struct block_cache{
+    int fd;
+    size_t block_size;
+    size_t capacity;
+    block_store_cache_policy_t policy;
+    uint8_t *data;          // capacity * block_size bytes, slot i at i * block_size
+    struct cache_slot *slots;
+    size_t *free_slots;     // stack of empty slots
+    size_t free_count;
+    struct id_table table;  // cached block id -> slot
+    // CLOCK
+    size_t hand;
+    // 2Q: blocks seen once wait in the in queue (FIFO), blocks seen again move to main (LRU)
+    // and the ids recently pushed out of the in queue are remembered in the ghost ring
+    struct slot_queue in, main;
+    size_t in_limit;
+    size_t *ghost_ids;      // ring of ghost ids, oldest at ghost_head
+    size_t ghost_head, ghost_count, ghost_limit, ghost_seq;
+    struct id_table ghosts; // ghost id -> sequence number of its ring entry
+    block_store_cache_stats_t stats;
+};
+
+//
+// id table
+//
+
+static bool table_init(struct id_table *const table, const size_t entries){
+    // at most half full keeps the probes short
+    size_t buckets = 16;
+    unsigned bits = 4;
+    while(buckets < entries * 2){
+        buckets <<= 1;
+        bits++;
+    }
+    table->keys = (size_t *)malloc(buckets * sizeof(size_t));
+    table->values = (size_t *)malloc(buckets * sizeof(size_t));
+    if((table->keys == NULL) || (table->values == NULL)){
+        return false;
+    }
+    memset(table->keys, 0xFF, buckets * sizeof(size_t));
+    table->mask = buckets - 1;
+    table->shift = 64 - bits;
+    return true;
+}
+
+static void table_free(struct id_table *const table){
+    free(table->keys);
+    free(table->values);
+}
+
+static inline size_t table_home(const struct id_table *const table, const size_t key){
+    return (size_t)(((uint64_t)key * UINT64_C(0x9E3779B97F4A7C15)) >> table->shift);
+}
+
+// bucket holding the key, SIZE_MAX if it isn't there
+static size_t table_bucket(const struct id_table *const table, const size_t key){
+    for(size_t bucket = table_home(table, key); ; bucket = (bucket + 1) & table->mask){
+        if(table->keys[bucket] == key){
+            return bucket;
+        }
+        if(table->keys[bucket] == SIZE_MAX){
+            return SIZE_MAX;
+        }
+    }
+}
+
+static size_t table_find(const struct id_table *const table, const size_t key){
+    const size_t bucket = table_bucket(table, key);
+    return (bucket == SIZE_MAX) ? SIZE_MAX : table->values[bucket];
+}
+
+// adds or replaces the key's value
+static void table_insert(struct id_table *const table, const size_t key, const size_t value){
+    size_t bucket = table_home(table, key);
+    while((table->keys[bucket] != SIZE_MAX) && (table->keys[bucket] != key)){
+        bucket = (bucket + 1) & table->mask;
+    }
+    table->keys[bucket] = key;
+    table->values[bucket] = value;
+}
+
+static void table_erase(struct id_table *const table, const size_t key){
+    size_t hole = table_bucket(table, key);
+    if(hole == SIZE_MAX){
+        return;
+    }
+    // pull later entries of the probe run back into the hole, unless that would put
+    // them in front of their home bucket
+    for(size_t bucket = (hole + 1) & table->mask; table->keys[bucket] != SIZE_MAX; bucket = (bucket + 1) & table->mask){
+        const size_t home = table_home(table, table->keys[bucket]);
+        if(((bucket - home) & table->mask) >= ((bucket - hole) & table->mask)){
+            table->keys[hole] = table->keys[bucket];
+            table->values[hole] = table->values[bucket];
+            hole = bucket;
+        }
+    }
+    table->keys[hole] = SIZE_MAX;
+}
+
+//
+// 2Q queues
+//
+
+static void queue_push(block_cache_t *const cache, struct slot_queue *const queue, const uint8_t which, const size_t slot){
+    struct cache_slot *const s = &cache->slots[slot];
+    s->queue = which;
+    s->prev = SIZE_MAX;
+    s->next = queue->head;
+    if(queue->head != SIZE_MAX){
+        cache->slots[queue->head].prev = slot;
+    }
+    else{
+        queue->tail = slot;
+    }
+    queue->head = slot;
+    queue->length++;
+}
+
+static void queue_unlink(block_cache_t *const cache, const size_t slot){
+    struct cache_slot *const s = &cache->slots[slot];
+    struct slot_queue *const queue = (s->queue == QUEUE_IN) ? &cache->in : &cache->main;
+    if(s->prev != SIZE_MAX){
+        cache->slots[s->prev].next = s->next;
+    }
+    else{
+        queue->head = s->next;
+    }
+    if(s->next != SIZE_MAX){
+        cache->slots[s->next].prev = s->prev;
+    }
+    else{
+        queue->tail = s->prev;
+    }
+    queue->length--;
+    s->queue = QUEUE_NONE;
+}
+
+// remembers a block that was pushed out of the in queue, forgetting the oldest if the ring is full
+static void ghost_push(block_cache_t *const cache, const size_t block_id){
+    if(cache->ghost_count == cache->ghost_limit){
+        const size_t oldest = cache->ghost_ids[cache->ghost_head];
+        // the id may have come back and been remembered again since, only its latest entry counts
+        if(table_find(&cache->ghosts, oldest) == cache->ghost_seq - cache->ghost_count){
+            table_erase(&cache->ghosts, oldest);
+        }
+        cache->ghost_head = (cache->ghost_head + 1) % cache->ghost_limit;
+        cache->ghost_count--;
+    }
+    cache->ghost_ids[(cache->ghost_head + cache->ghost_count) % cache->ghost_limit] = block_id;
+    cache->ghost_count++;
+    table_insert(&cache->ghosts, block_id, cache->ghost_seq++);
+}
+
+//
+// slots
+//
+
+static inline uint8_t *slot_data(const block_cache_t *const cache, const size_t slot){
+    return cache->data + slot * cache->block_size;
+}
+
+static bool write_block(const block_cache_t *const cache, const size_t slot){
+    const off_t offset = (off_t)(cache->slots[slot].block_id * cache->block_size);
+    return pwrite(cache->fd, slot_data(cache, slot), cache->block_size, offset) == (ssize_t)cache->block_size;
+}
+
+// picks a slot to throw out, the policy decides which
+static size_t pick_victim(block_cache_t *const cache){
+    if(cache->policy == BLOCK_STORE_CACHE_CLOCK){
+        // every slot is full when we get here, so this stops within two laps
+        for(;;){
+            const size_t slot = cache->hand;
+            cache->hand = (cache->hand + 1) % cache->capacity;
+            if(!cache->slots[slot].referenced){
+                return slot;
+            }
+            cache->slots[slot].referenced = false;
+        }
+    }
+    // 2Q takes from the in queue while it's over its share, so one pass over a lot of
+    // blocks can't flush out the ones that are used over and over
+    if((cache->in.length > cache->in_limit) || (cache->main.length == 0)){
+        return cache->in.tail;
+    }
+    return cache->main.tail;
+}
+
+// empties a slot, writing it back first if it's dirty
+// returns SIZE_MAX if the write back failed, in which case nothing changes
+static size_t evict(block_cache_t *const cache){
+    const size_t slot = pick_victim(cache);
+    struct cache_slot *const s = &cache->slots[slot];
+    if(s->dirty){
+        if(!write_block(cache, slot)){
+            return SIZE_MAX;
+        }
+        s->dirty = false;
+        cache->stats.writebacks++;
+    }
+    if(cache->policy == BLOCK_STORE_CACHE_2Q){
+        if(s->queue == QUEUE_IN){
+            ghost_push(cache, s->block_id);
+        }
+        queue_unlink(cache, slot);
+    }
+    table_erase(&cache->table, s->block_id);
+    s->block_id = SIZE_MAX;
+    cache->stats.evictions++;
+    return slot;
+}
+
+///
+/// Creates a cache in front of the given file
+/// \param fd File holding the blocks, block i at offset i * block_size
+/// \param block_size Bytes per block
+/// \param capacity Number of blocks the cache holds
+/// \param policy How blocks get picked for eviction
+/// \return Pointer to the new cache, NULL on error
+///
+block_cache_t *block_cache_create(const int fd, const size_t block_size, const size_t capacity, const block_store_cache_policy_t policy)
+{
+    if((fd < 0) || (block_size == 0) || (capacity == 0) || (capacity > SIZE_MAX / 4 / block_size) ||
+       ((policy != BLOCK_STORE_CACHE_CLOCK) && (policy != BLOCK_STORE_CACHE_2Q))){
+        return NULL;
+    }
+    block_cache_t *cache = (block_cache_t *)calloc(1, sizeof(block_cache_t));
+    if(cache == NULL){
+        return NULL;
+    }
+    cache->fd = fd;
+    cache->block_size = block_size;
+    cache->capacity = capacity;
+    cache->policy = policy;
+    cache->in.head = cache->in.tail = SIZE_MAX;
+    cache->main.head = cache->main.tail = SIZE_MAX;
+    // the sizes the 2Q paper suggests: a quarter of the cache for blocks seen once,
+    // and ghosts for half as many blocks as the cache holds
+    cache->in_limit = (capacity / 4) ? capacity / 4 : 1;
+    cache->ghost_limit = (capacity / 2) ? capacity / 2 : 1;
+    cache->data = (uint8_t *)malloc(capacity * block_size);
+    cache->slots = (struct cache_slot *)calloc(capacity, sizeof(struct cache_slot));
+    cache->free_slots = (size_t *)malloc(capacity * sizeof(size_t));
+    cache->ghost_ids = (size_t *)malloc(cache->ghost_limit * sizeof(size_t));
+    if((cache->data == NULL) || (cache->slots == NULL) || (cache->free_slots == NULL) || (cache->ghost_ids == NULL) ||
+       !table_init(&cache->table, capacity) || !table_init(&cache->ghosts, cache->ghost_limit)){
+        block_cache_destroy(cache);
+        return NULL;
+    }
+    // handed out from slot 0 up
+    for(size_t i = 0; i < capacity; i++){
+        cache->slots[i].block_id = SIZE_MAX;
+        cache->free_slots[i] = capacity - 1 - i;
+    }
+    cache->free_count = capacity;
+    return cache;
+}
+
+///
+/// Writes back every dirty block and destroys the cache, the file stays open
+/// \param cache The cache
+/// \return boolean indicating whether every dirty block made it to the file
+///
+bool block_cache_destroy(block_cache_t *const cache)
+{
+    if(cache == NULL){
+        return true;
+    }
+    // a cache that didn't finish being created has nothing to flush
+    bool flushed = (cache->slots == NULL) || block_cache_flush(cache);
+    free(cache->data);
+    free(cache->slots);
+    free(cache->free_slots);
+    free(cache->ghost_ids);
+    table_free(&cache->table);
+    table_free(&cache->ghosts);
+    free(cache);
+    return flushed;
+}
+
+///
+/// Looks up a block, reading it in (and evicting another) if it isn't cached
+/// \param cache The cache
+/// \param block_id The block
+/// \param write Whether the caller is going to change the block, marks it dirty
+/// \param whole Whether the caller is going to overwrite all of it, skips reading it in on a miss
+/// \return Pointer to the cached block, good until the next call into the cache, NULL on an I/O error
+///
+uint8_t *block_cache_get(block_cache_t *const cache, const size_t block_id, const bool write, const bool whole)
+{
+    uint8_t *data = block_cache_peek(cache, block_id, write);
+    if(data != NULL){
+        return data;
+    }
+    cache->stats.misses++;
+    const size_t slot = (cache->free_count > 0) ? cache->free_slots[--cache->free_count] : evict(cache);
+    if(slot == SIZE_MAX){
+        return NULL;
+    }
+    if(!whole && (pread(cache->fd, slot_data(cache, slot), cache->block_size, (off_t)(block_id * cache->block_size)) != (ssize_t)cache->block_size)){
+        cache->free_slots[cache->free_count++] = slot;
+        return NULL;
+    }
+    struct cache_slot *const s = &cache->slots[slot];
+    s->block_id = block_id;
+    s->referenced = false;
+    table_insert(&cache->table, block_id, slot);
+    if(cache->policy == BLOCK_STORE_CACHE_2Q){
+        // a block we threw out of the in queue not long ago is clearly getting reused
+        if(table_find(&cache->ghosts, block_id) != SIZE_MAX){
+            table_erase(&cache->ghosts, block_id);
+            queue_push(cache, &cache->main, QUEUE_MAIN, slot);
+        }
+        else{
+            queue_push(cache, &cache->in, QUEUE_IN, slot);
+        }
+    }
+    cache->slots[slot].dirty = write;
+    return slot_data(cache, slot);
+}
+
+///
+/// Looks up a block without reading it in if it isn't cached
+/// \param cache The cache
+/// \param block_id The block
+/// \param write Whether the caller is going to change the block, marks it dirty
+/// \return Pointer to the cached block, good until the next call into the cache, NULL if it isn't cached
+///
+uint8_t *block_cache_peek(block_cache_t *const cache, const size_t block_id, const bool write)
+{
+    const size_t slot = table_find(&cache->table, block_id);
+    if(slot == SIZE_MAX){
+        return NULL;
+    }
+    cache->stats.hits++;
+    if(cache->policy == BLOCK_STORE_CACHE_CLOCK){
+        cache->slots[slot].referenced = true;
+    }
+    else if(cache->slots[slot].queue == QUEUE_MAIN){
+        // main is LRU, the in queue stays FIFO so a burst of hits doesn't promote anything
+        queue_unlink(cache, slot);
+        queue_push(cache, &cache->main, QUEUE_MAIN, slot);
+    }
+    if(write){
+        cache->slots[slot].dirty = true;
+    }
+    return slot_data(cache, slot);
+}
+
+// orders dirty slots by the block they hold
+static int compare_block(const void *a, const void *b){
+    const size_t left = *(const size_t *)a, right = *(const size_t *)b;
+    return (left > right) - (left < right);
+}
+
+///
+/// Writes every dirty block back to the file in block order, coalescing neighbours into one write
+/// \param cache The cache
+/// \return boolean indicating succes of operation
+///
+bool block_cache_flush(block_cache_t *const cache)
+{
+    if(cache == NULL){
+        return false;
+    }
+    // pairs of (block id, slot) so sorting by the first element sorts the slots too
+    size_t *dirty = (size_t *)malloc(cache->capacity * 2 * sizeof(size_t));
+    if(dirty == NULL){
+        return false;
+    }
+    size_t count = 0;
+    for(size_t slot = 0; slot < cache->capacity; slot++){
+        if(cache->slots[slot].dirty){
+            dirty[count * 2] = cache->slots[slot].block_id;
+            dirty[count * 2 + 1] = slot;
+            count++;
+        }
+    }
+    qsort(dirty, count, 2 * sizeof(size_t), compare_block);
+
+    bool ok = true;
+    struct iovec iov[64];
+    for(size_t first = 0; first < count; ){
+        // gather a run of consecutive blocks into one write
+        size_t run = 0;
+        while((first + run < count) && (run < sizeof(iov) / sizeof(iov[0])) && (dirty[(first + run) * 2] == dirty[first * 2] + run)){
+            iov[run].iov_base = slot_data(cache, dirty[(first + run) * 2 + 1]);
+            iov[run].iov_len = cache->block_size;
+            run++;
+        }
+        const ssize_t expected = (ssize_t)(run * cache->block_size);
+        if(pwritev(cache->fd, iov, (int)run, (off_t)(dirty[first * 2] * cache->block_size)) == expected){
+            for(size_t i = 0; i < run; i++){
+                cache->slots[dirty[(first + i) * 2 + 1]].dirty = false;
+            }
+            cache->stats.writebacks += run;
+        }
+        else{
+            // the blocks stay dirty so a later flush can try again
+            ok = false;
+        }
+        first += run;
+    }
+    free(dirty);
+    return ok;
+}
+
+///
+/// Reports what the cache has done so far
+/// \param cache The cache
+/// \param stats Receives the counters
+///
+void block_cache_get_stats(const block_cache_t *const cache, block_store_cache_stats_t *const stats)
+{
+    *stats = cache->stats;
+}
@@ -0,0 +1,62 @@
+#ifndef BLOCK_CACHE_H__
+#define BLOCK_CACHE_H__
+
+// Write-back cache of whole blocks in front of a file, used by file backed block stores
+// Not thread safe, the block store serializes calls into it
+
+#include <stdint.h>
+#include "block_store.h"
+
+typedef struct block_cache block_cache_t;
+
+///
+/// Creates a cache in front of the given file
+/// \param fd File holding the blocks, block i at offset i * block_size
+/// \param block_size Bytes per block
+/// \param capacity Number of blocks the cache holds
+/// \param policy How blocks get picked for eviction
+/// \return Pointer to the new cache, NULL on error
+///
+block_cache_t *block_cache_create(const int fd, const size_t block_size, const size_t capacity, const block_store_cache_policy_t policy);
+
+///
+/// Writes back every dirty block and destroys the cache, the file stays open
+/// \param cache The cache
+/// \return boolean indicating whether every dirty block made it to the file
+///
+bool block_cache_destroy(block_cache_t *const cache);
+
+///
+/// Looks up a block, reading it in (and evicting another) if it isn't cached
+/// \param cache The cache
+/// \param block_id The block
+/// \param write Whether the caller is going to change the block, marks it dirty
+/// \param whole Whether the caller is going to overwrite all of it, skips reading it in on a miss
+/// \return Pointer to the cached block, good until the next call into the cache, NULL on an I/O error
+///
+uint8_t *block_cache_get(block_cache_t *const cache, const size_t block_id, const bool write, const bool whole);
+
+///
+/// Looks up a block without reading it in if it isn't cached
+/// \param cache The cache
+/// \param block_id The block
+/// \param write Whether the caller is going to change the block, marks it dirty
+/// \return Pointer to the cached block, good until the next call into the cache, NULL if it isn't cached
+///
+uint8_t *block_cache_peek(block_cache_t *const cache, const size_t block_id, const bool write);
+
+///
+/// Writes every dirty block back to the file in block order, coalescing neighbours into one write
+/// \param cache The cache
+/// \return boolean indicating succes of operation
+///
+bool block_cache_flush(block_cache_t *const cache);
+
+///
+/// Reports what the cache has done so far
+/// \param cache The cache
+/// \param stats Receives the counters
+///
+void block_cache_get_stats(const block_cache_t *const cache, block_store_cache_stats_t *const stats);
+
+#endif
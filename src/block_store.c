@@ -1,224 +1,2758 @@
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "async_io.h"
 #include "bitmap.h"
+#include "block_cache.h"
 #include "block_store.h"
+#include "buddy.h"
+#include "crc32c.h"
+#include "device_memory.h"
+#include "extent_index.h"
+#include "journal.h"
+#include "lz.h"
 // include more if you need
 
 // You might find this handy.  I put it around unused parameters, but you should
 // remove it before you submit. Just allows things to compile initially.
 #define UNUSED(x) (void)(x)
 
-typedef struct{
-    //unsigned char block[BLOCK_SIZE_BYTES];
-    unsigned char block[BLOCK_SIZE_BYTES];
-}block_t;
+// where the block array came from, so destroy knows how to give it back
+typedef enum { BACKING_HEAP = 0, BACKING_MMAP, BACKING_FILE, BACKING_ANON } backing_t;
 
 //struct block_store block_store_t;
 typedef struct block_store{
-    block_t blocks[BLOCK_STORE_NUM_BLOCKS];
+    size_t num_blocks;      // total blocks on the device, fbm blocks included
+    size_t avail_blocks;    // user-addressable blocks, ids [0, avail_blocks)
+    size_t block_size;      // bytes per block, always a power of two
+    unsigned block_shift;   // log2(block_size), block offsets are a shift instead of a multiply
+    size_t fbm_start;       // block index where the fbm bitmap starts
+    size_t fbm_blocks;      // number of blocks reserved to hold the fbm
+    uint8_t *blocks;        // num_blocks * block_size bytes of device storage, NULL when file backed or copy on write
     bitmap_t *fbm;
+    size_t used;            // user blocks set in the fbm (magazines included), atomic in concurrent mode
+    bitmap_t *dirty;        // blocks changed since the last block_store_serialize_incremental
+    block_store_policy_t policy;
+    size_t cursor;          // where the next next-fit search starts
+    backing_t backing;
+    size_t mapped;          // bytes mapped for the blocks of an anonymous device, see block_store_create_memory
+    bool read_only;         // refuses anything that would change the device
+    bool concurrent;        // fbm updates are atomic, see block_store_set_concurrent
+    struct debug_state *debug; // NULL unless debug mode is on
+    struct magazine_state *magazines; // NULL unless magazines are on
+    struct file_state *file; // NULL unless the blocks are read and written through a cache
+    struct async_state *async; // NULL until the first async request
+    journal_t *journal;     // NULL unless changes are journaled, see block_store_set_journal
+    buddy_t *buddy;         // NULL unless buddy mode is on, see block_store_set_buddy
+    extent_index_t *extents; // free extents by start and length, NULL in concurrent mode (or out of memory)
+    struct cow_state *cow;  // NULL unless the device shares blocks with a snapshot or clone
 }block_store_t;
 
-/*
-typedef struct block_store{
-    char* blocks[BLOCK_STORE_NUM_BLOCKS][BLOCK_SIZE_BYTES];
-    bitmap_t *fbm;
-} block_store_t;*/
+// blocks shared by a device and its snapshots and clones, see block_store_snapshot
+// a block is either still in the block array the first snapshot was taken of, or a copy one
+// of the devices made when it wrote to a block somebody else could still see. Either way it
+// has a count of the devices pointing at it, and nobody writes to it in place unless that's 1
+struct cow_family{
+    uint8_t *base;          // the block array of the device the first snapshot was taken of
+    uint32_t *base_refs;    // devices pointing at each user block of base
+    size_t avail_blocks;    // user blocks in base
+    size_t base_mapped;     // bytes mapped for base if it came from block_store_create_memory, 0 if calloc'd
+    unsigned block_shift;
+    size_t devices;         // devices in the family, the last one to go frees base
+};
+
+// a block copied on write, the data follows the header
+struct cow_copy{
+    uint32_t refs;
+};
+#define COW_HEADER 64       // a cache line of header keeps the data at malloc's alignment
+
+// a device's view of its family
+struct cow_state{
+    struct cow_family *family;
+    uint8_t **table;        // where each user block's bytes are
+    uint8_t *fbm;           // the fbm blocks, every device has its own
+    bool fbm_owned;         // false for the device the fbm is still in base for
+};
+
+// a device whose blocks stay in a file and go through a block cache, see block_store_open_file
+struct file_state{
+    int fd;
+    block_cache_t *cache;   // NULL reads and writes the file directly
+    pthread_mutex_t lock;   // the cache isn't thread safe, held from block_begin to block_end
+    uint8_t *fbm;           // the fbm blocks are always in memory, they go back to the file on sync
+    uint8_t *bounce;        // one block to stage direct reads and writes in when there's no cache
+};
+
+// bookkeeping for debug mode, see block_store_set_debug
+// this sits behind a pointer so the const accessors can still report what they catch
+struct debug_state{
+    uint32_t *pins;         // outstanding pins per user block
+    bitmap_t *poisoned;     // blocks filled with BLOCK_STORE_POISON when they were released
+    size_t violations;
+};
+
+// an async read or write, from block_store_read/write_async until its callback has run
+struct async_request{
+    async_op_t op;          // what goes to the engine when the file has to be touched
+    size_t block_id;
+    block_store_io_callback_t callback;
+    void *context;
+    size_t bytes;           // what the callback gets told
+    struct async_request *next;
+};
+
+struct async_state{
+    block_store_async_backend_t backend;
+    size_t depth;
+    async_io_t *io;         // started the first time a request has to go to the file
+    struct async_request *queued, *queued_tail;  // waiting for submit
+    struct async_request *done, *done_tail;      // waiting for poll to run the callback
+    size_t in_flight;       // handed to the engine and not back yet
+};
+
+// a thread's private stash of claimed block ids, see block_store_set_magazines
+// the blocks are set in the fbm, so nobody else can be handed them while they sit here
+struct magazine{
+    pthread_mutex_t lock;   // only contended when another thread steals, flushes or tears down
+    size_t count;           // ids in the stash, atomic so counting doesn't need the lock
+    struct magazine *next;
+    block_store_t *bs;      // where the blocks go back to when the thread exits
+    size_t ids[];           // capacity ids, the most recently released on top
+};
+
+struct magazine_state{
+    pthread_key_t key;      // the calling thread's magazine
+    pthread_mutex_t lock;   // guards the list
+    struct magazine *list;  // every thread's magazine
+    size_t capacity;
+    bitmap_t *cached;       // blocks sitting in some magazine, so a second release of one gets caught
+};
+
+// address of the first byte of the given block
+static inline uint8_t *block_addr(const block_store_t *const bs, const size_t block_id){
+    struct cow_state *cow = bs->cow;
+    if(cow != NULL){
+        return (block_id < bs->avail_blocks) ? cow->table[block_id] : cow->fbm + ((block_id - bs->fbm_start) << bs->block_shift);
+    }
+    return bs->blocks + (block_id << bs->block_shift);
+}
+
+// whether a block's bytes are still in base, rather than in a copy
+static inline bool cow_in_base(const struct cow_family *const family, const uint8_t *const data){
+    return ((uintptr_t)data - (uintptr_t)family->base) < ((uintptr_t)family->avail_blocks << family->block_shift);
+}
+
+// the count of devices pointing at a shared block
+static inline uint32_t *cow_refs(const struct cow_family *const family, uint8_t *const data){
+    if(cow_in_base(family, data)){
+        return &family->base_refs[(size_t)(data - family->base) >> family->block_shift];
+    }
+    return &((struct cow_copy *)(data - COW_HEADER))->refs;
+}
+
+// drops a device's reference to a shared block, copies go once nobody points at them
+// (base goes all at once, with the family)
+static void cow_unref(const struct cow_family *const family, uint8_t *const data){
+    if((__atomic_sub_fetch(cow_refs(family, data), 1, __ATOMIC_ACQ_REL) == 0) && !cow_in_base(family, data)){
+        free(data - COW_HEADER);
+    }
+}
+
+// the address of a block the caller is about to write to, copying it first if another device can see it
+// whole says the caller overwrites all of it, so the old bytes needn't be copied
+// returns NULL if there's no memory for the copy
+static uint8_t *cow_writable(const block_store_t *const bs, const size_t block_id, const bool whole){
+    struct cow_state *cow = bs->cow;
+    if(block_id >= bs->avail_blocks){
+        return block_addr(bs, block_id);
+    }
+    uint8_t *data = cow->table[block_id];
+    if(__atomic_load_n(cow_refs(cow->family, data), __ATOMIC_ACQUIRE) == 1){
+        return data;
+    }
+    uint8_t *copy = (uint8_t *)malloc(COW_HEADER + bs->block_size);
+    if(copy == NULL){
+        return NULL;
+    }
+    ((struct cow_copy *)copy)->refs = 1;
+    copy += COW_HEADER;
+    if(!whole){
+        memcpy(copy, data, bs->block_size);
+    }
+    cow->table[block_id] = copy;
+    cow_unref(cow->family, data);
+    return copy;
+}
+
+// pointer to a block's bytes wherever the device keeps them, every access to block data goes
+// through here so file backed devices can bring the block in first
+// write marks the block as changed, whole says the caller overwrites all of it so it needn't be read in
+// a file backed device stays locked until block_end, which has to be called unless this returns NULL
+static inline uint8_t *block_begin(const block_store_t *const bs, const size_t block_id, const bool write, const bool whole){
+    struct file_state *file = bs->file;
+    if(file == NULL){
+        return (write && (bs->cow != NULL)) ? cow_writable(bs, block_id, whole) : block_addr(bs, block_id);
+    }
+    if(block_id >= bs->fbm_start){
+        return file->fbm + ((block_id - bs->fbm_start) << bs->block_shift);
+    }
+    pthread_mutex_lock(&file->lock);
+    uint8_t *data;
+    if(file->cache != NULL){
+        data = block_cache_get(file->cache, block_id, write, whole);
+    }
+    else{
+        data = file->bounce;
+        if(!whole && (pread(file->fd, data, bs->block_size, (off_t)(block_id << bs->block_shift)) != (ssize_t)bs->block_size)){
+            data = NULL;
+        }
+    }
+    if(data == NULL){
+        pthread_mutex_unlock(&file->lock);
+    }
+    return data;
+}
+
+// done with a block from block_begin, write has to match
+// returns false if an uncached write didn't make it to the file
+static inline bool block_end(const block_store_t *const bs, const size_t block_id, const bool write){
+    struct file_state *file = bs->file;
+    if((file == NULL) || (block_id >= bs->fbm_start)){
+        return true;
+    }
+    bool ok = true;
+    if((file->cache == NULL) && write){
+        ok = pwrite(file->fd, file->bounce, bs->block_size, (off_t)(block_id << bs->block_shift)) == (ssize_t)bs->block_size;
+    }
+    pthread_mutex_unlock(&file->lock);
+    return ok;
+}
+
+// counts and reports a misuse caught in debug mode
+static void debug_violation(const block_store_t *const bs, const char *const what, const size_t block_id){
+    __atomic_fetch_add(&bs->debug->violations, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "block_store: %s (block %zu)\n", what, block_id);
+}
+
+// debug mode bookkeeping for a block that was just claimed
+static void debug_claimed(block_store_t *const bs, const size_t block_id){
+    bool poisoned = bs->concurrent ? bitmap_test_and_reset_atomic(bs->debug->poisoned, block_id) : bitmap_test(bs->debug->poisoned, block_id);
+    if(poisoned){
+        // anything but poison means someone wrote through a pointer they kept after releasing it
+        const uint8_t *data = block_begin(bs, block_id, false, false);
+        bool clean = true;
+        for(size_t i = 0; (data != NULL) && (i < bs->block_size); i++){
+            if(data[i] != BLOCK_STORE_POISON){
+                clean = false;
+                break;
+            }
+        }
+        if(data != NULL){
+            block_end(bs, block_id, false);
+        }
+        if(!clean){
+            debug_violation(bs, "block was written after it was released", block_id);
+        }
+        if(!bs->concurrent){
+            bitmap_reset(bs->debug->poisoned, block_id);
+        }
+    }
+}
+
+// debug mode version of freeing a single block, refuses releases that would leave dangling pins
+// returns whether the block was actually freed
+static bool debug_free(block_store_t *const bs, const size_t block_id){
+    if(!bitmap_test(bs->fbm, block_id)){
+        debug_violation(bs, "released a block that isn't allocated", block_id);
+    }
+    else if(__atomic_load_n(&bs->debug->pins[block_id], __ATOMIC_RELAXED)){
+        // somebody is still using it, so the release doesn't happen
+        debug_violation(bs, "released a block that is still pinned", block_id);
+    }
+    else{
+        // poison it so stale readers see garbage and stale writers get caught on reallocation
+        uint8_t *data = block_begin(bs, block_id, true, true);
+        if(data != NULL){
+            memset(data, BLOCK_STORE_POISON, bs->block_size);
+            block_end(bs, block_id, true);
+        }
+        if(bs->concurrent){
+            bitmap_test_and_set_atomic(bs->debug->poisoned, block_id);
+            if(!bitmap_test_and_reset_atomic(bs->fbm, block_id)){
+                debug_violation(bs, "released a block that isn't allocated", block_id);
+                return false;
+            }
+        }
+        else{
+            bitmap_set(bs->debug->poisoned, block_id);
+            bitmap_reset(bs->fbm, block_id);
+        }
+        return true;
+    }
+    return false;
+}
+
+// moves the used block counter, the getters read it without a lock
+static inline void used_add(block_store_t *const bs, const size_t count){
+    if(bs->concurrent){
+        __atomic_fetch_add(&bs->used, count, __ATOMIC_RELAXED);
+    }
+    else{
+        bs->used += count;
+    }
+}
+
+static inline void used_sub(block_store_t *const bs, const size_t count){
+    if(bs->concurrent){
+        __atomic_fetch_sub(&bs->used, count, __ATOMIC_RELAXED);
+    }
+    else{
+        bs->used -= count;
+    }
+}
+
+// sets the used block counter from the fbm, for when the fbm changed wholesale (opening, loading)
+static void used_recount(block_store_t *const bs){
+    // the blocks holding the fbm are always set but aren't user blocks
+    __atomic_store_n(&bs->used, bitmap_count_range(bs->fbm, 0, bs->avail_blocks), __ATOMIC_RELAXED);
+}
+
+// builds the free extent index from the fbm, concurrent mode goes without one
+static void extents_rebuild(block_store_t *const bs){
+    extent_index_destroy(bs->extents);
+    bs->extents = bs->concurrent ? NULL : extent_index_create(bs->fbm, bs->avail_blocks);
+}
+
+// an index update ran out of memory, so the index can't be trusted any more
+// everything that uses it falls back to searching the fbm
+static void extents_lost(block_store_t *const bs){
+    extent_index_destroy(bs->extents);
+    bs->extents = NULL;
+}
+
+// notes that blocks [start, start + count) changed, so the next incremental serialize writes them
+// the dirty map sits behind a pointer, so const callers can still mark it
+static void mark_dirty(const block_store_t *const bs, const size_t start, const size_t count){
+    if(!bs->concurrent){
+        if(count == 1){
+            bitmap_set(bs->dirty, start);
+        }
+        else{
+            bitmap_set_range(bs->dirty, start, count);
+        }
+        return;
+    }
+    // most writes hit blocks that are already dirty, testing first keeps them off the shared word
+    for(size_t id = start; id < start + count; id++){
+        if(!bitmap_test(bs->dirty, id)){
+            bitmap_test_and_set_atomic(bs->dirty, id);
+        }
+    }
+}
+
+// adds a block's new contents to the journal's pending transaction, if there's a journal
+static inline void journal_block(const block_store_t *const bs, const size_t block_id, const void *const data){
+    if(bs->journal != NULL){
+        journal_write(bs->journal, block_id, data);
+    }
+}
+
+// marks free user blocks [start, start + count) as in use
+// every allocation path ends up here, so per-block bookkeeping only has to go in one place
+// returns false if any of them were already in use, which in concurrent mode happens when
+// another thread claims a block between our search finding it and us claiming it
+static bool claim_blocks(block_store_t *const bs, const size_t start, const size_t count){
+    if(bs->concurrent){
+        // lock free: a single block is a fetch-or, a run is a compare and swap per word
+        if((count == 1) ? bitmap_test_and_set_atomic(bs->fbm, start) : !bitmap_claim_range_atomic(bs->fbm, start, count)){
+            return false;
+        }
+    }
+    else if(count == 1){
+        if(bitmap_test(bs->fbm, start)){
+            return false;
+        }
+        bitmap_set(bs->fbm, start);
+    }
+    else{
+        // runs come straight from a search that just told us they're clear
+        bitmap_set_range(bs->fbm, start, count);
+    }
+    used_add(bs, count);
+    if(bs->buddy != NULL){
+        buddy_claim(bs->buddy, start, count);
+    }
+    if((bs->extents != NULL) && !extent_index_claim(bs->extents, start, count)){
+        extents_lost(bs);
+    }
+    if(bs->debug != NULL){
+        for(size_t id = start; id < start + count; id++){
+            debug_claimed(bs, id);
+        }
+    }
+    mark_dirty(bs, start, count);
+    if(bs->journal != NULL){
+        journal_range(bs->journal, JOURNAL_ALLOCATE, start, count);
+    }
+    return true;
+}
+
+// marks user blocks [start, start + count) as free
+// every release path ends up here, like claim_blocks for allocations
+static void free_blocks(block_store_t *const bs, const size_t start, const size_t count){
+    // only blocks that were actually in use come off the used counter
+    size_t freed = 0;
+    if(bs->debug != NULL){
+        for(size_t id = start; id < start + count; id++){
+            freed += debug_free(bs, id);
+        }
+    }
+    else if(bs->concurrent){
+        if(count == 1){
+            freed = bitmap_test_and_reset_atomic(bs->fbm, start);
+        }
+        else{
+            freed = bitmap_reset_range_atomic(bs->fbm, start, count);
+        }
+    }
+    else if(count == 1){
+        freed = bitmap_test(bs->fbm, start);
+        bitmap_reset(bs->fbm, start);
+    }
+    else{
+        freed = bitmap_count_range(bs->fbm, start, count);
+        bitmap_reset_range(bs->fbm, start, count);
+    }
+    used_sub(bs, freed);
+    if(bs->buddy != NULL){
+        if(freed == count){
+            buddy_release(bs->buddy, start, count);
+        }
+        else{
+            // some of them were free already (or debug mode refused to free them)
+            for(size_t id = start; id < start + count; id++){
+                if(!bitmap_test(bs->fbm, id) && !buddy_is_free(bs->buddy, id)){
+                    buddy_release(bs->buddy, id, 1);
+                }
+            }
+        }
+    }
+    if(bs->extents != NULL){
+        bool ok = true;
+        if(freed == count){
+            ok = extent_index_release(bs->extents, start, count);
+        }
+        else{
+            for(size_t id = start; ok && (id < start + count); id++){
+                if(!bitmap_test(bs->fbm, id) && !extent_index_is_free(bs->extents, id)){
+                    ok = extent_index_release(bs->extents, id, 1);
+                }
+            }
+        }
+        if(!ok){
+            extents_lost(bs);
+        }
+    }
+    mark_dirty(bs, start, count);
+    if(bs->journal != NULL){
+        journal_range(bs->journal, JOURNAL_RELEASE, start, count);
+    }
+}
+
+// in debug mode writes only go to allocated blocks (or the fbm blocks, which are always set)
+static bool debug_write_check(const block_store_t *const bs, const size_t block_id){
+    if((bs->debug != NULL) && !bitmap_test(bs->fbm, block_id)){
+        debug_violation(bs, "wrote to a block that isn't allocated", block_id);
+        return false;
+    }
+    return true;
+}
+
+// finds the first free user block at or after start, wrapping around to zero
+// returns SIZE_MAX if the device is full
+static size_t find_free_block(const block_store_t *const bs, const size_t start){
+    // the fbm blocks at the end are always set, so a hit is always a user block
+    size_t id = bitmap_ffz_from(bs->fbm, start);
+    if((id == SIZE_MAX) && (start > 0)){
+        // nothing free in [start, end), so anything found from zero is below start
+        id = bitmap_ffz(bs->fbm);
+    }
+    return (id < bs->avail_blocks) ? id : SIZE_MAX;
+}
+
+// gives the oldest blocks in a magazine back to the fbm until only keep are left, the caller holds its lock
+// (the newest stay behind since they're the ones still warm in the cache)
+static void magazine_drain(block_store_t *const bs, struct magazine *const mag, const size_t keep){
+    if(mag->count <= keep){
+        return;
+    }
+    const size_t drop = mag->count - keep;
+    for(size_t i = 0; i < drop; i++){
+        bitmap_test_and_reset_atomic(bs->magazines->cached, mag->ids[i]);
+        free_blocks(bs, mag->ids[i], 1);
+    }
+    memmove(mag->ids, mag->ids + drop, keep * sizeof(size_t));
+    __atomic_store_n(&mag->count, keep, __ATOMIC_RELAXED);
+}
+
+// thread exit hook, the magazine's blocks go back to the fbm
+static void magazine_thread_exit(void *arg){
+    struct magazine *mag = (struct magazine *)arg;
+    struct magazine_state *state = mag->bs->magazines;
+    pthread_mutex_lock(&state->lock);
+    for(struct magazine **link = &state->list; *link != NULL; link = &(*link)->next){
+        if(*link == mag){
+            *link = mag->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&state->lock);
+    // nobody can find it anymore, so the lock isn't needed
+    magazine_drain(mag->bs, mag, 0);
+    pthread_mutex_destroy(&mag->lock);
+    free(mag);
+}
+
+// the calling thread's magazine, created the first time the thread asks
+// returns NULL if magazines are off or there's no memory, callers go straight to the fbm then
+static struct magazine *magazine_get(block_store_t *const bs){
+    struct magazine_state *state = bs->magazines;
+    if(state == NULL){
+        return NULL;
+    }
+    struct magazine *mag = (struct magazine *)pthread_getspecific(state->key);
+    if(mag != NULL){
+        return mag;
+    }
+    mag = (struct magazine *)calloc(1, sizeof(struct magazine) + state->capacity * sizeof(size_t));
+    if(mag == NULL){
+        return NULL;
+    }
+    if(pthread_mutex_init(&mag->lock, NULL) != 0){
+        free(mag);
+        return NULL;
+    }
+    mag->bs = bs;
+    if(pthread_setspecific(state->key, mag) != 0){
+        pthread_mutex_destroy(&mag->lock);
+        free(mag);
+        return NULL;
+    }
+    pthread_mutex_lock(&state->lock);
+    mag->next = state->list;
+    state->list = mag;
+    pthread_mutex_unlock(&state->lock);
+    return mag;
+}
+
+// hands out a block from the thread's magazine, refilling it from the fbm when it runs dry
+// returns SIZE_MAX if there isn't a free block anywhere
+static size_t magazine_pop(block_store_t *const bs, struct magazine *const mag){
+    size_t id = SIZE_MAX;
+    pthread_mutex_lock(&mag->lock);
+    if(mag->count == 0){
+        // half full leaves room for releases before we have to drain again
+        const size_t got = block_store_allocate_many(bs, (bs->magazines->capacity + 1) / 2, mag->ids);
+        for(size_t i = 0; i < got; i++){
+            bitmap_test_and_set_atomic(bs->magazines->cached, mag->ids[i]);
+        }
+        __atomic_store_n(&mag->count, got, __ATOMIC_RELAXED);
+    }
+    if(mag->count > 0){
+        id = mag->ids[mag->count - 1];
+        __atomic_store_n(&mag->count, mag->count - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&mag->lock);
+    if(id != SIZE_MAX){
+        bitmap_test_and_reset_atomic(bs->magazines->cached, id);
+        return id;
+    }
+    // the fbm is full, but other threads may be sitting on free blocks
+    // (our own lock is dropped first so two threads stealing from each other can't deadlock)
+    struct magazine_state *state = bs->magazines;
+    pthread_mutex_lock(&state->lock);
+    for(struct magazine *other = state->list; (other != NULL) && (id == SIZE_MAX); other = other->next){
+        pthread_mutex_lock(&other->lock);
+        if(other->count > 0){
+            id = other->ids[other->count - 1];
+            __atomic_store_n(&other->count, other->count - 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&other->lock);
+    }
+    pthread_mutex_unlock(&state->lock);
+    if(id != SIZE_MAX){
+        bitmap_test_and_reset_atomic(state->cached, id);
+    }
+    return id;
+}
+
+// puts a released block in the thread's magazine, draining the older half back to the fbm when it's full
+// a block that's already free or already in a magazine is dropped, the way free_blocks ignores it,
+// otherwise it would be handed out twice
+static void magazine_push(block_store_t *const bs, struct magazine *const mag, const size_t block_id){
+    if(!bitmap_test(bs->fbm, block_id) || bitmap_test_and_set_atomic(bs->magazines->cached, block_id)){
+        return;
+    }
+    pthread_mutex_lock(&mag->lock);
+    if(mag->count == bs->magazines->capacity){
+        magazine_drain(bs, mag, mag->count / 2);
+    }
+    mag->ids[mag->count] = block_id;
+    __atomic_store_n(&mag->count, mag->count + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&mag->lock);
+}
+
+// frees user blocks [start, start + count) for the release calls, skipping the ones sitting in a magazine:
+// they're already free as far as users know, and freeing them under the magazine would hand them out twice
+static void release_run(block_store_t *const bs, const size_t start, const size_t count){
+    const bitmap_t *cached = (bs->magazines != NULL) ? bs->magazines->cached : NULL;
+    size_t run = start;
+    const size_t end = start + count;
+    for(size_t id = bitmap_ffs_from(cached, start); (id != SIZE_MAX) && (id < end); id = bitmap_ffs_from(cached, id + 1)){
+        if(bs->debug != NULL){
+            debug_violation(bs, "released a block that isn't allocated", id);
+        }
+        if(id > run){
+            free_blocks(bs, run, id - run);
+        }
+        run = id + 1;
+    }
+    if(end > run){
+        free_blocks(bs, run, end - run);
+    }
+}
+
+// number of free blocks sitting in magazines, a snapshot if other threads are busy
+static size_t magazine_cached(const block_store_t *const bs){
+    struct magazine_state *state = bs->magazines;
+    size_t cached = 0;
+    if(state != NULL){
+        pthread_mutex_lock(&state->lock);
+        for(const struct magazine *mag = state->list; mag != NULL; mag = mag->next){
+            cached += __atomic_load_n(&mag->count, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&state->lock);
+    }
+    return cached;
+}
+
+// works out the block shift and how many blocks the fbm takes for the given geometry
+// returns false if the geometry is no good
+static bool device_geometry(const size_t num_blocks, const size_t block_size, unsigned *const shift, size_t *const fbm_blocks){
+    // block size has to be a power of two so offsets can be computed with a shift
+    if((block_size < BLOCK_STORE_MIN_BLOCK_SIZE) || (block_size & (block_size - 1))){
+        return false;
+    }
+    *shift = 0;
+    while(((size_t)1 << *shift) < block_size){
+        (*shift)++;
+    }
+    // the device has to fit in the address space
+    if((num_blocks == 0) || (num_blocks > (SIZE_MAX >> *shift))){
+        return false;
+    }
+    // calculate number of blocks required to store the bitmap, one bit per block
+    size_t bitmapBytes = (num_blocks >> 3) + ((num_blocks & 0x07) ? 1 : 0);
+    *fbm_blocks = (bitmapBytes + block_size - 1) >> *shift;
+    // there has to be at least one block left over for the user
+    return *fbm_blocks < num_blocks;
+}
+
+// allocates a device header and works out its geometry, the caller supplies the blocks
+// returns NULL if the geometry is no good
+static block_store_t *device_alloc(const size_t num_blocks, const size_t block_size){
+    unsigned shift;
+    size_t bitmapNumBlocks;
+    if(!device_geometry(num_blocks, block_size, &shift, &bitmapNumBlocks)){
+        return NULL;
+    }
+
+    block_store_t *bs = (block_store_t *)calloc(sizeof(block_store_t), 1);
+    if(bs == NULL){
+        return NULL;
+    }
+    // nothing has been checkpointed yet, so every block starts out dirty
+    bs->dirty = bitmap_create(num_blocks);
+    if(bs->dirty == NULL){
+        free(bs);
+        return NULL;
+    }
+    bitmap_set_range(bs->dirty, 0, num_blocks);
+    bs->num_blocks = num_blocks;
+    bs->block_size = block_size;
+    bs->block_shift = shift;
+    bs->fbm_blocks = bitmapNumBlocks;
+    // the fbm lives at the end of the device so user block ids stay contiguous from zero
+    bs->fbm_start = num_blocks - bitmapNumBlocks;
+    bs->avail_blocks = bs->fbm_start;
+    return bs;
+}
+
+// overlays the fbm on its blocks once the block array is in place
+static bool device_attach_fbm(block_store_t *const bs){
+    // number of bits in the bitmap equals the number of blocks
+    bs->fbm = bitmap_overlay(bs->num_blocks, (bs->file != NULL) ? bs->file->fbm : block_addr(bs, bs->fbm_start));
+    // the summary lets allocation skip 64 full words per lookup instead of testing every bit
+    if((bs->fbm == NULL) || !bitmap_enable_summary(bs->fbm)){
+        return false;
+    }
+    // mark each block used by the bitmap as used in the fbm
+    // (these ids are outside the user range, so block_store_request would refuse them)
+    // a read only mapping can't be touched, an image we wrote already has them set
+    if(!bs->read_only){
+        bitmap_set_range(bs->fbm, bs->fbm_start, bs->fbm_blocks);
+    }
+    used_recount(bs);
+    extents_rebuild(bs);
+    return true;
+}
+
+// opens (creating it if asked to) the file behind a file backed device and works out its geometry
+// returns the device header with the open descriptor in *fd, NULL on error
+static block_store_t *device_open(const char *const path, const int flags, const size_t num_blocks, const size_t block_size, int *const fd){
+    if(path == NULL){
+        return NULL;
+    }
+    const bool readOnly = (flags & BLOCK_STORE_MMAP_READONLY) != 0;
+    int openFlags = readOnly ? O_RDONLY : O_RDWR;
+    if((flags & BLOCK_STORE_MMAP_CREATE) && !readOnly){
+        openFlags |= O_CREAT;
+    }
+    *fd = open(path, openFlags, 0644);
+    if(*fd < 0){
+        return NULL;
+    }
+    struct stat st;
+    if(fstat(*fd, &st) != 0){
+        close(*fd);
+        return NULL;
+    }
+    // an empty file is a brand new device, anything else tells us how many blocks it holds
+    size_t blockCount = num_blocks;
+    if(st.st_size != 0){
+        if((block_size == 0) || ((size_t)st.st_size % block_size)){
+            close(*fd);
+            return NULL;
+        }
+        blockCount = (size_t)st.st_size / block_size;
+    }
+    else if(!(flags & BLOCK_STORE_MMAP_CREATE) || readOnly){
+        close(*fd);
+        return NULL;
+    }
+    block_store_t *bs = device_alloc(blockCount, block_size);
+    if(bs == NULL){
+        close(*fd);
+        return NULL;
+    }
+    bs->read_only = readOnly;
+    // growing the file zero fills it, which is exactly what a new device looks like
+    if((st.st_size == 0) && (ftruncate(*fd, (off_t)(blockCount << bs->block_shift)) != 0)){
+        close(*fd);
+        bitmap_destroy(bs->dirty);
+        free(bs);
+        return NULL;
+    }
+    return bs;
+}
+
+// puts a heap device's blocks in a family of their own, the first time it gets a snapshot or clone
+// from here on every block is reached through the table, bs->blocks belongs to the family
+static bool cow_start(block_store_t *const bs){
+    struct cow_family *family = (struct cow_family *)calloc(1, sizeof(struct cow_family));
+    struct cow_state *cow = (struct cow_state *)calloc(1, sizeof(struct cow_state));
+    uint8_t **table = (uint8_t **)malloc(bs->avail_blocks * sizeof(uint8_t *));
+    uint32_t *refs = (uint32_t *)malloc(bs->avail_blocks * sizeof(uint32_t));
+    if((family == NULL) || (cow == NULL) || (table == NULL) || (refs == NULL)){
+        free(family);
+        free(cow);
+        free(table);
+        free(refs);
+        return false;
+    }
+    family->base = bs->blocks;
+    family->base_mapped = bs->mapped;
+    family->base_refs = refs;
+    family->avail_blocks = bs->avail_blocks;
+    family->block_shift = bs->block_shift;
+    family->devices = 1;
+    for(size_t id = 0; id < bs->avail_blocks; id++){
+        table[id] = block_addr(bs, id);
+        refs[id] = 1;
+    }
+    // the fbm stays where it is, so the overlay doesn't have to move
+    cow->family = family;
+    cow->table = table;
+    cow->fbm = block_addr(bs, bs->fbm_start);
+    bs->cow = cow;
+    bs->blocks = NULL;
+    bs->mapped = 0;
+    return true;
+}
+
+// takes a device out of its family, the last one out frees base
+static void cow_leave(block_store_t *const bs){
+    struct cow_state *cow = bs->cow;
+    if(cow == NULL){
+        return;
+    }
+    struct cow_family *family = cow->family;
+    for(size_t id = 0; id < bs->avail_blocks; id++){
+        cow_unref(family, cow->table[id]);
+    }
+    free(cow->table);
+    if(cow->fbm_owned){
+        free(cow->fbm);
+    }
+    if(__atomic_sub_fetch(&family->devices, 1, __ATOMIC_ACQ_REL) == 0){
+        if(family->base_mapped > 0){
+            device_memory_unmap(family->base, family->base_mapped);
+        }
+        else{
+            free(family->base);
+        }
+        free(family->base_refs);
+        free(family);
+    }
+    free(cow);
+    bs->cow = NULL;
+}
+
+// gives back everything the device owns, however far it got through being set up
+static void device_free(block_store_t *const bs){
+    // outstanding async requests still point at the device (and the callers' buffers)
+    if(bs->async != NULL){
+        block_store_poll(bs, SIZE_MAX);
+        async_io_destroy(bs->async->io);
+        free(bs->async);
+    }
+    block_store_set_magazines(bs, 0);
+    block_store_set_debug(bs, false);
+    buddy_destroy(bs->buddy);
+    extent_index_destroy(bs->extents);
+    // whatever wasn't committed is gone, as it would be after a crash
+    journal_close(bs->journal);
+    // the fbm is an overlay, so this only frees the bitmap object
+    bitmap_destroy(bs->fbm);
+    bitmap_destroy(bs->dirty);
+    cow_leave(bs);
+    if(bs->backing == BACKING_MMAP){
+        munmap(bs->blocks, bs->num_blocks << bs->block_shift);
+    }
+    else if(bs->backing == BACKING_ANON){
+        device_memory_unmap(bs->blocks, bs->mapped);
+    }
+    else if(bs->backing == BACKING_FILE){
+        struct file_state *file = bs->file;
+        if(file->fd >= 0){
+            // whatever is still only in memory goes out, there's no one left to tell if it fails
+            block_store_sync(bs);
+            block_cache_destroy(file->cache);
+            close(file->fd);
+            pthread_mutex_destroy(&file->lock);
+        }
+        free(file->fbm);
+        free(file->bounce);
+        free(file);
+    }
+    else{
+        // free the memory used by the block store
+        free(bs->blocks);
+    }
+    free(bs);
+}
+
+///
+/// This creates a new BS device, ready to go
+/// \return Pointer to a new block storage device, NULL on error
+///
+block_store_t *block_store_create()
+{
+    return block_store_create_ex(BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES);
+}
+
+///
+/// This creates a new BS device with the requested geometry
+///  The FBM is stored in the last blocks of the device, so the number of
+///  user-addressable blocks is num_blocks minus the blocks the FBM needs
+/// \param num_blocks Total number of blocks on the device, FBM included
+/// \param block_size Bytes per block, must be a power of two and at least BLOCK_STORE_MIN_BLOCK_SIZE
+/// \return Pointer to a new block storage device, NULL on error
+///
+block_store_t *block_store_create_ex(const size_t num_blocks, const size_t block_size)
+{
+    block_store_t *bs = device_alloc(num_blocks, block_size);
+    if(bs == NULL){
+        return NULL;
+    }
+    // use calloc so the memory containing the fbm is initialized to all zeros
+    bs->blocks = (uint8_t *)calloc(num_blocks, block_size);
+    if((bs->blocks == NULL) || !device_attach_fbm(bs)){
+        device_free(bs);
+        return NULL;
+    }
+    return bs;
+}
+
+///
+/// This creates a new BS device with the requested geometry whose blocks live in memory mapped to order
+/// \param num_blocks Total number of blocks on the device, FBM included
+/// \param block_size Bytes per block, must be a power of two and at least BLOCK_STORE_MIN_BLOCK_SIZE
+/// \param memory How the block memory is backed and placed, NULL for the defaults
+/// \return Pointer to a new block storage device, NULL on error
+///
+block_store_t *block_store_create_memory(const size_t num_blocks, const size_t block_size, const block_store_memory_t *const memory)
+{
+    static const block_store_memory_t defaults = {BLOCK_STORE_PAGES_DEFAULT, BLOCK_STORE_NUMA_DEFAULT, 0};
+    block_store_t *bs = device_alloc(num_blocks, block_size);
+    if(bs == NULL){
+        return NULL;
+    }
+    bs->backing = BACKING_ANON;
+    // anonymous memory comes zero filled, like calloc
+    bs->blocks = (uint8_t *)device_memory_map(num_blocks << bs->block_shift, (memory != NULL) ? memory : &defaults, &bs->mapped);
+    if((bs->blocks == NULL) || !device_attach_fbm(bs)){
+        device_free(bs);
+        return NULL;
+    }
+    return bs;
+}
+
+///
+/// Opens a file as a BS device, mapping it straight into memory
+/// \param path The backing file
+/// \param flags Any of the BLOCK_STORE_MMAP_ flags
+/// \return Pointer to the BS device, NULL on error
+///
+block_store_t *block_store_open_mmap(const char *const path, const int flags)
+{
+    return block_store_open_mmap_ex(path, flags, BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES);
+}
+
+///
+/// Opens a file as a BS device with the given geometry, mapping it straight into memory
+/// \param path The backing file
+/// \param flags Any of the BLOCK_STORE_MMAP_ flags
+/// \param num_blocks Total number of blocks if the file gets created, otherwise ignored
+/// \param block_size Bytes per block, the file size must be a multiple of it
+/// \return Pointer to the BS device, NULL on error
+///
+block_store_t *block_store_open_mmap_ex(const char *const path, const int flags, const size_t num_blocks, const size_t block_size)
+{
+    int fd;
+    block_store_t *bs = device_open(path, flags, num_blocks, block_size, &fd);
+    if(bs == NULL){
+        return NULL;
+    }
+    size_t length = bs->num_blocks << bs->block_shift;
+    void *mapping = mmap(NULL, length, bs->read_only ? PROT_READ : (PROT_READ | PROT_WRITE), MAP_SHARED, fd, 0);
+    // the mapping keeps the file alive, we don't need the descriptor anymore
+    close(fd);
+    if(mapping == MAP_FAILED){
+        bitmap_destroy(bs->dirty);
+        free(bs);
+        return NULL;
+    }
+    bs->blocks = (uint8_t *)mapping;
+    bs->backing = BACKING_MMAP;
+    if(!device_attach_fbm(bs)){
+        device_free(bs);
+        return NULL;
+    }
+    return bs;
+}
+
+///
+/// Opens a file as a BS device that's read and written through a block cache instead of mapped
+/// \param path The backing file
+/// \param flags Any of the BLOCK_STORE_MMAP_ flags, they mean the same thing here
+/// \param num_blocks Total number of blocks if the file gets created, otherwise ignored
+/// \param block_size Bytes per block, the file size must be a multiple of it
+/// \return Pointer to the BS device, NULL on error
+///
+block_store_t *block_store_open_file(const char *const path, const int flags, const size_t num_blocks, const size_t block_size)
+{
+    int fd;
+    block_store_t *bs = device_open(path, flags, num_blocks, block_size, &fd);
+    if(bs == NULL){
+        return NULL;
+    }
+    bs->backing = BACKING_FILE;
+    struct file_state *file = (struct file_state *)calloc(1, sizeof(struct file_state));
+    if(file == NULL){
+        close(fd);
+        bitmap_destroy(bs->dirty);
+        free(bs);
+        return NULL;
+    }
+    bs->file = file;
+    file->fd = -1;
+    const size_t fbmBytes = bs->fbm_blocks << bs->block_shift;
+    file->fbm = (uint8_t *)malloc(fbmBytes);
+    file->bounce = (uint8_t *)malloc(bs->block_size);
+    if((file->fbm == NULL) || (file->bounce == NULL) ||
+       (pread(fd, file->fbm, fbmBytes, (off_t)(bs->fbm_start << bs->block_shift)) != (ssize_t)fbmBytes) ||
+       (pthread_mutex_init(&file->lock, NULL) != 0)){
+        close(fd);
+        device_free(bs);
+        return NULL;
+    }
+    // from here on device_free syncs and closes it
+    file->fd = fd;
+    if(!device_attach_fbm(bs) || !block_store_set_cache(bs, BLOCK_STORE_CACHE_BLOCKS, BLOCK_STORE_CACHE_CLOCK)){
+        device_free(bs);
+        return NULL;
+    }
+    return bs;
+}
+
+// a new device that shares every block with bs until one of them writes to it
+static block_store_t *cow_fork(block_store_t *const bs, const bool read_only){
+    // a mapped or file backed device has to keep writing to its file, so only memory devices can share,
+    // and two threads could both copy a shared block on a concurrent one
+    if((bs == NULL) || bs->concurrent || ((bs->backing != BACKING_HEAP) && (bs->backing != BACKING_ANON)) || ((bs->cow == NULL) && !cow_start(bs))){
+        return NULL;
+    }
+    // a block sitting in a magazine would be allocated forever in the copy
+    block_store_flush_magazines(bs);
+    block_store_t *fork = device_alloc(bs->num_blocks, bs->block_size);
+    if(fork == NULL){
+        return NULL;
+    }
+    const size_t fbmBytes = bs->fbm_blocks << bs->block_shift;
+    struct cow_state *cow = (struct cow_state *)calloc(1, sizeof(struct cow_state));
+    if(cow != NULL){
+        cow->table = (uint8_t **)malloc(bs->avail_blocks * sizeof(uint8_t *));
+        cow->fbm = (uint8_t *)malloc(fbmBytes);
+    }
+    if((cow == NULL) || (cow->table == NULL) || (cow->fbm == NULL)){
+        if(cow != NULL){
+            free(cow->table);
+            free(cow->fbm);
+            free(cow);
+        }
+        device_free(fork);
+        return NULL;
+    }
+    // the table and the fbm are the only things copied, the blocks just gain a reference
+    struct cow_family *family = bs->cow->family;
+    memcpy(cow->table, bs->cow->table, bs->avail_blocks * sizeof(uint8_t *));
+    memcpy(cow->fbm, bs->cow->fbm, fbmBytes);
+    cow->fbm_owned = true;
+    cow->family = family;
+    __atomic_add_fetch(&family->devices, 1, __ATOMIC_RELAXED);
+    for(size_t id = 0; id < bs->avail_blocks; id++){
+        __atomic_add_fetch(cow_refs(family, cow->table[id]), 1, __ATOMIC_RELAXED);
+    }
+    fork->cow = cow;
+    fork->read_only = read_only;
+    fork->policy = bs->policy;
+    if(!device_attach_fbm(fork)){
+        device_free(fork);
+        return NULL;
+    }
+    return fork;
+}
+
+///
+/// Takes a read only point in time copy of a BS device that shares its blocks
+/// \param bs BS device
+/// \return Pointer to the snapshot, NULL on error
+///
+block_store_t *block_store_snapshot(block_store_t *const bs)
+{
+    return cow_fork(bs, true);
+}
+
+///
+/// Forks a BS device into a writable copy that shares its blocks
+/// \param bs BS device
+/// \return Pointer to the clone, NULL on error
+///
+block_store_t *block_store_clone(block_store_t *const bs)
+{
+    return cow_fork(bs, false);
+}
+
+///
+/// Replaces the block cache of a file backed device, writing back the old one first
+/// \param bs BS device
+/// \param capacity Number of blocks to cache, 0 reads and writes the file directly
+/// \param policy How blocks get picked for eviction
+/// \return boolean indicating succes of operation
+///
+bool block_store_set_cache(block_store_t *const bs, const size_t capacity, const block_store_cache_policy_t policy)
+{
+    if((bs == NULL) || (bs->file == NULL) || ((policy != BLOCK_STORE_CACHE_CLOCK) && (policy != BLOCK_STORE_CACHE_2Q))){
+        return false;
+    }
+    block_cache_t *cache = NULL;
+    if(capacity > 0){
+        cache = block_cache_create(bs->file->fd, bs->block_size, capacity, policy);
+        if(cache == NULL){
+            return false;
+        }
+    }
+    // if the old cache can't write its dirty blocks back they'd be lost, so it stays
+    pthread_mutex_lock(&bs->file->lock);
+    if((bs->file->cache != NULL) && !block_cache_flush(bs->file->cache)){
+        pthread_mutex_unlock(&bs->file->lock);
+        block_cache_destroy(cache);
+        return false;
+    }
+    block_cache_destroy(bs->file->cache);
+    bs->file->cache = cache;
+    pthread_mutex_unlock(&bs->file->lock);
+    return true;
+}
+
+///
+/// Reports the hit/miss/eviction counters of a file backed device's block cache
+/// \param bs BS device
+/// \param stats Receives the counters
+/// \return boolean indicating succes of operation, false if the device has no cache
+///
+bool block_store_get_cache_stats(const block_store_t *const bs, block_store_cache_stats_t *const stats)
+{
+    if((bs == NULL) || (bs->file == NULL) || (bs->file->cache == NULL) || (stats == NULL)){
+        return false;
+    }
+    pthread_mutex_lock(&bs->file->lock);
+    block_cache_get_stats(bs->file->cache, stats);
+    pthread_mutex_unlock(&bs->file->lock);
+    return true;
+}
+
+///
+/// Flushes a file backed BS device to disk
+/// \param bs BS device
+/// \return boolean indicating succes of operation, devices that aren't backed by a file always succeed
+///
+bool block_store_sync(block_store_t *const bs)
+{
+    if(bs == NULL){
+        return false;
+    }
+    if(bs->backing == BACKING_MMAP){
+        return msync(bs->blocks, bs->num_blocks << bs->block_shift, MS_SYNC) == 0;
+    }
+    if((bs->backing == BACKING_FILE) && !bs->read_only){
+        // dirty blocks go out in block order, then the fbm, then we wait for the disk
+        struct file_state *file = bs->file;
+        const size_t fbmBytes = bs->fbm_blocks << bs->block_shift;
+        pthread_mutex_lock(&file->lock);
+        bool ok = ((file->cache == NULL) || block_cache_flush(file->cache)) &&
+                  (pwrite(file->fd, file->fbm, fbmBytes, (off_t)(bs->fbm_start << bs->block_shift)) == (ssize_t)fbmBytes) &&
+                  (fsync(file->fd) == 0);
+        pthread_mutex_unlock(&file->lock);
+        return ok;
+    }
+    return true;
+}
+
+///
+/// Destroys the provided block storage device
+/// This is an idempotent operation, so there is no return value
+/// \param bs BS device
+///
+void block_store_destroy(block_store_t *const bs)
+{
+    if(bs != NULL){
+        device_free(bs);
+    }
+}
+
+///
+/// Searches for a free block, marks it as in use, and returns the block's id
+/// \param bs BS device
+/// \return Allocated block's id, SIZE_MAX on error
+///
+size_t block_store_allocate(block_store_t *const bs)
+{
+    if((bs == NULL) || bs->read_only){
+        return SIZE_MAX;
+    }
+    // buddy mode hands out the first block of the smallest free chunk
+    if(bs->buddy != NULL){
+        return block_store_allocate_order(bs, 0);
+    }
+    // with magazines on the fbm only gets touched when this thread's magazine is empty
+    struct magazine *mag = magazine_get(bs);
+    if(mag != NULL){
+        return magazine_pop(bs, mag);
+    }
+    // best fit takes a block from the smallest hole, which needs the extent index
+    if((bs->policy == BLOCK_STORE_BEST_FIT) && (bs->extents != NULL)){
+        const size_t best = extent_index_best_fit(bs->extents, 1);
+        return ((best != SIZE_MAX) && claim_blocks(bs, best, 1)) ? best : SIZE_MAX;
+    }
+    // first fit always starts at the bottom, next fit picks up where the last allocation left off
+    // (the cursor is only ever a hint, so relaxed atomics are plenty in concurrent mode)
+    size_t id = (bs->policy == BLOCK_STORE_NEXT_FIT) ? __atomic_load_n(&bs->cursor, __ATOMIC_RELAXED) : 0;
+    // in concurrent mode someone can take the block between the search and the claim,
+    // in which case we keep searching from there
+    do{
+        id = find_free_block(bs, id);
+        // return SIZE_MAX if there isn't a free block anywhere
+        if(id == SIZE_MAX){
+            return SIZE_MAX;
+        }
+    }while(!claim_blocks(bs, id, 1));
+    __atomic_store_n(&bs->cursor, (id + 1 < bs->avail_blocks) ? id + 1 : 0, __ATOMIC_RELAXED);
+
+    return id;
+}
+
+///
+/// Searches for a free block at or after the hint (wrapping around to the start),
+///  marks it as in use, and returns the block's id. Lets callers keep related blocks close.
+///  A hint past the end of the device searches from the start.
+///  This ignores the allocation policy and doesn't move the next-fit cursor.
+/// \param bs BS device
+/// \param hint_id Block id to start searching at
+/// \return Allocated block's id, SIZE_MAX on error
+///
+size_t block_store_allocate_near(block_store_t *const bs, const size_t hint_id)
+{
+    if((bs == NULL) || bs->read_only){
+        return SIZE_MAX;
+    }
+    size_t id = (hint_id < bs->avail_blocks) ? hint_id : 0;
+    do{
+        id = find_free_block(bs, id);
+        if(id == SIZE_MAX){
+            return SIZE_MAX;
+        }
+    }while(!claim_blocks(bs, id, 1));
+    return id;
+}
+
+///
+/// Searches for a run of contiguous free blocks, marks them as in use,
+///  and returns the first block's id. Follows the allocation policy.
+/// \param bs BS device
+/// \param count Number of blocks in the run
+/// \param first_id Receives the id of the first block in the run
+/// \return boolean indicating succes of operation
+///
+bool block_store_allocate_extent(block_store_t *const bs, const size_t count, size_t *const first_id)
+{
+    if((bs == NULL) || bs->read_only || (first_id == NULL) || (count == 0) || (count > bs->avail_blocks)){
+        return false;
+    }
+    // with the extent index first and best fit are a walk down a tree
+    if((bs->extents != NULL) && (bs->policy != BLOCK_STORE_NEXT_FIT)){
+        const size_t found = (bs->policy == BLOCK_STORE_BEST_FIT) ? extent_index_best_fit(bs->extents, count) : extent_index_first_fit(bs->extents, count);
+        if((found == SIZE_MAX) || !claim_blocks(bs, found, count)){
+            return false;
+        }
+        *first_id = found;
+        return true;
+    }
+    // the fbm blocks are set, so a run never reaches past the user blocks
+    size_t start = (bs->policy == BLOCK_STORE_NEXT_FIT) ? __atomic_load_n(&bs->cursor, __ATOMIC_RELAXED) : 0;
+    size_t id;
+    do{
+        id = bitmap_find_zero_run(bs->fbm, start, count);
+        if((id == SIZE_MAX) && (start > 0)){
+            // a run that straddles the cursor gets found on the second pass from zero
+            id = bitmap_find_zero_run(bs->fbm, 0, count);
+        }
+        if(id == SIZE_MAX){
+            return false;
+        }
+        // lost part of the run to another thread, search again from the same place
+    }while(!claim_blocks(bs, id, count));
+    if(bs->policy == BLOCK_STORE_NEXT_FIT){
+        __atomic_store_n(&bs->cursor, (id + count < bs->avail_blocks) ? id + count : 0, __ATOMIC_RELAXED);
+    }
+    *first_id = id;
+    return true;
+}
+
+///
+/// Frees a run of contiguous blocks
+/// \param bs BS device
+/// \param first_id The first block to free
+/// \param count Number of blocks to free
+///
+void block_store_release_extent(block_store_t *const bs, const size_t first_id, const size_t count)
+{
+    // the whole run has to be user blocks, written so first_id + count can't overflow
+    if((bs != NULL) && !bs->read_only && (first_id < bs->avail_blocks) && (count <= bs->avail_blocks - first_id)){
+        release_run(bs, first_id, count);
+    }
+}
+
+///
+/// Allocates an aligned run of 2^order blocks from the buddy index
+/// \param bs BS device
+/// \param order log2 of the number of blocks
+/// \return The id of the first block, SIZE_MAX on error or if buddy mode is off
+///
+size_t block_store_allocate_order(block_store_t *const bs, const unsigned order)
+{
+    if((bs == NULL) || bs->read_only || (bs->buddy == NULL) || (order > buddy_max_order(bs->buddy))){
+        return SIZE_MAX;
+    }
+    const size_t id = buddy_find(bs->buddy, order);
+    // the index mirrors the fbm and nothing else runs in buddy mode, so the claim can't lose
+    if((id == SIZE_MAX) || !claim_blocks(bs, id, (size_t)1 << order)){
+        return SIZE_MAX;
+    }
+    return id;
+}
+
+///
+/// Frees a run of 2^order blocks, merging it with free neighbours in buddy mode
+/// \param bs BS device
+/// \param first_id The first block to free
+/// \param order log2 of the number of blocks
+///
+void block_store_release_order(block_store_t *const bs, const size_t first_id, const unsigned order)
+{
+    if(order < sizeof(size_t) * 8){
+        block_store_release_extent(bs, first_id, (size_t)1 << order);
+    }
+}
+
+///
+/// Allocates up to n free blocks in one pass over the FBM, following the allocation policy
+/// \param bs BS device
+/// \param n Number of blocks wanted
+/// \param ids_out Receives the allocated ids, must have room for n ids
+/// \return Number of blocks allocated, less than n if the device ran out, 0 on error
+///
+size_t block_store_allocate_many(block_store_t *const bs, const size_t n, size_t *const ids_out)
+{
+    if((bs == NULL) || bs->read_only || (ids_out == NULL)){
+        return 0;
+    }
+    size_t start = (bs->policy == BLOCK_STORE_NEXT_FIT) ? __atomic_load_n(&bs->cursor, __ATOMIC_RELAXED) : 0;
+    size_t count = 0;
+    // sweep [start, end) and then [0, start), each search picks up right after the last hit
+    // so the fbm gets walked once no matter how many blocks we hand out
+    size_t pos = start, stop = bs->avail_blocks;
+    while(count < n){
+        size_t id = bitmap_ffz_from(bs->fbm, pos);
+        if(id >= stop){
+            if((stop == start) || (start == 0)){
+                // we've come all the way around
+                break;
+            }
+            pos = 0;
+            stop = start;
+            continue;
+        }
+        // a block another thread beat us to just gets skipped
+        if(claim_blocks(bs, id, 1)){
+            ids_out[count++] = id;
+        }
+        pos = id + 1;
+    }
+    if((count > 0) && (bs->policy == BLOCK_STORE_NEXT_FIT)){
+        __atomic_store_n(&bs->cursor, (ids_out[count - 1] + 1 < bs->avail_blocks) ? ids_out[count - 1] + 1 : 0, __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
+///
+/// Frees every block in the list, ids that aren't user blocks are skipped
+/// \param bs BS device
+/// \param ids The blocks to free
+/// \param n Number of ids in the list
+///
+void block_store_release_many(block_store_t *const bs, const size_t *const ids, const size_t n)
+{
+    if((bs == NULL) || bs->read_only || (ids == NULL)){
+        return;
+    }
+    // one check of the device up front instead of one per block
+    for(size_t i = 0; i < n; i++){
+        if(ids[i] < bs->avail_blocks){
+            release_run(bs, ids[i], 1);
+        }
+    }
+}
+
+///
+/// Sets the policy block_store_allocate uses to pick free blocks
+/// \param bs BS device
+/// \param policy The allocation policy
+/// \return boolean indicating succes of operation
+///
+bool block_store_set_policy(block_store_t *const bs, const block_store_policy_t policy)
+{
+    if((bs == NULL) || ((policy != BLOCK_STORE_FIRST_FIT) && (policy != BLOCK_STORE_NEXT_FIT) && (policy != BLOCK_STORE_BEST_FIT))){
+        return false;
+    }
+    bs->policy = policy;
+    return true;
+}
+
+///
+/// Turns concurrent mode on or off
+/// \param bs BS device
+/// \param enable Whether concurrent mode should be on
+/// \return boolean indicating succes of operation
+///
+bool block_store_set_concurrent(block_store_t *const bs, const bool enable)
+{
+    // the buddy index isn't thread safe, and neither is copying a shared block on its first write
+    if((bs == NULL) || (enable && ((bs->buddy != NULL) || (bs->cow != NULL)))){
+        return false;
+    }
+    // lock free claims can't keep the extent trees up to date, so the index goes
+    // and comes back once the device is down to one thread again
+    const bool changed = (bs->concurrent != enable);
+    bs->concurrent = enable;
+    if(changed){
+        extents_rebuild(bs);
+    }
+    return true;
+}
+
+///
+/// Turns per-thread magazines on or off
+/// \param bs BS device
+/// \param capacity Most blocks a thread's magazine holds, 0 turns magazines off
+/// \return boolean indicating succes of operation
+///
+bool block_store_set_magazines(block_store_t *const bs, const size_t capacity)
+{
+    // buddy mode allocates around the magazines, so releases into them would never come back out
+    if((bs == NULL) || (capacity > (SIZE_MAX - sizeof(struct magazine)) / sizeof(size_t)) || ((capacity > 0) && (bs->buddy != NULL))){
+        return false;
+    }
+    // every magazine goes back to the fbm, a new capacity means starting over
+    struct magazine_state *state = bs->magazines;
+    if(state != NULL){
+        // once the key is gone no thread exit hook can run for it
+        pthread_key_delete(state->key);
+        while(state->list != NULL){
+            struct magazine *mag = state->list;
+            state->list = mag->next;
+            magazine_drain(bs, mag, 0);
+            pthread_mutex_destroy(&mag->lock);
+            free(mag);
+        }
+        pthread_mutex_destroy(&state->lock);
+        bitmap_destroy(state->cached);
+        free(state);
+        bs->magazines = NULL;
+    }
+    if(capacity == 0){
+        return true;
+    }
+    state = (struct magazine_state *)calloc(1, sizeof(struct magazine_state));
+    if(state == NULL){
+        return false;
+    }
+    state->cached = bitmap_create(bs->avail_blocks);
+    if((state->cached == NULL) || (pthread_mutex_init(&state->lock, NULL) != 0)){
+        bitmap_destroy(state->cached);
+        free(state);
+        return false;
+    }
+    if(pthread_key_create(&state->key, magazine_thread_exit) != 0){
+        pthread_mutex_destroy(&state->lock);
+        bitmap_destroy(state->cached);
+        free(state);
+        return false;
+    }
+    state->capacity = capacity;
+    bs->magazines = state;
+    return true;
+}
+
+///
+/// Turns buddy mode on or off
+/// \param bs BS device
+/// \param enable Whether buddy mode should be on
+/// \return boolean indicating succes of operation
+///
+bool block_store_set_buddy(block_store_t *const bs, const bool enable)
+{
+    // the index isn't thread safe, and allocating from it skips the magazines
+    if((bs == NULL) || (enable && (bs->concurrent || (bs->magazines != NULL)))){
+        return false;
+    }
+    // turning it on again rebuilds the index, which costs the same as keeping the old one
+    buddy_destroy(bs->buddy);
+    bs->buddy = NULL;
+    if(enable){
+        bs->buddy = buddy_create(bs->fbm, bs->avail_blocks);
+        return bs->buddy != NULL;
+    }
+    return true;
+}
+
+///
+/// Gives every block sitting in a magazine back to the FBM
+/// \param bs BS device
+///
+void block_store_flush_magazines(block_store_t *const bs)
+{
+    if((bs == NULL) || (bs->magazines == NULL)){
+        return;
+    }
+    struct magazine_state *state = bs->magazines;
+    pthread_mutex_lock(&state->lock);
+    for(struct magazine *mag = state->list; mag != NULL; mag = mag->next){
+        pthread_mutex_lock(&mag->lock);
+        magazine_drain(bs, mag, 0);
+        pthread_mutex_unlock(&mag->lock);
+    }
+    pthread_mutex_unlock(&state->lock);
+}
+
+///
+/// Attempts to allocate the requested block id
+/// \param bs the block store object
+/// \block_id the requested block identifier
+/// \return boolean indicating succes of operation
+///
+bool block_store_request(block_store_t *const bs, const size_t block_id)
+{
+    //check for bad parameters, block id is equal to the block index
+    if((bs == NULL) || bs->read_only || (block_id >= bs->avail_blocks)){
+        return false;
+    }
+    // set the block corresponding to the block id to used, the fbm blocks can't be requested
+    // returns false if the requested block is in use
+    return claim_blocks(bs, block_id, 1);
+}
+
+///
+/// Frees the specified block
+/// \param bs BS device
+/// \param block_id The block to free
+///
+void block_store_release(block_store_t *const bs, const size_t block_id)
+{
+    if((bs != NULL) && !bs->read_only && (block_id < bs->avail_blocks)){
+        // debug mode skips the magazine so every release gets checked
+        struct magazine *mag = (bs->debug == NULL) ? magazine_get(bs) : NULL;
+        if(mag != NULL){
+            magazine_push(bs, mag, block_id);
+            return;
+        }
+        // set the given bit in the bitmap to zero
+        release_run(bs, block_id, 1);
+    }
+}
+
+///
+/// Counts the number of blocks marked as in use
+/// \param bs BS device
+/// \return Total blocks in use, SIZE_MAX on error
+///
+size_t block_store_get_used_blocks(const block_store_t *const bs)
+{
+    if(bs != NULL){
+        // blocks waiting in magazines are set in the fbm but free as far as users are concerned
+        return block_store_get_used_blocks_approx(bs) - magazine_cached(bs);
+    }
+    else { return SIZE_MAX; }
+}
+
+///
+/// Counts the number of blocks marked as in use, counting blocks that sit in
+///  magazines as used. Skips visiting every thread's magazine.
+/// \param bs BS device
+/// \return Total blocks in use or in magazines, SIZE_MAX on error
+///
+size_t block_store_get_used_blocks_approx(const block_store_t *const bs)
+{
+    if(bs != NULL){
+        const size_t used = __atomic_load_n(&bs->used, __ATOMIC_RELAXED);
+        // debug mode checks the counter against the fbm, unless other threads could be
+        // between changing one and the other
+        if((bs->debug != NULL) && !bs->concurrent){
+            // the blocks holding the fbm are always set but aren't user blocks
+            const size_t counted = bitmap_total_set(bs->fbm) - bs->fbm_blocks;
+            if(counted != used){
+                __atomic_fetch_add(&bs->debug->violations, 1, __ATOMIC_RELAXED);
+                fprintf(stderr, "block_store: used block counter says %zu, the fbm says %zu\n", used, counted);
+                return counted;
+            }
+        }
+        return used;
+    }
+    else { return SIZE_MAX; }
+}
+
+///
+/// Calls func for every allocated block id, in increasing order
+/// \param bs BS device
+/// \param func The function to call (first parameter will be the block id)
+/// \param arg A generic pointer to pass to func
+/// \return Number of blocks func was called for, SIZE_MAX on error
+///
+size_t block_store_for_each_allocated(const block_store_t *const bs, void (*func)(size_t, void *), void *arg)
+{
+    if((bs == NULL) || (func == NULL)){
+        return SIZE_MAX;
+    }
+    size_t visited = 0;
+    bitmap_iter_t iter;
+    bitmap_iter_init(&iter, bs->fbm, 0);
+    // the fbm's own blocks come last, so the first id past the user blocks ends the walk
+    for(size_t id = bitmap_iter_next(&iter); id < bs->avail_blocks; id = bitmap_iter_next(&iter)){
+        func(id, arg);
+        visited++;
+    }
+    return visited;
+}
+
+// fills in the fragmentation report by walking the free runs of the fbm, for when there's no index
+static void free_runs_scan(const block_store_t *const bs, block_store_fragmentation_t *const stats, size_t *const largest_start){
+    memset(stats, 0, sizeof(*stats));
+    *largest_start = SIZE_MAX;
+    for(size_t pos = bitmap_ffz(bs->fbm); pos < bs->avail_blocks; ){
+        size_t end = bitmap_ffs_from(bs->fbm, pos);
+        if(end > bs->avail_blocks){
+            end = bs->avail_blocks;
+        }
+        const size_t length = end - pos;
+        stats->free_blocks += length;
+        stats->extents++;
+        stats->histogram[63 - __builtin_clzll((unsigned long long)length)]++;
+        if(length > stats->largest){
+            stats->largest = length;
+            *largest_start = pos;
+        }
+        pos = bitmap_ffz_from(bs->fbm, end);
+    }
+}
+
+///
+/// Finds the largest run of free blocks
+/// \param bs BS device
+/// \param first_id Receives the id of the first block in the run, may be NULL
+/// \return Number of blocks in the run, 0 if nothing is free, SIZE_MAX on error
+///
+size_t block_store_largest_free_extent(const block_store_t *const bs, size_t *const first_id)
+{
+    if(bs == NULL){
+        return SIZE_MAX;
+    }
+    size_t start = SIZE_MAX, length = 0;
+    if(bs->extents != NULL){
+        length = extent_index_largest(bs->extents, &start);
+    }
+    else{
+        block_store_fragmentation_t stats;
+        free_runs_scan(bs, &stats, &start);
+        length = stats.largest;
+    }
+    if((first_id != NULL) && (length > 0)){
+        *first_id = start;
+    }
+    return length;
+}
+
+///
+/// Reports how the free blocks are spread out
+/// \param bs BS device
+/// \param stats Receives the report
+/// \return boolean indicating succes of operation
+///
+bool block_store_get_fragmentation(const block_store_t *const bs, block_store_fragmentation_t *const stats)
+{
+    if((bs == NULL) || (stats == NULL)){
+        return false;
+    }
+    if(bs->extents == NULL){
+        size_t start;
+        free_runs_scan(bs, stats, &start);
+        return true;
+    }
+    extent_index_histogram(bs->extents, &stats->extents, stats->histogram);
+    stats->largest = extent_index_largest(bs->extents, NULL);
+    // the fbm counts blocks sitting in magazines as used, so the index does too
+    stats->free_blocks = bs->avail_blocks - __atomic_load_n(&bs->used, __ATOMIC_RELAXED);
+    return true;
+}
+
+// monotonic clock for the compaction time budget
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+///
+/// Moves allocated blocks toward the low end of the device, a little at a time
+/// \param bs BS device
+/// \param budget Limits on the work done, NULL for none
+/// \param remap Told about every move, may be NULL
+/// \param context Passed to remap
+/// \return Number of blocks moved, 0 once there's nothing left to move, SIZE_MAX on error
+///
+size_t block_store_compact(block_store_t *const bs, const block_store_compact_budget_t *const budget, block_store_remap_callback_t remap, void *context)
+{
+    // an owner could write to or release a block while it's being copied
+    if((bs == NULL) || bs->read_only || bs->concurrent || (bs->magazines != NULL)){
+        return SIZE_MAX;
+    }
+    const size_t max_blocks = ((budget != NULL) && (budget->blocks > 0)) ? budget->blocks : SIZE_MAX;
+    const uint64_t deadline = ((budget != NULL) && (budget->nanoseconds > 0)) ? now_ns() + budget->nanoseconds : 0;
+    uint8_t *buffer = NULL;
+    size_t moved = 0;
+    // the hole only moves up and the block only moves down, so a pass is one sweep from each end
+    size_t hole = find_free_block(bs, 0);
+    size_t top = bitmap_fls_before(bs->fbm, bs->avail_blocks);
+    while((moved < max_blocks) && (hole != SIZE_MAX) && (top != SIZE_MAX) && (hole < top)){
+        if((bs->debug != NULL) && (__atomic_load_n(&bs->debug->pins[top], __ATOMIC_RELAXED) > 0)){
+            // somebody holds a pointer into it
+            top = bitmap_fls_before(bs->fbm, top);
+            continue;
+        }
+        if(!claim_blocks(bs, hole, 1)){
+            // not free after all
+            hole = bitmap_ffz_from(bs->fbm, hole + 1);
+            continue;
+        }
+        if(buffer == NULL){
+            buffer = (uint8_t *)malloc(bs->block_size);
+        }
+        // through a buffer since a file backed device only lets one block in at a time
+        if((buffer == NULL) || (block_store_read(bs, top, buffer) != bs->block_size) || (block_store_write(bs, hole, buffer) != bs->block_size)){
+            free_blocks(bs, hole, 1);
+            free(buffer);
+            return (moved > 0) ? moved : SIZE_MAX;
+        }
+        if(remap != NULL){
+            remap(context, top, hole);
+        }
+        free_blocks(bs, top, 1);
+        moved++;
+        if((deadline != 0) && (now_ns() >= deadline)){
+            break;
+        }
+        hole = bitmap_ffz_from(bs->fbm, hole + 1);
+        top = bitmap_fls_before(bs->fbm, top);
+    }
+    free(buffer);
+    return moved;
+}
+
+///
+/// Counts the number of blocks marked free for use
+/// \param bs BS device
+/// \return Total blocks free, SIZE_MAX on error
+///
+size_t block_store_get_free_blocks(const block_store_t *const bs)
+{
+    if(bs != NULL){
+        // calculate the total free blocks
+        return bs->avail_blocks - block_store_get_used_blocks(bs);
+    }
+    else { return SIZE_MAX; }
+}
+
+///
+/// Returns the total number of user-addressable blocks
+/// \param bs BS device
+/// \return Total blocks, SIZE_MAX on error
+///
+size_t block_store_get_total_blocks(const block_store_t *const bs)
+{
+    if(bs != NULL){
+        return bs->avail_blocks;
+    }
+    else { return SIZE_MAX; }
+}
+
+///
+/// Returns the size of each block on the device
+/// \param bs BS device
+/// \return Bytes per block, 0 on error
+///
+size_t block_store_get_block_size(const block_store_t *const bs)
+{
+    if(bs != NULL){
+        return bs->block_size;
+    }
+    else { return 0; }
+}
+
+///
+/// Reads data from the specified block and writes it to the designated buffer
+/// \param bs BS device
+/// \param block_id Source block id
+/// \param buffer Data buffer to write to
+/// \return Number of bytes read, 0 on error
+///
+size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer)
+{
+    if((bs != NULL) && (block_id < bs->num_blocks) && (buffer != NULL)){
+        const uint8_t *data = block_begin(bs, block_id, false, false);
+        if(data == NULL){
+            return 0;
+        }
+        // copy the block specified by the block_id to the given buffer
+        memcpy(buffer, data, bs->block_size);
+        block_end(bs, block_id, false);
+        return bs->block_size;
+    }
+    return 0;
+}
+
+///
+/// Reads data from the specified buffer and writes it to the designated block
+/// \param bs BS device
+/// \param block_id Destination block id
+/// \param buffer Data buffer to read from
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer)
+{
+    if((bs != NULL) && !bs->read_only && (block_id < bs->num_blocks) && (buffer != NULL)){
+        if(!debug_write_check(bs, block_id)){
+            return 0;
+        }
+        uint8_t *data = block_begin(bs, block_id, true, true);
+        if(data == NULL){
+            return 0;
+        }
+        // write the data from the buffer to the block specified by the block_id
+        memcpy(data, buffer, bs->block_size);
+        mark_dirty(bs, block_id, 1);
+        journal_block(bs, block_id, data);
+        return block_end(bs, block_id, true) ? bs->block_size : 0;
+    }
+    return 0;
+}
+
+///
+/// Reads part of the specified block into the designated buffer
+/// \param bs BS device
+/// \param block_id Source block id
+/// \param offset Byte offset within the block to start at
+/// \param len Number of bytes to read, offset + len can't be past the end of the block
+/// \param buffer Data buffer to write to
+/// \return Number of bytes read, 0 on error
+///
+size_t block_store_pread(const block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, void *buffer)
+{
+    // written so offset + len can't overflow
+    if((bs != NULL) && (block_id < bs->num_blocks) && (buffer != NULL) && (offset < bs->block_size) && (len <= bs->block_size - offset)){
+        const uint8_t *data = block_begin(bs, block_id, false, false);
+        if(data == NULL){
+            return 0;
+        }
+        memcpy(buffer, data + offset, len);
+        block_end(bs, block_id, false);
+        return len;
+    }
+    return 0;
+}
+
+///
+/// Writes the designated buffer over part of the specified block
+/// \param bs BS device
+/// \param block_id Destination block id
+/// \param offset Byte offset within the block to start at
+/// \param len Number of bytes to write, offset + len can't be past the end of the block
+/// \param buffer Data buffer to read from
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_pwrite(block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, const void *buffer)
+{
+    if((bs != NULL) && !bs->read_only && (block_id < bs->num_blocks) && (buffer != NULL) && (offset < bs->block_size) && (len <= bs->block_size - offset)){
+        if(!debug_write_check(bs, block_id)){
+            return 0;
+        }
+        // the rest of the block has to be read in unless we're overwriting all of it
+        uint8_t *data = block_begin(bs, block_id, true, len == bs->block_size);
+        if(data == NULL){
+            return 0;
+        }
+        memcpy(data + offset, buffer, len);
+        mark_dirty(bs, block_id, 1);
+        // the journal takes whole blocks, so replay doesn't depend on what was there before
+        journal_block(bs, block_id, data);
+        return block_end(bs, block_id, true) ? len : 0;
+    }
+    return 0;
+}
+
+///
+/// Reads a list of whole blocks, each into its own buffer
+/// \param bs BS device
+/// \param iov The blocks to read and where each one goes
+/// \param count Number of entries in the list
+/// \return Number of bytes read, stops short at the first bad entry, 0 on error
+///
+size_t block_store_readv(const block_store_t *const bs, const block_store_iovec_t *const iov, const size_t count)
+{
+    if((bs == NULL) || (iov == NULL)){
+        return 0;
+    }
+    // the device gets checked once, each entry only needs its own id and buffer checked
+    size_t total = 0;
+    for(size_t i = 0; i < count; i++){
+        if((iov[i].block_id >= bs->num_blocks) || (iov[i].buffer == NULL)){
+            break;
+        }
+        const uint8_t *data = block_begin(bs, iov[i].block_id, false, false);
+        if(data == NULL){
+            break;
+        }
+        memcpy(iov[i].buffer, data, bs->block_size);
+        block_end(bs, iov[i].block_id, false);
+        total += bs->block_size;
+    }
+    return total;
+}
+
+///
+/// Writes a list of whole blocks, each from its own buffer
+/// \param bs BS device
+/// \param iov The blocks to write and where each one comes from
+/// \param count Number of entries in the list
+/// \return Number of bytes written, stops short at the first bad entry, 0 on error
+///
+size_t block_store_writev(block_store_t *const bs, const block_store_iovec_t *const iov, const size_t count)
+{
+    if((bs == NULL) || bs->read_only || (iov == NULL)){
+        return 0;
+    }
+    size_t total = 0;
+    for(size_t i = 0; i < count; i++){
+        if((iov[i].block_id >= bs->num_blocks) || (iov[i].buffer == NULL) || !debug_write_check(bs, iov[i].block_id)){
+            break;
+        }
+        uint8_t *data = block_begin(bs, iov[i].block_id, true, true);
+        if(data == NULL){
+            break;
+        }
+        memcpy(data, iov[i].buffer, bs->block_size);
+        mark_dirty(bs, iov[i].block_id, 1);
+        journal_block(bs, iov[i].block_id, data);
+        if(!block_end(bs, iov[i].block_id, true)){
+            break;
+        }
+        total += bs->block_size;
+    }
+    return total;
+}
+
+// appends a request to a list with the given ends
+static void request_append(struct async_request **const head, struct async_request **const tail, struct async_request *const request){
+    request->next = NULL;
+    if(*tail != NULL){
+        (*tail)->next = request;
+    }
+    else{
+        *head = request;
+    }
+    *tail = request;
+}
+
+// the device's async bookkeeping, set up the first time it's needed
+static struct async_state *async_state(block_store_t *const bs){
+    if(bs->async == NULL){
+        bs->async = (struct async_state *)calloc(1, sizeof(struct async_state));
+        if(bs->async != NULL){
+            bs->async->backend = BLOCK_STORE_ASYNC_AUTO;
+            bs->async->depth = BLOCK_STORE_ASYNC_DEPTH;
+        }
+    }
+    return bs->async;
+}
+
+// queues an async request, both directions share everything but the checks
+static bool async_queue(block_store_t *const bs, const size_t block_id, const bool write, void *buffer, block_store_io_callback_t callback, void *context){
+    struct async_state *async = async_state(bs);
+    struct async_request *request = (async != NULL) ? (struct async_request *)calloc(1, sizeof(struct async_request)) : NULL;
+    if(request == NULL){
+        return false;
+    }
+    request->block_id = block_id;
+    request->callback = callback;
+    request->context = context;
+    request->op.write = write;
+    request->op.iov.iov_base = buffer;
+    request->op.iov.iov_len = bs->block_size;
+    request->op.offset = (off_t)(block_id << bs->block_shift);
+    request_append(&async->queued, &async->queued_tail, request);
+    return true;
+}
+
+// finishes a request on the spot if it doesn't need the file: the device isn't file backed,
+// the block is part of the in memory fbm, or it's sitting in the cache
+// returns false if the request has to go to the file
+static bool async_try_inline(block_store_t *const bs, struct async_request *const request){
+    struct file_state *file = bs->file;
+    const bool write = request->op.write;
+    uint8_t *data = NULL;
+    // a write has to go through the cache like block_store_write does (skipping the read in),
+    // a write behind its back would leave a stale copy there for the next read to find
+    const bool peek = (file != NULL) && (request->block_id < bs->fbm_start) && ((file->cache == NULL) || !write);
+    if(peek){
+        // only a cache hit saves the trip, a miss goes to the file without filling the cache
+        pthread_mutex_lock(&file->lock);
+        data = (file->cache != NULL) ? block_cache_peek(file->cache, request->block_id, write) : NULL;
+        if(data == NULL){
+            pthread_mutex_unlock(&file->lock);
+            return false;
+        }
+    }
+    else{
+        data = block_begin(bs, request->block_id, write, write);
+        if(data == NULL){
+            return true;
+        }
+    }
+    if(write){
+        memcpy(data, request->op.iov.iov_base, bs->block_size);
+    }
+    else{
+        memcpy(request->op.iov.iov_base, data, bs->block_size);
+    }
+    if(peek){
+        pthread_mutex_unlock(&file->lock);
+    }
+    else{
+        block_end(bs, request->block_id, write);
+    }
+    request->bytes = bs->block_size;
+    return true;
+}
+
+///
+/// Queues a read of a whole block, it starts on the next block_store_submit (or block_store_poll)
+/// \param bs BS device
+/// \param block_id Source block id
+/// \param buffer Data buffer to write to
+/// \param callback Called once the read is done, may be NULL
+/// \param context Passed to the callback
+/// \return boolean indicating succes of operation
+///
+bool block_store_read_async(block_store_t *const bs, const size_t block_id, void *buffer, block_store_io_callback_t callback, void *context)
+{
+    if((bs == NULL) || (block_id >= bs->num_blocks) || (buffer == NULL)){
+        return false;
+    }
+    return async_queue(bs, block_id, false, buffer, callback, context);
+}
+
+///
+/// Queues a write of a whole block, see block_store_read_async
+/// \param bs BS device
+/// \param block_id Destination block id
+/// \param buffer Data buffer to read from
+/// \param callback Called once the write is done, may be NULL
+/// \param context Passed to the callback
+/// \return boolean indicating succes of operation
+///
+bool block_store_write_async(block_store_t *const bs, const size_t block_id, const void *buffer, block_store_io_callback_t callback, void *context)
+{
+    if((bs == NULL) || bs->read_only || (block_id >= bs->num_blocks) || (buffer == NULL) || !debug_write_check(bs, block_id)){
+        return false;
+    }
+    mark_dirty(bs, block_id, 1);
+    journal_block(bs, block_id, buffer);
+    // the engine wants a plain iovec, it only ever reads from a write's buffer
+    return async_queue(bs, block_id, true, (void *)buffer, callback, context);
+}
+
+///
+/// Starts every queued async request, as many as the queue depth allows
+/// \param bs BS device
+/// \return Number of requests started, the rest start as earlier ones are polled
+///
+size_t block_store_submit(block_store_t *const bs)
+{
+    if((bs == NULL) || (bs->async == NULL)){
+        return 0;
+    }
+    struct async_state *async = bs->async;
+    size_t started = 0;
+    bool pushed = false;
+    while(async->queued != NULL){
+        struct async_request *request = async->queued;
+        const bool finished = async_try_inline(bs, request);
+        if(!finished){
+            if(async->io == NULL){
+                async->io = async_io_create(async->backend, async->depth);
+            }
+            request->op.fd = bs->file->fd;
+            // a full engine leaves the rest queued for the next submit
+            if((async->io == NULL) || !async_io_push(async->io, &request->op)){
+                break;
+            }
+            async->in_flight++;
+            pushed = true;
+        }
+        async->queued = request->next;
+        if(async->queued == NULL){
+            async->queued_tail = NULL;
+        }
+        if(finished){
+            request_append(&async->done, &async->done_tail, request);
+        }
+        started++;
+    }
+    if(pushed){
+        async_io_submit(async->io);
+    }
+    return started;
+}
 
 ///
-/// This creates a new BS device, ready to go
-/// \return Pointer to a new block storage device, NULL on error
+/// Submits whatever is queued, then runs the callbacks of finished async requests
+/// \param bs BS device
+/// \param min_complete Waits until at least this many have finished (or nothing is outstanding)
+/// \return Number of callbacks run
 ///
-block_store_t *block_store_create()
+size_t block_store_poll(block_store_t *const bs, const size_t min_complete)
 {
-    // block index where the fbm bitmap starts
-    int fbmStartIndex = 127;
-    // use calloc so the memory containing the fbm is initialized to all zeros
-    block_store_t *bs = (block_store_t *)calloc(sizeof(block_store_t),1);;
-    // number of bits in the bitmap equals the number of blocks
-    bs->fbm = bitmap_overlay(BLOCK_STORE_NUM_BLOCKS, &bs->blocks[fbmStartIndex]);
-    
-    // calculate number of blocks required to store the bitmap
-    int bitmapNumBlocks = BITMAP_SIZE_BYTES/BLOCK_SIZE_BYTES;
-    if((BITMAP_SIZE_BYTES%BLOCK_SIZE_BYTES) > 0){
-        bitmapNumBlocks += 1;
+    if((bs == NULL) || (bs->async == NULL)){
+        return 0;
     }
-    // mark each block used by the bitmap as used in the fbm
-    // block id = block index
-    for(int i = fbmStartIndex; i < fbmStartIndex+bitmapNumBlocks; i++){
-        block_store_request(bs, i);
+    struct async_state *async = bs->async;
+    size_t finished = 0;
+    for(struct async_request *request = async->done; request != NULL; request = request->next){
+        finished++;
     }
-    return bs;
+    for(;;){
+        block_store_submit(bs);
+        if(async->in_flight == 0){
+            break;
+        }
+        // wait for what's still missing, but never for more than is in flight
+        // (each round frees up room for queued requests to follow)
+        const size_t wanted = (min_complete > finished) ? min_complete - finished : 0;
+        async_op_t *op;
+        const bool submitted = async_io_reap(async->io, wanted, &op);
+        if((op == NULL) && (!submitted || (wanted > 0))){
+            // the engine gave up on us, leave the rest for another poll
+            break;
+        }
+        for(; op != NULL; op = op->next){
+            // the op is the first member, so it's the request
+            struct async_request *request = (struct async_request *)op;
+            request->bytes = (op->result == (ssize_t)bs->block_size) ? bs->block_size : 0;
+            request_append(&async->done, &async->done_tail, request);
+            async->in_flight--;
+            finished++;
+        }
+        // after a refused submit, what's reaped makes room for the next poll to try again
+        if(!submitted || (finished >= min_complete) || (wanted == 0)){
+            break;
+        }
+    }
+    // callbacks may queue more requests, so the list is taken off the device first
+    struct async_request *request = async->done;
+    async->done = async->done_tail = NULL;
+    size_t ran = 0;
+    while(request != NULL){
+        struct async_request *next = request->next;
+        if(request->callback != NULL){
+            request->callback(request->context, request->block_id, request->bytes);
+        }
+        free(request);
+        request = next;
+        ran++;
+    }
+    return ran;
 }
 
 ///
-/// Destroys the provided block storage device
-/// This is an idempotent operation, so there is no return value
+/// Picks the engine for async requests and how many can be in flight at once
 /// \param bs BS device
+/// \param backend The engine
+/// \param depth Most requests in flight at once, up to 4096
+/// \return boolean indicating succes of operation
 ///
-void block_store_destroy(block_store_t *const bs)
+bool block_store_set_async(block_store_t *const bs, const block_store_async_backend_t backend, const size_t depth)
 {
-    if(bs != NULL){
-        // free the memory used by the block store
-        free(bs);
+    if((bs == NULL) || (depth == 0) || (depth > 4096) ||
+       ((backend != BLOCK_STORE_ASYNC_AUTO) && (backend != BLOCK_STORE_ASYNC_URING) && (backend != BLOCK_STORE_ASYNC_THREADS))){
+        return false;
     }
+    struct async_state *async = async_state(bs);
+    if((async == NULL) || (async->queued != NULL) || (async->done != NULL) || (async->in_flight > 0)){
+        return false;
+    }
+    // file backed devices start the engine right away, so an unavailable backend is reported here
+    async_io_t *io = NULL;
+    if(bs->file != NULL){
+        io = async_io_create(backend, depth);
+        if(io == NULL){
+            return false;
+        }
+    }
+    async_io_destroy(async->io);
+    async->io = io;
+    async->backend = backend;
+    async->depth = depth;
+    return true;
 }
 
 ///
-/// Searches for a free block, marks it as in use, and returns the block's id
+/// Tells which engine runs the device's async requests
 /// \param bs BS device
-/// \return Allocated block's id, SIZE_MAX on error
+/// \return The engine, BLOCK_STORE_ASYNC_AUTO if none is running
 ///
-size_t block_store_allocate(block_store_t *const bs)
+block_store_async_backend_t block_store_get_async_backend(const block_store_t *const bs)
 {
-    if(bs == NULL){
-        return SIZE_MAX;
+    if((bs == NULL) || (bs->async == NULL) || (bs->async->io == NULL)){
+        return BLOCK_STORE_ASYNC_AUTO;
     }
-    // find the the first zero (unused block) in the fbm
-    int id = bitmap_ffz(bs->fbm);
-    // return SIZE_MAX if the end of the file is reached without a free block
-    if(id > BLOCK_STORE_AVAIL_BLOCKS){
-        return SIZE_MAX;
+    return async_io_backend(bs->async->io);
+}
+
+///
+/// Returns a pointer straight into the device's storage for the given block
+/// \param bs BS device
+/// \param block_id The block
+/// \return Pointer to block_size bytes of block data, NULL on error
+///
+void *block_store_block_ptr(block_store_t *const bs, const size_t block_id)
+{
+    if((bs == NULL) || bs->read_only){
+        return NULL;
     }
-    block_store_request(bs, id);
-    
-    return id;
+    void *data = (void *)block_store_block_ptr_const(bs, block_id);
+    if((data != NULL) && (bs->cow != NULL)){
+        // a pointer that can be written through has to point at the device's own copy
+        data = cow_writable(bs, block_id, false);
+    }
+    if(data != NULL){
+        // there's no telling when the caller writes through it
+        mark_dirty(bs, block_id, 1);
+    }
+    return data;
 }
 
 ///
-/// Attempts to allocate the requested block id
-/// \param bs the block store object
-/// \block_id the requested block identifier
-/// \return boolean indicating succes of operation
+/// Returns a read only pointer straight into the device's storage for the given block
+/// \param bs BS device
+/// \param block_id The block
+/// \return Pointer to block_size bytes of block data, NULL on error
 ///
-bool block_store_request(block_store_t *const bs, const size_t block_id)
+const void *block_store_block_ptr_const(const block_store_t *const bs, const size_t block_id)
 {
-    //check for bad parameters, block id is equal to the block index
-    if((bs == NULL) || (block_id > BLOCK_STORE_AVAIL_BLOCKS)){
-        return false;
+    // the fbm blocks aren't handed out, writing through them would corrupt the device
+    // and the blocks of a file backed device don't stay put long enough to point at
+    if((bs == NULL) || (block_id >= bs->avail_blocks) || (bs->file != NULL)){
+        return NULL;
     }
-    // return false if the requested block is in use
-    if(bitmap_test(bs->fbm, block_id)){
-        return false;
+    if((bs->debug != NULL) && !bitmap_test(bs->fbm, block_id)){
+        debug_violation(bs, "asked for a pointer to a block that isn't allocated", block_id);
+        return NULL;
     }
-    // set the block corresponding to the block id to used, block 127 is the fbm
-    bitmap_set(bs->fbm, block_id);
-    return true;
+    return block_addr(bs, block_id);
 }
 
 ///
-/// Frees the specified block
+/// Pins a block and returns a pointer straight into its storage
 /// \param bs BS device
-/// \param block_id The block to free
+/// \param block_id The block
+/// \return Pointer to block_size bytes of block data, NULL on error
 ///
-void block_store_release(block_store_t *const bs, const size_t block_id)
+void *block_store_pin(block_store_t *const bs, const size_t block_id)
 {
-    if((bs != NULL) && (block_id <= BLOCK_STORE_AVAIL_BLOCKS)){
-        // set the given bit in the bitmap to zero
-        bitmap_reset(bs->fbm, block_id);
+    void *data = block_store_block_ptr(bs, block_id);
+    if((data != NULL) && (bs->debug != NULL)){
+        __atomic_fetch_add(&bs->debug->pins[block_id], 1, __ATOMIC_RELAXED);
     }
+    return data;
 }
 
 ///
-/// Counts the number of blocks marked as in use
+/// Drops a pin taken with block_store_pin
 /// \param bs BS device
-/// \return Total blocks in use, SIZE_MAX on error
+/// \param block_id The block
 ///
-size_t block_store_get_used_blocks(const block_store_t *const bs)
+void block_store_unpin(block_store_t *const bs, const size_t block_id)
 {
-    if(bs != NULL){
-        return bitmap_total_set(bs->fbm);
+    if((bs != NULL) && !bs->read_only && (block_id < bs->avail_blocks)){
+        // whatever went through the pin since it was taken is in the block now
+        mark_dirty(bs, block_id, 1);
+        if(bs->file == NULL){
+            journal_block(bs, block_id, block_addr(bs, block_id));
+        }
+    }
+    if((bs != NULL) && (bs->debug != NULL) && (block_id < bs->avail_blocks)){
+        uint32_t pins = __atomic_load_n(&bs->debug->pins[block_id], __ATOMIC_RELAXED);
+        do{
+            if(pins == 0){
+                debug_violation(bs, "unpinned a block that isn't pinned", block_id);
+                return;
+            }
+        }while(!__atomic_compare_exchange_n(&bs->debug->pins[block_id], &pins, pins - 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
     }
-    else { return SIZE_MAX; }
 }
 
 ///
-/// Counts the number of blocks marked free for use
+/// Turns debug mode on or off
 /// \param bs BS device
-/// \return Total blocks free, SIZE_MAX on error
+/// \param enable Whether debug mode should be on
+/// \return boolean indicating succes of operation
 ///
-size_t block_store_get_free_blocks(const block_store_t *const bs)
+bool block_store_set_debug(block_store_t *const bs, const bool enable)
 {
-    if(bs != NULL){
-        // calculate the total free blocks
-        return (BLOCK_STORE_AVAIL_BLOCKS) - bitmap_total_set(bs->fbm);
+    if(bs == NULL){
+        return false;
     }
-    else { return SIZE_MAX; }
+    if(enable && (bs->debug == NULL)){
+        struct debug_state *debug = (struct debug_state *)calloc(1, sizeof(struct debug_state));
+        if(debug == NULL){
+            return false;
+        }
+        debug->pins = (uint32_t *)calloc(bs->avail_blocks, sizeof(uint32_t));
+        debug->poisoned = bitmap_create(bs->avail_blocks);
+        if((debug->pins == NULL) || (debug->poisoned == NULL)){
+            free(debug->pins);
+            bitmap_destroy(debug->poisoned);
+            free(debug);
+            return false;
+        }
+        bs->debug = debug;
+    }
+    else if(!enable && (bs->debug != NULL)){
+        free(bs->debug->pins);
+        bitmap_destroy(bs->debug->poisoned);
+        free(bs->debug);
+        bs->debug = NULL;
+    }
+    return true;
 }
 
 ///
-/// Returns the total number of user-addressable blocks
-///  (since this is constant, you don't even need the bs object)
-/// \return Total blocks
+/// Counts the misuses debug mode has caught so far
+/// \param bs BS device
+/// \return Number of violations, SIZE_MAX on error or if debug mode is off
 ///
-size_t block_store_get_total_blocks()
+size_t block_store_get_debug_violations(const block_store_t *const bs)
 {
-    return BLOCK_STORE_AVAIL_BLOCKS;
+    if((bs == NULL) || (bs->debug == NULL)){
+        return SIZE_MAX;
+    }
+    return bs->debug->violations;
 }
 
 ///
-/// Reads data from the specified block and writes it to the designated buffer
+/// Starts journaling the device's changes against an image, or stops
 /// \param bs BS device
-/// \param block_id Source block id
-/// \param buffer Data buffer to write to
-/// \return Number of bytes read, 0 on error
+/// \param filename The image, its journal is filename.journal, NULL stops journaling
+/// \return boolean indicating succes of operation
 ///
-size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer)
+bool block_store_set_journal(block_store_t *const bs, const char *const filename)
 {
-    if((bs != NULL) && (block_id < BLOCK_STORE_NUM_BLOCKS) && (buffer != NULL)){
-        // copy the block specified by the block_id to the given buffer
-        memcpy(buffer, &bs->blocks[block_id], BLOCK_SIZE_BYTES);
-        return BLOCK_SIZE_BYTES;
+    if((bs == NULL) || bs->read_only){
+        return false;
     }
-    return 0;
+    journal_t *journal = NULL;
+    if(filename != NULL){
+        journal = journal_open(filename, bs->block_size, bs->num_blocks);
+        if(journal == NULL){
+            return false;
+        }
+    }
+    journal_close(bs->journal);
+    bs->journal = journal;
+    return true;
 }
 
 ///
-/// Reads data from the specified buffer and writes it to the designated block
+/// Makes every change since the last commit durable as one transaction
 /// \param bs BS device
-/// \param block_id Destination block id
-/// \param buffer Data buffer to read from
-/// \return Number of bytes written, 0 on error
+/// \return boolean indicating succes of operation
 ///
-size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer)
+bool block_store_commit(block_store_t *const bs)
 {
-    if((bs != NULL) && (block_id < BLOCK_STORE_NUM_BLOCKS) && (buffer != NULL)){
-        // write the data from the buffer to the block specified by the block_id
-        memcpy(&bs->blocks[block_id], buffer, BLOCK_SIZE_BYTES);
-        return BLOCK_SIZE_BYTES;
+    if((bs == NULL) || (bs->journal == NULL)){
+        return false;
     }
-    return 0;
+    return journal_commit(bs->journal);
+}
+
+// redoes one journaled change on a device being deserialized
+static void replay_apply(void *context, const journal_op_t op, const size_t block_id, const size_t count, const uint8_t *data){
+    block_store_t *bs = (block_store_t *)context;
+    if(op == JOURNAL_WRITE){
+        memcpy(block_addr(bs, block_id), data, bs->block_size);
+    }
+    else if(op == JOURNAL_ALLOCATE){
+        bitmap_set_range(bs->fbm, block_id, count);
+    }
+    else{
+        bitmap_reset_range(bs->fbm, block_id, count);
+    }
+}
+
+// the versioned image format written by block_store_save
+#define IMAGE_MAGIC "BSIMAGE"       // with its terminator, 8 bytes
+#define IMAGE_VERSION 1
+#define IMAGE_FLAG_COMPRESSED 0x1   // only allocated blocks, lz compressed a segment at a time
+#define IMAGE_SEGMENT_BYTES ((size_t)1 << 20) // device bytes per segment of a compressed image
+
+// what starts a versioned image, the blocks follow it
+struct image_header{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;   // bytes before the first block
+    uint64_t num_blocks;
+    uint64_t block_size;
+    uint64_t data_bytes;    // bytes of blocks after the header
+    uint32_t data_crc;      // crc32c of those bytes
+    uint32_t flags;         // IMAGE_FLAG_, an image with any other set is refused
+    uint32_t segment_blocks; // blocks per segment of a compressed image
+    uint8_t reserved[8];
+    uint32_t header_crc;    // crc32c of everything above
+};
+_Static_assert(sizeof(struct image_header) == 64, "the image header is 64 bytes on disk");
+
+// a compressed image has the fbm after its header, then one of these for each segment of
+// segment_blocks user blocks, each followed by its allocated blocks (in id order) as stored
+struct segment_header{
+    uint32_t stored;        // bytes that follow, the same as raw when compressing didn't pay
+    uint32_t raw;           // bytes of allocated blocks in the segment
+};
+
+// opens the file an image is written to
+// the journal's own image is a checkpoint: everything committed goes in, and the image is
+// written to filename.tmp and renamed over the old one by image_close, so a crash leaves
+// one or the other whole
+// returns NULL on error, otherwise path has to be handed to image_close
+static FILE *image_open(const block_store_t *const bs, const char *const filename, char **const path){
+    *path = (char *)filename;
+    if(journal_covers(bs->journal, filename)){
+        const size_t length = strlen(filename) + sizeof(".tmp");
+        *path = (char *)malloc(length);
+        if((*path == NULL) || !journal_commit(bs->journal)){
+            free(*path);
+            return NULL;
+        }
+        snprintf(*path, length, "%s.tmp", filename);
+    }
+    FILE *fp = fopen(*path, "w");
+    if((fp == NULL) && (*path != filename)){
+        free(*path);
+    }
+    return fp;
+}
+
+// closes a file from image_open, ok says whether everything went into it
+// returns false if the image didn't make it out whole
+static bool image_close(const block_store_t *const bs, const char *const filename, FILE *const fp, char *const path, bool ok){
+    if(path == filename){
+        // closing flushes the stream, a failure here means the data didn't make it out
+        return (fclose(fp) == 0) && ok;
+    }
+    // the image has to be on disk before the journal lets go of what's in it
+    ok = ok && (fflush(fp) == 0) && (fsync(fileno(fp)) == 0);
+    ok = (fclose(fp) == 0) && ok && (rename(path, filename) == 0) && journal_truncate(bs->journal);
+    if(!ok){
+        remove(path);
+    }
+    free(path);
+    return ok;
+}
+
+// reads bytes of image to dest a chunk at a time, checksumming as it goes
+static block_store_load_status_t load_bytes(FILE *const fp, uint8_t *const dest, const size_t bytes, const size_t chunk_size, uint32_t *const crc){
+    for(size_t done = 0; done < bytes; ){
+        const size_t length = (bytes - done < chunk_size) ? bytes - done : chunk_size;
+        if(fread(dest + done, 1, length, fp) != length){
+            return ferror(fp) ? BLOCK_STORE_LOAD_IO_ERROR : BLOCK_STORE_LOAD_TRUNCATED;
+        }
+        *crc = crc32c_update(*crc, dest + done, length);
+        done += length;
+    }
+    return BLOCK_STORE_LOAD_OK;
+}
+
+// reads the fbm and segments of a compressed image into the device, see block_store_save_compressed
+static block_store_load_status_t load_segments(FILE *const fp, block_store_t *const bs, const struct image_header *const header, const size_t chunk_size, uint32_t *const crc){
+    const size_t fbmBytes = bs->fbm_blocks << bs->block_shift;
+    const size_t segmentBlocks = header->segment_blocks;
+    if((header->data_bytes < fbmBytes) || (segmentBlocks == 0) || (segmentBlocks > (IMAGE_SEGMENT_BYTES >> bs->block_shift) + 1)){
+        return BLOCK_STORE_LOAD_CORRUPT;
+    }
+    // the fbm comes first, it's what says which blocks each segment holds
+    block_store_load_status_t status = load_bytes(fp, block_addr(bs, bs->fbm_start), fbmBytes, chunk_size, crc);
+    if(status != BLOCK_STORE_LOAD_OK){
+        return status;
+    }
+    bitmap_rebuild_summary(bs->fbm);
+    uint64_t remaining = header->data_bytes - fbmBytes;
+    uint8_t *stored = (uint8_t *)malloc(segmentBlocks << bs->block_shift);
+    uint8_t *raw = (uint8_t *)malloc(segmentBlocks << bs->block_shift);
+    if((stored == NULL) || (raw == NULL)){
+        status = BLOCK_STORE_LOAD_NO_MEMORY;
+    }
+    for(size_t start = 0; (status == BLOCK_STORE_LOAD_OK) && (start < bs->fbm_start); start += segmentBlocks){
+        const size_t end = (bs->fbm_start - start < segmentBlocks) ? bs->fbm_start : start + segmentBlocks;
+        const size_t allocated = bitmap_count_range(bs->fbm, start, end - start);
+        const size_t rawBytes = allocated << bs->block_shift;
+        struct segment_header segment;
+        if(remaining < sizeof(segment)){
+            status = BLOCK_STORE_LOAD_CORRUPT;
+            break;
+        }
+        status = load_bytes(fp, (uint8_t *)&segment, sizeof(segment), sizeof(segment), crc);
+        if((status == BLOCK_STORE_LOAD_OK) && ((segment.raw != rawBytes) || (segment.stored > segment.raw) ||
+                                               (segment.stored > remaining - sizeof(segment)))){
+            status = BLOCK_STORE_LOAD_CORRUPT;
+        }
+        if(status != BLOCK_STORE_LOAD_OK){
+            break;
+        }
+        remaining -= sizeof(segment) + segment.stored;
+        // a fully allocated segment is contiguous, so it decompresses straight into place
+        const bool contiguous = allocated == end - start;
+        uint8_t *dest = contiguous ? block_addr(bs, start) : raw;
+        status = load_bytes(fp, (segment.stored == segment.raw) ? dest : stored, segment.stored, chunk_size, crc);
+        if((status == BLOCK_STORE_LOAD_OK) && (segment.stored != segment.raw) &&
+           (lz_decompress(stored, segment.stored, dest, rawBytes) != rawBytes)){
+            status = BLOCK_STORE_LOAD_CORRUPT;
+        }
+        if((status == BLOCK_STORE_LOAD_OK) && !contiguous){
+            const uint8_t *from = raw;
+            bitmap_iter_t iter;
+            bitmap_iter_init(&iter, bs->fbm, start);
+            for(size_t id = bitmap_iter_next(&iter); id < end; id = bitmap_iter_next(&iter)){
+                memcpy(block_addr(bs, id), from, bs->block_size);
+                from += bs->block_size;
+            }
+        }
+    }
+    free(stored);
+    free(raw);
+    if((status == BLOCK_STORE_LOAD_OK) && (remaining != 0)){
+        status = BLOCK_STORE_LOAD_CORRUPT;
+    }
+    return status;
+}
+
+// checks the header of a versioned image and works out the device it holds
+static block_store_load_status_t load_header(const struct image_header *const header, const off_t file_size, size_t *const num_blocks, size_t *const block_size){
+    if(header->version != IMAGE_VERSION){
+        return BLOCK_STORE_LOAD_UNSUPPORTED;
+    }
+    if(crc32c_update(0, header, offsetof(struct image_header, header_crc)) != header->header_crc){
+        return BLOCK_STORE_LOAD_CORRUPT;
+    }
+    if((header->flags & ~(uint32_t)IMAGE_FLAG_COMPRESSED) || (header->header_size != sizeof(struct image_header))){
+        return BLOCK_STORE_LOAD_UNSUPPORTED;
+    }
+    unsigned shift;
+    size_t fbmBlocks;
+    if((header->num_blocks > SIZE_MAX) || (header->block_size > SIZE_MAX) ||
+       !device_geometry((size_t)header->num_blocks, (size_t)header->block_size, &shift, &fbmBlocks)){
+        return BLOCK_STORE_LOAD_BAD_GEOMETRY;
+    }
+    // a plain image holds every block, a compressed one can only be checked as it's read
+    if(!(header->flags & IMAGE_FLAG_COMPRESSED) && (header->data_bytes != (header->num_blocks << shift))){
+        return BLOCK_STORE_LOAD_BAD_GEOMETRY;
+    }
+    // compared this way round so a bogus data_bytes can't overflow
+    if((uint64_t)(file_size - (off_t)sizeof(struct image_header)) < header->data_bytes){
+        return BLOCK_STORE_LOAD_TRUNCATED;
+    }
+    if((uint64_t)(file_size - (off_t)sizeof(struct image_header)) > header->data_bytes){
+        return BLOCK_STORE_LOAD_CORRUPT;
+    }
+    *num_blocks = (size_t)header->num_blocks;
+    *block_size = (size_t)header->block_size;
+    return BLOCK_STORE_LOAD_OK;
+}
+
+// raw dumps of a default device from before the fbm moved to the end of the device kept it in this block
+#define LEGACY_FBM_BLOCK 127
+
+// whether the bytes of a block past where the fbm would end are all zero, as they are in the fbm's own block
+static bool fbm_tail_clear(const block_store_t *const bs, const size_t block_id){
+    const uint8_t *data = block_addr(bs, block_id);
+    for(size_t i = (bs->num_blocks + 7) >> 3; i < bs->block_size; i++){
+        if(data[i] != 0){
+            return false;
+        }
+    }
+    return true;
+}
+
+// checks the fbm of a raw dump, moving it where it goes now if the dump is from before it moved,
+// when block 127 becomes a free user block again
+// those devices let users have the last block, which the fbm needs now, so an image using it can't be brought over
+static block_store_load_status_t load_raw_fbm(block_store_t *const bs){
+    // whatever wrote the image marked the fbm's own blocks in use
+    const bool marked = bitmap_ffz_from(bs->fbm, bs->fbm_start) == SIZE_MAX;
+    if(marked && fbm_tail_clear(bs, bs->fbm_start)){
+        return BLOCK_STORE_LOAD_OK;
+    }
+    uint8_t *const old = block_addr(bs, LEGACY_FBM_BLOCK);
+    bitmap_t *legacy = bitmap_overlay(bs->num_blocks, old);
+    if(legacy == NULL){
+        return BLOCK_STORE_LOAD_NO_MEMORY;
+    }
+    block_store_load_status_t status = BLOCK_STORE_LOAD_OK;
+    if(!bitmap_test(legacy, LEGACY_FBM_BLOCK) || !fbm_tail_clear(bs, LEGACY_FBM_BLOCK)){
+        // not an old image either
+        status = marked ? BLOCK_STORE_LOAD_OK : BLOCK_STORE_LOAD_CORRUPT;
+        bitmap_destroy(legacy);
+        return status;
+    }
+    if(bitmap_test(legacy, bs->fbm_start)){
+        status = BLOCK_STORE_LOAD_UNSUPPORTED;
+    }
+    bitmap_destroy(legacy);
+    if(status != BLOCK_STORE_LOAD_OK){
+        return status;
+    }
+    // the last block was free, so whatever it held can go
+    uint8_t *const fbm = block_addr(bs, bs->fbm_start);
+    memset(fbm, 0, bs->fbm_blocks << bs->block_shift);
+    memcpy(fbm, old, (bs->num_blocks + 7) >> 3);
+    memset(old, 0, bs->block_size);
+    bitmap_reset(bs->fbm, LEGACY_FBM_BLOCK);
+    bitmap_set_range(bs->fbm, bs->fbm_start, bs->fbm_blocks);
+    bitmap_rebuild_summary(bs->fbm);
+    return BLOCK_STORE_LOAD_OK;
+}
+
+// loads either kind of image from an open file into a new device
+// the caller closes the file, the device is only handed back if it loaded cleanly
+static block_store_load_status_t load_image(FILE *const fp, const char *const filename, const size_t chunk_size, block_store_t **const loaded){
+    struct stat st;
+    if(fstat(fileno(fp), &st) != 0){
+        return BLOCK_STORE_LOAD_IO_ERROR;
+    }
+    // a versioned image says so up front, anything else has to be a raw dump of a default device
+    struct image_header header;
+    const bool versioned = (st.st_size >= (off_t)sizeof(header.magic)) && (fread(header.magic, sizeof(header.magic), 1, fp) == 1) &&
+                           (memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) == 0);
+    size_t numBlocks = BLOCK_STORE_NUM_BLOCKS, blockSize = BLOCK_SIZE_BYTES;
+    if(versioned){
+        if(fread(header.magic + sizeof(header.magic), sizeof(header) - sizeof(header.magic), 1, fp) != 1){
+            return ferror(fp) ? BLOCK_STORE_LOAD_IO_ERROR : BLOCK_STORE_LOAD_TRUNCATED;
+        }
+        const block_store_load_status_t status = load_header(&header, st.st_size, &numBlocks, &blockSize);
+        if(status != BLOCK_STORE_LOAD_OK){
+            return status;
+        }
+    }
+    else if(st.st_size != BLOCK_STORE_NUM_BYTES){
+        // a raw dump has no header to go by, only its exact size
+        return (st.st_size < BLOCK_STORE_NUM_BYTES) ? BLOCK_STORE_LOAD_TRUNCATED : BLOCK_STORE_LOAD_NOT_AN_IMAGE;
+    }
+    else if(fseek(fp, 0, SEEK_SET) != 0){
+        return BLOCK_STORE_LOAD_IO_ERROR;
+    }
+
+    block_store_t *bs = block_store_create_ex(numBlocks, blockSize);
+    if(bs == NULL){
+        return BLOCK_STORE_LOAD_NO_MEMORY;
+    }
+    uint32_t crc = 0;
+    block_store_load_status_t status;
+    if(versioned && (header.flags & IMAGE_FLAG_COMPRESSED)){
+        status = load_segments(fp, bs, &header, chunk_size, &crc);
+    }
+    else{
+        status = load_bytes(fp, bs->blocks, numBlocks << bs->block_shift, chunk_size, &crc);
+    }
+    if((status == BLOCK_STORE_LOAD_OK) && versioned && (crc != header.data_crc)){
+        status = BLOCK_STORE_LOAD_CORRUPT;
+    }
+    if(status == BLOCK_STORE_LOAD_OK){
+        // the fbm was loaded straight into the overlay, so its summary is stale
+        bitmap_rebuild_summary(bs->fbm);
+        // and whatever wrote the image would have marked the fbm's own blocks in use,
+        // a raw dump may also be from when the fbm lived in the middle of the device
+        if(!versioned){
+            status = load_raw_fbm(bs);
+        }
+        else if(bitmap_ffz_from(bs->fbm, bs->fbm_start) != SIZE_MAX){
+            status = BLOCK_STORE_LOAD_CORRUPT;
+        }
+    }
+    if(status != BLOCK_STORE_LOAD_OK){
+        device_free(bs);
+        return status;
+    }
+    // then whatever was committed to the journal since the image was written
+    if(journal_replay(filename, bs->block_size, bs->num_blocks, replay_apply, bs) > 0){
+        bitmap_rebuild_summary(bs->fbm);
+    }
+    used_recount(bs);
+    extents_rebuild(bs);
+    *loaded = bs;
+    return BLOCK_STORE_LOAD_OK;
 }
 
 ///
-/// Imports BS device from the given file - for grads/bonus
-/// \param filename The file to load
+/// Loads a BS device from an image, reading it a chunk at a time and checking it as it goes
+/// \param filename The image, from block_store_save or block_store_serialize
+/// \param chunk_size Bytes to read at a time, 0 for BLOCK_STORE_LOAD_CHUNK
+/// \param status Receives why the load failed (or BLOCK_STORE_LOAD_OK), may be NULL
 /// \return Pointer to new BS device, NULL on error
 ///
-block_store_t *block_store_deserialize(const char *const filename)
+block_store_t *block_store_load(const char *const filename, const size_t chunk_size, block_store_load_status_t *const status)
 {
-    if(filename == NULL){
-        return NULL;
+    block_store_t *bs = NULL;
+    block_store_load_status_t result = BLOCK_STORE_LOAD_BAD_ARGUMENT;
+    if(filename != NULL){
+        FILE *fp = fopen(filename, "rb");
+        result = BLOCK_STORE_LOAD_IO_ERROR;
+        if(fp != NULL){
+            result = load_image(fp, filename, (chunk_size != 0) ? chunk_size : BLOCK_STORE_LOAD_CHUNK, &bs);
+            fclose(fp);
+        }
     }
-    FILE * fp;
-    fp = fopen (filename, "r");
-    // return NULL if error opening file
-    if(fp == NULL){
-        return NULL;
-    }
-    
-    block_store_t * bs = block_store_create();
-    // read BLOCK_STORE_NUM_BLOCKS number of blocks, each of size BLOCK_SIZE_BYTES
-    // from the file to the empty block store array
-    int elementsRead = fread(bs->blocks, BLOCK_SIZE_BYTES, BLOCK_STORE_NUM_BLOCKS, fp);
-    // an error occured if all of the blocks were not read from the file
-    if(elementsRead != BLOCK_STORE_NUM_BLOCKS){
-        printf("Error reading file\n");
+    if(status != NULL){
+        *status = result;
     }
     return bs;
 }
 
+///
+/// Describes a block_store_load status
+/// \param status The status
+/// \return A short description, never NULL
+///
+const char *block_store_load_status_string(const block_store_load_status_t status)
+{
+    switch(status){
+        case BLOCK_STORE_LOAD_OK: return "ok";
+        case BLOCK_STORE_LOAD_BAD_ARGUMENT: return "bad argument";
+        case BLOCK_STORE_LOAD_IO_ERROR: return "couldn't open or read the image";
+        case BLOCK_STORE_LOAD_NOT_AN_IMAGE: return "not a block store image";
+        case BLOCK_STORE_LOAD_UNSUPPORTED: return "image version or flags not supported";
+        case BLOCK_STORE_LOAD_BAD_GEOMETRY: return "image geometry is invalid";
+        case BLOCK_STORE_LOAD_TRUNCATED: return "image is truncated";
+        case BLOCK_STORE_LOAD_CORRUPT: return "image is corrupt";
+        case BLOCK_STORE_LOAD_NO_MEMORY: return "out of memory";
+    }
+    return "unknown status";
+}
+
+///
+/// Imports BS device from the given file - for grads/bonus
+/// \param filename The file to load
+/// \return Pointer to new BS device, NULL on error
+///
+block_store_t *block_store_deserialize(const char *const filename)
+{
+    return block_store_load(filename, 0, NULL);
+}
+
 ///
 /// Writes the entirety of the BS device to file, overwriting it if it exists - for grads/bonus
 /// \param bs BS device
@@ -227,19 +2761,344 @@ block_store_t *block_store_deserialize(const char *const filename)
 ///
 size_t block_store_serialize(const block_store_t *const bs, const char *const filename)
 {
-    if(filename == NULL){
+    if((bs == NULL) || (filename == NULL)){
         return 0;
     }
-    FILE * fp;
-    fp = fopen (filename, "w");
+    char *path;
+    FILE *fp = image_open(bs, filename, &path);
     // return 0 if error opening file
     if(fp == NULL){
         return 0;
     }
     // write the enitre block store array the the file
-    int elementsWritten = fwrite(bs->blocks, BLOCK_SIZE_BYTES, BLOCK_STORE_NUM_BLOCKS, fp);
-    
-    // elements written should be the same as BLOCK_STORE_NUM_BLOCKS
+    size_t elementsWritten = 0;
+    if(bs->blocks != NULL){
+        elementsWritten = fwrite(bs->blocks, bs->block_size, bs->num_blocks, fp);
+    }
+    else{
+        // a file backed device isn't in memory and a copy on write one isn't in one piece,
+        // so they go out a block at a time
+        uint8_t *buffer = (uint8_t *)malloc(bs->block_size);
+        while((buffer != NULL) && (elementsWritten < bs->num_blocks) && block_store_read(bs, elementsWritten, buffer) &&
+              (fwrite(buffer, bs->block_size, 1, fp) == 1)){
+            elementsWritten++;
+        }
+        free(buffer);
+    }
+    if(!image_close(bs, filename, fp, path, elementsWritten == bs->num_blocks)){
+        return 0;
+    }
     // returns the total number of bytes written
-    return elementsWritten*BLOCK_SIZE_BYTES;
+    return elementsWritten*bs->block_size;
+}
+
+///
+/// Writes the BS device to a versioned image, overwriting it if it exists
+/// \param bs BS device
+/// \param filename The file to write to
+/// \return Number of bytes written, header included, 0 on error
+///
+size_t block_store_save(const block_store_t *const bs, const char *const filename)
+{
+    if((bs == NULL) || (filename == NULL)){
+        return 0;
+    }
+    char *path;
+    FILE *fp = image_open(bs, filename, &path);
+    if(fp == NULL){
+        return 0;
+    }
+    struct image_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.header_size = sizeof(header);
+    header.num_blocks = bs->num_blocks;
+    header.block_size = bs->block_size;
+    header.data_bytes = (uint64_t)bs->num_blocks << bs->block_shift;
+    // the header is written again at the end, once the checksum is known
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    uint8_t *buffer = (bs->blocks == NULL) ? (uint8_t *)malloc(bs->block_size) : NULL;
+    ok = ok && ((bs->blocks != NULL) || (buffer != NULL));
+    // in memory the blocks go out a chunk at a time, checksummed while they're in the cache
+    const size_t chunkBlocks = (BLOCK_STORE_LOAD_CHUNK >> bs->block_shift) + 1;
+    uint32_t crc = 0;
+    for(size_t id = 0; ok && (id < bs->num_blocks); ){
+        size_t count = 1;
+        const uint8_t *data = buffer;
+        if(bs->blocks != NULL){
+            count = (bs->num_blocks - id < chunkBlocks) ? bs->num_blocks - id : chunkBlocks;
+            data = block_addr(bs, id);
+        }
+        else if(!block_store_read(bs, id, buffer)){
+            ok = false;
+            break;
+        }
+        crc = crc32c_update(crc, data, count << bs->block_shift);
+        ok = fwrite(data, count << bs->block_shift, 1, fp) == 1;
+        id += count;
+    }
+    free(buffer);
+    header.data_crc = crc;
+    header.header_crc = crc32c_update(0, &header, offsetof(struct image_header, header_crc));
+    ok = ok && (fseek(fp, 0, SEEK_SET) == 0) && (fwrite(&header, sizeof(header), 1, fp) == 1);
+    if(!image_close(bs, filename, fp, path, ok)){
+        return 0;
+    }
+    return sizeof(header) + (bs->num_blocks << bs->block_shift);
+}
+
+// a run of segments of a compressed image, compressed by several threads at once
+struct save_batch{
+    const block_store_t *bs;
+    size_t segment_blocks;
+    size_t first;           // the batch's first segment
+    size_t count;           // segments in the batch
+    size_t next;            // the next one a thread takes, counts up atomically
+    struct save_segment *segments;
+};
+
+// one compressed segment waiting to be written
+struct save_segment{
+    struct segment_header header;
+    uint8_t *data;          // header.stored bytes
+    bool ok;
+};
+
+// gathers segment index of a batch's allocated blocks into gather and compresses them
+static void save_compress(struct save_batch *const batch, const size_t index, uint8_t *const gather){
+    const block_store_t *bs = batch->bs;
+    struct save_segment *segment = &batch->segments[index];
+    const size_t start = (batch->first + index) * batch->segment_blocks;
+    const size_t end = (bs->fbm_start - start < batch->segment_blocks) ? bs->fbm_start : start + batch->segment_blocks;
+    size_t rawBytes = 0;
+    segment->ok = true;
+    bitmap_iter_t iter;
+    bitmap_iter_init(&iter, bs->fbm, start);
+    for(size_t id = bitmap_iter_next(&iter); segment->ok && (id < end); id = bitmap_iter_next(&iter)){
+        if(bs->file == NULL){
+            memcpy(gather + rawBytes, block_addr(bs, id), bs->block_size);
+        }
+        else{
+            segment->ok = block_store_read(bs, id, gather + rawBytes) != 0;
+        }
+        rawBytes += bs->block_size;
+    }
+    segment->header.raw = (uint32_t)rawBytes;
+    segment->header.stored = 0;
+    if(!segment->ok || (rawBytes == 0)){
+        return;
+    }
+    segment->data = (uint8_t *)malloc(lz_bound(rawBytes));
+    if(segment->data == NULL){
+        segment->ok = false;
+        return;
+    }
+    size_t stored = lz_compress(gather, rawBytes, segment->data, lz_bound(rawBytes));
+    if((stored == 0) || (stored >= rawBytes)){
+        // noise doesn't compress, it goes in as it is
+        memcpy(segment->data, gather, rawBytes);
+        stored = rawBytes;
+    }
+    segment->header.stored = (uint32_t)stored;
+}
+
+// takes segments off a batch until there are none left
+static void *save_worker(void *arg){
+    struct save_batch *batch = (struct save_batch *)arg;
+    uint8_t *gather = (uint8_t *)malloc(batch->segment_blocks << batch->bs->block_shift);
+    for(;;){
+        const size_t index = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        if(index >= batch->count){
+            break;
+        }
+        if(gather != NULL){
+            save_compress(batch, index, gather);
+        }
+        else{
+            batch->segments[index].ok = false;
+        }
+    }
+    free(gather);
+    return NULL;
+}
+
+///
+/// Writes the BS device to a compressed image, overwriting it if it exists
+/// \param bs BS device
+/// \param filename The file to write to
+/// \param threads Threads compressing at once, 0 for one per processor
+/// \return Number of bytes written, header included, 0 on error
+///
+size_t block_store_save_compressed(const block_store_t *const bs, const char *const filename, size_t threads)
+{
+    // a segment's sizes have to fit its 32 bit header
+    if((bs == NULL) || (filename == NULL) || (bs->block_size > IMAGE_SEGMENT_BYTES)){
+        return 0;
+    }
+    if(threads == 0){
+        const long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (processors > 0) ? (size_t)processors : 1;
+    }
+    threads = (threads > 64) ? 64 : threads;
+    char *path;
+    FILE *fp = image_open(bs, filename, &path);
+    if(fp == NULL){
+        return 0;
+    }
+    struct image_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.header_size = sizeof(header);
+    header.num_blocks = bs->num_blocks;
+    header.block_size = bs->block_size;
+    header.flags = IMAGE_FLAG_COMPRESSED;
+    header.segment_blocks = (uint32_t)(IMAGE_SEGMENT_BYTES >> bs->block_shift);
+    // the header is written again at the end, once the sizes and checksum are known
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    const uint8_t *fbm = (bs->file != NULL) ? bs->file->fbm : block_addr(bs, bs->fbm_start);
+    const size_t fbmBytes = bs->fbm_blocks << bs->block_shift;
+    ok = ok && (fwrite(fbm, fbmBytes, 1, fp) == 1);
+    uint32_t crc = crc32c_update(0, fbm, fbmBytes);
+    uint64_t dataBytes = fbmBytes;
+
+    // a few segments per thread at a time, so what's waiting to be written stays bounded
+    const size_t segmentCount = (bs->fbm_start + header.segment_blocks - 1) / header.segment_blocks;
+    const size_t batchSize = threads * 4;
+    struct save_segment *segments = (struct save_segment *)calloc(batchSize, sizeof(struct save_segment));
+    pthread_t *workers = (pthread_t *)calloc(threads, sizeof(pthread_t));
+    ok = ok && (segments != NULL) && (workers != NULL);
+    for(size_t first = 0; ok && (first < segmentCount); first += batchSize){
+        struct save_batch batch = {bs, header.segment_blocks, first, 0, 0, segments};
+        batch.count = (segmentCount - first < batchSize) ? segmentCount - first : batchSize;
+        memset(segments, 0, batch.count * sizeof(struct save_segment));
+        // this thread works too, so a thread that won't start only slows things down
+        size_t started = 0;
+        while((started + 1 < threads) && (pthread_create(&workers[started], NULL, save_worker, &batch) == 0)){
+            started++;
+        }
+        save_worker(&batch);
+        for(size_t i = 0; i < started; i++){
+            pthread_join(workers[i], NULL);
+        }
+        for(size_t i = 0; i < batch.count; i++){
+            struct save_segment *segment = &segments[i];
+            ok = ok && segment->ok && (fwrite(&segment->header, sizeof(segment->header), 1, fp) == 1) &&
+                 ((segment->header.stored == 0) || (fwrite(segment->data, segment->header.stored, 1, fp) == 1));
+            if(ok){
+                crc = crc32c_update(crc, &segment->header, sizeof(segment->header));
+                crc = crc32c_update(crc, segment->data, segment->header.stored);
+                dataBytes += sizeof(segment->header) + segment->header.stored;
+            }
+            free(segment->data);
+        }
+    }
+    free(segments);
+    free(workers);
+    header.data_bytes = dataBytes;
+    header.data_crc = crc;
+    header.header_crc = crc32c_update(0, &header, offsetof(struct image_header, header_crc));
+    ok = ok && (fseek(fp, 0, SEEK_SET) == 0) && (fwrite(&header, sizeof(header), 1, fp) == 1);
+    if(!image_close(bs, filename, fp, path, ok)){
+        return 0;
+    }
+    return sizeof(header) + dataBytes;
+}
+
+// writes blocks [start, start + count) to the image at their own offsets
+// returns false if any of them didn't make it
+static bool write_run(const block_store_t *const bs, const int fd, const size_t start, const size_t count, uint8_t *const buffer){
+    if(bs->blocks != NULL){
+        // the device is in one piece in memory, so a whole run goes out in one call
+        const size_t bytes = count << bs->block_shift;
+        size_t done = 0;
+        while(done < bytes){
+            const ssize_t written = pwrite(fd, block_addr(bs, start) + done, bytes - done, (off_t)((start << bs->block_shift) + done));
+            if(written <= 0){
+                return false;
+            }
+            done += (size_t)written;
+        }
+        return true;
+    }
+    for(size_t id = start; id < start + count; id++){
+        if(!block_store_read(bs, id, buffer) ||
+           (pwrite(fd, buffer, bs->block_size, (off_t)(id << bs->block_shift)) != (ssize_t)bs->block_size)){
+            return false;
+        }
+    }
+    return true;
+}
+
+///
+/// Brings an image of the BS device up to date, writing only the blocks changed since the last call
+/// \param bs BS device
+/// \param filename The image to update
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_serialize_incremental(const block_store_t *const bs, const char *const filename)
+{
+    if((bs == NULL) || (filename == NULL)){
+        return 0;
+    }
+    // into the journal's own image is a checkpoint, everything committed has to go in,
+    // and if it's cut short replaying the journal redoes every block it was writing
+    const bool checkpoint = journal_covers(bs->journal, filename);
+    if(checkpoint && !journal_commit(bs->journal)){
+        return 0;
+    }
+    int fd = open(filename, O_WRONLY | O_CREAT, 0644);
+    if(fd < 0){
+        return 0;
+    }
+    // a new (or short) image is zero filled up to the device size, so untouched blocks read back as zeros
+    const off_t imageSize = (off_t)(bs->num_blocks << bs->block_shift);
+    struct stat st;
+    if((fstat(fd, &st) != 0) || ((st.st_size != imageSize) && (ftruncate(fd, imageSize) != 0))){
+        close(fd);
+        return 0;
+    }
+    // write_run goes a block at a time through this unless the blocks are in one piece
+    uint8_t *buffer = (bs->blocks == NULL) ? (uint8_t *)malloc(bs->block_size) : NULL;
+    if((bs->blocks == NULL) && (buffer == NULL)){
+        close(fd);
+        return 0;
+    }
+    size_t bytesWritten = 0;
+    bool ok = true;
+    // dirty user blocks go out a run at a time, the fbm is small and always goes out last
+    size_t start = bitmap_ffs(bs->dirty);
+    while(ok && (start < bs->fbm_start)){
+        size_t end = bitmap_ffz_from(bs->dirty, start);
+        end = ((end == SIZE_MAX) || (end > bs->fbm_start)) ? bs->fbm_start : end;
+        // cleared before the copy, so a block written meanwhile is caught by the next call
+        if(bs->concurrent){
+            bitmap_reset_range_atomic(bs->dirty, start, end - start);
+        }
+        else{
+            bitmap_reset_range(bs->dirty, start, end - start);
+        }
+        if(!write_run(bs, fd, start, end - start, buffer)){
+            // still dirty, the next call tries again
+            mark_dirty(bs, start, end - start);
+            ok = false;
+            break;
+        }
+        bytesWritten += (end - start) << bs->block_shift;
+        start = bitmap_ffs_from(bs->dirty, end);
+    }
+    if(ok && write_run(bs, fd, bs->fbm_start, bs->fbm_blocks, buffer)){
+        bytesWritten += bs->fbm_blocks << bs->block_shift;
+    }
+    else{
+        ok = false;
+    }
+    free(buffer);
+    // the image has to be on disk before the journal lets go of what's in it
+    ok = ok && (!checkpoint || (fsync(fd) == 0));
+    if((close(fd) != 0) || !ok || (checkpoint && !journal_truncate(bs->journal))){
+        return 0;
+    }
+    return bytesWritten;
 }
@@ -0,0 +1,262 @@
+#include <stdint.h>
+#include "block_store_sharded.h"
+
+struct block_store_sharded{
+    size_t shard_count;
+    size_t shard_blocks;        // user blocks on each shard, they all share one geometry
+    block_store_route_t route;
+    block_store_t **shards;
+};
+
+// every thread gets a slot the first time it allocates, which picks its home shard
+// these are per thread, not per device, so routing never writes to memory other threads read
+static size_t next_slot;
+static _Thread_local size_t thread_slot = SIZE_MAX;
+static _Thread_local size_t thread_turn;
+
+// the shard a thread should try first
+static size_t route_shard(const block_store_sharded_t *const sbs){
+    if(thread_slot == SIZE_MAX){
+        thread_slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED);
+        thread_turn = thread_slot;
+    }
+    if(sbs->route == BLOCK_STORE_ROUTE_THREAD){
+        return thread_slot % sbs->shard_count;
+    }
+    return thread_turn++ % sbs->shard_count;
+}
+
+// splits a global id into its shard and the id on that shard
+// returns false if the id isn't on the device
+static inline bool split_id(const block_store_sharded_t *const sbs, const size_t block_id, size_t *const shard, size_t *const local){
+    if(block_id / sbs->shard_count >= sbs->shard_blocks){
+        return false;
+    }
+    *shard = block_id % sbs->shard_count;
+    *local = block_id / sbs->shard_count;
+    return true;
+}
+
+///
+/// Creates a sharded device, every shard is in concurrent mode and has the same geometry
+/// \param shard_count Number of shards
+/// \param num_blocks Total number of blocks on each shard, FBM included
+/// \param block_size Bytes per block, same rules as block_store_create_ex
+/// \return Pointer to the new sharded device, NULL on error
+///
+block_store_sharded_t *block_store_sharded_create(const size_t shard_count, const size_t num_blocks, const size_t block_size)
+{
+    if(shard_count == 0){
+        return NULL;
+    }
+    block_store_sharded_t *sbs = (block_store_sharded_t *)calloc(1, sizeof(block_store_sharded_t));
+    if(sbs == NULL){
+        return NULL;
+    }
+    sbs->shard_count = shard_count;
+    sbs->shards = (block_store_t **)calloc(shard_count, sizeof(block_store_t *));
+    if(sbs->shards == NULL){
+        free(sbs);
+        return NULL;
+    }
+    for(size_t i = 0; i < shard_count; i++){
+        sbs->shards[i] = block_store_create_ex(num_blocks, block_size);
+        if((sbs->shards[i] == NULL) || !block_store_set_concurrent(sbs->shards[i], true)){
+            block_store_sharded_destroy(sbs);
+            return NULL;
+        }
+    }
+    sbs->shard_blocks = block_store_get_total_blocks(sbs->shards[0]);
+    // the global id space has to fit in a size_t with SIZE_MAX left over for errors
+    if(sbs->shard_blocks > (SIZE_MAX - 1) / shard_count){
+        block_store_sharded_destroy(sbs);
+        return NULL;
+    }
+    return sbs;
+}
+
+///
+/// Destroys the sharded device and all of its shards
+/// \param sbs Sharded device
+///
+void block_store_sharded_destroy(block_store_sharded_t *const sbs)
+{
+    if(sbs != NULL){
+        for(size_t i = 0; i < sbs->shard_count; i++){
+            block_store_destroy(sbs->shards[i]);
+        }
+        free(sbs->shards);
+        free(sbs);
+    }
+}
+
+///
+/// Sets how allocations are routed to shards
+/// \param sbs Sharded device
+/// \param route The routing policy
+/// \return boolean indicating succes of operation
+///
+bool block_store_sharded_set_routing(block_store_sharded_t *const sbs, const block_store_route_t route)
+{
+    if((sbs == NULL) || ((route != BLOCK_STORE_ROUTE_ROUND_ROBIN) && (route != BLOCK_STORE_ROUTE_THREAD))){
+        return false;
+    }
+    sbs->route = route;
+    return true;
+}
+
+///
+/// Returns one of the shards
+/// \param sbs Sharded device
+/// \param index The shard
+/// \return The shard, NULL on error
+///
+block_store_t *block_store_sharded_get_shard(block_store_sharded_t *const sbs, const size_t index)
+{
+    if((sbs == NULL) || (index >= sbs->shard_count)){
+        return NULL;
+    }
+    return sbs->shards[index];
+}
+
+///
+/// Returns the number of shards
+/// \param sbs Sharded device
+/// \return Number of shards, 0 on error
+///
+size_t block_store_sharded_get_shard_count(const block_store_sharded_t *const sbs)
+{
+    return (sbs != NULL) ? sbs->shard_count : 0;
+}
+
+///
+/// Allocates a free block from the shard the routing policy picks
+/// \param sbs Sharded device
+/// \return Allocated block's global id, SIZE_MAX on error
+///
+size_t block_store_sharded_allocate(block_store_sharded_t *const sbs)
+{
+    if(sbs == NULL){
+        return SIZE_MAX;
+    }
+    // a full shard sends us on to the next one, so this only fails once they're all full
+    const size_t first = route_shard(sbs);
+    for(size_t i = 0; i < sbs->shard_count; i++){
+        const size_t shard = (first + i) % sbs->shard_count;
+        const size_t local = block_store_allocate(sbs->shards[shard]);
+        if(local != SIZE_MAX){
+            return local * sbs->shard_count + shard;
+        }
+    }
+    return SIZE_MAX;
+}
+
+///
+/// Attempts to allocate the requested block id
+/// \param sbs Sharded device
+/// \param block_id Global block id
+/// \return boolean indicating succes of operation
+///
+bool block_store_sharded_request(block_store_sharded_t *const sbs, const size_t block_id)
+{
+    size_t shard, local;
+    if((sbs == NULL) || !split_id(sbs, block_id, &shard, &local)){
+        return false;
+    }
+    return block_store_request(sbs->shards[shard], local);
+}
+
+///
+/// Frees the specified block
+/// \param sbs Sharded device
+/// \param block_id Global block id
+///
+void block_store_sharded_release(block_store_sharded_t *const sbs, const size_t block_id)
+{
+    size_t shard, local;
+    if((sbs != NULL) && split_id(sbs, block_id, &shard, &local)){
+        block_store_release(sbs->shards[shard], local);
+    }
+}
+
+///
+/// Counts the number of blocks marked as in use over all shards
+/// \param sbs Sharded device
+/// \return Total blocks in use, SIZE_MAX on error
+///
+size_t block_store_sharded_get_used_blocks(const block_store_sharded_t *const sbs)
+{
+    if(sbs == NULL){
+        return SIZE_MAX;
+    }
+    size_t used = 0;
+    for(size_t i = 0; i < sbs->shard_count; i++){
+        used += block_store_get_used_blocks(sbs->shards[i]);
+    }
+    return used;
+}
+
+///
+/// Counts the number of blocks marked free for use over all shards
+/// \param sbs Sharded device
+/// \return Total blocks free, SIZE_MAX on error
+///
+size_t block_store_sharded_get_free_blocks(const block_store_sharded_t *const sbs)
+{
+    if(sbs == NULL){
+        return SIZE_MAX;
+    }
+    return block_store_sharded_get_total_blocks(sbs) - block_store_sharded_get_used_blocks(sbs);
+}
+
+///
+/// Returns the total number of user-addressable blocks
+/// \param sbs Sharded device
+/// \return Total blocks, SIZE_MAX on error
+///
+size_t block_store_sharded_get_total_blocks(const block_store_sharded_t *const sbs)
+{
+    return (sbs != NULL) ? sbs->shard_blocks * sbs->shard_count : SIZE_MAX;
+}
+
+///
+/// Returns the size of each block
+/// \param sbs Sharded device
+/// \return Bytes per block, 0 on error
+///
+size_t block_store_sharded_get_block_size(const block_store_sharded_t *const sbs)
+{
+    return (sbs != NULL) ? block_store_get_block_size(sbs->shards[0]) : 0;
+}
+
+///
+/// Reads data from the specified block and writes it to the designated buffer
+/// \param sbs Sharded device
+/// \param block_id Global source block id
+/// \param buffer Data buffer to write to
+/// \return Number of bytes read, 0 on error
+///
+size_t block_store_sharded_read(const block_store_sharded_t *const sbs, const size_t block_id, void *buffer)
+{
+    size_t shard, local;
+    if((sbs == NULL) || !split_id(sbs, block_id, &shard, &local)){
+        return 0;
+    }
+    return block_store_read(sbs->shards[shard], local, buffer);
+}
+
+///
+/// Reads data from the specified buffer and writes it to the designated block
+/// \param sbs Sharded device
+/// \param block_id Global destination block id
+/// \param buffer Data buffer to read from
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_sharded_write(block_store_sharded_t *const sbs, const size_t block_id, const void *buffer)
+{
+    size_t shard, local;
+    if((sbs == NULL) || !split_id(sbs, block_id, &shard, &local)){
+        return 0;
+    }
+    return block_store_write(sbs->shards[shard], local, buffer);
+}
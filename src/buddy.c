@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include "buddy.h"
+
+// enough orders for any device a size_t can count
+#define BUDDY_ORDERS 64
+
+struct buddy{
+    size_t blocks;
+    unsigned orders;                // chunks come in orders [0, orders)
+    // bit i of busy[k] is clear when blocks [i << k, (i + 1) << k) are a free chunk
+    // it's the inverse of a free list so bitmap_ffz and its summary do the searching
+    bitmap_t *busy[BUDDY_ORDERS];
+};
+
+// log2 rounded down, n > 0
+static inline unsigned floor_log2(const size_t n){
+    return (unsigned)(63 - __builtin_clzll((unsigned long long)n));
+}
+
+// whether chunk idx of the given order exists and is free
+static inline bool chunk_free(const buddy_t *const buddy, const unsigned order, const size_t idx){
+    return (idx < bitmap_get_bits(buddy->busy[order])) && !bitmap_test(buddy->busy[order], idx);
+}
+
+// the order of the free chunk holding a block, buddy->orders if it isn't free
+static unsigned containing_order(const buddy_t *const buddy, const size_t block_id){
+    unsigned order = 0;
+    while((order < buddy->orders) && !chunk_free(buddy, order, block_id >> order)){
+        order++;
+    }
+    return order;
+}
+
+// frees one aligned chunk, merging it with its buddy for as long as the buddy is free too
+static void chunk_release(buddy_t *const buddy, const size_t start, unsigned order){
+    size_t idx = start >> order;
+    // two chunks that both exist always have a parent that exists
+    while((order + 1 < buddy->orders) && chunk_free(buddy, order, idx ^ 1)){
+        bitmap_set(buddy->busy[order], idx ^ 1);
+        idx >>= 1;
+        order++;
+    }
+    bitmap_reset(buddy->busy[order], idx);
+}
+
+///
+/// Puts blocks back in the index, merging chunks with their buddies where they can
+/// \param buddy The index
+/// \param start First block, none of them may be free in the index
+/// \param count Number of blocks
+///
+void buddy_release(buddy_t *const buddy, const size_t start, const size_t count){
+    // cut the range into the largest aligned chunks that fit, left to right
+    const size_t end = start + count;
+    for(size_t pos = start; pos < end; ){
+        unsigned order = floor_log2(end - pos);
+        if((pos != 0) && ((unsigned)__builtin_ctzll(pos) < order)){
+            order = (unsigned)__builtin_ctzll(pos);
+        }
+        chunk_release(buddy, pos, order);
+        pos += (size_t)1 << order;
+    }
+}
+
+///
+/// Takes blocks out of the index, splitting the chunks they were part of
+/// \param buddy The index
+/// \param start First block, all of them have to be free in the index
+/// \param count Number of blocks
+///
+void buddy_claim(buddy_t *const buddy, const size_t start, const size_t count){
+    const size_t end = start + count;
+    for(size_t pos = start; pos < end; ){
+        const unsigned order = containing_order(buddy, pos);
+        if(order == buddy->orders){
+            // not free as far as we know, nothing to take out
+            pos++;
+            continue;
+        }
+        const size_t first = (pos >> order) << order, last = first + ((size_t)1 << order);
+        bitmap_set(buddy->busy[order], pos >> order);
+        // the parts of the chunk on either side of the claim stay free, as smaller chunks
+        if(first < pos){
+            buddy_release(buddy, first, pos - first);
+        }
+        if(last > end){
+            buddy_release(buddy, end, last - end);
+        }
+        pos = (last < end) ? last : end;
+    }
+}
+
+///
+/// Finds the smallest free chunk of at least the given order
+/// \param buddy The index
+/// \param order log2 of the number of blocks wanted
+/// \return First block of the chunk, which is aligned to its order, SIZE_MAX if there isn't one
+///
+size_t buddy_find(const buddy_t *const buddy, const unsigned order){
+    for(unsigned k = order; k < buddy->orders; k++){
+        const size_t idx = bitmap_ffz(buddy->busy[k]);
+        if(idx != SIZE_MAX){
+            return idx << k;
+        }
+    }
+    return SIZE_MAX;
+}
+
+///
+/// Tells whether a block is free as far as the index knows
+/// \param buddy The index
+/// \param block_id The block
+/// \return boolean indicating whether the block is part of a free chunk
+///
+bool buddy_is_free(const buddy_t *const buddy, const size_t block_id){
+    return (block_id < buddy->blocks) && (containing_order(buddy, block_id) < buddy->orders);
+}
+
+///
+/// Gets the largest order a chunk can have on this device
+/// \param buddy The index
+/// \return The order
+///
+unsigned buddy_max_order(const buddy_t *const buddy){
+    return buddy->orders - 1;
+}
+
+///
+/// Builds the index from the free blocks of an fbm
+/// \param fbm The fbm
+/// \param blocks Number of user blocks, ids [0, blocks)
+/// \return Pointer to the index, NULL on error
+///
+buddy_t *buddy_create(const bitmap_t *const fbm, const size_t blocks){
+    if((fbm == NULL) || (blocks == 0) || (blocks > bitmap_get_bits(fbm))){
+        return NULL;
+    }
+    buddy_t *buddy = (buddy_t *)calloc(1, sizeof(buddy_t));
+    if(buddy == NULL){
+        return NULL;
+    }
+    buddy->blocks = blocks;
+    buddy->orders = floor_log2(blocks) + 1;
+    for(unsigned k = 0; k < buddy->orders; k++){
+        buddy->busy[k] = bitmap_create(blocks >> k);
+        if((buddy->busy[k] == NULL) || !bitmap_enable_summary(buddy->busy[k])){
+            buddy_destroy(buddy);
+            return NULL;
+        }
+        bitmap_format(buddy->busy[k], 0xFF);
+    }
+    // every run of free blocks goes in as the chunks it's made of
+    for(size_t pos = bitmap_ffz(fbm); pos < blocks; ){
+        size_t end = bitmap_ffs_from(fbm, pos);
+        if(end > blocks){
+            end = blocks;
+        }
+        buddy_release(buddy, pos, end - pos);
+        pos = bitmap_ffz_from(fbm, end);
+    }
+    return buddy;
+}
+
+///
+/// Destroys the index
+/// \param buddy The index
+///
+void buddy_destroy(buddy_t *const buddy){
+    if(buddy != NULL){
+        for(unsigned k = 0; k < buddy->orders; k++){
+            bitmap_destroy(buddy->busy[k]);
+        }
+        free(buddy);
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef BUDDY_H__
+#define BUDDY_H__
+
+// Binary buddy index over the free blocks of a device, see block_store_set_buddy
+// The free blocks are kept as maximal aligned power of two chunks, one bitmap per order.
+// It only mirrors the fbm, which stays the record of what's allocated: the block store
+// tells it about every claim and release and it never touches the fbm itself.
+// Not thread safe.
+
+#include <stdint.h>
+#include "bitmap.h"
+
+typedef struct buddy buddy_t;
+
+///
+/// Builds the index from the free blocks of an fbm
+/// \param fbm The fbm
+/// \param blocks Number of user blocks, ids [0, blocks)
+/// \return Pointer to the index, NULL on error
+///
+buddy_t *buddy_create(const bitmap_t *const fbm, const size_t blocks);
+
+///
+/// Destroys the index
+/// \param buddy The index
+///
+void buddy_destroy(buddy_t *const buddy);
+
+///
+/// Finds the smallest free chunk of at least the given order
+/// \param buddy The index
+/// \param order log2 of the number of blocks wanted
+/// \return First block of the chunk, which is aligned to its order, SIZE_MAX if there isn't one
+///
+size_t buddy_find(const buddy_t *const buddy, const unsigned order);
+
+///
+/// Takes blocks out of the index, splitting the chunks they were part of
+/// \param buddy The index
+/// \param start First block, all of them have to be free in the index
+/// \param count Number of blocks
+///
+void buddy_claim(buddy_t *const buddy, const size_t start, const size_t count);
+
+///
+/// Puts blocks back in the index, merging chunks with their buddies where they can
+/// \param buddy The index
+/// \param start First block, none of them may be free in the index
+/// \param count Number of blocks
+///
+void buddy_release(buddy_t *const buddy, const size_t start, const size_t count);
+
+///
+/// Tells whether a block is free as far as the index knows
+/// \param buddy The index
+/// \param block_id The block
+/// \return boolean indicating whether the block is part of a free chunk
+///
+bool buddy_is_free(const buddy_t *const buddy, const size_t block_id);
+
+///
+/// Gets the largest order a chunk can have on this device
+/// \param buddy The index
+/// \return The order
+///
+unsigned buddy_max_order(const buddy_t *const buddy);
+
+#endif
@@ -0,0 +1,51 @@
+#include <pthread.h>
+#include "crc32c.h"
+
+// reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82F63B78u
+
+// eight tables so the main loop takes a word at a time ("slicing by 8")
+static uint32_t table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void table_init(void){
+    for(uint32_t i = 0; i < 256; i++){
+        uint32_t crc = i;
+        for(int bit = 0; bit < 8; bit++){
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        }
+        table[0][i] = crc;
+    }
+    for(uint32_t i = 0; i < 256; i++){
+        for(int t = 1; t < 8; t++){
+            table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xFF];
+        }
+    }
+}
+
+///
+/// Extends a checksum over more bytes, start from 0
+/// \param crc Checksum of everything before data
+/// \param data The bytes
+/// \param len Number of bytes
+/// \return Checksum of everything up to and including data
+///
+uint32_t crc32c_update(uint32_t crc, const void *const data, const size_t len)
+{
+    pthread_once(&table_once, table_init);
+    const uint8_t *p = (const uint8_t *)data;
+    size_t left = len;
+    crc = ~crc;
+    // the first four bytes fold into the crc, the other four go straight through the tables
+    while(left >= 8){
+        const uint32_t lo = crc ^ ((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+        crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^ table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+              table[3][p[4]] ^ table[2][p[5]] ^ table[1][p[6]] ^ table[0][p[7]];
+        p += 8;
+        left -= 8;
+    }
+    while(left-- > 0){
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xFF];
+    }
+    return ~crc;
+}
@@ -0,0 +1,18 @@
+#ifndef CRC32C_H__
+#define CRC32C_H__
+
+// CRC-32C (Castagnoli), the checksum on journal records
+
+#include <stddef.h>
+#include <stdint.h>
+
+///
+/// Extends a checksum over more bytes, start from 0
+/// \param crc Checksum of everything before data
+/// \param data The bytes
+/// \param len Number of bytes
+/// \return Checksum of everything up to and including data
+///
+uint32_t crc32c_update(uint32_t crc, const void *const data, const size_t len);
+
+#endif
@@ -0,0 +1,148 @@
+// MAP_ANONYMOUS, MAP_HUGETLB, MADV_HUGEPAGE, syscall
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "device_memory.h"
+
+// the default huge page size on x86-64 and arm64, transparent ones are always this size
+#define HUGE_PAGE_BYTES ((size_t)2 << 20)
+
+// memory policy modes and flags, linux/mempolicy.h isn't always installed and there's no libnuma
+#define MPOL_MODE_BIND 2
+#define MPOL_MODE_INTERLEAVE 3
+#define MPOL_FLAG_MEMS_ALLOWED 4
+#define NODE_WORDS 16                            // node masks cover 1024 nodes
+#define NODE_BITS (NODE_WORDS * 8 * sizeof(unsigned long))
+
+static inline size_t round_up(const size_t n, const size_t to){
+    return (n + to - 1) / to * to;
+}
+
+// maps memory that starts on a huge page boundary, otherwise the kernel can only
+// use huge pages for the part of it that happens to be aligned
+static void *map_aligned(const size_t bytes){
+    const size_t padded = bytes + HUGE_PAGE_BYTES;
+    void *raw = mmap(NULL, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(raw == MAP_FAILED){
+        return NULL;
+    }
+    // trim what's left over on either side
+    const uintptr_t start = (uintptr_t)raw, aligned = round_up(start, HUGE_PAGE_BYTES);
+    if(aligned > start){
+        munmap(raw, aligned - start);
+    }
+    const size_t tail = (start + padded) - (aligned + bytes);
+    if(tail > 0){
+        munmap((void *)(aligned + bytes), tail);
+    }
+    return (void *)aligned;
+}
+
+// sets the NUMA policy of memory nothing has touched yet
+static bool place(void *const data, const size_t bytes, const block_store_memory_t *const memory){
+    if(memory->numa == BLOCK_STORE_NUMA_DEFAULT){
+        return true;
+    }
+    unsigned long nodes[NODE_WORDS];
+    memset(nodes, 0, sizeof(nodes));
+    int mode;
+    long result = -1;
+    errno = ENOSYS;
+    if(memory->numa == BLOCK_STORE_NUMA_INTERLEAVE){
+        // every node the process is allowed to use
+        mode = MPOL_MODE_INTERLEAVE;
+#ifdef SYS_get_mempolicy
+        result = syscall(SYS_get_mempolicy, NULL, nodes, NODE_BITS + 1, NULL, MPOL_FLAG_MEMS_ALLOWED);
+#endif
+    }
+    else if((memory->numa == BLOCK_STORE_NUMA_BIND) && (memory->node >= 0) && ((size_t)memory->node < NODE_BITS)){
+        mode = MPOL_MODE_BIND;
+        nodes[memory->node / (8 * sizeof(unsigned long))] = 1UL << (memory->node % (8 * sizeof(unsigned long)));
+        result = 0;
+    }
+    else{
+        return false;
+    }
+#ifdef SYS_mbind
+    if(result == 0){
+        result = syscall(SYS_mbind, data, bytes, mode, nodes, NODE_BITS + 1, 0);
+    }
+#else
+    (void)data;
+    (void)bytes;
+    (void)mode;
+    result = -1;
+    errno = ENOSYS;
+#endif
+    if(result == 0){
+        return true;
+    }
+    // a kernel without NUMA support has one node, which is where the memory goes anyway
+    return (errno == ENOSYS) && ((memory->numa == BLOCK_STORE_NUMA_INTERLEAVE) || (memory->node == 0));
+}
+
+///
+/// Maps zero filled memory for a block array
+/// \param bytes Bytes wanted
+/// \param memory How to back and place it
+/// \param mapped Receives the bytes actually mapped, what device_memory_unmap needs back
+/// \return Pointer to the memory, NULL on error
+///
+void *device_memory_map(const size_t bytes, const block_store_memory_t *const memory, size_t *const mapped){
+    // rounding up (and padding for alignment) mustn't wrap around
+    if((bytes == 0) || (bytes > SIZE_MAX - 2 * HUGE_PAGE_BYTES) || (memory == NULL) || (mapped == NULL)){
+        return NULL;
+    }
+    void *data = NULL;
+    size_t length = round_up(bytes, (size_t)sysconf(_SC_PAGESIZE));
+    switch(memory->pages){
+        case BLOCK_STORE_PAGES_DEFAULT:
+            data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            data = (data == MAP_FAILED) ? NULL : data;
+            break;
+        case BLOCK_STORE_PAGES_TRANSPARENT:
+            // whole huge pages, and the kernel is only a hint away from backing them
+            // (whether it does depends on /sys/kernel/mm/transparent_hugepage, so that can't fail)
+            length = round_up(bytes, HUGE_PAGE_BYTES);
+            data = map_aligned(length);
+#ifdef MADV_HUGEPAGE
+            if(data != NULL){
+                madvise(data, length, MADV_HUGEPAGE);
+            }
+#endif
+            break;
+        case BLOCK_STORE_PAGES_EXPLICIT:
+            // from the reserved pool (vm.nr_hugepages), which is all or nothing
+            length = round_up(bytes, HUGE_PAGE_BYTES);
+#ifdef MAP_HUGETLB
+            data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            data = (data == MAP_FAILED) ? NULL : data;
+#endif
+            break;
+        default:
+            break;
+    }
+    if(data == NULL){
+        return NULL;
+    }
+    if(!place(data, length, memory)){
+        munmap(data, length);
+        return NULL;
+    }
+    *mapped = length;
+    return data;
+}
+
+///
+/// Gives back memory from device_memory_map
+/// \param data The memory, may be NULL
+/// \param mapped The size device_memory_map reported
+///
+void device_memory_unmap(void *const data, const size_t mapped){
+    if(data != NULL){
+        munmap(data, mapped);
+    }
+}
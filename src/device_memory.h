@@ -0,0 +1,27 @@
+#ifndef DEVICE_MEMORY_H__
+#define DEVICE_MEMORY_H__
+
+// Anonymous mappings for a device's blocks, see block_store_create_memory
+// The page size and NUMA placement are settled before anything touches the memory,
+// so the first touch can't put it somewhere else.
+
+#include <stdint.h>
+#include "block_store.h"
+
+///
+/// Maps zero filled memory for a block array
+/// \param bytes Bytes wanted
+/// \param memory How to back and place it
+/// \param mapped Receives the bytes actually mapped, what device_memory_unmap needs back
+/// \return Pointer to the memory, NULL on error
+///
+void *device_memory_map(const size_t bytes, const block_store_memory_t *const memory, size_t *const mapped);
+
+///
+/// Gives back memory from device_memory_map
+/// \param data The memory, may be NULL
+/// \param mapped The size device_memory_map reported
+///
+void device_memory_unmap(void *const data, const size_t mapped);
+
+#endif
@@ -0,0 +1,414 @@
+#include <stdlib.h>
+#include "extent_index.h"
+
+// the two trees every extent is in
+enum { BY_START = 0, BY_LENGTH = 1 };
+
+struct extent{
+    size_t start, length;
+    struct extent *left[2], *right[2];  // children in each tree
+    int height[2];
+    size_t max_length;      // longest extent in this one's subtree of the by-start tree
+};
+
+struct extent_index{
+    struct extent *root[2];
+    size_t extents;
+    size_t histogram[EXTENT_INDEX_BUCKETS];
+};
+
+// log2 rounded down, n > 0
+static inline unsigned floor_log2(const size_t n){
+    return (unsigned)(63 - __builtin_clzll((unsigned long long)n));
+}
+
+static inline int height(const struct extent *const node, const int tree){
+    return (node != NULL) ? node->height[tree] : 0;
+}
+
+// by start, or by length and then start, so no two extents ever compare equal
+static int compare(const int tree, const struct extent *const a, const struct extent *const b){
+    if((tree == BY_LENGTH) && (a->length != b->length)){
+        return (a->length < b->length) ? -1 : 1;
+    }
+    return (a->start < b->start) ? -1 : (a->start > b->start);
+}
+
+// fixes up a node's height, and its max_length in the by-start tree, from its children
+static void update(struct extent *const node, const int tree){
+    const int left = height(node->left[tree], tree), right = height(node->right[tree], tree);
+    node->height[tree] = 1 + ((left > right) ? left : right);
+    if(tree == BY_START){
+        size_t longest = node->length;
+        if((node->left[tree] != NULL) && (node->left[tree]->max_length > longest)){
+            longest = node->left[tree]->max_length;
+        }
+        if((node->right[tree] != NULL) && (node->right[tree]->max_length > longest)){
+            longest = node->right[tree]->max_length;
+        }
+        node->max_length = longest;
+    }
+}
+
+static struct extent *rotate_left(struct extent *const node, const int tree){
+    struct extent *const top = node->right[tree];
+    node->right[tree] = top->left[tree];
+    top->left[tree] = node;
+    update(node, tree);
+    update(top, tree);
+    return top;
+}
+
+static struct extent *rotate_right(struct extent *const node, const int tree){
+    struct extent *const top = node->left[tree];
+    node->left[tree] = top->right[tree];
+    top->right[tree] = node;
+    update(node, tree);
+    update(top, tree);
+    return top;
+}
+
+// AVL rebalance of a subtree whose children are balanced, returns the new subtree root
+static struct extent *rebalance(struct extent *const node, const int tree){
+    update(node, tree);
+    const int balance = height(node->left[tree], tree) - height(node->right[tree], tree);
+    if(balance > 1){
+        if(height(node->left[tree]->left[tree], tree) < height(node->left[tree]->right[tree], tree)){
+            node->left[tree] = rotate_left(node->left[tree], tree);
+        }
+        return rotate_right(node, tree);
+    }
+    if(balance < -1){
+        if(height(node->right[tree]->right[tree], tree) < height(node->right[tree]->left[tree], tree)){
+            node->right[tree] = rotate_right(node->right[tree], tree);
+        }
+        return rotate_left(node, tree);
+    }
+    return node;
+}
+
+static struct extent *tree_insert(struct extent *const root, struct extent *const node, const int tree){
+    if(root == NULL){
+        node->left[tree] = NULL;
+        node->right[tree] = NULL;
+        update(node, tree);
+        return node;
+    }
+    if(compare(tree, node, root) < 0){
+        root->left[tree] = tree_insert(root->left[tree], node, tree);
+    }
+    else{
+        root->right[tree] = tree_insert(root->right[tree], node, tree);
+    }
+    return rebalance(root, tree);
+}
+
+static struct extent *tree_remove_min(struct extent *const root, const int tree, struct extent **const min){
+    if(root->left[tree] == NULL){
+        *min = root;
+        return root->right[tree];
+    }
+    root->left[tree] = tree_remove_min(root->left[tree], tree, min);
+    return rebalance(root, tree);
+}
+
+static struct extent *tree_remove(struct extent *const root, const struct extent *const node, const int tree){
+    if(root == NULL){
+        return NULL;
+    }
+    const int order = compare(tree, node, root);
+    if(order < 0){
+        root->left[tree] = tree_remove(root->left[tree], node, tree);
+    }
+    else if(order > 0){
+        root->right[tree] = tree_remove(root->right[tree], node, tree);
+    }
+    else{
+        // the smallest node on the right takes its place
+        struct extent *const left = root->left[tree];
+        struct extent *right = root->right[tree];
+        if(right == NULL){
+            return left;
+        }
+        struct extent *min = NULL;
+        right = tree_remove_min(right, tree, &min);
+        min->left[tree] = left;
+        min->right[tree] = right;
+        return rebalance(min, tree);
+    }
+    return rebalance(root, tree);
+}
+
+static void extent_add(extent_index_t *const index, struct extent *const node){
+    index->root[BY_START] = tree_insert(index->root[BY_START], node, BY_START);
+    index->root[BY_LENGTH] = tree_insert(index->root[BY_LENGTH], node, BY_LENGTH);
+    index->extents++;
+    index->histogram[floor_log2(node->length)]++;
+}
+
+static void extent_drop(extent_index_t *const index, struct extent *const node){
+    index->root[BY_START] = tree_remove(index->root[BY_START], node, BY_START);
+    index->root[BY_LENGTH] = tree_remove(index->root[BY_LENGTH], node, BY_LENGTH);
+    index->extents--;
+    index->histogram[floor_log2(node->length)]--;
+}
+
+// the extent starting at or before the block, NULL if there isn't one
+static struct extent *extent_at_or_before(const extent_index_t *const index, const size_t block_id){
+    struct extent *found = NULL;
+    for(struct extent *node = index->root[BY_START]; node != NULL; ){
+        if(node->start <= block_id){
+            found = node;
+            node = node->right[BY_START];
+        }
+        else{
+            node = node->left[BY_START];
+        }
+    }
+    return found;
+}
+
+// the extent starting at or after the block, NULL if there isn't one
+static struct extent *extent_at_or_after(const extent_index_t *const index, const size_t block_id){
+    struct extent *found = NULL;
+    for(struct extent *node = index->root[BY_START]; node != NULL; ){
+        if(node->start >= block_id){
+            found = node;
+            node = node->left[BY_START];
+        }
+        else{
+            node = node->right[BY_START];
+        }
+    }
+    return found;
+}
+
+///
+/// Takes blocks out of the index, splitting the extent they were part of
+/// \param index The index
+/// \param start First block, all of them have to be free in the index
+/// \param count Number of blocks
+/// \return boolean indicating succes of operation, false means there was no memory and the index is no good any more
+///
+bool extent_index_claim(extent_index_t *const index, const size_t start, const size_t count){
+    const size_t end = start + count;
+    for(size_t pos = start; pos < end; ){
+        struct extent *node = extent_at_or_before(index, pos);
+        if((node == NULL) || (pos >= node->start + node->length)){
+            // not free as far as we know, on to the next extent that is
+            node = extent_at_or_after(index, pos);
+            if((node == NULL) || (node->start >= end)){
+                break;
+            }
+            pos = node->start;
+        }
+        const size_t first = node->start, last = node->start + node->length;
+        extent_drop(index, node);
+        // whatever is left on either side stays free, the node gets reused for one of them
+        if(first < pos){
+            node->start = first;
+            node->length = pos - first;
+            extent_add(index, node);
+            node = NULL;
+        }
+        if(last > end){
+            if(node == NULL){
+                node = (struct extent *)malloc(sizeof(struct extent));
+                if(node == NULL){
+                    return false;
+                }
+            }
+            node->start = end;
+            node->length = last - end;
+            extent_add(index, node);
+            node = NULL;
+        }
+        free(node);
+        pos = last;
+    }
+    return true;
+}
+
+///
+/// Puts blocks back in the index, merging them with the extents on either side
+/// \param index The index
+/// \param start First block, none of them may be free in the index
+/// \param count Number of blocks
+/// \return boolean indicating succes of operation, false means there was no memory and the index is no good any more
+///
+bool extent_index_release(extent_index_t *const index, const size_t start, const size_t count){
+    size_t first = start, last = start + count;
+    struct extent *before = (start > 0) ? extent_at_or_before(index, start - 1) : NULL;
+    if((before != NULL) && (before->start + before->length == start)){
+        first = before->start;
+        extent_drop(index, before);
+    }
+    else{
+        before = NULL;
+    }
+    struct extent *after = extent_at_or_after(index, last);
+    if((after != NULL) && (after->start == last)){
+        last = after->start + after->length;
+        extent_drop(index, after);
+    }
+    else{
+        after = NULL;
+    }
+    // one node is enough for the merged extent
+    struct extent *node = (before != NULL) ? before : after;
+    if((before != NULL) && (after != NULL)){
+        free(after);
+    }
+    if(node == NULL){
+        node = (struct extent *)malloc(sizeof(struct extent));
+        if(node == NULL){
+            return false;
+        }
+    }
+    node->start = first;
+    node->length = last - first;
+    extent_add(index, node);
+    return true;
+}
+
+///
+/// Tells whether a block is free as far as the index knows
+/// \param index The index
+/// \param block_id The block
+/// \return boolean indicating whether the block is part of a free extent
+///
+bool extent_index_is_free(const extent_index_t *const index, const size_t block_id){
+    const struct extent *const node = extent_at_or_before(index, block_id);
+    return (node != NULL) && (block_id < node->start + node->length);
+}
+
+///
+/// Finds the lowest free extent of at least count blocks
+/// \param index The index
+/// \param count Blocks wanted
+/// \return Start of the extent, SIZE_MAX if there isn't one
+///
+size_t extent_index_first_fit(const extent_index_t *const index, const size_t count){
+    // max_length says which side of each node has one, leftmost first
+    const struct extent *node = index->root[BY_START];
+    if((node == NULL) || (node->max_length < count)){
+        return SIZE_MAX;
+    }
+    while(node != NULL){
+        if((node->left[BY_START] != NULL) && (node->left[BY_START]->max_length >= count)){
+            node = node->left[BY_START];
+        }
+        else if(node->length >= count){
+            return node->start;
+        }
+        else{
+            node = node->right[BY_START];
+        }
+    }
+    return SIZE_MAX;
+}
+
+///
+/// Finds the smallest free extent of at least count blocks, the lowest of those if there's a tie
+/// \param index The index
+/// \param count Blocks wanted
+/// \return Start of the extent, SIZE_MAX if there isn't one
+///
+size_t extent_index_best_fit(const extent_index_t *const index, const size_t count){
+    const struct extent *found = NULL;
+    for(const struct extent *node = index->root[BY_LENGTH]; node != NULL; ){
+        if(node->length >= count){
+            found = node;
+            node = node->left[BY_LENGTH];
+        }
+        else{
+            node = node->right[BY_LENGTH];
+        }
+    }
+    return (found != NULL) ? found->start : SIZE_MAX;
+}
+
+///
+/// Finds the largest free extent, the lowest of those if there's a tie
+/// \param index The index
+/// \param start Receives the start of the extent, may be NULL
+/// \return Length of the extent, 0 if nothing is free
+///
+size_t extent_index_largest(const extent_index_t *const index, size_t *const start){
+    const struct extent *node = index->root[BY_LENGTH];
+    if(node == NULL){
+        return 0;
+    }
+    while(node->right[BY_LENGTH] != NULL){
+        node = node->right[BY_LENGTH];
+    }
+    if(start != NULL){
+        *start = extent_index_best_fit(index, node->length);
+    }
+    return node->length;
+}
+
+///
+/// Reports the shape of the free space
+/// \param index The index
+/// \param extents Receives the number of free extents
+/// \param histogram Receives EXTENT_INDEX_BUCKETS counts, bucket i counts extents of [2^i, 2^(i+1)) blocks
+///
+void extent_index_histogram(const extent_index_t *const index, size_t *const extents, size_t *const histogram){
+    *extents = index->extents;
+    for(size_t i = 0; i < EXTENT_INDEX_BUCKETS; i++){
+        histogram[i] = index->histogram[i];
+    }
+}
+
+///
+/// Builds the index from the free blocks of an fbm
+/// \param fbm The fbm
+/// \param blocks Number of user blocks, ids [0, blocks)
+/// \return Pointer to the index, NULL on error
+///
+extent_index_t *extent_index_create(const bitmap_t *const fbm, const size_t blocks){
+    if((fbm == NULL) || (blocks > bitmap_get_bits(fbm))){
+        return NULL;
+    }
+    extent_index_t *index = (extent_index_t *)calloc(1, sizeof(extent_index_t));
+    if(index == NULL){
+        return NULL;
+    }
+    for(size_t pos = bitmap_ffz(fbm); pos < blocks; ){
+        size_t end = bitmap_ffs_from(fbm, pos);
+        if(end > blocks){
+            end = blocks;
+        }
+        struct extent *node = (struct extent *)malloc(sizeof(struct extent));
+        if(node == NULL){
+            extent_index_destroy(index);
+            return NULL;
+        }
+        node->start = pos;
+        node->length = end - pos;
+        extent_add(index, node);
+        pos = bitmap_ffz_from(fbm, end);
+    }
+    return index;
+}
+
+// frees a subtree of the by-start tree, which holds every node
+static void tree_free(struct extent *const node){
+    if(node != NULL){
+        tree_free(node->left[BY_START]);
+        tree_free(node->right[BY_START]);
+        free(node);
+    }
+}
+
+///
+/// Destroys the index
+/// \param index The index
+///
+void extent_index_destroy(extent_index_t *const index){
+    if(index != NULL){
+        tree_free(index->root[BY_START]);
+        free(index);
+    }
+}
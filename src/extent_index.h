@@ -0,0 +1,90 @@
+#ifndef EXTENT_INDEX_H__
+#define EXTENT_INDEX_H__
+
+// Index of the free extents (maximal runs of free blocks) of a device, see block_store_largest_free_extent
+// Every extent sits in two AVL trees, one by start and one by length, so first fit, best fit
+// and the largest extent are a walk down one tree. It only mirrors the fbm: the block store
+// tells it about every claim and release and it never touches the fbm itself.
+// Not thread safe.
+
+#include <stdint.h>
+#include "bitmap.h"
+
+// buckets in the length histogram, bucket i counts extents of [2^i, 2^(i+1)) blocks
+#define EXTENT_INDEX_BUCKETS 64
+
+typedef struct extent_index extent_index_t;
+
+///
+/// Builds the index from the free blocks of an fbm
+/// \param fbm The fbm
+/// \param blocks Number of user blocks, ids [0, blocks)
+/// \return Pointer to the index, NULL on error
+///
+extent_index_t *extent_index_create(const bitmap_t *const fbm, const size_t blocks);
+
+///
+/// Destroys the index
+/// \param index The index
+///
+void extent_index_destroy(extent_index_t *const index);
+
+///
+/// Takes blocks out of the index, splitting the extent they were part of
+/// \param index The index
+/// \param start First block, all of them have to be free in the index
+/// \param count Number of blocks
+/// \return boolean indicating succes of operation, false means there was no memory and the index is no good any more
+///
+bool extent_index_claim(extent_index_t *const index, const size_t start, const size_t count);
+
+///
+/// Puts blocks back in the index, merging them with the extents on either side
+/// \param index The index
+/// \param start First block, none of them may be free in the index
+/// \param count Number of blocks
+/// \return boolean indicating succes of operation, false means there was no memory and the index is no good any more
+///
+bool extent_index_release(extent_index_t *const index, const size_t start, const size_t count);
+
+///
+/// Tells whether a block is free as far as the index knows
+/// \param index The index
+/// \param block_id The block
+/// \return boolean indicating whether the block is part of a free extent
+///
+bool extent_index_is_free(const extent_index_t *const index, const size_t block_id);
+
+///
+/// Finds the lowest free extent of at least count blocks
+/// \param index The index
+/// \param count Blocks wanted
+/// \return Start of the extent, SIZE_MAX if there isn't one
+///
+size_t extent_index_first_fit(const extent_index_t *const index, const size_t count);
+
+///
+/// Finds the smallest free extent of at least count blocks, the lowest of those if there's a tie
+/// \param index The index
+/// \param count Blocks wanted
+/// \return Start of the extent, SIZE_MAX if there isn't one
+///
+size_t extent_index_best_fit(const extent_index_t *const index, const size_t count);
+
+///
+/// Finds the largest free extent, the lowest of those if there's a tie
+/// \param index The index
+/// \param start Receives the start of the extent, may be NULL
+/// \return Length of the extent, 0 if nothing is free
+///
+size_t extent_index_largest(const extent_index_t *const index, size_t *const start);
+
+///
+/// Reports the shape of the free space
+/// \param index The index
+/// \param extents Receives the number of free extents
+/// \param histogram Receives EXTENT_INDEX_BUCKETS counts, bucket i counts extents of [2^i, 2^(i+1)) blocks
+///
+void extent_index_histogram(const extent_index_t *const index, size_t *const extents, size_t *const histogram);
+
+#endif
@@ -0,0 +1,406 @@
+// pwritev, fdatasync
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "crc32c.h"
+#include "journal.h"
+
+#define JOURNAL_MAGIC 0x524A5342u   // "BSJR"
+
+// what starts every record on disk, followed by length bytes of entries
+struct record_header{
+    uint32_t magic;
+    uint32_t crc;           // crc32c of the rest of the header and the entries
+    uint64_t seq;           // counts up from 1 over the life of the journal file
+    uint64_t length;
+    uint32_t block_size;    // a journal only replays onto a device with the same blocks
+    uint32_t entries;
+};
+
+// one change, a JOURNAL_WRITE is followed by the block's block_size bytes
+struct record_entry{
+    uint32_t op;
+    uint32_t reserved;
+    uint64_t block_id;
+    uint64_t count;
+};
+
+struct journal{
+    int fd;
+    char *image;
+    size_t block_size;
+    size_t num_blocks;
+    pthread_mutex_t lock;
+    pthread_cond_t synced;  // a sync finished, waiters may be covered by it
+    uint8_t *pending;       // entries of the transaction being built
+    size_t pending_length, pending_capacity;
+    uint32_t pending_entries;
+    bool lost;              // an entry didn't fit in memory, so the transaction can't be committed
+    off_t end;              // where the next record goes, just past the last whole one
+    uint64_t seq;           // last record written
+    uint64_t synced_seq;    // last record known to be on disk
+    bool syncing;           // some thread is in fdatasync
+};
+
+// "<image>.journal", NULL if out of memory
+static char *journal_path(const char *const image){
+    const size_t length = strlen(image) + sizeof(".journal");
+    char *path = (char *)malloc(length);
+    if(path != NULL){
+        snprintf(path, length, "%s.journal", image);
+    }
+    return path;
+}
+
+// checks that a record's entries are well formed and stay on the device
+static bool record_valid(const uint8_t *const payload, const size_t length, const uint32_t entries, const size_t block_size, const size_t num_blocks){
+    size_t offset = 0;
+    for(uint32_t i = 0; i < entries; i++){
+        struct record_entry entry;
+        if(length - offset < sizeof(entry)){
+            return false;
+        }
+        memcpy(&entry, payload + offset, sizeof(entry));
+        offset += sizeof(entry);
+        if(entry.op == JOURNAL_WRITE){
+            if((entry.block_id >= num_blocks) || (length - offset < block_size)){
+                return false;
+            }
+            offset += block_size;
+        }
+        else if((entry.op != JOURNAL_ALLOCATE) && (entry.op != JOURNAL_RELEASE)){
+            return false;
+        }
+        else if((entry.count == 0) || (entry.block_id >= num_blocks) || (entry.count > num_blocks - entry.block_id)){
+            return false;
+        }
+    }
+    return offset == length;
+}
+
+static void record_apply(const uint8_t *const payload, const uint32_t entries, const size_t block_size, journal_apply_t apply, void *context){
+    size_t offset = 0;
+    for(uint32_t i = 0; i < entries; i++){
+        struct record_entry entry;
+        memcpy(&entry, payload + offset, sizeof(entry));
+        offset += sizeof(entry);
+        if(entry.op == JOURNAL_WRITE){
+            apply(context, JOURNAL_WRITE, entry.block_id, 1, payload + offset);
+            offset += block_size;
+        }
+        else{
+            apply(context, (journal_op_t)entry.op, entry.block_id, entry.count, NULL);
+        }
+    }
+}
+
+// walks the whole records at the start of a journal, handing each to apply unless it's NULL
+// returns the offset just past the last whole record, with their count and the last seq
+static off_t journal_scan(const int fd, const size_t block_size, const size_t num_blocks, journal_apply_t apply, void *context, size_t *const records, uint64_t *const last_seq){
+    struct stat st;
+    if(fstat(fd, &st) != 0){
+        return 0;
+    }
+    off_t end = 0;
+    uint8_t *payload = NULL;
+    for(;;){
+        struct record_header header;
+        if((st.st_size - end < (off_t)sizeof(header)) || (pread(fd, &header, sizeof(header), end) != (ssize_t)sizeof(header))){
+            break;
+        }
+        // anything off about a record means it (and whatever follows) never finished
+        if((header.magic != JOURNAL_MAGIC) || (header.block_size != block_size) ||
+           (header.length > (uint64_t)(st.st_size - end - (off_t)sizeof(header)))){
+            break;
+        }
+        const size_t length = (size_t)header.length;
+        uint8_t *grown = (uint8_t *)realloc(payload, length + 1);
+        if(grown == NULL){
+            break;
+        }
+        payload = grown;
+        if(pread(fd, payload, length, end + (off_t)sizeof(header)) != (ssize_t)length){
+            break;
+        }
+        uint32_t crc = crc32c_update(0, &header.seq, sizeof(header) - offsetof(struct record_header, seq));
+        crc = crc32c_update(crc, payload, length);
+        if((crc != header.crc) || !record_valid(payload, length, header.entries, block_size, num_blocks)){
+            break;
+        }
+        if(apply != NULL){
+            record_apply(payload, header.entries, block_size, apply, context);
+        }
+        end += (off_t)(sizeof(header) + length);
+        (*records)++;
+        *last_seq = header.seq;
+    }
+    free(payload);
+    return end;
+}
+
+///
+/// Opens (creating it if needed) the journal of an image, dropping any torn record at its end
+/// \param image The image the journal belongs to
+/// \param block_size Bytes per block of the device
+/// \param num_blocks Blocks on the device, fbm included
+/// \return Pointer to the journal, NULL on error
+///
+journal_t *journal_open(const char *const image, const size_t block_size, const size_t num_blocks)
+{
+    if((image == NULL) || (block_size == 0) || (block_size > UINT32_MAX)){
+        return NULL;
+    }
+    journal_t *journal = (journal_t *)calloc(1, sizeof(journal_t));
+    char *path = journal_path(image);
+    if((journal == NULL) || (path == NULL)){
+        free(journal);
+        free(path);
+        return NULL;
+    }
+    journal->image = strdup(image);
+    journal->fd = (journal->image != NULL) ? open(path, O_RDWR | O_CREAT, 0644) : -1;
+    free(path);
+    if(journal->fd < 0){
+        free(journal->image);
+        free(journal);
+        return NULL;
+    }
+    journal->block_size = block_size;
+    journal->num_blocks = num_blocks;
+    // new records go after the ones already there, a torn tail would hide them from replay
+    size_t records = 0;
+    journal->end = journal_scan(journal->fd, block_size, num_blocks, NULL, NULL, &records, &journal->seq);
+    journal->synced_seq = journal->seq;
+    if(ftruncate(journal->fd, journal->end) != 0){
+        close(journal->fd);
+        free(journal->image);
+        free(journal);
+        return NULL;
+    }
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->synced, NULL);
+    return journal;
+}
+
+///
+/// Closes the journal, anything not committed is dropped as if the process had crashed
+/// \param journal The journal
+///
+void journal_close(journal_t *const journal)
+{
+    if(journal == NULL){
+        return;
+    }
+    close(journal->fd);
+    pthread_cond_destroy(&journal->synced);
+    pthread_mutex_destroy(&journal->lock);
+    free(journal->pending);
+    free(journal->image);
+    free(journal);
+}
+
+///
+/// Tells whether the journal belongs to the given image
+/// \param journal The journal
+/// \param image The image
+/// \return true if it does
+///
+bool journal_covers(const journal_t *const journal, const char *const image)
+{
+    return (journal != NULL) && (image != NULL) && (strcmp(journal->image, image) == 0);
+}
+
+// makes room for bytes more at the end of the pending transaction, the caller holds the lock
+// returns where they go, NULL (and the transaction is lost) if out of memory
+static uint8_t *pending_reserve(journal_t *const journal, const size_t bytes){
+    if(journal->lost){
+        return NULL;
+    }
+    if(journal->pending_capacity - journal->pending_length < bytes){
+        size_t capacity = (journal->pending_capacity != 0) ? journal->pending_capacity : 4096;
+        while(capacity - journal->pending_length < bytes){
+            capacity *= 2;
+        }
+        uint8_t *grown = (uint8_t *)realloc(journal->pending, capacity);
+        if(grown == NULL){
+            journal->lost = true;
+            return NULL;
+        }
+        journal->pending = grown;
+        journal->pending_capacity = capacity;
+    }
+    uint8_t *at = journal->pending + journal->pending_length;
+    journal->pending_length += bytes;
+    journal->pending_entries++;
+    return at;
+}
+
+///
+/// Adds a block's new contents to the pending transaction
+/// \param journal The journal
+/// \param block_id The block
+/// \param data block_size bytes
+///
+void journal_write(journal_t *const journal, const size_t block_id, const void *const data)
+{
+    struct record_entry entry = {JOURNAL_WRITE, 0, block_id, 1};
+    pthread_mutex_lock(&journal->lock);
+    uint8_t *at = pending_reserve(journal, sizeof(entry) + journal->block_size);
+    if(at != NULL){
+        memcpy(at, &entry, sizeof(entry));
+        memcpy(at + sizeof(entry), data, journal->block_size);
+    }
+    pthread_mutex_unlock(&journal->lock);
+}
+
+///
+/// Adds an fbm change to the pending transaction
+/// \param journal The journal
+/// \param op JOURNAL_ALLOCATE or JOURNAL_RELEASE
+/// \param start First block of the run
+/// \param count Blocks in the run
+///
+void journal_range(journal_t *const journal, const journal_op_t op, const size_t start, const size_t count)
+{
+    struct record_entry entry = {(uint32_t)op, 0, start, count};
+    pthread_mutex_lock(&journal->lock);
+    uint8_t *at = pending_reserve(journal, sizeof(entry));
+    if(at != NULL){
+        memcpy(at, &entry, sizeof(entry));
+    }
+    pthread_mutex_unlock(&journal->lock);
+}
+
+// appends the pending transaction as the next record, the caller holds the lock
+// a record that only partly made it out doesn't move the end, so the next one goes over it
+static bool journal_append(journal_t *const journal){
+    struct record_header header = {JOURNAL_MAGIC, 0, journal->seq + 1, journal->pending_length,
+                                   (uint32_t)journal->block_size, journal->pending_entries};
+    header.crc = crc32c_update(0, &header.seq, sizeof(header) - offsetof(struct record_header, seq));
+    header.crc = crc32c_update(header.crc, journal->pending, journal->pending_length);
+    const size_t total = sizeof(header) + journal->pending_length;
+    size_t done = 0;
+    while(done < total){
+        // one sequential write for the whole transaction
+        struct iovec iov[2];
+        int count = 0;
+        if(done < sizeof(header)){
+            iov[count].iov_base = (uint8_t *)&header + done;
+            iov[count++].iov_len = sizeof(header) - done;
+        }
+        const size_t payloadDone = (done > sizeof(header)) ? done - sizeof(header) : 0;
+        iov[count].iov_base = journal->pending + payloadDone;
+        iov[count++].iov_len = journal->pending_length - payloadDone;
+        const ssize_t written = pwritev(journal->fd, iov, count, journal->end + (off_t)done);
+        if(written <= 0){
+            return false;
+        }
+        done += (size_t)written;
+    }
+    journal->end += (off_t)total;
+    journal->seq++;
+    journal->pending_length = 0;
+    journal->pending_entries = 0;
+    return true;
+}
+
+///
+/// Appends the pending transaction as one record and waits until it's on disk
+/// Threads committing at the same time share one sync (group commit)
+/// \param journal The journal
+/// \return boolean indicating succes of operation, the transaction is dropped if
+///  a change couldn't be added to it and kept for another try if the write failed
+///
+bool journal_commit(journal_t *const journal)
+{
+    if(journal == NULL){
+        return false;
+    }
+    pthread_mutex_lock(&journal->lock);
+    bool ok = true;
+    if(journal->lost){
+        journal->pending_length = 0;
+        journal->pending_entries = 0;
+        journal->lost = false;
+        ok = false;
+    }
+    else if(journal->pending_entries > 0){
+        ok = journal_append(journal);
+    }
+    // whoever syncs covers every record written so far, so a thread that finds a sync
+    // under way waits for it and only syncs itself if its record came in too late
+    const uint64_t target = journal->seq;
+    while(ok && (journal->synced_seq < target)){
+        if(journal->syncing){
+            pthread_cond_wait(&journal->synced, &journal->lock);
+            continue;
+        }
+        journal->syncing = true;
+        const uint64_t covered = journal->seq;
+        pthread_mutex_unlock(&journal->lock);
+        const bool synced = fdatasync(journal->fd) == 0;
+        pthread_mutex_lock(&journal->lock);
+        journal->syncing = false;
+        if(synced){
+            journal->synced_seq = covered;
+        }
+        ok = synced;
+        pthread_cond_broadcast(&journal->synced);
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return ok;
+}
+
+///
+/// Empties the journal once its image has caught up, the pending transaction stays
+/// \param journal The journal
+/// \return boolean indicating succes of operation
+///
+bool journal_truncate(journal_t *const journal)
+{
+    if(journal == NULL){
+        return false;
+    }
+    pthread_mutex_lock(&journal->lock);
+    const bool ok = (ftruncate(journal->fd, 0) == 0) && (fdatasync(journal->fd) == 0);
+    if(ok){
+        journal->end = 0;
+        journal->synced_seq = journal->seq;
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return ok;
+}
+
+///
+/// Applies every committed record in an image's journal, in order
+/// \param image The image the journal belongs to
+/// \param block_size Bytes per block of the device
+/// \param num_blocks Blocks on the device, entries outside it end the replay
+/// \param apply Called for each entry
+/// \param context Passed to apply
+/// \return Number of records applied, 0 if there's no journal
+///
+size_t journal_replay(const char *const image, const size_t block_size, const size_t num_blocks, journal_apply_t apply, void *context)
+{
+    if((image == NULL) || (apply == NULL)){
+        return 0;
+    }
+    char *path = journal_path(image);
+    const int fd = (path != NULL) ? open(path, O_RDONLY) : -1;
+    free(path);
+    if(fd < 0){
+        return 0;
+    }
+    size_t records = 0;
+    uint64_t seq = 0;
+    journal_scan(fd, block_size, num_blocks, apply, context, &records, &seq);
+    close(fd);
+    return records;
+}
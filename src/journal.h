@@ -0,0 +1,91 @@
+#ifndef JOURNAL_H__
+#define JOURNAL_H__
+
+// Redo journal for a serialized block store image
+// Changes pile up in a pending transaction until journal_commit appends them to
+// "<image>.journal" as one checksummed record, records that didn't make it out whole are
+// ignored on replay. Every call is thread safe.
+
+#include <stdint.h>
+#include "block_store.h"
+
+typedef struct journal journal_t;
+
+// what a journal entry does to the device
+typedef enum {
+    JOURNAL_WRITE = 1,      // a whole block's new contents
+    JOURNAL_ALLOCATE,       // a run of blocks marked in use in the fbm
+    JOURNAL_RELEASE,        // a run of blocks marked free in the fbm
+} journal_op_t;
+
+// applies one entry of a committed record, data is the block for JOURNAL_WRITE and NULL otherwise
+typedef void (*journal_apply_t)(void *context, const journal_op_t op, const size_t block_id, const size_t count, const uint8_t *data);
+
+///
+/// Opens (creating it if needed) the journal of an image, dropping any torn record at its end
+/// \param image The image the journal belongs to
+/// \param block_size Bytes per block of the device
+/// \param num_blocks Blocks on the device, fbm included
+/// \return Pointer to the journal, NULL on error
+///
+journal_t *journal_open(const char *const image, const size_t block_size, const size_t num_blocks);
+
+///
+/// Closes the journal, anything not committed is dropped as if the process had crashed
+/// \param journal The journal
+///
+void journal_close(journal_t *const journal);
+
+///
+/// Tells whether the journal belongs to the given image
+/// \param journal The journal
+/// \param image The image
+/// \return true if it does
+///
+bool journal_covers(const journal_t *const journal, const char *const image);
+
+///
+/// Adds a block's new contents to the pending transaction
+/// \param journal The journal
+/// \param block_id The block
+/// \param data block_size bytes
+///
+void journal_write(journal_t *const journal, const size_t block_id, const void *const data);
+
+///
+/// Adds an fbm change to the pending transaction
+/// \param journal The journal
+/// \param op JOURNAL_ALLOCATE or JOURNAL_RELEASE
+/// \param start First block of the run
+/// \param count Blocks in the run
+///
+void journal_range(journal_t *const journal, const journal_op_t op, const size_t start, const size_t count);
+
+///
+/// Appends the pending transaction as one record and waits until it's on disk
+/// Threads committing at the same time share one sync (group commit)
+/// \param journal The journal
+/// \return boolean indicating succes of operation, the transaction is dropped if
+///  a change couldn't be added to it and kept for another try if the write failed
+///
+bool journal_commit(journal_t *const journal);
+
+///
+/// Empties the journal once its image has caught up, the pending transaction stays
+/// \param journal The journal
+/// \return boolean indicating succes of operation
+///
+bool journal_truncate(journal_t *const journal);
+
+///
+/// Applies every committed record in an image's journal, in order
+/// \param image The image the journal belongs to
+/// \param block_size Bytes per block of the device
+/// \param num_blocks Blocks on the device, entries outside it end the replay
+/// \param apply Called for each entry
+/// \param context Passed to apply
+/// \return Number of records applied, 0 if there's no journal
+///
+size_t journal_replay(const char *const image, const size_t block_size, const size_t num_blocks, journal_apply_t apply, void *context);
+
+#endif
@@ -0,0 +1,219 @@
+#include <stdbool.h>
+#include <string.h>
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4          // shortest match worth a sequence
+#define LZ_LAST_LITERALS 5      // the format ends every block with at least this many literals
+#define LZ_MATCH_LIMIT 12       // and no match starts closer than this to the end
+#define LZ_MAX_OFFSET 65535     // offsets are two bytes
+#define LZ_HASH_BITS 12
+#define LZ_SKIP_TRIGGER 6       // search step grows by one every 64 bytes without a match
+
+static inline uint32_t read32(const uint8_t *const p){
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t lz_hash(const uint32_t value){
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// how far the bytes at a and b agree, stopping at limit (which bounds a)
+static inline size_t match_length(const uint8_t *a, const uint8_t *b, const uint8_t *const limit){
+    const uint8_t *const start = a;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    // eight bytes at a time, the first differing byte is the lowest set byte of the xor
+    while(a + 8 <= limit){
+        uint64_t x, y;
+        memcpy(&x, a, sizeof(x));
+        memcpy(&y, b, sizeof(y));
+        if(x != y){
+            return (size_t)(a - start) + ((size_t)__builtin_ctzll(x ^ y) >> 3);
+        }
+        a += 8;
+        b += 8;
+    }
+#endif
+    while((a < limit) && (*a == *b)){
+        a++;
+        b++;
+    }
+    return (size_t)(a - start);
+}
+
+// writes the part of a length that didn't fit in its token nibble
+static inline uint8_t *put_length(uint8_t *op, size_t length){
+    while(length >= 255){
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+// writes a sequence: literals [anchor, anchor + literals) then a match, none if match is 0
+static inline uint8_t *put_sequence(uint8_t *op, const uint8_t *const anchor, const size_t literals, const size_t offset, const size_t match){
+    uint8_t *token = op++;
+    *token = (uint8_t)(((literals >= 15) ? 15 : literals) << 4);
+    if(literals >= 15){
+        op = put_length(op, literals - 15);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    if(match != 0){
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        const size_t extra = match - LZ_MIN_MATCH;
+        *token |= (uint8_t)((extra >= 15) ? 15 : extra);
+        if(extra >= 15){
+            op = put_length(op, extra - 15);
+        }
+    }
+    return op;
+}
+
+///
+/// Largest output lz_compress can produce for an input of the given size
+/// \param length Input bytes
+/// \return Output bytes to allow for
+///
+size_t lz_bound(const size_t length)
+{
+    return length + length / 255 + 16;
+}
+
+///
+/// Compresses a buffer
+/// \param src The input
+/// \param length Input bytes
+/// \param dst Where the output goes
+/// \param capacity Room at dst, has to be at least lz_bound(length)
+/// \return Output bytes, 0 if capacity is too small
+///
+size_t lz_compress(const void *const src, const size_t length, void *const dst, const size_t capacity)
+{
+    if((src == NULL) || (dst == NULL) || (capacity < lz_bound(length))){
+        return 0;
+    }
+    const uint8_t *const base = (const uint8_t *)src;
+    const uint8_t *const end = base + length;
+    const uint8_t *ip = base, *anchor = base;
+    uint8_t *op = (uint8_t *)dst;
+    if(length > LZ_MATCH_LIMIT){
+        // positions are offsets from base, a stale or empty slot just fails the compare
+        uint32_t table[1 << LZ_HASH_BITS];
+        memset(table, 0, sizeof(table));
+        const uint8_t *const searchEnd = end - LZ_MATCH_LIMIT;
+        const uint8_t *const matchEnd = end - LZ_LAST_LITERALS;
+        while(ip < searchEnd){
+            const uint32_t sequence = read32(ip);
+            const uint32_t h = lz_hash(sequence);
+            const uint8_t *ref = base + table[h];
+            table[h] = (uint32_t)(ip - base);
+            if((ref >= ip) || ((size_t)(ip - ref) > LZ_MAX_OFFSET) || (read32(ref) != sequence)){
+                // incompressible stretches are skipped over faster the longer they go on
+                ip += 1 + ((size_t)(ip - anchor) >> LZ_SKIP_TRIGGER);
+                continue;
+            }
+            // a match can often be pulled back over literals that happen to agree too
+            while((ip > anchor) && (ref > base) && (ip[-1] == ref[-1])){
+                ip--;
+                ref--;
+            }
+            const size_t match = LZ_MIN_MATCH + match_length(ip + LZ_MIN_MATCH, ref + LZ_MIN_MATCH, matchEnd);
+            op = put_sequence(op, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), match);
+            ip += match;
+            anchor = ip;
+            // the position just before the next search seeds the table for repeats
+            if(ip < searchEnd){
+                table[lz_hash(read32(ip - 2))] = (uint32_t)(ip - 2 - base);
+            }
+        }
+    }
+    op = put_sequence(op, anchor, (size_t)(end - anchor), 0, 0);
+    return (size_t)(op - (uint8_t *)dst);
+}
+
+// reads the part of a length past its token nibble, false if the input ends first
+static inline bool get_length(const uint8_t **const ip, const uint8_t *const end, size_t *const length){
+    uint8_t byte;
+    do{
+        if(*ip >= end){
+            return false;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    }while(byte == 255);
+    return true;
+}
+
+///
+/// Decompresses a buffer from lz_compress, never reading or writing outside the given ones
+/// \param src The compressed input
+/// \param length Input bytes
+/// \param dst Where the output goes
+/// \param capacity Room at dst
+/// \return Output bytes, SIZE_MAX if the input is malformed or doesn't fit
+///
+size_t lz_decompress(const void *const src, const size_t length, void *const dst, const size_t capacity)
+{
+    if((src == NULL) || (dst == NULL)){
+        return SIZE_MAX;
+    }
+    const uint8_t *ip = (const uint8_t *)src;
+    const uint8_t *const end = ip + length;
+    uint8_t *const out = (uint8_t *)dst;
+    uint8_t *op = out;
+    uint8_t *const outEnd = out + capacity;
+    while(ip < end){
+        const uint8_t token = *ip++;
+        size_t literals = token >> 4;
+        if((literals == 15) && !get_length(&ip, end, &literals)){
+            return SIZE_MAX;
+        }
+        if((literals > (size_t)(end - ip)) || (literals > (size_t)(outEnd - op))){
+            return SIZE_MAX;
+        }
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        // the last sequence is only literals
+        if(ip == end){
+            break;
+        }
+        if(end - ip < 2){
+            return SIZE_MAX;
+        }
+        const size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t match = token & 15;
+        if((match == 15) && !get_length(&ip, end, &match)){
+            return SIZE_MAX;
+        }
+        match += LZ_MIN_MATCH;
+        if((offset == 0) || (offset > (size_t)(op - out)) || (match > (size_t)(outEnd - op))){
+            return SIZE_MAX;
+        }
+        const uint8_t *ref = op - offset;
+        if((offset >= 8) && ((size_t)(outEnd - op) >= match + 8)){
+            // whole words, the up to seven bytes past the match are overwritten by what follows
+            // (or lie past the end of the output)
+            uint8_t *const stop = op + match;
+            while(op < stop){
+                memcpy(op, ref, 8);
+                op += 8;
+                ref += 8;
+            }
+            op = stop;
+        }
+        else{
+            // close repeats overlap themselves, byte by byte is what makes them repeat
+            for(size_t i = 0; i < match; i++){
+                op[i] = ref[i];
+            }
+            op += match;
+        }
+    }
+    return (size_t)(op - out);
+}
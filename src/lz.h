@@ -0,0 +1,37 @@
+#ifndef LZ_H__
+#define LZ_H__
+
+// A small LZ77 codec in the LZ4 block format: fast to compress, faster to decompress
+// Used for compressed images, the output of lz_compress decodes with any LZ4 block decoder
+
+#include <stddef.h>
+#include <stdint.h>
+
+///
+/// Largest output lz_compress can produce for an input of the given size
+/// \param length Input bytes
+/// \return Output bytes to allow for
+///
+size_t lz_bound(const size_t length);
+
+///
+/// Compresses a buffer
+/// \param src The input
+/// \param length Input bytes
+/// \param dst Where the output goes
+/// \param capacity Room at dst, has to be at least lz_bound(length)
+/// \return Output bytes, 0 if capacity is too small
+///
+size_t lz_compress(const void *const src, const size_t length, void *const dst, const size_t capacity);
+
+///
+/// Decompresses a buffer from lz_compress, never reading or writing outside the given ones
+/// \param src The compressed input
+/// \param length Input bytes
+/// \param dst Where the output goes
+/// \param capacity Room at dst
+/// \return Output bytes, SIZE_MAX if the input is malformed or doesn't fit
+///
+size_t lz_decompress(const void *const src, const size_t length, void *const dst, const size_t capacity);
+
+#endif
@@ -3,7 +3,14 @@
 
 #include <gtest/gtest.h>
 #include <sys/stat.h>
+#include <algorithm>
+#include <random>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include "block_store.h"
+#include "bitmap.h"
+#include "block_store_sharded.h"
 
 // The object is opaque, so we can't really test things directly....
 
@@ -49,10 +56,58 @@ TEST(block_store_destroy, null_pointer) {
 
 
 TEST(block_store_get_total_blocks, num_blocks) {
-    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS, block_store_get_total_blocks());
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS, block_store_get_total_blocks(bs));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_get_block_size(bs));
+    ASSERT_EQ(SIZE_MAX, block_store_get_total_blocks(NULL));
+    block_store_destroy(bs);
     score += 2;
 }
 
+TEST(block_store_create, create_ex_bad_geometry) {
+    // not a power of two
+    ASSERT_EQ(nullptr, block_store_create_ex(1024, 1000));
+    // too small to hold anything
+    ASSERT_EQ(nullptr, block_store_create_ex(1024, 4));
+    ASSERT_EQ(nullptr, block_store_create_ex(0, 256));
+    // nothing left over for the user once the FBM takes its block
+    ASSERT_EQ(nullptr, block_store_create_ex(1, 256));
+    // overflows the address space
+    ASSERT_EQ(nullptr, block_store_create_ex(SIZE_MAX / 2, 4096));
+}
+
+TEST(block_store_create, create_ex_large) {
+    // 2^20 blocks of 1KiB, the FBM takes 128KiB or 128 blocks at the end
+    const size_t num_blocks = 1 << 20, block_size = 1024;
+    block_store_t *bs = block_store_create_ex(num_blocks, block_size);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    const size_t avail = num_blocks - 128;
+    ASSERT_EQ(avail, block_store_get_total_blocks(bs));
+    ASSERT_EQ(block_size, block_store_get_block_size(bs));
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    ASSERT_EQ(avail, block_store_get_free_blocks(bs));
+
+    ASSERT_EQ(true, block_store_request(bs, avail - 1));
+    ASSERT_EQ(false, block_store_request(bs, avail));
+    ASSERT_EQ(0, block_store_allocate(bs));
+    ASSERT_EQ(2, block_store_get_used_blocks(bs));
+
+    uint8_t *write_buffer = (uint8_t *) calloc(1, block_size);
+    uint8_t *read_buffer = (uint8_t *) calloc(1, block_size);
+    ASSERT_NE(nullptr, write_buffer) << "calloc ... failed?" << std::endl;
+    ASSERT_NE(nullptr, read_buffer) << "calloc ... failed?" << std::endl;
+    memset(write_buffer, '~', block_size);
+    ASSERT_EQ(block_size, block_store_write(bs, avail - 1, write_buffer));
+    ASSERT_EQ(block_size, block_store_read(bs, avail - 1, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, write_buffer, block_size));
+    ASSERT_EQ(0, block_store_read(bs, num_blocks, read_buffer));
+
+    free(read_buffer);
+    free(write_buffer);
+    block_store_destroy(bs);
+}
+
 TEST(block_store_alloc_free_req, allocate_null) {
     size_t id;
     id = block_store_allocate(nullptr);
@@ -107,6 +162,124 @@ TEST(block_store_alloc_free_req, over_allocate) {
 }
 
 
+TEST(block_store_alloc_free_req, next_fit) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    ASSERT_EQ(false, block_store_set_policy(NULL, BLOCK_STORE_NEXT_FIT));
+    ASSERT_EQ(true, block_store_set_policy(bs, BLOCK_STORE_NEXT_FIT));
+
+    ASSERT_EQ(0, block_store_allocate(bs));
+    ASSERT_EQ(1, block_store_allocate(bs));
+    block_store_release(bs, 0);
+    // next fit keeps going instead of reusing the freed block
+    ASSERT_EQ(2, block_store_allocate(bs));
+
+    // fill up the rest, then the cursor has to wrap around to find block 0
+    for (size_t i = 3; i < BLOCK_STORE_AVAIL_BLOCKS; i++) {
+        ASSERT_EQ(i, block_store_allocate(bs));
+    }
+    ASSERT_EQ(0, block_store_allocate(bs));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+
+    // back to first fit
+    block_store_release(bs, 200);
+    block_store_release(bs, 100);
+    ASSERT_EQ(true, block_store_set_policy(bs, BLOCK_STORE_FIRST_FIT));
+    ASSERT_EQ(100, block_store_allocate(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_alloc_free_req, allocate_near) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_near(NULL, 10));
+
+    ASSERT_EQ(50, block_store_allocate_near(bs, 50));
+    ASSERT_EQ(51, block_store_allocate_near(bs, 50));
+    ASSERT_EQ(true, block_store_request(bs, 254));
+    // nothing free at or after the hint, so it wraps around
+    ASSERT_EQ(0, block_store_allocate_near(bs, 254));
+    // out of range hints just start at the bottom
+    ASSERT_EQ(1, block_store_allocate_near(bs, 5000));
+    // near allocations don't disturb first fit
+    ASSERT_EQ(2, block_store_allocate(bs));
+    block_store_destroy(bs);
+}
+
+
+TEST(block_store_alloc_free_req, extents) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    size_t first = 0;
+    ASSERT_EQ(false, block_store_allocate_extent(NULL, 4, &first));
+    ASSERT_EQ(false, block_store_allocate_extent(bs, 0, &first));
+    ASSERT_EQ(false, block_store_allocate_extent(bs, 4, NULL));
+    ASSERT_EQ(false, block_store_allocate_extent(bs, BLOCK_STORE_AVAIL_BLOCKS + 1, &first));
+
+    // leave holes too small for the run we ask for next
+    ASSERT_EQ(true, block_store_request(bs, 3));
+    ASSERT_EQ(true, block_store_request(bs, 69));
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 66, &first));
+    ASSERT_EQ(70, first);
+    ASSERT_EQ(68, block_store_get_used_blocks(bs));
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 3, &first));
+    ASSERT_EQ(0, first);
+
+    // the run can't spill into the FBM at the end
+    ASSERT_EQ(false, block_store_allocate_extent(bs, BLOCK_STORE_AVAIL_BLOCKS - 135, &first));
+    ASSERT_EQ(true, block_store_allocate_extent(bs, BLOCK_STORE_AVAIL_BLOCKS - 136, &first));
+    ASSERT_EQ(136, first);
+
+    block_store_release_extent(bs, 70, 66);
+    ASSERT_EQ(124, block_store_get_used_blocks(bs));
+    // releasing over the end is refused
+    block_store_release_extent(bs, 200, 100);
+    ASSERT_EQ(124, block_store_get_used_blocks(bs));
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 66, &first));
+    ASSERT_EQ(70, first);
+    block_store_destroy(bs);
+}
+
+
+TEST(block_store_alloc_free_req, batches) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    size_t ids[BLOCK_STORE_AVAIL_BLOCKS + 10];
+    ASSERT_EQ(0, block_store_allocate_many(NULL, 10, ids));
+    ASSERT_EQ(0, block_store_allocate_many(bs, 10, NULL));
+
+    ASSERT_EQ(true, block_store_request(bs, 1));
+    ASSERT_EQ(true, block_store_request(bs, 3));
+    ASSERT_EQ(4, block_store_allocate_many(bs, 4, ids));
+    ASSERT_EQ(0, ids[0]);
+    ASSERT_EQ(2, ids[1]);
+    ASSERT_EQ(4, ids[2]);
+    ASSERT_EQ(5, ids[3]);
+
+    // asking for more than is left hands out what there is
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS - 6, block_store_allocate_many(bs, BLOCK_STORE_AVAIL_BLOCKS, ids));
+    ASSERT_EQ(6, ids[0]);
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS - 1, ids[BLOCK_STORE_AVAIL_BLOCKS - 7]);
+    ASSERT_EQ(0, block_store_get_free_blocks(bs));
+    ASSERT_EQ(0, block_store_allocate_many(bs, 1, ids));
+
+    // bad ids in the list get skipped
+    const size_t release[] = {7, 9000, 100, BLOCK_STORE_AVAIL_BLOCKS, 200};
+    block_store_release_many(bs, release, 5);
+    ASSERT_EQ(3, block_store_get_free_blocks(bs));
+
+    // next fit wraps around the device in the same pass
+    ASSERT_EQ(true, block_store_set_policy(bs, BLOCK_STORE_NEXT_FIT));
+    ASSERT_EQ(7, block_store_allocate(bs));
+    block_store_release(bs, 7);
+    ASSERT_EQ(3, block_store_allocate_many(bs, 5, ids));
+    ASSERT_EQ(100, ids[0]);
+    ASSERT_EQ(200, ids[1]);
+    ASSERT_EQ(7, ids[2]);
+    block_store_destroy(bs);
+}
+
+
 TEST(block_store_alloc_free_req, null_pointers) {
     size_t res = 0;
 
@@ -198,6 +371,631 @@ TEST(block_store, count_free_and_used_null) {
     score += 2;
 }
 
+TEST(block_store, used_counter) {
+    // the counters are kept up as blocks come and go, debug mode checks them against the fbm
+    block_store_t *bs = block_store_create_ex(4096, 64);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    ASSERT_EQ(true, block_store_set_debug(bs, true));
+    const size_t avail = block_store_get_total_blocks(bs);
+    size_t first = 0;
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 100, &first));
+    ASSERT_EQ(true, block_store_request(bs, 500));
+    ASSERT_EQ(false, block_store_request(bs, 500));
+    ASSERT_EQ(101, block_store_get_used_blocks(bs));
+    ASSERT_EQ(avail - 101, block_store_get_free_blocks(bs));
+
+    // releasing blocks that are already free doesn't count twice
+    block_store_release(bs, 10);
+    block_store_release(bs, 10);
+    ASSERT_EQ(100, block_store_get_used_blocks(bs));
+    ASSERT_EQ(true, block_store_set_debug(bs, false));
+    block_store_release(bs, 11);
+    block_store_release(bs, 11);
+    block_store_release_extent(bs, 50, 100);
+    ASSERT_EQ(49, block_store_get_used_blocks(bs));
+    ASSERT_EQ(true, block_store_set_concurrent(bs, true));
+    block_store_release_extent(bs, 0, 50);
+    block_store_release(bs, 700);
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    ASSERT_EQ(true, block_store_set_concurrent(bs, false));
+
+    // a loaded image starts with the count from its fbm
+    ASSERT_EQ(true, block_store_set_debug(bs, true));
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 30, &first));
+    ASSERT_EQ(31, block_store_get_used_blocks(bs));
+    ASSERT_EQ(0, block_store_get_debug_violations(bs));
+    ASSERT_NE(0, block_store_save(bs, "test_counter.bs"));
+    block_store_destroy(bs);
+    bs = block_store_load("test_counter.bs", 0, NULL);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(31, block_store_get_used_blocks(bs));
+    ASSERT_EQ(avail - 31, block_store_get_free_blocks(bs));
+    block_store_destroy(bs);
+    remove("test_counter.bs");
+}
+
+static void collect_id(size_t id, void *arg)
+{
+    std::vector<size_t> *ids = (std::vector<size_t> *) arg;
+    ids->push_back(id);
+}
+
+TEST(block_store, for_each_allocated) {
+    block_store_t *bs = block_store_create_ex(4096, 64);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    std::vector<size_t> seen;
+    ASSERT_EQ(0, block_store_for_each_allocated(bs, collect_id, &seen));
+    const size_t ids[] = {0, 1, 63, 64, 1000, block_store_get_total_blocks(bs) - 1};
+    for (size_t id : ids) {
+        ASSERT_EQ(true, block_store_request(bs, id));
+    }
+    // the fbm's own blocks are set too but never show up
+    ASSERT_EQ(6, block_store_for_each_allocated(bs, collect_id, &seen));
+    ASSERT_EQ(std::vector<size_t>(ids, ids + 6), seen);
+    ASSERT_EQ(SIZE_MAX, block_store_for_each_allocated(NULL, collect_id, &seen));
+    ASSERT_EQ(SIZE_MAX, block_store_for_each_allocated(bs, NULL, &seen));
+    block_store_destroy(bs);
+}
+
+TEST(block_store, buddy) {
+    // 1024 blocks of 64 bytes leave 1022 user blocks, free chunks of 512, 256, ..., 2
+    block_store_t *bs = block_store_create_ex(1024, 64);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_order(bs, 0));
+    ASSERT_EQ(true, block_store_set_buddy(bs, true));
+    ASSERT_EQ(false, block_store_set_concurrent(bs, true));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_order(bs, 10));
+
+    // the smallest chunk that fits gets used
+    ASSERT_EQ(1008, block_store_allocate_order(bs, 3));
+    ASSERT_EQ(1020, block_store_allocate(bs));
+    ASSERT_EQ(1021, block_store_allocate_order(bs, 0));
+    ASSERT_EQ(0, block_store_allocate_order(bs, 9));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_order(bs, 9));
+    block_store_release_order(bs, 0, 9);
+
+    // requests split the chunk they land in, releases merge it back
+    ASSERT_EQ(true, block_store_request(bs, 300));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_order(bs, 9));
+    ASSERT_EQ(0, block_store_allocate_order(bs, 8));
+    ASSERT_EQ(384, block_store_allocate_order(bs, 7));
+    ASSERT_EQ(512, block_store_allocate_order(bs, 8));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_order(bs, 8));
+    block_store_release(bs, 300);
+    block_store_release_order(bs, 384, 7);
+    block_store_release_order(bs, 0, 8);
+    ASSERT_EQ(0, block_store_allocate_order(bs, 9));
+    block_store_release_extent(bs, 0, 512);
+    block_store_release_order(bs, 512, 8);
+    block_store_release_order(bs, 1008, 3);
+    block_store_release_many(bs, std::vector<size_t>{1020, 1021}.data(), 2);
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+
+    // churn with every kind of call, then everything goes back and merges into the big chunks
+    std::mt19937_64 rng(3);
+    std::vector<std::pair<size_t, unsigned>> held;
+    for (size_t round = 0; round < 20000; ++round) {
+        const unsigned order = rng() % 5;
+        if (held.size() > 0 && rng() % 2) {
+            const size_t pick = rng() % held.size();
+            block_store_release_order(bs, held[pick].first, held[pick].second);
+            held[pick] = held.back();
+            held.pop_back();
+        } else if (rng() % 4 == 0) {
+            size_t first = 0;
+            if (block_store_allocate_extent(bs, (size_t) 1 << order, &first)) {
+                held.push_back({first, order});
+            }
+        } else {
+            const size_t id = block_store_allocate_order(bs, order);
+            if (id != SIZE_MAX) {
+                ASSERT_EQ(0, id % ((size_t) 1 << order));
+                held.push_back({id, order});
+            }
+        }
+    }
+    size_t blocks_held = 0;
+    for (const std::pair<size_t, unsigned> &h : held) {
+        blocks_held += (size_t) 1 << h.second;
+    }
+    ASSERT_EQ(blocks_held, block_store_get_used_blocks(bs));
+    // one release over everything, most of it already free
+    block_store_release_extent(bs, 0, block_store_get_total_blocks(bs));
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    ASSERT_EQ(0, block_store_allocate_order(bs, 9));
+    ASSERT_EQ(512, block_store_allocate_order(bs, 8));
+    ASSERT_EQ(true, block_store_set_buddy(bs, false));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_order(bs, 0));
+    ASSERT_EQ(true, block_store_set_concurrent(bs, true));
+    ASSERT_EQ(false, block_store_set_buddy(bs, true));
+    block_store_destroy(bs);
+}
+
+TEST(block_store, buddy_magazines) {
+    // buddy allocations skip the magazines, so releases into them would leak the blocks
+    block_store_t *bs = block_store_create_ex(1024, 64);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    ASSERT_EQ(true, block_store_set_buddy(bs, true));
+    ASSERT_EQ(false, block_store_set_magazines(bs, 8));
+    ASSERT_EQ(true, block_store_set_magazines(bs, 0));
+    const size_t id = block_store_allocate(bs);
+    ASSERT_NE(SIZE_MAX, id);
+    block_store_release(bs, id);
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    ASSERT_EQ(0, block_store_allocate_order(bs, 9));
+    block_store_release_order(bs, 0, 9);
+
+    ASSERT_EQ(true, block_store_set_buddy(bs, false));
+    ASSERT_EQ(true, block_store_set_magazines(bs, 8));
+    ASSERT_EQ(false, block_store_set_buddy(bs, true));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_order(bs, 0));
+    ASSERT_EQ(true, block_store_set_magazines(bs, 0));
+    ASSERT_EQ(true, block_store_set_buddy(bs, true));
+    ASSERT_EQ(0, block_store_allocate_order(bs, 9));
+    block_store_destroy(bs);
+}
+
+// fragmentation from the fbm, concurrent mode drops the extent index and walks it instead
+static block_store_fragmentation_t scanned_fragmentation(block_store_t *bs) {
+    block_store_fragmentation_t stats;
+    EXPECT_EQ(true, block_store_set_concurrent(bs, true));
+    EXPECT_EQ(true, block_store_get_fragmentation(bs, &stats));
+    EXPECT_EQ(true, block_store_set_concurrent(bs, false));
+    return stats;
+}
+
+static void expect_same_fragmentation(const block_store_fragmentation_t &a, const block_store_fragmentation_t &b) {
+    EXPECT_EQ(a.free_blocks, b.free_blocks);
+    EXPECT_EQ(a.extents, b.extents);
+    EXPECT_EQ(a.largest, b.largest);
+    for (size_t bucket = 0; bucket < BLOCK_STORE_EXTENT_BUCKETS; ++bucket) {
+        EXPECT_EQ(a.histogram[bucket], b.histogram[bucket]) << "bucket " << bucket;
+    }
+}
+
+TEST(block_store, extent_index) {
+    // 1024 blocks of 64 bytes leave 1022 user blocks
+    block_store_fragmentation_t stats;
+    size_t first = 0;
+    ASSERT_EQ(SIZE_MAX, block_store_largest_free_extent(NULL, &first));
+    ASSERT_EQ(false, block_store_get_fragmentation(NULL, &stats));
+    block_store_t *bs = block_store_create_ex(1024, 64);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    ASSERT_EQ(false, block_store_get_fragmentation(bs, NULL));
+    ASSERT_EQ(1022, block_store_largest_free_extent(bs, &first));
+    ASSERT_EQ(0, first);
+    ASSERT_EQ(true, block_store_get_fragmentation(bs, &stats));
+    ASSERT_EQ(1022, stats.free_blocks);
+    ASSERT_EQ(1, stats.extents);
+    ASSERT_EQ(1, stats.histogram[9]);
+
+    // holes of 3, 1 and 8 blocks and a tail of 1022 - 40 = 982
+    for (size_t id = 0; id < 40; ++id) {
+        ASSERT_EQ(true, block_store_request(bs, id));
+    }
+    block_store_release_extent(bs, 2, 3);
+    block_store_release(bs, 10);
+    block_store_release_extent(bs, 20, 8);
+    ASSERT_EQ(982, block_store_largest_free_extent(bs, &first));
+    ASSERT_EQ(40, first);
+    ASSERT_EQ(true, block_store_get_fragmentation(bs, &stats));
+    ASSERT_EQ(994, stats.free_blocks);
+    ASSERT_EQ(4, stats.extents);
+    ASSERT_EQ(1, stats.histogram[0]);
+    ASSERT_EQ(1, stats.histogram[1]);
+    ASSERT_EQ(1, stats.histogram[3]);
+    ASSERT_EQ(1, stats.histogram[9]);
+    expect_same_fragmentation(stats, scanned_fragmentation(bs));
+
+    // best fit takes the smallest hole that fits, first fit the lowest
+    ASSERT_EQ(false, block_store_set_policy(bs, (block_store_policy_t) 7));
+    ASSERT_EQ(true, block_store_set_policy(bs, BLOCK_STORE_BEST_FIT));
+    ASSERT_EQ(10, block_store_allocate(bs));
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 4, &first));
+    ASSERT_EQ(20, first);
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 3, &first));
+    ASSERT_EQ(2, first);
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 2, &first));
+    ASSERT_EQ(24, first);
+    ASSERT_EQ(false, block_store_allocate_extent(bs, 1000, &first));
+    ASSERT_EQ(true, block_store_set_policy(bs, BLOCK_STORE_FIRST_FIT));
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 2, &first));
+    ASSERT_EQ(26, first);
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 2, &first));
+    ASSERT_EQ(40, first);
+    ASSERT_EQ(980, block_store_largest_free_extent(bs, &first));
+    ASSERT_EQ(42, first);
+
+    // holes of 2, 2 and 1 blocks, and the block before the tail joins it: 1022 - 41 = 981
+    block_store_release_extent(bs, 30, 2);
+    block_store_release(bs, 35);
+    block_store_release_extent(bs, 5, 2);
+    block_store_release(bs, 41);
+    ASSERT_EQ(981, block_store_largest_free_extent(bs, &first));
+    ASSERT_EQ(41, first);
+    ASSERT_EQ(true, block_store_get_fragmentation(bs, &stats));
+    ASSERT_EQ(986, stats.free_blocks);
+    ASSERT_EQ(4, stats.extents);
+    ASSERT_EQ(1, stats.histogram[0]);
+    ASSERT_EQ(2, stats.histogram[1]);
+    ASSERT_EQ(1, stats.histogram[9]);
+    expect_same_fragmentation(stats, scanned_fragmentation(bs));
+
+    // best fit breaks ties between equal holes by taking the lowest
+    ASSERT_EQ(true, block_store_set_policy(bs, BLOCK_STORE_BEST_FIT));
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 2, &first));
+    ASSERT_EQ(5, first);
+    ASSERT_EQ(35, block_store_allocate(bs));
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 2, &first));
+    ASSERT_EQ(30, first);
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 2, &first));
+    ASSERT_EQ(41, first);
+    block_store_release_extent(bs, 5, 2);
+    block_store_release(bs, 35);
+    block_store_release_extent(bs, 30, 2);
+    block_store_release_extent(bs, 41, 2);
+    ASSERT_EQ(true, block_store_get_fragmentation(bs, &stats));
+    ASSERT_EQ(986, stats.free_blocks);
+    ASSERT_EQ(4, stats.extents);
+
+    // a request in the middle of the tail splits it in two equal runs, the lowest one is the largest
+    ASSERT_EQ(true, block_store_request(bs, 531));
+    ASSERT_EQ(490, block_store_largest_free_extent(bs, &first));
+    ASSERT_EQ(41, first);
+    ASSERT_EQ(true, block_store_get_fragmentation(bs, &stats));
+    ASSERT_EQ(5, stats.extents);
+    ASSERT_EQ(490, stats.largest);
+    ASSERT_EQ(2, stats.histogram[8]);
+    ASSERT_EQ(0, stats.histogram[9]);
+    expect_same_fragmentation(stats, scanned_fragmentation(bs));
+    block_store_release(bs, 531);
+    ASSERT_EQ(981, block_store_largest_free_extent(bs, &first));
+
+    // releasing the blocks between two holes merges them with both
+    block_store_release_extent(bs, 32, 3);
+    ASSERT_EQ(true, block_store_get_fragmentation(bs, &stats));
+    ASSERT_EQ(989, stats.free_blocks);
+    ASSERT_EQ(3, stats.extents);
+    ASSERT_EQ(0, stats.histogram[0]);
+    ASSERT_EQ(1, stats.histogram[1]);
+    ASSERT_EQ(1, stats.histogram[2]);
+    ASSERT_EQ(1, stats.histogram[9]);
+    expect_same_fragmentation(stats, scanned_fragmentation(bs));
+    size_t largest_start = 0;
+    const size_t largest = block_store_largest_free_extent(bs, &largest_start);
+    ASSERT_EQ(981, largest);
+
+    // a loaded image builds its index from the fbm it brings along
+    ASSERT_NE(0, block_store_save(bs, "test_extents.bs"));
+    block_store_t *loaded = block_store_load("test_extents.bs", 0, NULL);
+    remove("test_extents.bs");
+    ASSERT_NE(nullptr, loaded);
+    block_store_fragmentation_t loaded_stats;
+    ASSERT_EQ(true, block_store_get_fragmentation(loaded, &loaded_stats));
+    expect_same_fragmentation(stats, loaded_stats);
+    ASSERT_EQ(largest, block_store_largest_free_extent(loaded, &first));
+    ASSERT_EQ(largest_start, first);
+    block_store_destroy(loaded);
+
+    // everything goes back and merges into one extent
+    block_store_release_extent(bs, 0, 1022);
+    ASSERT_EQ(1022, block_store_largest_free_extent(bs, &first));
+    ASSERT_EQ(0, first);
+    ASSERT_EQ(true, block_store_get_fragmentation(bs, &stats));
+    ASSERT_EQ(1, stats.extents);
+    block_store_destroy(bs);
+}
+
+// remap callback for the compaction test, keeps the caller's id -> data map current
+static void note_move(void *context, size_t old_id, size_t new_id) {
+    std::vector<std::pair<size_t, uint8_t>> *held = (std::vector<std::pair<size_t, uint8_t>> *) context;
+    for (std::pair<size_t, uint8_t> &h : *held) {
+        if (h.first == old_id) {
+            h.first = new_id;
+            return;
+        }
+    }
+    ADD_FAILURE() << "moved block " << old_id << " that nobody holds";
+}
+
+TEST(block_store, compact) {
+    // 1024 blocks of 64 bytes leave 1022 user blocks
+    ASSERT_EQ(SIZE_MAX, block_store_compact(NULL, NULL, NULL, NULL));
+    block_store_t *bs = block_store_create_ex(1024, 64);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    ASSERT_EQ(0, block_store_compact(bs, NULL, NULL, NULL));
+
+    // every third block, each filled with its own byte
+    std::vector<std::pair<size_t, uint8_t>> held;
+    uint8_t buffer[64];
+    for (size_t id = 0; id < 1022; id += 3) {
+        ASSERT_EQ(true, block_store_request(bs, id));
+        memset(buffer, (int) (id & 0xFF), sizeof(buffer));
+        ASSERT_EQ(64, block_store_write(bs, id, buffer));
+        held.push_back({id, (uint8_t) (id & 0xFF)});
+    }
+    const size_t used = held.size();
+    ASSERT_EQ(true, block_store_set_magazines(bs, 8));
+    ASSERT_EQ(SIZE_MAX, block_store_compact(bs, NULL, note_move, &held));
+    ASSERT_EQ(true, block_store_set_magazines(bs, 0));
+    // nor can one in concurrent mode, an owner could change a block while it's copied
+    ASSERT_EQ(true, block_store_set_concurrent(bs, true));
+    ASSERT_EQ(SIZE_MAX, block_store_compact(bs, NULL, note_move, &held));
+    ASSERT_EQ(true, block_store_set_concurrent(bs, false));
+
+    // a block budget moves exactly that many, a time budget at least one
+    block_store_compact_budget_t budget = {10, 0};
+    ASSERT_EQ(10, block_store_compact(bs, &budget, note_move, &held));
+    budget = {0, 1};
+    ASSERT_LE(1, block_store_compact(bs, &budget, note_move, &held));
+    // pinned blocks stay put in debug mode
+    ASSERT_EQ(true, block_store_set_debug(bs, true));
+    // the highest block is the next one compaction would move
+    const size_t pinned = std::max_element(held.begin(), held.end()) - held.begin();
+    const size_t pinned_id = held[pinned].first;
+    ASSERT_NE(nullptr, block_store_pin(bs, pinned_id));
+    budget = {7, 0};
+    size_t moved, moved_total = 0;
+    while ((moved = block_store_compact(bs, &budget, note_move, &held)) > 0) {
+        ASSERT_NE(SIZE_MAX, moved);
+        ASSERT_GE(7, moved);
+        moved_total += moved;
+    }
+    ASSERT_LT(0, moved_total);
+    ASSERT_EQ(0, block_store_get_debug_violations(bs));
+    ASSERT_EQ(pinned_id, held[pinned].first);
+    block_store_unpin(bs, pinned_id);
+    ASSERT_EQ(true, block_store_set_debug(bs, false));
+    ASSERT_LT(0, block_store_compact(bs, NULL, note_move, &held));
+    ASSERT_EQ(0, block_store_compact(bs, NULL, note_move, &held));
+
+    // everything sits at the bottom with its data
+    ASSERT_EQ(used, block_store_get_used_blocks(bs));
+    size_t first = 0;
+    ASSERT_EQ(1022 - used, block_store_largest_free_extent(bs, &first));
+    ASSERT_EQ(used, first);
+    for (const std::pair<size_t, uint8_t> &h : held) {
+        ASSERT_GT(used, h.first);
+        ASSERT_EQ(64, block_store_read(bs, h.first, buffer));
+        ASSERT_EQ(h.second, buffer[0]);
+        ASSERT_EQ(h.second, buffer[63]);
+    }
+    block_store_destroy(bs);
+}
+
+TEST(block_store, compact_threads) {
+    // writers and releasers keep working while another thread compacts, all serialized by one lock
+    block_store_t *bs = block_store_create_ex(1024, 64);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    std::vector<std::pair<size_t, uint8_t>> held;
+    uint8_t buffer[64];
+    for (size_t id = 1; id < 1022; id += 2) {
+        ASSERT_EQ(true, block_store_request(bs, id));
+        memset(buffer, (int) (id & 0xFF), sizeof(buffer));
+        ASSERT_EQ(64, block_store_write(bs, id, buffer));
+        held.push_back({id, (uint8_t) (id & 0xFF)});
+    }
+
+    std::mutex lock;
+    bool done = false;
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < 3; t++) {
+        workers.emplace_back([bs, t, &lock, &held]() {
+            std::mt19937_64 rng(t);
+            uint8_t data[64];
+            for (size_t round = 0; round < 3000; ++round) {
+                std::lock_guard<std::mutex> guard(lock);
+                const size_t pick = rng() % held.size();
+                const uint8_t value = (uint8_t) rng();
+                memset(data, value, sizeof(data));
+                if (t == 0) {
+                    // the releaser hands a block back and takes a new one
+                    block_store_release(bs, held[pick].first);
+                    held[pick].first = block_store_allocate(bs);
+                    EXPECT_NE(SIZE_MAX, held[pick].first);
+                }
+                EXPECT_EQ(64, block_store_write(bs, held[pick].first, data));
+                held[pick].second = value;
+            }
+        });
+    }
+    std::thread compactor([bs, &lock, &held, &done]() {
+        const block_store_compact_budget_t budget = {4, 0};
+        for (bool last = false; ; ) {
+            size_t moved;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                last = done;
+                moved = block_store_compact(bs, &budget, note_move, &held);
+            }
+            EXPECT_NE(SIZE_MAX, moved);
+            if ((last && moved == 0) || moved == SIZE_MAX) {
+                return;
+            }
+            std::this_thread::yield();
+        }
+    });
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        done = true;
+    }
+    compactor.join();
+
+    // every block is where its owner thinks, with the last data written to it
+    const size_t used = held.size();
+    ASSERT_EQ(used, block_store_get_used_blocks(bs));
+    size_t first = 0;
+    ASSERT_EQ(1022 - used, block_store_largest_free_extent(bs, &first));
+    ASSERT_EQ(used, first);
+    for (const std::pair<size_t, uint8_t> &h : held) {
+        ASSERT_GT(used, h.first);
+        ASSERT_EQ(64, block_store_read(bs, h.first, buffer));
+        ASSERT_EQ(h.second, buffer[0]);
+        ASSERT_EQ(h.second, buffer[63]);
+    }
+    block_store_destroy(bs);
+}
+
+// whole contents of a file, defined with the serialization tests
+static std::vector<uint8_t> file_bytes(const char *path);
+
+// first byte of a block, for the snapshot test
+static uint8_t first_byte(const block_store_t *bs, size_t id) {
+    uint8_t buffer[64];
+    return block_store_read(bs, id, buffer) == 64 ? buffer[0] : 0;
+}
+
+TEST(block_store, snapshot_clone) {
+    ASSERT_EQ(nullptr, block_store_snapshot(NULL));
+    ASSERT_EQ(nullptr, block_store_clone(NULL));
+    block_store_t *bs = block_store_create_ex(1024, 64);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    uint8_t buffer[64];
+    for (size_t id = 0; id < 10; ++id) {
+        ASSERT_EQ(id, block_store_allocate(bs));
+        memset(buffer, (int) ('a' + id), sizeof(buffer));
+        ASSERT_EQ(64, block_store_write(bs, id, buffer));
+    }
+    // copying shared blocks isn't thread safe, so concurrent mode and sharing don't mix
+    ASSERT_EQ(true, block_store_set_concurrent(bs, true));
+    ASSERT_EQ(nullptr, block_store_snapshot(bs));
+    ASSERT_EQ(nullptr, block_store_clone(bs));
+    ASSERT_EQ(true, block_store_set_concurrent(bs, false));
+
+    // a snapshot is read only and sees the device as it was
+    block_store_t *snap = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snap);
+    block_store_t *clone = block_store_clone(bs);
+    ASSERT_NE(nullptr, clone);
+    ASSERT_EQ(false, block_store_set_concurrent(bs, true));
+    ASSERT_EQ(false, block_store_set_concurrent(clone, true));
+    ASSERT_EQ(10, block_store_get_used_blocks(snap));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(snap));
+    ASSERT_EQ(0, block_store_write(snap, 0, buffer));
+    memset(buffer, 'X', sizeof(buffer));
+    ASSERT_EQ(64, block_store_write(bs, 3, buffer));
+    ASSERT_EQ('X', first_byte(bs, 3));
+    ASSERT_EQ('d', first_byte(snap, 3));
+    ASSERT_EQ('d', first_byte(clone, 3));
+
+    // a clone is a device of its own that started out the same
+    ASSERT_EQ(1, block_store_pwrite(clone, 5, 1, 1, "Y"));
+    ASSERT_EQ('f', first_byte(clone, 5));
+    ASSERT_EQ(64, block_store_read(clone, 5, buffer));
+    ASSERT_EQ('Y', buffer[1]);
+    ASSERT_EQ(64, block_store_read(bs, 5, buffer));
+    ASSERT_EQ('f', buffer[1]);
+    ASSERT_EQ(10, block_store_allocate(clone));
+    ASSERT_EQ(10, block_store_allocate(bs));
+    ASSERT_EQ(11, block_store_allocate(bs));
+    block_store_release(clone, 0);
+    ASSERT_EQ(10, block_store_get_used_blocks(clone));
+    ASSERT_EQ(12, block_store_get_used_blocks(bs));
+    ASSERT_EQ(10, block_store_get_used_blocks(snap));
+
+    // writable pointers point at the device's own copy
+    uint8_t *data = (uint8_t *) block_store_block_ptr(bs, 7);
+    ASSERT_NE(nullptr, data);
+    data[0] = 'Z';
+    ASSERT_EQ('Z', first_byte(bs, 7));
+    ASSERT_EQ('h', first_byte(snap, 7));
+    ASSERT_EQ('h', first_byte(clone, 7));
+
+    // incremental images of shared devices go out a block at a time, the first has everything
+    ASSERT_EQ(1024 * 64, block_store_serialize_incremental(bs, "test_snapshot_inc.bs"));
+    ASSERT_EQ(64, block_store_write(bs, 8, buffer));
+    ASSERT_EQ(3 * 64, block_store_serialize_incremental(bs, "test_snapshot_inc.bs"));
+    ASSERT_EQ(1024 * 64, block_store_serialize(bs, "test_snapshot_full.bs"));
+    ASSERT_EQ(file_bytes("test_snapshot_full.bs"), file_bytes("test_snapshot_inc.bs"));
+    ASSERT_EQ(1024 * 64, block_store_serialize_incremental(snap, "test_snapshot_inc.bs"));
+    ASSERT_EQ(2 * 64, block_store_serialize_incremental(snap, "test_snapshot_inc.bs"));
+    remove("test_snapshot_inc.bs");
+    remove("test_snapshot_full.bs");
+
+    // snapshots of a clone share too, and outlive everything they came from
+    block_store_t *clone_snap = block_store_snapshot(clone);
+    ASSERT_NE(nullptr, clone_snap);
+    block_store_destroy(bs);
+    block_store_destroy(clone);
+    ASSERT_EQ(64, block_store_read(clone_snap, 5, buffer));
+    ASSERT_EQ('Y', buffer[1]);
+    ASSERT_EQ('d', first_byte(clone_snap, 3));
+    ASSERT_EQ('h', first_byte(clone_snap, 7));
+    ASSERT_EQ(10, block_store_get_used_blocks(clone_snap));
+
+    // a snapshot isn't in one piece, it gets saved and loaded a block at a time
+    ASSERT_NE(0, block_store_save(snap, "test_snapshot.bs"));
+    block_store_t *loaded = block_store_load("test_snapshot.bs", 0, NULL);
+    remove("test_snapshot.bs");
+    ASSERT_NE(nullptr, loaded);
+    for (size_t id = 0; id < 10; ++id) {
+        ASSERT_EQ('a' + id, first_byte(loaded, id));
+    }
+    ASSERT_EQ(10, block_store_get_used_blocks(loaded));
+    block_store_destroy(loaded);
+    ASSERT_EQ(1024 * 64, block_store_serialize(snap, "test_snapshot.bs"));
+    remove("test_snapshot.bs");
+    block_store_destroy(clone_snap);
+    block_store_destroy(snap);
+
+    // only heap devices can share their blocks
+    remove("test_snapshot_file.bs");
+    bs = block_store_open_file("test_snapshot_file.bs", BLOCK_STORE_MMAP_CREATE, 1024, 64);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(nullptr, block_store_snapshot(bs));
+    block_store_destroy(bs);
+    remove("test_snapshot_file.bs");
+}
+
+TEST(block_store, create_memory) {
+    const block_store_memory_t policies[] = {
+        {BLOCK_STORE_PAGES_DEFAULT, BLOCK_STORE_NUMA_DEFAULT, 0},
+        {BLOCK_STORE_PAGES_TRANSPARENT, BLOCK_STORE_NUMA_DEFAULT, 0},
+        {BLOCK_STORE_PAGES_TRANSPARENT, BLOCK_STORE_NUMA_INTERLEAVE, 0},
+        {BLOCK_STORE_PAGES_DEFAULT, BLOCK_STORE_NUMA_BIND, 0},
+    };
+    uint8_t buffer[256];
+    for (const block_store_memory_t &memory : policies) {
+        // every machine has a node 0, and transparent huge pages are only a hint
+        block_store_t *bs = block_store_create_memory(1 << 14, 256, &memory);
+        ASSERT_NE(nullptr, bs) << "block_store_create_memory returned NULL when it should not have\n";
+        ASSERT_EQ(0, block_store_get_used_blocks(bs));
+        ASSERT_EQ(0, block_store_allocate(bs));
+        memset(buffer, 'h', sizeof(buffer));
+        ASSERT_EQ(256, block_store_write(bs, 0, buffer));
+        ASSERT_EQ(256, block_store_read(bs, 100, buffer));
+        ASSERT_EQ(0, buffer[0]);
+
+        // snapshots work the same as on a calloc'd device, and can outlive it
+        block_store_t *snap = block_store_snapshot(bs);
+        ASSERT_NE(nullptr, snap);
+        block_store_destroy(bs);
+        ASSERT_EQ(256, block_store_read(snap, 0, buffer));
+        ASSERT_EQ('h', buffer[255]);
+        block_store_destroy(snap);
+    }
+    block_store_t *bs = block_store_create_memory(1024, 64, NULL);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(1024 - 2, block_store_get_free_blocks(bs));
+    block_store_destroy(bs);
+
+    // explicit huge pages need a reserved pool, which most machines don't have
+    const block_store_memory_t explicit_pages = {BLOCK_STORE_PAGES_EXPLICIT, BLOCK_STORE_NUMA_DEFAULT, 0};
+    bs = block_store_create_memory(1024, 64, &explicit_pages);
+    if (bs != NULL) {
+        ASSERT_EQ(0, block_store_allocate(bs));
+        block_store_destroy(bs);
+    }
+    const block_store_memory_t bad_node = {BLOCK_STORE_PAGES_DEFAULT, BLOCK_STORE_NUMA_BIND, -1};
+    ASSERT_EQ(nullptr, block_store_create_memory(1024, 64, &bad_node));
+    const block_store_memory_t bad_pages = {(block_store_pages_t) 9, BLOCK_STORE_NUMA_DEFAULT, 0};
+    ASSERT_EQ(nullptr, block_store_create_memory(1024, 64, &bad_pages));
+    ASSERT_EQ(nullptr, block_store_create_memory(1024, 63, NULL));
+}
+
 TEST(block_store_write_read, valid_write) {
     block_store_t *bs = NULL;
     bs = block_store_create();
@@ -224,7 +1022,7 @@ TEST(block_store_write_read, valid_write) {
 TEST(block_store_write_read, null_bs_write) {
     size_t bytesWritten;
     // Want to give buffer a valid value since we are testing bs.
-    int buffer;
+    int buffer = 0;
     bytesWritten = block_store_write(NULL, 0, &buffer);
     ASSERT_EQ(bytesWritten, 0);
 
@@ -252,7 +1050,7 @@ TEST(block_store_write_read, null_buffer_write) {
 TEST(block_store_write_read, null_bs_read) {
     size_t bytesWritten;
     // Want to give buffer a valid value since we are testing bs.
-    int buffer;
+    int buffer = 0;
     bytesWritten = block_store_read(NULL, 0, &buffer);
     ASSERT_EQ(bytesWritten, 0);
     score += 2;
@@ -312,6 +1110,63 @@ TEST(block_store_write_read, valid_write_and_read) {
 }
 
 
+TEST(block_store_write_read, partial_blocks)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    uint8_t block[BLOCK_SIZE_BYTES];
+    memset(block, 'a', BLOCK_SIZE_BYTES);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 9, block));
+
+    // update a 16 byte header in the middle of the block
+    ASSERT_EQ(16, block_store_pwrite(bs, 9, 32, 16, "0123456789abcdef"));
+    char header[16];
+    ASSERT_EQ(16, block_store_pread(bs, 9, 32, 16, header));
+    ASSERT_EQ(0, memcmp(header, "0123456789abcdef", 16));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 9, block));
+    ASSERT_EQ('a', block[31]);
+    ASSERT_EQ('0', block[32]);
+    ASSERT_EQ('a', block[48]);
+
+    // right up to the end is fine, past it isn't
+    ASSERT_EQ(1, block_store_pread(bs, 9, BLOCK_SIZE_BYTES - 1, 1, header));
+    ASSERT_EQ(0, block_store_pread(bs, 9, BLOCK_SIZE_BYTES - 1, 2, header));
+    ASSERT_EQ(0, block_store_pwrite(bs, 9, BLOCK_SIZE_BYTES, 1, header));
+    ASSERT_EQ(0, block_store_pwrite(bs, 9, 1, SIZE_MAX, header));
+    ASSERT_EQ(0, block_store_pread(NULL, 9, 0, 1, header));
+    ASSERT_EQ(0, block_store_pwrite(bs, BLOCK_STORE_NUM_BLOCKS, 0, 1, header));
+    ASSERT_EQ(0, block_store_pwrite(bs, 9, 0, 1, NULL));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_write_read, vectored)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    uint8_t write_buffers[3][BLOCK_SIZE_BYTES], read_buffers[3][BLOCK_SIZE_BYTES];
+    block_store_iovec_t writes[3], reads[3];
+    const size_t ids[3] = {40, 2, 41};
+    for (int i = 0; i < 3; i++) {
+        memset(write_buffers[i], 'x' + i, BLOCK_SIZE_BYTES);
+        writes[i].block_id = ids[i];
+        writes[i].buffer = write_buffers[i];
+        reads[i].block_id = ids[i];
+        reads[i].buffer = read_buffers[i];
+    }
+    ASSERT_EQ(3 * BLOCK_SIZE_BYTES, block_store_writev(bs, writes, 3));
+    ASSERT_EQ(3 * BLOCK_SIZE_BYTES, block_store_readv(bs, reads, 3));
+    ASSERT_EQ(0, memcmp(read_buffers, write_buffers, sizeof(read_buffers)));
+
+    // a bad entry stops the list short
+    reads[1].block_id = BLOCK_STORE_NUM_BLOCKS;
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_readv(bs, reads, 3));
+    writes[0].buffer = NULL;
+    ASSERT_EQ(0, block_store_writev(bs, writes, 3));
+    ASSERT_EQ(0, block_store_readv(NULL, reads, 3));
+    ASSERT_EQ(0, block_store_writev(bs, NULL, 3));
+    block_store_destroy(bs);
+}
+
 TEST(block_store_serialize, valid_serialize) 
 {
     block_store_t *bs = NULL;
@@ -411,6 +1266,77 @@ TEST(block_store_serialize, null_bs)
     score += 2;
 }
 
+// the whole of a file, to compare images with
+static std::vector<uint8_t> file_bytes(const char *path)
+{
+    std::vector<uint8_t> bytes;
+    FILE *fp = fopen(path, "rb");
+    if (fp != NULL) {
+        int c;
+        while ((c = fgetc(fp)) != EOF) {
+            bytes.push_back((uint8_t) c);
+        }
+        fclose(fp);
+    }
+    return bytes;
+}
+
+TEST(block_store_serialize, incremental)
+{
+    remove("test_incremental.bs");
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    ASSERT_EQ(0, block_store_serialize_incremental(NULL, "test_incremental.bs"));
+    ASSERT_EQ(0, block_store_serialize_incremental(bs, NULL));
+
+    // the first checkpoint has to write everything, after that only the fbm goes out
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize_incremental(bs, "test_incremental.bs"));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_serialize_incremental(bs, "test_incremental.bs"));
+
+    uint8_t buffer[BLOCK_SIZE_BYTES];
+    memset(buffer, 'x', sizeof(buffer));
+    ASSERT_EQ(true, block_store_request(bs, 10));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 10, buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 11, buffer));
+    ASSERT_EQ(4, block_store_pwrite(bs, 40, 4, 4, "part"));
+    ASSERT_EQ(4 * BLOCK_SIZE_BYTES, block_store_serialize_incremental(bs, "test_incremental.bs"));
+
+    // a pointer handed out counts as a change, and so does a release
+    uint8_t *data = (uint8_t *) block_store_block_ptr(bs, 100);
+    ASSERT_NE(nullptr, data);
+    memset(data, 'p', 8);
+    block_store_release(bs, 10);
+    ASSERT_EQ(3 * BLOCK_SIZE_BYTES, block_store_serialize_incremental(bs, "test_incremental.bs"));
+
+    // the image ends up the same as a full dump
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test.bs"));
+    ASSERT_EQ(file_bytes("test.bs"), file_bytes("test_incremental.bs"));
+    block_store_destroy(bs);
+    bs = block_store_deserialize("test_incremental.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(true, block_store_request(bs, 10));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 11, buffer));
+    ASSERT_EQ('x', buffer[0]);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 100, buffer));
+    ASSERT_EQ(0, memcmp(buffer, "pppppppp", 8));
+    ASSERT_EQ(0, buffer[8]);
+    block_store_destroy(bs);
+
+    // a file backed device reads its dirty blocks back through the cache
+    remove("test_file.bs");
+    bs = block_store_open_file("test_file.bs", BLOCK_STORE_MMAP_CREATE, 1024, 64);
+    ASSERT_NE(nullptr, bs) << "block_store_open_file returned NULL when it should not have\n";
+    ASSERT_EQ(1024 * 64, block_store_serialize_incremental(bs, "test_incremental.bs"));
+    ASSERT_EQ(0, block_store_allocate(bs));
+    ASSERT_EQ(64, block_store_write(bs, 0, buffer));
+    // block 0 and the two fbm blocks
+    ASSERT_EQ(3 * 64, block_store_serialize_incremental(bs, "test_incremental.bs"));
+    block_store_destroy(bs);
+    ASSERT_EQ(file_bytes("test_file.bs"), file_bytes("test_incremental.bs"));
+    remove("test_file.bs");
+    remove("test_incremental.bs");
+}
+
 TEST(block_store_deserialize, valid_deserialize) 
 {
     block_store_t *bsWrite = NULL;
@@ -486,3 +1412,1289 @@ TEST(block_store_deserialize, null_filename)
     score += 2;
 }
 
+
+
+TEST(block_store_journal, crash_recovery)
+{
+    remove("test_journal.bs");
+    remove("test_journal.bs.journal");
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    ASSERT_EQ(false, block_store_set_journal(NULL, "test_journal.bs"));
+    ASSERT_EQ(false, block_store_commit(bs));
+    ASSERT_EQ(true, block_store_set_journal(bs, "test_journal.bs"));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_journal.bs"));
+    ASSERT_EQ(0, file_bytes("test_journal.bs.journal").size());
+
+    // one committed transaction, then changes that never get committed before the "crash"
+    uint8_t buffer[BLOCK_SIZE_BYTES];
+    memset(buffer, 'a', sizeof(buffer));
+    ASSERT_EQ(true, block_store_request(bs, 5));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 5, buffer));
+    ASSERT_EQ(0, block_store_allocate(bs));
+    ASSERT_EQ(4, block_store_pwrite(bs, 0, 8, 4, "torn"));
+    ASSERT_EQ(true, block_store_commit(bs));
+    memset(buffer, 'b', sizeof(buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 6, buffer));
+    block_store_release(bs, 5);
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("test_journal.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(false, block_store_request(bs, 5));
+    ASSERT_EQ(false, block_store_request(bs, 0));
+    ASSERT_EQ(2, block_store_get_used_blocks(bs));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 5, buffer));
+    ASSERT_EQ('a', buffer[BLOCK_SIZE_BYTES - 1]);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 0, buffer));
+    ASSERT_EQ(0, memcmp(buffer + 8, "torn", 4));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 6, buffer));
+    ASSERT_EQ(0, buffer[0]);
+
+    // a record cut short at the end of the journal is ignored, the ones before it aren't
+    ASSERT_EQ(true, block_store_set_journal(bs, "test_journal.bs"));
+    memset(buffer, 'c', sizeof(buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 7, buffer));
+    ASSERT_EQ(true, block_store_commit(bs));
+    memset(buffer, 'd', sizeof(buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 8, buffer));
+    ASSERT_EQ(true, block_store_commit(bs));
+    ASSERT_EQ(true, block_store_commit(bs));
+    block_store_destroy(bs);
+    const size_t length = file_bytes("test_journal.bs.journal").size();
+    ASSERT_EQ(0, truncate("test_journal.bs.journal", (off_t) length - 10));
+    bs = block_store_deserialize("test_journal.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 5, buffer));
+    ASSERT_EQ('a', buffer[0]);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 7, buffer));
+    ASSERT_EQ('c', buffer[0]);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 8, buffer));
+    ASSERT_EQ(0, buffer[0]);
+
+    // reopening drops the torn record, so new ones don't end up hidden behind it
+    ASSERT_EQ(true, block_store_set_journal(bs, "test_journal.bs"));
+    memset(buffer, 'e', sizeof(buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 8, buffer));
+    ASSERT_EQ(true, block_store_commit(bs));
+    // the new record took the torn one's place, both hold one block
+    ASSERT_EQ(length, file_bytes("test_journal.bs.journal").size());
+    block_store_destroy(bs);
+
+    // group commit from several threads, every committed allocation and write survives
+    bs = block_store_deserialize("test_journal.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 8, buffer));
+    ASSERT_EQ('e', buffer[0]);
+    ASSERT_EQ(true, block_store_set_concurrent(bs, true));
+    ASSERT_EQ(true, block_store_set_journal(bs, "test_journal.bs"));
+    // an incremental checkpoint empties the journal too
+    ASSERT_LT(0, block_store_serialize_incremental(bs, "test_journal.bs"));
+    ASSERT_EQ(0, file_bytes("test_journal.bs.journal").size());
+    std::vector<std::vector<size_t>> ids(4);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < ids.size(); t++) {
+        threads.emplace_back([&, t]() {
+            uint8_t block[BLOCK_SIZE_BYTES];
+            for (int i = 0; i < 20; i++) {
+                const size_t id = block_store_allocate(bs);
+                memset(block, (int) (id + 1), sizeof(block));
+                if ((id != SIZE_MAX) && block_store_write(bs, id, block) && block_store_commit(bs)) {
+                    ids[t].push_back(id);
+                }
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    block_store_destroy(bs);
+    bs = block_store_deserialize("test_journal.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(2 + 80, block_store_get_used_blocks(bs));
+    for (const std::vector<size_t> &list : ids) {
+        ASSERT_EQ(20, list.size());
+        for (size_t id : list) {
+            ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, buffer));
+            ASSERT_EQ((uint8_t) (id + 1), buffer[BLOCK_SIZE_BYTES - 1]);
+        }
+    }
+    block_store_destroy(bs);
+    remove("test_journal.bs");
+    remove("test_journal.bs.journal");
+}
+
+// overwrites a file with the given bytes
+static void put_file_bytes(const char *path, const std::vector<uint8_t> &bytes)
+{
+    FILE *fp = fopen(path, "wb");
+    if (fp != NULL) {
+        fwrite(bytes.data(), 1, bytes.size(), fp);
+        fclose(fp);
+    }
+}
+
+TEST(block_store_load, versioned_image)
+{
+    // a geometry a raw dump can't describe, read back in chunks that don't line up with blocks
+    block_store_t *bs = block_store_create_ex(4096, 512);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    uint8_t buffer[512];
+    for (size_t i = 0; i < 100; i++) {
+        ASSERT_EQ(i, block_store_allocate(bs));
+        memset(buffer, (int) i, sizeof(buffer));
+        ASSERT_EQ(512, block_store_write(bs, i, buffer));
+    }
+    ASSERT_EQ(0, block_store_save(NULL, "test_image.bs"));
+    ASSERT_EQ(0, block_store_save(bs, NULL));
+    ASSERT_EQ(64 + 4096 * 512, block_store_save(bs, "test_image.bs"));
+    block_store_destroy(bs);
+
+    block_store_load_status_t status = BLOCK_STORE_LOAD_CORRUPT;
+    bs = block_store_load("test_image.bs", 1000, &status);
+    ASSERT_NE(nullptr, bs) << block_store_load_status_string(status);
+    ASSERT_EQ(BLOCK_STORE_LOAD_OK, status);
+    ASSERT_EQ(512, block_store_get_block_size(bs));
+    ASSERT_EQ(4095, block_store_get_total_blocks(bs));
+    ASSERT_EQ(100, block_store_get_used_blocks(bs));
+    ASSERT_EQ(100, block_store_allocate(bs));
+    ASSERT_EQ(512, block_store_read(bs, 99, buffer));
+    ASSERT_EQ(99, buffer[511]);
+    block_store_destroy(bs);
+    bs = block_store_deserialize("test_image.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(100, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+
+    // every way an image can go wrong is reported, and nothing half loaded comes back
+    const std::vector<uint8_t> image = file_bytes("test_image.bs");
+    ASSERT_EQ(nullptr, block_store_load(NULL, 0, &status));
+    ASSERT_EQ(BLOCK_STORE_LOAD_BAD_ARGUMENT, status);
+    remove("test_missing.bs");
+    ASSERT_EQ(nullptr, block_store_load("test_missing.bs", 0, &status));
+    ASSERT_EQ(BLOCK_STORE_LOAD_IO_ERROR, status);
+
+    std::vector<uint8_t> broken(image.begin(), image.end() - 100);
+    put_file_bytes("test_image.bs", broken);
+    ASSERT_EQ(nullptr, block_store_load("test_image.bs", 0, &status));
+    ASSERT_EQ(BLOCK_STORE_LOAD_TRUNCATED, status);
+    ASSERT_EQ(nullptr, block_store_deserialize("test_image.bs"));
+    broken.assign(image.begin(), image.begin() + 40);
+    put_file_bytes("test_image.bs", broken);
+    ASSERT_EQ(nullptr, block_store_load("test_image.bs", 0, &status));
+    ASSERT_EQ(BLOCK_STORE_LOAD_TRUNCATED, status);
+
+    broken = image;
+    broken[64 + 50 * 512 + 7] ^= 1;
+    put_file_bytes("test_image.bs", broken);
+    ASSERT_EQ(nullptr, block_store_load("test_image.bs", 0, &status));
+    ASSERT_EQ(BLOCK_STORE_LOAD_CORRUPT, status);
+    broken = image;
+    broken[16] ^= 1; // num_blocks
+    put_file_bytes("test_image.bs", broken);
+    ASSERT_EQ(nullptr, block_store_load("test_image.bs", 0, &status));
+    ASSERT_EQ(BLOCK_STORE_LOAD_CORRUPT, status);
+    broken = image;
+    broken[8] = 2; // version
+    put_file_bytes("test_image.bs", broken);
+    ASSERT_EQ(nullptr, block_store_load("test_image.bs", 0, &status));
+    ASSERT_EQ(BLOCK_STORE_LOAD_UNSUPPORTED, status);
+
+    broken.assign(300, 'z');
+    put_file_bytes("test_image.bs", broken);
+    ASSERT_EQ(nullptr, block_store_load("test_image.bs", 0, &status));
+    ASSERT_EQ(BLOCK_STORE_LOAD_TRUNCATED, status);
+    broken.assign(BLOCK_STORE_NUM_BYTES + 1, 'z');
+    put_file_bytes("test_image.bs", broken);
+    ASSERT_EQ(nullptr, block_store_load("test_image.bs", 0, &status));
+    ASSERT_EQ(BLOCK_STORE_LOAD_NOT_AN_IMAGE, status);
+
+    // a raw dump whose fbm doesn't even cover itself
+    broken.assign(BLOCK_STORE_NUM_BYTES, 0);
+    put_file_bytes("test_image.bs", broken);
+    ASSERT_EQ(nullptr, block_store_deserialize("test_image.bs"));
+    ASSERT_EQ(nullptr, block_store_load("test_image.bs", 0, &status));
+    ASSERT_EQ(BLOCK_STORE_LOAD_CORRUPT, status);
+    ASSERT_STRNE("", block_store_load_status_string(status));
+    remove("test_image.bs");
+}
+
+TEST(block_store_load, legacy_raw_image)
+{
+    // a raw dump from when the fbm lived at the start of block 127 and users had block 255
+    std::vector<uint8_t> image(BLOCK_STORE_NUM_BYTES, 0);
+    bitmap_t *fbm = bitmap_overlay(BLOCK_STORE_NUM_BLOCKS, &image[127 * BLOCK_SIZE_BYTES]);
+    ASSERT_NE(nullptr, fbm);
+    const size_t ids[] = {0, 1, 130, 200};
+    bitmap_set(fbm, 127);
+    for (size_t i = 0; i < 4; i++) {
+        bitmap_set(fbm, ids[i]);
+        memset(&image[ids[i] * BLOCK_SIZE_BYTES], (int) ('a' + i), BLOCK_SIZE_BYTES);
+    }
+    // block 255 held something once, but was free
+    memset(&image[255 * BLOCK_SIZE_BYTES], 0xFF, BLOCK_SIZE_BYTES);
+    put_file_bytes("test_legacy.bs", image);
+
+    block_store_load_status_t status;
+    block_store_t *bs = block_store_load("test_legacy.bs", 0, &status);
+    ASSERT_EQ(BLOCK_STORE_LOAD_OK, status);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(4, block_store_get_used_blocks(bs));
+    uint8_t buffer[BLOCK_SIZE_BYTES];
+    for (size_t i = 0; i < 4; i++) {
+        ASSERT_EQ(false, block_store_request(bs, ids[i]));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, ids[i], buffer));
+        ASSERT_EQ('a' + i, buffer[0]);
+    }
+    // the old fbm block is an empty user block now
+    ASSERT_EQ(true, block_store_request(bs, 127));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 127, buffer));
+    ASSERT_EQ(std::vector<uint8_t>(BLOCK_SIZE_BYTES, 0), std::vector<uint8_t>(buffer, buffer + BLOCK_SIZE_BYTES));
+    block_store_destroy(bs);
+    bs = block_store_deserialize("test_legacy.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(4, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+
+    // an image that gave block 255 to a user can't make room for the fbm
+    bitmap_set(fbm, 255);
+    put_file_bytes("test_legacy.bs", image);
+    ASSERT_EQ(nullptr, block_store_load("test_legacy.bs", 0, &status));
+    ASSERT_EQ(BLOCK_STORE_LOAD_UNSUPPORTED, status);
+    // and one with neither fbm is no image at all
+    std::fill(image.begin(), image.end(), 0);
+    put_file_bytes("test_legacy.bs", image);
+    ASSERT_EQ(nullptr, block_store_load("test_legacy.bs", 0, &status));
+    ASSERT_EQ(BLOCK_STORE_LOAD_CORRUPT, status);
+    bitmap_destroy(fbm);
+    remove("test_legacy.bs");
+}
+
+TEST(block_store_load, compressed_image)
+{
+    // four segments: one sparse, one untouched, one full (loads straight into place), one partly used
+    block_store_t *bs = block_store_create_ex(8192, 512);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    std::vector<std::vector<uint8_t>> expected(8192);
+    uint32_t seed = 12345;
+    auto fill = [&](size_t id, int kind) {
+        std::vector<uint8_t> block(512);
+        for (size_t i = 0; i < block.size(); i++) {
+            seed = seed * 1103515245 + 12345;
+            block[i] = kind == 0 ? 0 : kind == 1 ? (uint8_t) "block store "[i % 12] : (uint8_t) (seed >> 16);
+        }
+        ASSERT_EQ(true, block_store_request(bs, id));
+        ASSERT_EQ(512, block_store_write(bs, id, block.data()));
+        expected[id] = block;
+    };
+    for (size_t id = 0; id < 2048; id += 3) {
+        fill(id, id % 3);
+    }
+    for (size_t id = 4096; id < 6144; id++) {
+        fill(id, (id / 7) % 3);
+    }
+    for (size_t id = 6144; id < 7000; id += 5) {
+        fill(id, 1);
+    }
+    // written but never allocated, so it isn't in the image
+    uint8_t buffer[512];
+    memset(buffer, 0x77, sizeof(buffer));
+    ASSERT_EQ(512, block_store_write(bs, 3000, buffer));
+
+    ASSERT_EQ(0, block_store_save_compressed(NULL, "test_image.bs", 0));
+    const size_t full = block_store_save(bs, "test_image.bs");
+    const size_t compressed = block_store_save_compressed(bs, "test_image.bs", 3);
+    ASSERT_LT(0, compressed);
+    ASSERT_GT(full / 2, compressed);
+    const std::vector<uint8_t> image = file_bytes("test_image.bs");
+    ASSERT_EQ(compressed, block_store_save_compressed(bs, "test_image.bs", 1));
+    ASSERT_EQ(image, file_bytes("test_image.bs")) << "the thread count changed the image\n";
+    const size_t used = block_store_get_used_blocks(bs);
+    block_store_destroy(bs);
+
+    block_store_load_status_t status = BLOCK_STORE_LOAD_CORRUPT;
+    bs = block_store_load("test_image.bs", 4096, &status);
+    ASSERT_NE(nullptr, bs) << block_store_load_status_string(status);
+    ASSERT_EQ(used, block_store_get_used_blocks(bs));
+    for (size_t id = 0; id < block_store_get_total_blocks(bs); id++) {
+        ASSERT_EQ(512, block_store_read(bs, id, buffer));
+        if (expected[id].empty()) {
+            ASSERT_EQ(0, buffer[0]) << "block " << id << " should have been skipped\n";
+            ASSERT_EQ(0, buffer[511]);
+        } else {
+            ASSERT_EQ(0, memcmp(expected[id].data(), buffer, 512)) << "block " << id << " came back wrong\n";
+        }
+    }
+    block_store_destroy(bs);
+
+    std::vector<uint8_t> broken = image;
+    broken[image.size() / 2] ^= 0x10;
+    put_file_bytes("test_image.bs", broken);
+    ASSERT_EQ(nullptr, block_store_load("test_image.bs", 0, &status));
+    ASSERT_EQ(BLOCK_STORE_LOAD_CORRUPT, status);
+    broken.assign(image.begin(), image.end() - 1);
+    put_file_bytes("test_image.bs", broken);
+    ASSERT_EQ(nullptr, block_store_load("test_image.bs", 0, &status));
+    ASSERT_EQ(BLOCK_STORE_LOAD_TRUNCATED, status);
+
+    // file backed devices save through their cache
+    remove("test_file.bs");
+    bs = block_store_open_file("test_file.bs", BLOCK_STORE_MMAP_CREATE, 1024, 64);
+    ASSERT_NE(nullptr, bs) << "block_store_open_file returned NULL when it should not have\n";
+    ASSERT_EQ(0, block_store_allocate(bs));
+    memset(buffer, 0x77, sizeof(buffer));
+    ASSERT_EQ(64, block_store_write(bs, 0, buffer));
+    ASSERT_LT(0, block_store_save_compressed(bs, "test_image.bs", 0));
+    block_store_destroy(bs);
+    bs = block_store_deserialize("test_image.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    ASSERT_EQ(64, block_store_read(bs, 0, buffer));
+    ASSERT_EQ(0x77, buffer[63]);
+    block_store_destroy(bs);
+    remove("test_file.bs");
+    remove("test_image.bs");
+}
+
+TEST(block_store_zero_copy, block_ptr)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    ASSERT_EQ(nullptr, block_store_block_ptr(NULL, 0));
+    ASSERT_EQ(nullptr, block_store_block_ptr_const(bs, BLOCK_STORE_AVAIL_BLOCKS));
+
+    size_t id = block_store_allocate(bs);
+    uint8_t *data = (uint8_t *) block_store_block_ptr(bs, id);
+    ASSERT_NE(nullptr, data);
+    memset(data, '~', 16);
+    uint8_t read_buffer[BLOCK_SIZE_BYTES];
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, "~~~~~~~~~~~~~~~~", 16));
+    ASSERT_EQ(data, block_store_block_ptr_const(bs, id));
+    // pins outside of debug mode are just pointers
+    ASSERT_EQ(data, block_store_pin(bs, id));
+    block_store_unpin(bs, id);
+    ASSERT_EQ(SIZE_MAX, block_store_get_debug_violations(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_zero_copy, debug_mode)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    ASSERT_EQ(true, block_store_set_debug(bs, true));
+    ASSERT_EQ(0, block_store_get_debug_violations(bs));
+
+    // no pointers to or writes into free blocks
+    uint8_t buffer[BLOCK_SIZE_BYTES] = {0};
+    ASSERT_EQ(nullptr, block_store_block_ptr(bs, 5));
+    ASSERT_EQ(0, block_store_write(bs, 5, buffer));
+    ASSERT_EQ(2, block_store_get_debug_violations(bs));
+
+    // a pinned block can't be released
+    size_t id = block_store_allocate(bs);
+    uint8_t *data = (uint8_t *) block_store_pin(bs, id);
+    ASSERT_NE(nullptr, data);
+    block_store_release(bs, id);
+    ASSERT_EQ(3, block_store_get_debug_violations(bs));
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    block_store_unpin(bs, id);
+    block_store_unpin(bs, id);
+    ASSERT_EQ(4, block_store_get_debug_violations(bs));
+
+    // released blocks get poisoned, and releasing twice is caught
+    block_store_release(bs, id);
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    ASSERT_EQ(BLOCK_STORE_POISON, data[0]);
+    ASSERT_EQ(BLOCK_STORE_POISON, data[BLOCK_SIZE_BYTES - 1]);
+    block_store_release(bs, id);
+    ASSERT_EQ(5, block_store_get_debug_violations(bs));
+
+    // reallocating a block that's still poison is fine
+    ASSERT_EQ(id, block_store_allocate(bs));
+    ASSERT_EQ(5, block_store_get_debug_violations(bs));
+    // but a stale write through the old pointer is caught when the block comes back
+    block_store_release(bs, id);
+    data[10] = 'x';
+    ASSERT_EQ(id, block_store_allocate(bs));
+    ASSERT_EQ(6, block_store_get_debug_violations(bs));
+
+    ASSERT_EQ(true, block_store_set_debug(bs, false));
+    ASSERT_EQ(SIZE_MAX, block_store_get_debug_violations(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_concurrent, unique_allocations)
+{
+    // every thread allocates until the device is full, nobody may get the same block twice
+    const size_t num_blocks = 1 << 16, threads = 8;
+    block_store_t *bs = block_store_create_ex(num_blocks, 64);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    ASSERT_EQ(true, block_store_set_concurrent(bs, true));
+    const size_t avail = block_store_get_total_blocks(bs);
+
+    std::vector<std::vector<size_t>> ids(threads);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([bs, t, &ids]() {
+            size_t batch[16];
+            for (size_t round = 0; ; round++) {
+                // mix up the different ways of allocating
+                if (round % 3 == 0) {
+                    size_t got = block_store_allocate_many(bs, 16, batch);
+                    ids[t].insert(ids[t].end(), batch, batch + got);
+                    if (got == 0) {
+                        break;
+                    }
+                } else if (round % 3 == 1 && block_store_allocate_extent(bs, 4, &batch[0])) {
+                    for (size_t i = 0; i < 4; i++) {
+                        ids[t].push_back(batch[0] + i);
+                    }
+                } else {
+                    size_t id = block_store_allocate_near(bs, t * 1000);
+                    if (id == SIZE_MAX) {
+                        break;
+                    }
+                    ids[t].push_back(id);
+                }
+            }
+        });
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+
+    std::vector<size_t> all;
+    for (const std::vector<size_t> &mine : ids) {
+        all.insert(all.end(), mine.begin(), mine.end());
+    }
+    std::sort(all.begin(), all.end());
+    ASSERT_EQ(all.end(), std::adjacent_find(all.begin(), all.end())) << "a block was handed out twice\n";
+    ASSERT_EQ(avail, all.size());
+    ASSERT_EQ(avail, block_store_get_used_blocks(bs));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_concurrent, churn)
+{
+    // threads allocate, stamp, check and release blocks over and over on a small device so
+    // they constantly fight over the same words, any block shared by two threads shows up as
+    // a stamp that changed underneath its owner
+    const size_t num_blocks = 2048, block_size = 64, threads = 8, rounds = 20000;
+    for (int mode = 0; mode < 2; mode++) {
+        block_store_t *bs = block_store_create_ex(num_blocks, block_size);
+        ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+        ASSERT_EQ(true, block_store_set_concurrent(bs, true));
+        // second time around with next fit and debug mode on top
+        if (mode == 1) {
+            ASSERT_EQ(true, block_store_set_policy(bs, BLOCK_STORE_NEXT_FIT));
+            ASSERT_EQ(true, block_store_set_debug(bs, true));
+        }
+        std::vector<size_t> failures(threads, 0);
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < threads; t++) {
+            workers.emplace_back([bs, t, &failures, rounds, block_size]() {
+                uint8_t stamp[64], check[64];
+                size_t held[4];
+                for (size_t round = 0; round < rounds; round++) {
+                    memset(stamp, (int) (t * 31 + round), block_size);
+                    size_t got = 0;
+                    for (; got < 4; got++) {
+                        held[got] = block_store_allocate(bs);
+                        if (held[got] == SIZE_MAX) {
+                            break;
+                        }
+                        block_store_write(bs, held[got], stamp);
+                    }
+                    std::this_thread::yield();
+                    for (size_t i = 0; i < got; i++) {
+                        block_store_read(bs, held[i], check);
+                        failures[t] += memcmp(stamp, check, block_size) != 0;
+                        block_store_release(bs, held[i]);
+                    }
+                }
+            });
+        }
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+        for (size_t t = 0; t < threads; t++) {
+            ASSERT_EQ(0, failures[t]) << "thread " << t << " had its blocks overwritten\n";
+        }
+        ASSERT_EQ(0, block_store_get_used_blocks(bs));
+        if (mode == 1) {
+            ASSERT_EQ(0, block_store_get_debug_violations(bs));
+        }
+        block_store_destroy(bs);
+    }
+}
+
+TEST(block_store_concurrent, magazines)
+{
+    const size_t num_blocks = 4096, threads = 4;
+    block_store_t *bs = block_store_create_ex(num_blocks, 64);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    ASSERT_EQ(false, block_store_set_magazines(NULL, BLOCK_STORE_MAGAZINE_SIZE));
+    ASSERT_EQ(true, block_store_set_concurrent(bs, true));
+    ASSERT_EQ(true, block_store_set_magazines(bs, 8));
+    const size_t avail = block_store_get_total_blocks(bs);
+
+    // the first allocation pulls half a magazine out of the fbm, the counts only see one
+    size_t id = block_store_allocate(bs);
+    ASSERT_NE(SIZE_MAX, id);
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    ASSERT_EQ(avail - 1, block_store_get_free_blocks(bs));
+    ASSERT_EQ(4, block_store_get_used_blocks_approx(bs));
+    // released blocks come straight back out
+    block_store_release(bs, id);
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    ASSERT_EQ(id, block_store_allocate(bs));
+    block_store_release(bs, id);
+    block_store_flush_magazines(bs);
+    ASSERT_EQ(0, block_store_get_used_blocks_approx(bs));
+
+    // every thread keeps allocating until the device is full, which takes stealing from each other
+    std::vector<std::vector<size_t>> ids(threads);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([bs, t, &ids]() {
+            for (size_t round = 0; ; round++) {
+                size_t got = block_store_allocate(bs);
+                if (got == SIZE_MAX) {
+                    break;
+                }
+                ids[t].push_back(got);
+                // give a few back now and then so the magazines overflow and drain too
+                if (round % 5 == 4) {
+                    for (size_t i = 0; i < 3; i++) {
+                        block_store_release(bs, ids[t].back());
+                        ids[t].pop_back();
+                    }
+                }
+            }
+        });
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    std::vector<size_t> all;
+    for (const std::vector<size_t> &mine : ids) {
+        all.insert(all.end(), mine.begin(), mine.end());
+    }
+    std::sort(all.begin(), all.end());
+    ASSERT_EQ(all.end(), std::adjacent_find(all.begin(), all.end())) << "a block was handed out twice\n";
+    ASSERT_EQ(avail, all.size());
+    ASSERT_EQ(avail, block_store_get_used_blocks(bs));
+
+    // threads that exited gave their magazines back, so releasing everything empties the fbm
+    block_store_release_many(bs, all.data(), all.size());
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    ASSERT_EQ(true, block_store_set_magazines(bs, 0));
+    ASSERT_EQ(0, block_store_get_used_blocks_approx(bs));
+    ASSERT_EQ(avail, block_store_get_free_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_concurrent, magazines_double_release)
+{
+    block_store_t *bs = block_store_create_ex(256, 64);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    ASSERT_EQ(true, block_store_set_concurrent(bs, true));
+    ASSERT_EQ(true, block_store_set_magazines(bs, 8));
+    const size_t avail = block_store_get_total_blocks(bs);
+
+    // a second release of a block already sitting in the magazine is dropped
+    size_t id = block_store_allocate(bs);
+    ASSERT_NE(SIZE_MAX, id);
+    block_store_release(bs, id);
+    block_store_release(bs, id);
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    ASSERT_EQ(id, block_store_allocate(bs));
+    size_t other = block_store_allocate(bs);
+    ASSERT_NE(id, other);
+    block_store_release(bs, other);
+    block_store_release(bs, id);
+
+    // and so are batch and extent releases of blocks sitting in a magazine
+    block_store_release_many(bs, &id, 1);
+    block_store_release_extent(bs, 0, avail);
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    const size_t again = block_store_allocate(bs);
+    ASSERT_NE(SIZE_MAX, again);
+    size_t first = 0;
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 1, &first));
+    ASSERT_NE(again, first);
+    ASSERT_EQ(2, block_store_get_used_blocks(bs));
+    block_store_release(bs, again);
+    block_store_release_extent(bs, first, 1);
+
+    // so is one of a block that's free in the fbm, never allocated or already drained
+    block_store_flush_magazines(bs);
+    block_store_release(bs, id);
+    block_store_release(bs, avail - 1);
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+
+    // every block still comes out exactly once
+    std::vector<size_t> all;
+    for (size_t got = block_store_allocate(bs); got != SIZE_MAX; got = block_store_allocate(bs)) {
+        all.push_back(got);
+    }
+    std::sort(all.begin(), all.end());
+    ASSERT_EQ(all.end(), std::adjacent_find(all.begin(), all.end())) << "a block was handed out twice\n";
+    ASSERT_EQ(avail, all.size());
+    ASSERT_EQ(avail, block_store_get_used_blocks(bs));
+    block_store_release_many(bs, all.data(), all.size());
+    ASSERT_EQ(true, block_store_set_magazines(bs, 0));
+    ASSERT_EQ(avail, block_store_get_free_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_sharded, basics)
+{
+    ASSERT_EQ(nullptr, block_store_sharded_create(0, 256, 256));
+    ASSERT_EQ(nullptr, block_store_sharded_create(4, 256, 100));
+    block_store_sharded_t *sbs = block_store_sharded_create(4, 256, 256);
+    ASSERT_NE(nullptr, sbs) << "block_store_sharded_create returned NULL when it should not have\n";
+    ASSERT_EQ(4, block_store_sharded_get_shard_count(sbs));
+    ASSERT_EQ(4 * 255, block_store_sharded_get_total_blocks(sbs));
+    ASSERT_EQ(256, block_store_sharded_get_block_size(sbs));
+    ASSERT_EQ(nullptr, block_store_sharded_get_shard(sbs, 4));
+
+    // round robin spreads consecutive allocations over every shard
+    for (size_t i = 0; i < 4; i++) {
+        ASSERT_NE(SIZE_MAX, block_store_sharded_allocate(sbs));
+    }
+    for (size_t i = 0; i < 4; i++) {
+        ASSERT_EQ(1, block_store_get_used_blocks(block_store_sharded_get_shard(sbs, i)));
+    }
+
+    // global ids stripe over the shards
+    ASSERT_EQ(true, block_store_sharded_request(sbs, 4 * 10 + 2));
+    ASSERT_EQ(false, block_store_sharded_request(sbs, 4 * 10 + 2));
+    ASSERT_EQ(true, block_store_request(block_store_sharded_get_shard(sbs, 3), 10));
+    ASSERT_EQ(false, block_store_sharded_request(sbs, 4 * 10 + 3));
+    ASSERT_EQ(false, block_store_sharded_request(sbs, 4 * 255));
+    ASSERT_EQ(6, block_store_sharded_get_used_blocks(sbs));
+
+    uint8_t data[256], check[256] = {0};
+    memset(data, 0x5A, sizeof(data));
+    ASSERT_EQ(256, block_store_sharded_write(sbs, 4 * 10 + 2, data));
+    ASSERT_EQ(256, block_store_read(block_store_sharded_get_shard(sbs, 2), 10, check));
+    ASSERT_EQ(0, memcmp(data, check, sizeof(data)));
+    ASSERT_EQ(0, block_store_sharded_read(sbs, 4 * 255, check));
+    ASSERT_EQ(0, block_store_sharded_write(NULL, 0, data));
+
+    // thread routing fills its home shard first, then spills onto the others
+    ASSERT_EQ(true, block_store_sharded_set_routing(sbs, BLOCK_STORE_ROUTE_THREAD));
+    const size_t home = block_store_sharded_allocate(sbs) % 4;
+    ASSERT_EQ(home, block_store_sharded_allocate(sbs) % 4);
+    while (block_store_sharded_allocate(sbs) != SIZE_MAX) {
+    }
+    ASSERT_EQ(4 * 255, block_store_sharded_get_used_blocks(sbs));
+    ASSERT_EQ(0, block_store_sharded_get_free_blocks(sbs));
+    block_store_sharded_release(sbs, 4 * 10 + 2);
+    ASSERT_EQ(4 * 10 + 2, block_store_sharded_allocate(sbs));
+    block_store_sharded_destroy(sbs);
+}
+
+TEST(block_store_sharded, concurrent_allocations)
+{
+    const size_t shards = 4, threads = 8;
+    block_store_sharded_t *sbs = block_store_sharded_create(shards, 2048, 64);
+    ASSERT_NE(nullptr, sbs) << "block_store_sharded_create returned NULL when it should not have\n";
+    const size_t capacity = block_store_sharded_get_total_blocks(sbs);
+    std::vector<std::vector<size_t>> ids(threads);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([sbs, t, &ids]() {
+            uint8_t stamp[64], check[64];
+            memset(stamp, (int) t, sizeof(stamp));
+            for (size_t id; (id = block_store_sharded_allocate(sbs)) != SIZE_MAX; ) {
+                block_store_sharded_write(sbs, id, stamp);
+                ids[t].push_back(id);
+            }
+            for (size_t id : ids[t]) {
+                block_store_sharded_read(sbs, id, check);
+                ASSERT_EQ(0, memcmp(stamp, check, sizeof(stamp)));
+            }
+        });
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    std::vector<size_t> all;
+    for (const std::vector<size_t> &mine : ids) {
+        all.insert(all.end(), mine.begin(), mine.end());
+    }
+    std::sort(all.begin(), all.end());
+    ASSERT_EQ(all.end(), std::adjacent_find(all.begin(), all.end())) << "a block was handed out twice\n";
+    ASSERT_EQ(capacity, all.size());
+    for (size_t id : all) {
+        block_store_sharded_release(sbs, id);
+    }
+    ASSERT_EQ(0, block_store_sharded_get_used_blocks(sbs));
+    block_store_sharded_destroy(sbs);
+}
+
+TEST(block_store_mmap, create_and_reopen)
+{
+    remove("test_mmap.bs");
+    ASSERT_EQ(nullptr, block_store_open_mmap(NULL, BLOCK_STORE_MMAP_CREATE));
+    // no file and not allowed to make one
+    ASSERT_EQ(nullptr, block_store_open_mmap("test_mmap.bs", 0));
+    // an empty file that can't be grown
+    ASSERT_EQ(nullptr, block_store_open_mmap("/dev/null", BLOCK_STORE_MMAP_CREATE));
+
+    block_store_t *bs = block_store_open_mmap("test_mmap.bs", BLOCK_STORE_MMAP_CREATE);
+    ASSERT_NE(nullptr, bs) << "block_store_open_mmap returned NULL when it should not have\n";
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS, block_store_get_total_blocks(bs));
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    ASSERT_EQ(true, block_store_request(bs, 10));
+    char write_buffer[BLOCK_SIZE_BYTES] = "Hello Mapped World!";
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 10, write_buffer));
+    ASSERT_EQ(true, block_store_sync(bs));
+    block_store_destroy(bs);
+
+    struct stat st;
+    ASSERT_EQ(0, stat("test_mmap.bs", &st));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, st.st_size);
+
+    // the blocks and the FBM both made it to the file
+    bs = block_store_open_mmap("test_mmap.bs", BLOCK_STORE_MMAP_READONLY);
+    ASSERT_NE(nullptr, bs) << "block_store_open_mmap returned NULL when it should not have\n";
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    char read_buffer[BLOCK_SIZE_BYTES] = {0};
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 10, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, write_buffer, BLOCK_SIZE_BYTES));
+    // read only means read only
+    ASSERT_EQ(0, block_store_write(bs, 10, write_buffer));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+    ASSERT_EQ(false, block_store_request(bs, 11));
+    block_store_release(bs, 10);
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_mmap, open_serialized_image)
+{
+    block_store_t *bs = block_store_create_ex(4096, 512);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    ASSERT_EQ(true, block_store_request(bs, 4000));
+    char write_buffer[512] = "serialized";
+    ASSERT_EQ(512, block_store_write(bs, 4000, write_buffer));
+    ASSERT_EQ(4096 * 512, block_store_serialize(bs, "test_mmap.bs"));
+    block_store_destroy(bs);
+
+    // a file that isn't a whole number of blocks is rejected
+    ASSERT_EQ(nullptr, block_store_open_mmap_ex("test_mmap.bs", 0, 0, 1000));
+    bs = block_store_open_mmap_ex("test_mmap.bs", 0, 0, 512);
+    ASSERT_NE(nullptr, bs) << "block_store_open_mmap_ex returned NULL when it should not have\n";
+    ASSERT_EQ(4095, block_store_get_total_blocks(bs));
+    ASSERT_EQ(false, block_store_request(bs, 4000));
+    ASSERT_EQ(0, block_store_allocate(bs));
+    char read_buffer[512] = {0};
+    ASSERT_EQ(512, block_store_read(bs, 4000, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, write_buffer, 512));
+    block_store_destroy(bs);
+    remove("test_mmap.bs");
+}
+
+TEST(block_store_file, cached_device)
+{
+    remove("test_file.bs");
+    ASSERT_EQ(nullptr, block_store_open_file("test_file.bs", 0, 1024, 256));
+    ASSERT_EQ(nullptr, block_store_open_file("/dev/null", BLOCK_STORE_MMAP_CREATE, 1024, 256));
+    block_store_t *bs = block_store_open_file("test_file.bs", BLOCK_STORE_MMAP_CREATE, 1024, 256);
+    ASSERT_NE(nullptr, bs) << "block_store_open_file returned NULL when it should not have\n";
+    ASSERT_EQ(1023, block_store_get_total_blocks(bs));
+    ASSERT_EQ(true, block_store_set_cache(bs, 8, BLOCK_STORE_CACHE_CLOCK));
+    ASSERT_EQ(false, block_store_set_cache(bs, 8, (block_store_cache_policy_t) 7));
+
+    // eight times more blocks than the cache holds, so most of them get evicted dirty
+    uint8_t buffer[256], check[256];
+    for (size_t i = 0; i < 64; i++) {
+        ASSERT_EQ(i, block_store_allocate(bs));
+        memset(buffer, (int) i, sizeof(buffer));
+        ASSERT_EQ(256, block_store_write(bs, i, buffer));
+    }
+    for (size_t i = 0; i < 64; i++) {
+        memset(buffer, (int) i, sizeof(buffer));
+        ASSERT_EQ(256, block_store_read(bs, i, check));
+        ASSERT_EQ(0, memcmp(buffer, check, sizeof(buffer))) << "block " << i << " came back wrong\n";
+    }
+    block_store_cache_stats_t stats;
+    ASSERT_EQ(false, block_store_get_cache_stats(bs, NULL));
+    ASSERT_EQ(true, block_store_get_cache_stats(bs, &stats));
+    ASSERT_EQ(128, stats.hits + stats.misses);
+    ASSERT_LE(120, stats.evictions);
+    ASSERT_LE(64 - 8, stats.writebacks);
+    ASSERT_EQ(256, block_store_read(bs, 63, check));
+    block_store_cache_stats_t after;
+    ASSERT_EQ(true, block_store_get_cache_stats(bs, &after));
+    ASSERT_EQ(stats.hits + 1, after.hits);
+
+    // a partial write to a block that isn't cached keeps the rest of it
+    memset(buffer, 0xAB, 16);
+    ASSERT_EQ(16, block_store_pwrite(bs, 0, 100, 16, buffer));
+    ASSERT_EQ(256, block_store_read(bs, 0, check));
+    ASSERT_EQ(0, check[99]);
+    ASSERT_EQ(0xAB, check[100]);
+    ASSERT_EQ(0xAB, check[115]);
+    ASSERT_EQ(0, check[116]);
+
+    // no fixed addresses to hand out
+    ASSERT_EQ(nullptr, block_store_block_ptr(bs, 0));
+    ASSERT_EQ(nullptr, block_store_pin(bs, 0));
+
+    // the same file as a mapped device shows everything, fbm included
+    ASSERT_EQ(true, block_store_sync(bs));
+    block_store_destroy(bs);
+    bs = block_store_open_mmap_ex("test_file.bs", 0, 0, 256);
+    ASSERT_NE(nullptr, bs) << "block_store_open_mmap_ex returned NULL when it should not have\n";
+    ASSERT_EQ(64, block_store_get_used_blocks(bs));
+    for (size_t i = 1; i < 64; i++) {
+        memset(buffer, (int) i, sizeof(buffer));
+        ASSERT_EQ(256, block_store_read(bs, i, check));
+        ASSERT_EQ(0, memcmp(buffer, check, sizeof(buffer)));
+    }
+    ASSERT_EQ(0xAB, ((const uint8_t *) block_store_block_ptr_const(bs, 0))[100]);
+    block_store_destroy(bs);
+
+    // and without a cache it goes straight to the file
+    bs = block_store_open_file("test_file.bs", 0, 0, 256);
+    ASSERT_NE(nullptr, bs) << "block_store_open_file returned NULL when it should not have\n";
+    ASSERT_EQ(true, block_store_set_cache(bs, 0, BLOCK_STORE_CACHE_CLOCK));
+    ASSERT_EQ(false, block_store_get_cache_stats(bs, &stats));
+    ASSERT_EQ(64, block_store_get_used_blocks(bs));
+    memset(buffer, 0x11, sizeof(buffer));
+    ASSERT_EQ(true, block_store_request(bs, 500));
+    ASSERT_EQ(256, block_store_write(bs, 500, buffer));
+    ASSERT_EQ(8, block_store_pwrite(bs, 500, 0, 8, "uncached"));
+    ASSERT_EQ(256, block_store_read(bs, 500, check));
+    ASSERT_EQ(0, memcmp("uncached", check, 8));
+    ASSERT_EQ(0x11, check[8]);
+    block_store_destroy(bs);
+
+    // read only opens see what the last one left behind and can't change it
+    bs = block_store_open_file("test_file.bs", BLOCK_STORE_MMAP_READONLY, 0, 256);
+    ASSERT_NE(nullptr, bs) << "block_store_open_file returned NULL when it should not have\n";
+    ASSERT_EQ(65, block_store_get_used_blocks(bs));
+    ASSERT_EQ(256, block_store_read(bs, 500, check));
+    ASSERT_EQ(0, memcmp("uncached", check, 8));
+    ASSERT_EQ(0, block_store_write(bs, 500, buffer));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+    block_store_destroy(bs);
+    remove("test_file.bs");
+}
+
+TEST(block_store_file, scan_resistance)
+{
+    // a small hot set that has been used twice, then one long pass over cold blocks
+    // CLOCK loses the hot set to the scan, 2Q keeps it
+    for (int policy = 0; policy < 2; policy++) {
+        remove("test_file.bs");
+        block_store_t *bs = block_store_open_file("test_file.bs", BLOCK_STORE_MMAP_CREATE, 1024, 64);
+        ASSERT_NE(nullptr, bs) << "block_store_open_file returned NULL when it should not have\n";
+        ASSERT_EQ(true, block_store_set_cache(bs, 16, (block_store_cache_policy_t) policy));
+        uint8_t buffer[64];
+        size_t cold = 100;
+        for (size_t hot = 0; hot < 4; hot++) {
+            block_store_read(bs, hot, buffer);
+        }
+        // enough to push the hot set out of 2Q's in queue once, so its second use promotes it
+        for (size_t i = 0; i < 16; i++) {
+            block_store_read(bs, cold++, buffer);
+        }
+        for (size_t hot = 0; hot < 4; hot++) {
+            block_store_read(bs, hot, buffer);
+        }
+        for (size_t i = 0; i < 500; i++) {
+            block_store_read(bs, cold++, buffer);
+        }
+        block_store_cache_stats_t before, after;
+        ASSERT_EQ(true, block_store_get_cache_stats(bs, &before));
+        for (size_t hot = 0; hot < 4; hot++) {
+            block_store_read(bs, hot, buffer);
+        }
+        ASSERT_EQ(true, block_store_get_cache_stats(bs, &after));
+        ASSERT_EQ(policy == BLOCK_STORE_CACHE_2Q ? 4 : 0, after.hits - before.hits);
+        ASSERT_EQ(0, after.writebacks);
+        block_store_destroy(bs);
+    }
+    remove("test_file.bs");
+}
+
+// tallies async completions, context of the callbacks below
+struct async_tally {
+    size_t calls;
+    size_t bytes;
+    std::vector<size_t> ids;
+};
+
+static void count_completion(void *context, size_t block_id, size_t bytes)
+{
+    async_tally *tally = (async_tally *) context;
+    tally->calls++;
+    tally->bytes += bytes;
+    tally->ids.push_back(block_id);
+}
+
+TEST(block_store_async, memory_device)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    async_tally tally = {0, 0, {}};
+    uint8_t buffer[BLOCK_SIZE_BYTES], check[BLOCK_SIZE_BYTES];
+    memset(buffer, 0x5A, sizeof(buffer));
+    ASSERT_EQ(false, block_store_read_async(NULL, 0, check, count_completion, &tally));
+    ASSERT_EQ(false, block_store_read_async(bs, BLOCK_STORE_NUM_BLOCKS, check, count_completion, &tally));
+    ASSERT_EQ(false, block_store_write_async(bs, 0, NULL, count_completion, &tally));
+    ASSERT_EQ(0, block_store_poll(bs, SIZE_MAX));
+
+    // nothing happens until submit, and nothing is reported until poll
+    ASSERT_EQ(true, block_store_write_async(bs, 7, buffer, count_completion, &tally));
+    ASSERT_EQ(true, block_store_read_async(bs, 7, check, count_completion, &tally));
+    ASSERT_EQ(true, block_store_write_async(bs, 8, buffer, NULL, NULL));
+    ASSERT_EQ(3, block_store_submit(bs));
+    ASSERT_EQ(0, tally.calls);
+    ASSERT_EQ(0, memcmp(buffer, check, sizeof(buffer)));
+    ASSERT_EQ(3, block_store_poll(bs, 0));
+    ASSERT_EQ(2, tally.calls);
+    ASSERT_EQ(2 * BLOCK_SIZE_BYTES, tally.bytes);
+    ASSERT_EQ(7, tally.ids[0]);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 8, check));
+    ASSERT_EQ(0, memcmp(buffer, check, sizeof(buffer)));
+
+    // memory devices never need an engine
+    ASSERT_EQ(BLOCK_STORE_ASYNC_AUTO, block_store_get_async_backend(bs));
+    ASSERT_EQ(true, block_store_set_async(bs, BLOCK_STORE_ASYNC_THREADS, 4));
+    ASSERT_EQ(false, block_store_set_async(bs, BLOCK_STORE_ASYNC_THREADS, 0));
+    ASSERT_EQ(false, block_store_set_async(bs, BLOCK_STORE_ASYNC_THREADS, 4097));
+    ASSERT_EQ(false, block_store_set_async(bs, (block_store_async_backend_t) 9, 4));
+    ASSERT_EQ(true, block_store_read_async(bs, 7, check, NULL, NULL));
+    ASSERT_EQ(false, block_store_set_async(bs, BLOCK_STORE_ASYNC_AUTO, 4));
+    ASSERT_EQ(1, block_store_poll(bs, SIZE_MAX));
+    ASSERT_EQ(BLOCK_STORE_ASYNC_AUTO, block_store_get_async_backend(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_async, file_device)
+{
+    const block_store_async_backend_t backends[] = {BLOCK_STORE_ASYNC_URING, BLOCK_STORE_ASYNC_THREADS};
+    for (block_store_async_backend_t backend : backends) {
+        remove("test_file.bs");
+        block_store_t *bs = block_store_open_file("test_file.bs", BLOCK_STORE_MMAP_CREATE, 1024, 256);
+        ASSERT_NE(nullptr, bs) << "block_store_open_file returned NULL when it should not have\n";
+        ASSERT_EQ(true, block_store_set_cache(bs, 8, BLOCK_STORE_CACHE_CLOCK));
+        if (!block_store_set_async(bs, backend, 8)) {
+            // a kernel without io_uring (or with it locked down) only has the threads
+            ASSERT_EQ(BLOCK_STORE_ASYNC_URING, backend);
+            block_store_destroy(bs);
+            continue;
+        }
+        ASSERT_EQ(backend, block_store_get_async_backend(bs));
+
+        // many more requests than the queue is deep, and than the cache holds
+        std::vector<uint8_t> data(200 * 256), check(200 * 256);
+        for (size_t i = 0; i < data.size(); i++) {
+            data[i] = (uint8_t) (i * 7 + i / 256);
+        }
+        async_tally tally = {0, 0, {}};
+        for (size_t i = 0; i < 200; i++) {
+            ASSERT_EQ(true, block_store_write_async(bs, i, &data[i * 256], count_completion, &tally));
+        }
+        ASSERT_EQ(200, block_store_poll(bs, SIZE_MAX));
+        ASSERT_EQ(200, tally.calls);
+        ASSERT_EQ(200 * 256, tally.bytes);
+        for (size_t i = 0; i < 200; i++) {
+            ASSERT_EQ(true, block_store_read_async(bs, i, &check[i * 256], count_completion, &tally));
+        }
+        size_t polled = 0;
+        while (polled < 200) {
+            polled += block_store_poll(bs, 10);
+        }
+        ASSERT_EQ(200, polled);
+        ASSERT_EQ(400 * 256, tally.bytes);
+        ASSERT_EQ(true, data == check) << "async reads didn't see the async writes\n";
+
+        // a dirty cached block is read from the cache, not the stale file
+        uint8_t buffer[256], cached[256];
+        memset(buffer, 0xEE, sizeof(buffer));
+        ASSERT_EQ(256, block_store_write(bs, 3, buffer));
+        ASSERT_EQ(true, block_store_read_async(bs, 3, cached, NULL, NULL));
+        ASSERT_EQ(1, block_store_poll(bs, 1));
+        ASSERT_EQ(0, memcmp(buffer, cached, sizeof(buffer)));
+        ASSERT_EQ(256, block_store_read(bs, 150, buffer));
+        ASSERT_EQ(0, memcmp(&data[150 * 256], buffer, sizeof(buffer)));
+
+        // a read while an async write is outstanding mustn't leave the old data cached
+        uint8_t fresh[256];
+        memset(fresh, 0x5C, sizeof(fresh));
+        for (size_t round = 0; round < 20; round++) {
+            fresh[0] = (uint8_t) round;
+            ASSERT_EQ(true, block_store_write_async(bs, 160 + round, fresh, NULL, NULL));
+            block_store_submit(bs);
+            ASSERT_EQ(256, block_store_read(bs, 160 + round, buffer));
+            ASSERT_EQ(1, block_store_poll(bs, SIZE_MAX));
+            ASSERT_EQ(256, block_store_read(bs, 160 + round, buffer));
+            ASSERT_EQ(0, memcmp(fresh, buffer, sizeof(buffer))) << "round " << round;
+        }
+
+        // outstanding requests are finished before the device goes away
+        for (size_t i = 0; i < 50; i++) {
+            ASSERT_EQ(true, block_store_read_async(bs, 100 + i, &check[i * 256], count_completion, &tally));
+        }
+        ASSERT_EQ(8, block_store_submit(bs));
+        ASSERT_EQ(false, block_store_set_async(bs, backend, 16));
+        block_store_destroy(bs);
+        ASSERT_EQ(450, tally.calls);
+
+        bs = block_store_open_file("test_file.bs", BLOCK_STORE_MMAP_READONLY, 0, 256);
+        ASSERT_NE(nullptr, bs) << "block_store_open_file returned NULL when it should not have\n";
+        ASSERT_EQ(false, block_store_write_async(bs, 0, buffer, NULL, NULL));
+        ASSERT_EQ(true, block_store_read_async(bs, 199, buffer, NULL, NULL));
+        ASSERT_EQ(1, block_store_poll(bs, SIZE_MAX));
+        ASSERT_EQ(0, memcmp(&data[199 * 256], buffer, sizeof(buffer)));
+        block_store_destroy(bs);
+    }
+    remove("test_file.bs");
+}
+
+TEST(bitmap, ffz_ffs_words)
+{
+    // odd size so the last word is partial, run it with and without the summary
+    for (int summary = 0; summary < 2; ++summary) {
+        const size_t bits = 64 * 70 + 13;
+        bitmap_t *bitmap = bitmap_create(bits);
+        ASSERT_NE(nullptr, bitmap);
+        if (summary) {
+            ASSERT_EQ(true, bitmap_enable_summary(bitmap));
+        }
+        ASSERT_EQ(SIZE_MAX, bitmap_ffs(bitmap));
+        ASSERT_EQ(0, bitmap_ffz(bitmap));
+
+        for (size_t i = 0; i < bits; ++i) {
+            bitmap_set(bitmap, i);
+        }
+        // the bits past the end of the map must not show up as zeros
+        ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+        ASSERT_EQ(0, bitmap_ffs(bitmap));
+
+        bitmap_reset(bitmap, bits - 1);
+        ASSERT_EQ(bits - 1, bitmap_ffz(bitmap));
+        bitmap_reset(bitmap, 64 * 33 + 5);
+        ASSERT_EQ(64 * 33 + 5, bitmap_ffz(bitmap));
+        bitmap_flip(bitmap, 64 * 33 + 5);
+        ASSERT_EQ(bits - 1, bitmap_ffz(bitmap));
+
+        // searches starting part way through a word
+        ASSERT_EQ(bits - 1, bitmap_ffz_from(bitmap, 64 * 33 + 6));
+        ASSERT_EQ(SIZE_MAX, bitmap_ffz_from(bitmap, bits));
+        ASSERT_EQ(64 * 12 + 3, bitmap_ffs_from(bitmap, 64 * 12 + 3));
+
+        bitmap_invert(bitmap);
+        ASSERT_EQ(bits - 1, bitmap_ffs(bitmap));
+        ASSERT_EQ(bits - 1, bitmap_ffs_from(bitmap, 7));
+        ASSERT_EQ(7, bitmap_ffz_from(bitmap, 7));
+        ASSERT_EQ(0, bitmap_ffz(bitmap));
+        bitmap_format(bitmap, 0xFF);
+        ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+        bitmap_destroy(bitmap);
+    }
+}
+
+TEST(bitmap, fls_before)
+{
+    // odd size so the last word is partial
+    const size_t bits = 64 * 70 + 13;
+    bitmap_t *bitmap = bitmap_create(bits);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_EQ(SIZE_MAX, bitmap_fls_before(bitmap, SIZE_MAX));
+    ASSERT_EQ(SIZE_MAX, bitmap_fls_before(NULL, bits));
+
+    bitmap_set(bitmap, bits - 1);
+    ASSERT_EQ(bits - 1, bitmap_fls_before(bitmap, SIZE_MAX));
+    ASSERT_EQ(SIZE_MAX, bitmap_fls_before(bitmap, bits - 1));
+    // searches ending part way through a word
+    bitmap_set(bitmap, 64 * 33 + 5);
+    ASSERT_EQ(64 * 33 + 5, bitmap_fls_before(bitmap, bits - 1));
+    ASSERT_EQ(64 * 33 + 5, bitmap_fls_before(bitmap, 64 * 33 + 6));
+    ASSERT_EQ(SIZE_MAX, bitmap_fls_before(bitmap, 64 * 33 + 5));
+    ASSERT_EQ(SIZE_MAX, bitmap_fls_before(bitmap, 0));
+
+    bitmap_format(bitmap, 0xFF);
+    ASSERT_EQ(bits - 1, bitmap_fls_before(bitmap, bits));
+    ASSERT_EQ(63, bitmap_fls_before(bitmap, 64));
+    ASSERT_EQ(0, bitmap_fls_before(bitmap, 1));
+    bitmap_destroy(bitmap);
+}
+
+TEST(bitmap, ranges)
+{
+    for (int summary = 0; summary < 2; ++summary) {
+        const size_t bits = 1000;
+        bitmap_t *bitmap = bitmap_create(bits);
+        ASSERT_NE(nullptr, bitmap);
+        if (summary) {
+            ASSERT_EQ(true, bitmap_enable_summary(bitmap));
+        }
+        bitmap_set_range(bitmap, 3, 2);
+        ASSERT_EQ(2, bitmap_total_set(bitmap));
+        bitmap_set_range(bitmap, 60, 300);
+        ASSERT_EQ(302, bitmap_total_set(bitmap));
+        ASSERT_EQ(60, bitmap_ffs_from(bitmap, 5));
+        ASSERT_EQ(360, bitmap_ffz_from(bitmap, 60));
+        // ranges past the end don't do anything
+        bitmap_set_range(bitmap, 990, 11);
+        ASSERT_EQ(302, bitmap_total_set(bitmap));
+
+        ASSERT_EQ(0, bitmap_find_zero_run(bitmap, 0, 3));
+        ASSERT_EQ(5, bitmap_find_zero_run(bitmap, 0, 4));
+        ASSERT_EQ(360, bitmap_find_zero_run(bitmap, 0, 56));
+        ASSERT_EQ(360, bitmap_find_zero_run(bitmap, 0, 640));
+        ASSERT_EQ(SIZE_MAX, bitmap_find_zero_run(bitmap, 0, 641));
+
+        bitmap_reset_range(bitmap, 100, 200);
+        ASSERT_EQ(102, bitmap_total_set(bitmap));
+        ASSERT_EQ(100, bitmap_find_zero_run(bitmap, 6, 200));
+        bitmap_set_range(bitmap, 0, bits);
+        ASSERT_EQ(bits, bitmap_total_set(bitmap));
+        ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+        bitmap_destroy(bitmap);
+    }
+}
+
+TEST(bitmap, atomics)
+{
+    const size_t bits = 200;
+    bitmap_t *bitmap = bitmap_create(bits);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_EQ(true, bitmap_enable_summary(bitmap));
+    ASSERT_EQ(false, bitmap_test_and_set_atomic(bitmap, 70));
+    ASSERT_EQ(true, bitmap_test_and_set_atomic(bitmap, 70));
+    ASSERT_EQ(true, bitmap_test(bitmap, 70));
+
+    // a range that hits a set bit leaves everything as it was
+    ASSERT_EQ(false, bitmap_claim_range_atomic(bitmap, 10, 100));
+    ASSERT_EQ(1, bitmap_total_set(bitmap));
+    ASSERT_EQ(true, bitmap_claim_range_atomic(bitmap, 0, 70));
+    ASSERT_EQ(true, bitmap_claim_range_atomic(bitmap, 71, bits - 71));
+    ASSERT_EQ(bits, bitmap_total_set(bitmap));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+    ASSERT_EQ(false, bitmap_claim_range_atomic(bitmap, 199, 2));
+
+    ASSERT_EQ(true, bitmap_test_and_reset_atomic(bitmap, 130));
+    ASSERT_EQ(false, bitmap_test_and_reset_atomic(bitmap, 130));
+    ASSERT_EQ(130, bitmap_ffz(bitmap));
+    bitmap_reset_range_atomic(bitmap, 60, 10);
+    ASSERT_EQ(60, bitmap_ffz(bitmap));
+    ASSERT_EQ(bits - 11, bitmap_total_set(bitmap));
+    bitmap_destroy(bitmap);
+}
+
+TEST(bitmap, summary_overlay_rebuild)
+{
+    uint8_t data[32] = {0};
+    bitmap_t *bitmap = bitmap_overlay(256, data);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_EQ(true, bitmap_enable_summary(bitmap));
+    // write the memory underneath the overlay, the summary doesn't know yet
+    memset(data, 0xFF, 20);
+    bitmap_rebuild_summary(bitmap);
+    ASSERT_EQ(160, bitmap_ffz(bitmap));
+    bitmap_destroy(bitmap);
+}
+
+static void count_bit(size_t bit, void *arg)
+{
+    std::vector<size_t> *bits = (std::vector<size_t> *) arg;
+    bits->push_back(bit);
+}
+
+TEST(bitmap, kernels)
+{
+    const bitmap_kernel_t kernels[] = {BITMAP_KERNEL_SCALAR, BITMAP_KERNEL_SSE42, BITMAP_KERNEL_AVX2};
+    ASSERT_EQ(true, bitmap_set_kernel(BITMAP_KERNEL_SCALAR));
+    ASSERT_EQ(BITMAP_KERNEL_SCALAR, bitmap_get_kernel());
+    for (bitmap_kernel_t kernel : kernels) {
+        if (!bitmap_set_kernel(kernel)) {
+            continue;  // this CPU doesn't have it
+        }
+        // sparse, with long runs for the scans to skip, odd sized, and laid over unaligned memory
+        const size_t bits = 64 * 300 + 37;
+        std::vector<uint8_t> memory((bits + 7) / 8 + 1, 0);
+        bitmap_t *bitmap = bitmap_overlay(bits, memory.data() + 1);
+        ASSERT_NE(nullptr, bitmap);
+        std::vector<size_t> expected;
+        for (size_t i = 3; i < bits; i += 131 + i % 977) {
+            bitmap_set(bitmap, i);
+            expected.push_back(i);
+        }
+        bitmap_set(bitmap, bits - 1);
+        expected.push_back(bits - 1);
+        // the spare bits of the last byte never count
+        memory.back() |= 0xE0;
+
+        ASSERT_EQ(expected.size(), bitmap_total_set(bitmap));
+        std::vector<size_t> seen;
+        bitmap_for_each(bitmap, count_bit, &seen);
+        ASSERT_EQ(expected, seen);
+        for (size_t i = 0; i + 1 < expected.size(); ++i) {
+            ASSERT_EQ(expected[i + 1], bitmap_ffs_from(bitmap, expected[i] + 1));
+        }
+
+        bitmap_invert(bitmap);
+        ASSERT_EQ(bits - expected.size(), bitmap_total_set(bitmap));
+        for (size_t i = 0; i < expected.size(); ++i) {
+            ASSERT_EQ(expected[i], bitmap_ffz_from(bitmap, i ? expected[i - 1] + 1 : 0));
+        }
+        ASSERT_EQ(0, bitmap_ffs(bitmap));
+        bitmap_destroy(bitmap);
+    }
+    ASSERT_EQ(true, bitmap_set_kernel(BITMAP_KERNEL_AUTO));
+    ASSERT_NE(BITMAP_KERNEL_AUTO, bitmap_get_kernel());
+    // SSE4.2 only when asked for
+    ASSERT_NE(BITMAP_KERNEL_SSE42, bitmap_get_kernel());
+}
+
+TEST(bitmap, iterator)
+{
+    const size_t bits = 64 * 40 + 9;
+    bitmap_t *bitmap = bitmap_create(bits);
+    ASSERT_NE(nullptr, bitmap);
+    bitmap_iter_t iter;
+    bitmap_iter_init(&iter, bitmap, 0);
+    ASSERT_EQ(SIZE_MAX, bitmap_iter_next(&iter));
+    ASSERT_EQ(SIZE_MAX, bitmap_iter_next(&iter));
+
+    const size_t set[] = {0, 5, 63, 64, 65, 64 * 20 + 1, bits - 1};
+    for (size_t bit : set) {
+        bitmap_set(bitmap, bit);
+    }
+    bitmap_iter_init(&iter, bitmap, 0);
+    for (size_t bit : set) {
+        ASSERT_EQ(bit, bitmap_iter_next(&iter));
+    }
+    ASSERT_EQ(SIZE_MAX, bitmap_iter_next(&iter));
+
+    // starting part way through a word, and past the end
+    bitmap_iter_init(&iter, bitmap, 6);
+    ASSERT_EQ(63, bitmap_iter_next(&iter));
+    bitmap_iter_init(&iter, bitmap, 66);
+    ASSERT_EQ(64 * 20 + 1, bitmap_iter_next(&iter));
+    ASSERT_EQ(bits - 1, bitmap_iter_next(&iter));
+    ASSERT_EQ(SIZE_MAX, bitmap_iter_next(&iter));
+    bitmap_iter_init(&iter, bitmap, bits);
+    ASSERT_EQ(SIZE_MAX, bitmap_iter_next(&iter));
+
+    // a full map hands out every bit and nothing past the end
+    bitmap_format(bitmap, 0xFF);
+    size_t visited = 0;
+    bitmap_iter_init(&iter, bitmap, 0);
+    for (size_t bit = bitmap_iter_next(&iter); bit != SIZE_MAX; bit = bitmap_iter_next(&iter)) {
+        ASSERT_EQ(visited++, bit);
+    }
+    ASSERT_EQ(bits, visited);
+    bitmap_destroy(bitmap);
+}